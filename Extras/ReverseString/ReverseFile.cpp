@@ -0,0 +1,395 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the 
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+#include "stdafx.h"
+#include "ReverseStr.h"
+#include "ReverseFile.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// Problem 2: Reverse a file that is much larger than the available memory.
+
+namespace Extras
+{
+    using namespace concurrency;
+
+    //  A file that is mapped into memory a window at a time. Offsets passed to Map
+    //  must be a multiple of Granularity().
+
+    class MappedFile
+    {
+    public:
+        //  Open an existing file for reading.
+        explicit MappedFile(const std::string& path);
+        //  Create a new file of the given size for writing.
+        MappedFile(const std::string& path, unsigned long long size);
+        ~MappedFile();
+
+        unsigned long long Size() const { return m_size; }
+
+        char* Map(unsigned long long offset, size_t length) const;
+        void Unmap(char* const pView, size_t length) const;
+
+        //  Start reading a view into memory without waiting for the I/O to complete.
+        static void Prefetch(const char* const pView, size_t length);
+        static size_t Granularity();
+
+    private:
+        unsigned long long m_size;
+        bool m_writable;
+#if defined(_WIN32)
+        HANDLE m_file;
+        HANDLE m_mapping;
+#else
+        int m_file;
+#endif
+
+        //  Release the handles, the constructors call this before throwing as the
+        //  destructor does not run for a partially constructed object.
+        void Close();
+
+        MappedFile(const MappedFile&);
+        MappedFile& operator=(const MappedFile&);
+    };
+
+#if defined(_WIN32)
+
+    MappedFile::MappedFile(const std::string& path) :
+        m_size(0),
+        m_writable(false),
+        m_mapping(nullptr)
+    {
+        m_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL, nullptr);
+        LARGE_INTEGER size;
+        if ((m_file == INVALID_HANDLE_VALUE) || !GetFileSizeEx(m_file, &size))
+        {
+            Close();
+            throw std::runtime_error("Unable to open input file.");
+        }
+        m_size = size.QuadPart;
+
+        // Empty files cannot be mapped.
+        if (m_size > 0)
+            m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if ((m_size > 0) && (m_mapping == nullptr))
+        {
+            Close();
+            throw std::runtime_error("Unable to map input file.");
+        }
+    }
+
+    MappedFile::MappedFile(const std::string& path, unsigned long long size) :
+        m_size(size),
+        m_writable(true),
+        m_mapping(nullptr)
+    {
+        m_file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (m_file == INVALID_HANDLE_VALUE)
+            throw std::runtime_error("Unable to create output file.");
+
+        // The mapping extends the file to the requested size.
+        LARGE_INTEGER mappingSize;
+        mappingSize.QuadPart = size;
+        if (m_size > 0)
+            m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READWRITE,
+                mappingSize.HighPart, mappingSize.LowPart, nullptr);
+        if ((m_size > 0) && (m_mapping == nullptr))
+        {
+            Close();
+            throw std::runtime_error("Unable to map output file.");
+        }
+    }
+
+    MappedFile::~MappedFile()
+    {
+        Close();
+    }
+
+    void MappedFile::Close()
+    {
+        if (m_mapping != nullptr)
+            CloseHandle(m_mapping);
+        if (m_file != INVALID_HANDLE_VALUE)
+            CloseHandle(m_file);
+        m_mapping = nullptr;
+        m_file = INVALID_HANDLE_VALUE;
+    }
+
+    char* MappedFile::Map(unsigned long long offset, size_t length) const
+    {
+        LARGE_INTEGER viewOffset;
+        viewOffset.QuadPart = offset;
+        void* pView = MapViewOfFile(m_mapping, m_writable ? FILE_MAP_WRITE : FILE_MAP_READ,
+            viewOffset.HighPart, viewOffset.LowPart, length);
+        if (pView == nullptr)
+            throw std::runtime_error("Unable to map view of file.");
+        return static_cast<char*>(pView);
+    }
+
+#pragma warning(push)
+#pragma warning(disable:4100)   // Ignore unused parameter warning.
+
+    void MappedFile::Unmap(char* const pView, size_t length) const
+    {
+        UnmapViewOfFile(pView);
+    }
+
+#pragma warning(pop)
+
+    //  Touch one byte in each page so the page faults are taken on this thread.
+
+    void MappedFile::Prefetch(const char* const pView, size_t length)
+    {
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        volatile char sink = 0;
+        for (size_t i = 0; i < length; i += info.dwPageSize)
+            sink ^= pView[i];
+    }
+
+    size_t MappedFile::Granularity()
+    {
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        return info.dwAllocationGranularity;
+    }
+
+#else
+
+    MappedFile::MappedFile(const std::string& path) :
+        m_size(0),
+        m_writable(false)
+    {
+        m_file = open(path.c_str(), O_RDONLY);
+        struct stat status;
+        if ((m_file < 0) || (fstat(m_file, &status) != 0))
+        {
+            Close();
+            throw std::runtime_error("Unable to open input file.");
+        }
+        m_size = status.st_size;
+    }
+
+    MappedFile::MappedFile(const std::string& path, unsigned long long size) :
+        m_size(size),
+        m_writable(true)
+    {
+        m_file = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if ((m_file < 0) || (ftruncate(m_file, size) != 0))
+        {
+            Close();
+            throw std::runtime_error("Unable to create output file.");
+        }
+    }
+
+    MappedFile::~MappedFile()
+    {
+        Close();
+    }
+
+    void MappedFile::Close()
+    {
+        if (m_file >= 0)
+            close(m_file);
+        m_file = -1;
+    }
+
+    char* MappedFile::Map(unsigned long long offset, size_t length) const
+    {
+        void* pView = mmap(nullptr, length, m_writable ? (PROT_READ | PROT_WRITE) : PROT_READ,
+            MAP_SHARED, m_file, offset);
+        if (pView == MAP_FAILED)
+            throw std::runtime_error("Unable to map view of file.");
+        return static_cast<char*>(pView);
+    }
+
+    void MappedFile::Unmap(char* const pView, size_t length) const
+    {
+        munmap(pView, length);
+    }
+
+    //  Ask the kernel to start read ahead, this returns immediately.
+
+    void MappedFile::Prefetch(const char* const pView, size_t length)
+    {
+        madvise(const_cast<char*>(pView), length, MADV_WILLNEED);
+    }
+
+    size_t MappedFile::Granularity()
+    {
+        return static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    }
+
+#endif
+
+    //  A view of an output window, unmapped when it goes out of scope.
+
+    class MappedView
+    {
+    public:
+        MappedView(const MappedFile& file, unsigned long long offset, size_t length) :
+            m_file(file),
+            m_pView(file.Map(offset, length)),
+            m_length(length)
+        {
+        }
+
+        ~MappedView()
+        {
+            m_file.Unmap(m_pView, m_length);
+        }
+
+        char* Data() const { return m_pView; }
+
+    private:
+        const MappedFile& m_file;
+        char* m_pView;
+        size_t m_length;
+
+        MappedView(const MappedView&);
+        MappedView& operator=(const MappedView&);
+    };
+
+    //  A view of part of the input file. Views must start on a multiple of the allocation
+    //  granularity so the view may start before the data that is required. The view is
+    //  unmapped by Unmap or when the window goes out of scope.
+
+    class InputWindow
+    {
+    public:
+        const char* pData;
+        size_t dataLength;
+
+        InputWindow() : pData(nullptr), dataLength(0), m_pFile(nullptr), m_pView(nullptr), m_viewLength(0) { }
+        ~InputWindow() { Unmap(); }
+
+        //  Map the input data that is written to [outOffset, outOffset + windowSize) in the
+        //  output. This is read backwards from the end of the input file.
+        void Map(const MappedFile& in, unsigned long long outOffset, size_t windowSize)
+        {
+            Unmap();
+            const unsigned long long size = in.Size();
+            const unsigned long long end = size - outOffset;
+            const size_t length = static_cast<size_t>(std::min<unsigned long long>(windowSize, end));
+
+            const unsigned long long start = end - length;
+            const unsigned long long viewStart = start - (start % MappedFile::Granularity());
+            const size_t viewLength = static_cast<size_t>(end - viewStart);
+            m_pView = in.Map(viewStart, viewLength);
+            m_pFile = &in;
+            m_viewLength = viewLength;
+            pData = m_pView + (start - viewStart);
+            dataLength = length;
+        }
+
+        void Unmap()
+        {
+            if (m_pView != nullptr)
+                m_pFile->Unmap(m_pView, m_viewLength);
+            m_pView = nullptr;
+            m_viewLength = 0;
+            pData = nullptr;
+            dataLength = 0;
+        }
+
+        void Prefetch() const
+        {
+            MappedFile::Prefetch(m_pView, m_viewLength);
+        }
+
+        void Swap(InputWindow& other)
+        {
+            std::swap(pData, other.pData);
+            std::swap(dataLength, other.dataLength);
+            std::swap(m_pFile, other.m_pFile);
+            std::swap(m_pView, other.m_pView);
+            std::swap(m_viewLength, other.m_viewLength);
+        }
+
+    private:
+        const MappedFile* m_pFile;
+        char* m_pView;
+        size_t m_viewLength;
+
+        InputWindow(const InputWindow&);
+        InputWindow& operator=(const InputWindow&);
+    };
+
+    //  Each output window is filled by reversing the matching input window from the tail
+    //  of the input file. While one window is being reversed the next input window is mapped
+    //  and prefetched on another task, overlapping the I/O with the reversal.
+    //
+    //  If mapping or copying a window throws, the prefetch task is canceled and waited for 
+    //  before the exception propagates, a task_group must not be destroyed while its tasks are 
+    //  running. The windows unmap their views as the stack unwinds.
+
+    void ReverseFile(const std::string& inPath, const std::string& outPath, size_t windowSize)
+    {
+        const size_t granularity = MappedFile::Granularity();
+        windowSize = std::max(granularity, windowSize - (windowSize % granularity));
+
+        MappedFile in(inPath);
+        const unsigned long long size = in.Size();
+        MappedFile out(outPath, size);
+        if (size == 0)
+            return;
+
+        const unsigned long long numWindows = (size + windowSize - 1) / windowSize;
+        InputWindow current;
+        current.Map(in, 0, windowSize);
+        current.Prefetch();
+
+        for (unsigned long long w = 0; w < numWindows; ++w)
+        {
+            const unsigned long long outOffset = w * windowSize;
+            InputWindow next;
+            task_group prefetch;
+            if ((w + 1) < numWindows)
+            {
+                prefetch.run([&in, &next, outOffset, windowSize]
+                {
+                    next.Map(in, outOffset + windowSize, windowSize);
+                    next.Prefetch();
+                });
+            }
+
+            try
+            {
+                MappedView outView(out, outOffset, current.dataLength);
+                ReverseCopyBytes(current.pData, current.dataLength, outView.Data());
+            }
+            catch (...)
+            {
+                prefetch.cancel();
+                prefetch.wait();
+                throw;
+            }
+            current.Unmap();
+
+            prefetch.wait();
+            current.Swap(next);
+        }
+    }
+}
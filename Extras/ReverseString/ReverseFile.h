@@ -0,0 +1,33 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the 
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+#include "stdafx.h"
+
+#pragma once
+
+namespace Extras
+{
+    //  Reverse the bytes of a file into a new file. The file does not have to fit into
+    //  memory, at most three windows of windowSize bytes are mapped at any one time. The
+    //  window size is rounded down to a multiple of the system's allocation granularity.
+    //
+    //  Throws std::runtime_error if either file cannot be opened or mapped.
+
+    const size_t kDefaultWindowSize = 64 * 1024 * 1024;
+
+    void ReverseFile(const std::string& inPath, const std::string& outPath,
+        size_t windowSize = kDefaultWindowSize);
+}
@@ -0,0 +1,102 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the 
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+#include "stdafx.h"
+
+#include "ReverseStr.h"
+#include "ReverseFile.h"
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+using namespace Extras;
+
+namespace ReverseStringTests
+{
+    const char* const kInputFile = "ReverseFileTests_in.bin";
+    const char* const kOutputFile = "ReverseFileTests_out.bin";
+
+    std::vector<char> WriteTestFile(size_t size)
+    {
+        std::vector<char> data(size);
+        for (size_t i = 0; i < size; ++i)
+            data[i] = static_cast<char>((i * 7919) ^ (i >> 8));
+
+        std::ofstream file(kInputFile, std::ios::binary);
+        file.write(data.data(), data.size());
+        return data;
+    }
+
+    std::vector<char> ReadTestFile()
+    {
+        std::ifstream file(kOutputFile, std::ios::binary);
+        return std::vector<char>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+
+    TEST_CLASS(ReverseCopyBytesTests)
+    {
+    public:
+        TEST_METHOD(ReverseCopyBytesTests_UnalignedLength)
+        {
+            std::string input("abcdefghijklmnopqrstuvwxyz0123456789");
+            std::string expected(input.rbegin(), input.rend());
+            std::string output(input.size(), ' ');
+
+            ReverseCopyBytes(input.data(), input.size(), &output[0]);
+
+            Assert::IsTrue(expected == output);
+        }
+    };
+
+    TEST_CLASS(ReverseFileTests)
+    {
+    public:
+        TEST_METHOD_CLEANUP(ReverseFileTests_Cleanup)
+        {
+            std::remove(kInputFile);
+            std::remove(kOutputFile);
+        }
+
+        TEST_METHOD(ReverseFileTests_EmptyFile)
+        {
+            WriteTestFile(0);
+
+            ReverseFile(kInputFile, kOutputFile);
+
+            Assert::IsTrue(ReadTestFile().empty());
+        }
+
+        TEST_METHOD(ReverseFileTests_SingleWindow)
+        {
+            std::vector<char> expected = WriteTestFile(1000);
+            std::reverse(expected.begin(), expected.end());
+
+            ReverseFile(kInputFile, kOutputFile);
+
+            Assert::IsTrue(expected == ReadTestFile());
+        }
+
+        TEST_METHOD(ReverseFileTests_ManyWindows)
+        {
+            // The smallest possible window is used so the file is streamed through many windows
+            // and input windows do not start on an allocation boundary.
+            std::vector<char> expected = WriteTestFile(3 * 1024 * 1024 + 17);
+            std::reverse(expected.begin(), expected.end());
+
+            ReverseFile(kInputFile, kOutputFile, 1);
+
+            Assert::IsTrue(expected == ReadTestFile());
+        }
+    };
+}
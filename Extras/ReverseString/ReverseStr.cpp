@@ -115,4 +115,246 @@ namespace Extras
         copy(strData.cbegin() + blkChars - charLen, strData.cend(), 
             stdext::make_checked_array_iterator<char*>(pStr, charLen));
     }
+
+    //  UTF-8 aware version. Reversing the raw bytes corrupts any character encoded as a
+    //  multi-byte sequence. Instead each segment (a code point or a grapheme cluster) is
+    //  reversed in place first and then the whole string is reversed, which puts the
+    //  bytes within each segment back in their original order.
+    //
+    //  Both passes run in parallel on chunks of the string. Chunk boundaries are moved
+    //  forward so that they never split a segment, which is the only fix-up required.
+    //
+    //  See: http://www.unicode.org/reports/tr29/
+
+    const size_t kChunkSize = 64 * 1024;    // Minimum number of bytes processed by each task.
+
+    inline bool IsContinuationByte(char c)
+    {
+        return (static_cast<unsigned char>(c) & 0xC0) == 0x80;
+    }
+
+    //  Length of the sequence starting at p. Malformed sequences are truncated at the first
+    //  byte that is not a continuation byte, stray bytes are treated as single byte
+    //  sequences so they are reversed like any other character.
+
+    inline unsigned SequenceLength(const char* const p, const char* const pEnd)
+    {
+        const unsigned char b = static_cast<unsigned char>(*p);
+        unsigned len = 1;
+        if (b >= 0xC0 && b < 0xF8)
+            len = (b < 0xE0) ? 2 : ((b < 0xF0) ? 3 : 4);
+
+        unsigned i = 1;
+        while ((i < len) && (p + i < pEnd) && IsContinuationByte(p[i]))
+            ++i;
+        return i;
+    }
+
+    inline const char* NextCodePoint(const char* const p, const char* const pEnd, unsigned& codePoint)
+    {
+        const unsigned len = SequenceLength(p, pEnd);
+        const unsigned char leadMask[] = { 0x00, 0x7F, 0x1F, 0x0F, 0x07 };
+
+        codePoint = static_cast<unsigned char>(*p) & leadMask[len];
+        for (unsigned i = 1; i < len; ++i)
+            codePoint = (codePoint << 6) | (static_cast<unsigned char>(p[i]) & 0x3F);
+        return p + len;
+    }
+
+    //  Code points that extend the preceding grapheme cluster. This covers the common
+    //  cases from UAX #29; combining marks, variation selectors, emoji modifiers and
+    //  tags. The zero width joiner is handled separately as it also joins the following
+    //  code point.
+
+    const unsigned kZeroWidthJoiner = 0x200D;
+
+    inline bool IsGraphemeExtender(unsigned cp)
+    {
+        return (cp >= 0x0300 && cp <= 0x036F) ||    // Combining Diacritical Marks
+            (cp >= 0x1AB0 && cp <= 0x1AFF) ||       // Combining Diacritical Marks Extended
+            (cp >= 0x1DC0 && cp <= 0x1DFF) ||       // Combining Diacritical Marks Supplement
+            (cp >= 0x20D0 && cp <= 0x20FF) ||       // Combining Diacritical Marks for Symbols
+            (cp >= 0xFE00 && cp <= 0xFE0F) ||       // Variation Selectors
+            (cp >= 0xFE20 && cp <= 0xFE2F) ||       // Combining Half Marks
+            (cp >= 0x1F3FB && cp <= 0x1F3FF) ||     // Emoji skin tone modifiers
+            (cp >= 0xE0020 && cp <= 0xE007F) ||     // Tags
+            (cp >= 0xE0100 && cp <= 0xE01EF) ||     // Variation Selectors Supplement
+            (cp == kZeroWidthJoiner);
+    }
+
+    inline bool IsRegionalIndicator(unsigned cp)
+    {
+        return (cp >= 0x1F1E6 && cp <= 0x1F1FF);
+    }
+
+    //  Return the end of the segment starting at p.
+
+    const char* NextSegment(const char* const p, const char* const pEnd, Utf8ReverseMode mode)
+    {
+        if (mode == kReverseCodePoints)
+            return p + SequenceLength(p, pEnd);
+
+        if ((*p == '\r') && (p + 1 < pEnd) && (p[1] == '\n'))
+            return p + 2;
+
+        unsigned cp;
+        const char* pNext = NextCodePoint(p, pEnd, cp);
+        int regionalIndicators = IsRegionalIndicator(cp) ? 1 : 0;
+        bool joined = false;
+
+        while (pNext < pEnd)
+        {
+            unsigned nextCp;
+            const char* pAfter = NextCodePoint(pNext, pEnd, nextCp);
+            const bool flagPair = (regionalIndicators == 1) && IsRegionalIndicator(nextCp);
+            if (!IsGraphemeExtender(nextCp) && !joined && !flagPair)
+                break;
+            regionalIndicators += IsRegionalIndicator(nextCp) ? 1 : 0;
+            joined = (nextCp == kZeroWidthJoiner);
+            pNext = pAfter;
+        }
+        return pNext;
+    }
+
+    //  Move a chunk boundary forward until it is also a segment boundary. For grapheme
+    //  clusters whole runs of regional indicators are skipped, the pairing of flags
+    //  within a run can only be determined by scanning from its start.
+
+    const char* AlignToSegment(const char* p, const char* const pBegin, const char* const pEnd,
+        Utf8ReverseMode mode)
+    {
+        while ((p < pEnd) && IsContinuationByte(*p))
+            ++p;
+        if (mode == kReverseCodePoints)
+            return p;
+
+        while ((p > pBegin) && (p < pEnd))
+        {
+            const char* pPrev = p - 1;
+            while ((pPrev > pBegin) && IsContinuationByte(*pPrev))
+                --pPrev;
+            unsigned prevCp, cp;
+            NextCodePoint(pPrev, pEnd, prevCp);
+            const char* pNext = NextCodePoint(p, pEnd, cp);
+            const bool crlf = (prevCp == '\r') && (cp == '\n');
+            if (!IsGraphemeExtender(cp) && (prevCp != kZeroWidthJoiner) &&
+                !(IsRegionalIndicator(cp) && IsRegionalIndicator(prevCp)) && !crlf)
+                break;
+            p = pNext;
+        }
+        return p;
+    }
+
+    //  Classification pass. Blocks of 16 ASCII characters contain no multi-byte sequences
+    //  so they can be skipped using a single SSE2 comparison. When reversing grapheme clusters
+    //  the last byte of each block may start a cluster and CR LF pairs must be kept together,
+    //  so these are left to the scalar code.
+
+    void ReverseSegments(char* const pBegin, char* const pEnd, Utf8ReverseMode mode)
+    {
+        const __m128i cr = _mm_set1_epi8('\r');
+        const ptrdiff_t skip = (mode == kReverseCodePoints) ? 16 : 15;
+        char* p = pBegin;
+
+        while (p < pEnd)
+        {
+            if (pEnd - p >= 16)
+            {
+                const __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+                int mask = _mm_movemask_epi8(block);
+                if (mode == kReverseGraphemes)
+                    mask |= _mm_movemask_epi8(_mm_cmpeq_epi8(block, cr));
+                if (mask == 0)
+                {
+                    p += skip;
+                    continue;
+                }
+            }
+            char* pNext = const_cast<char*>(NextSegment(p, pEnd, mode));
+            std::reverse(p, pNext);
+            p = pNext;
+        }
+    }
+
+    //  Reverse 16 bytes using SSE2. Reverse the order of the 32 bit words, then the 16 bit
+    //  words within each of them and finally swap the bytes within each 16 bit word.
+
+    inline __m128i ReverseBlock(__m128i v)
+    {
+        v = _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));
+        v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    }
+
+    //  Reverse the bytes in [pBegin, pEnd) by swapping 16 byte blocks from each end of the
+    //  range in parallel. The unpaired bytes left in the middle are reversed by std::reverse.
+
+    void ReverseBytes(char* const pBegin, char* const pEnd)
+    {
+        const size_t blkSize = sizeof(__m128i);
+        const size_t len = pEnd - pBegin;
+        const size_t blkPairs = len / (2 * blkSize);
+        const size_t blkPairsPerTask = kChunkSize / blkSize;
+        const size_t numTasks = (blkPairs + blkPairsPerTask - 1) / blkPairsPerTask;
+
+        parallel_for(size_t(0), numTasks, [=](size_t t)
+        {
+            const size_t last = std::min(blkPairs, (t + 1) * blkPairsPerTask);
+            for (size_t i = t * blkPairsPerTask; i < last; ++i)
+            {
+                __m128i* pLeft = reinterpret_cast<__m128i*>(pBegin + i * blkSize);
+                __m128i* pRight = reinterpret_cast<__m128i*>(pEnd - (i + 1) * blkSize);
+                const __m128i left = _mm_loadu_si128(pLeft);
+                _mm_storeu_si128(pLeft, ReverseBlock(_mm_loadu_si128(pRight)));
+                _mm_storeu_si128(pRight, ReverseBlock(left));
+            }
+        });
+        std::reverse(pBegin + blkPairs * blkSize, pEnd - blkPairs * blkSize);
+    }
+
+    //  Copy [pSrc, pSrc + len) to pDst in reverse order. Used to stream the contents of
+    //  files that do not fit into memory, see ReverseFile.
+
+    void ReverseCopyBytes(const char* const pSrc, const size_t len, char* const pDst)
+    {
+        const size_t blkSize = sizeof(__m128i);
+        const size_t numBlks = len / blkSize;
+        const size_t blksPerTask = kChunkSize / blkSize;
+        const size_t numTasks = (numBlks + blksPerTask - 1) / blksPerTask;
+
+        parallel_for(size_t(0), numTasks, [=](size_t t)
+        {
+            const size_t last = std::min(numBlks, (t + 1) * blksPerTask);
+            for (size_t i = t * blksPerTask; i < last; ++i)
+            {
+                const __m128i blk = _mm_loadu_si128(
+                    reinterpret_cast<const __m128i*>(pSrc + len - (i + 1) * blkSize));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(pDst + i * blkSize), ReverseBlock(blk));
+            }
+        });
+        std::reverse_copy(pSrc, pSrc + len - numBlks * blkSize, pDst + numBlks * blkSize);
+    }
+
+    void ReverseStrUtf8(char* const pStr, Utf8ReverseMode mode)
+    {
+        char* const pEnd = FindEnd(pStr);
+        const size_t len = pEnd - pStr;
+        const size_t numChunks = std::max<size_t>(1, len / kChunkSize);
+
+        std::vector<char*> boundaries(numChunks + 1);
+        boundaries[0] = pStr;
+        for (size_t i = 1; i < numChunks; ++i)
+        {
+            char* pNominal = std::max(pStr + i * (len / numChunks), boundaries[i - 1]);
+            boundaries[i] = const_cast<char*>(AlignToSegment(pNominal, pStr, pEnd, mode));
+        }
+        boundaries[numChunks] = pEnd;
+
+        parallel_for(size_t(0), numChunks, [=, &boundaries](size_t i)
+        {
+            ReverseSegments(boundaries[i], boundaries[i + 1], mode);
+        });
+        ReverseBytes(pStr, pEnd);
+    }
 }
\ No newline at end of file
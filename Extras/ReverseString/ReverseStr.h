@@ -22,4 +22,19 @@ namespace Extras
 {
     void ReverseStr(char* const pStr);
     void ReverseStrAmp(char* const pStr);
+
+    //  Reversal of UTF-8 encoded strings. Multi-byte sequences are kept intact and, 
+    //  optionally, so are grapheme clusters like a base character followed by combining marks.
+
+    enum Utf8ReverseMode
+    {
+        kReverseCodePoints = 0,
+        kReverseGraphemes
+    };
+
+    void ReverseStrUtf8(char* const pStr, Utf8ReverseMode mode = kReverseCodePoints);
+
+    //  Copy len bytes from pSrc to pDst in reverse order using SSE2.
+
+    void ReverseCopyBytes(const char* const pSrc, const size_t len, char* const pDst);
 }
\ No newline at end of file
@@ -146,4 +146,91 @@ namespace ReverseStringTests
             Assert::AreEqual(0, expected.compare(input), Msg(expected, input).c_str());
         }
     };
+
+    TEST_CLASS(ReverseStrUtf8Tests)
+    {
+    public:
+        TEST_METHOD(ReverseStrUtf8Tests_AsciiString)
+        {
+            std::string input("abcdefghijklmnopqrstuvwxyz0123456789");
+            std::string expected(input.rbegin(), input.rend());
+
+            ReverseStrUtf8(const_cast<char*>(input.c_str()));
+
+            Assert::AreEqual(0, expected.compare(input), Msg(expected, input).c_str());
+        }
+
+        TEST_METHOD(ReverseStrUtf8Tests_EmptyString)
+        {
+            std::string input("");
+            std::string expected("");
+
+            ReverseStrUtf8(const_cast<char*>(input.c_str()));
+
+            Assert::AreEqual(0, expected.compare(input), Msg(expected, input).c_str());
+        }
+
+        TEST_METHOD(ReverseStrUtf8Tests_MultiByteSequences)
+        {
+            // "a", U+00E9, U+20AC, U+1F600 encoded as 1, 2, 3 and 4 byte sequences.
+            std::string input("a\xC3\xA9\xE2\x82\xAC\xF0\x9F\x98\x80");
+            std::string expected("\xF0\x9F\x98\x80\xE2\x82\xAC\xC3\xA9" "a");
+
+            ReverseStrUtf8(const_cast<char*>(input.c_str()));
+
+            Assert::AreEqual(0, expected.compare(input), Msg(expected, input).c_str());
+        }
+
+        TEST_METHOD(ReverseStrUtf8Tests_CombiningMarkCodePoints)
+        {
+            // "e" followed by U+0301 COMBINING ACUTE ACCENT. Reversing code points moves the mark.
+            std::string input("e\xCC\x81x");
+            std::string expected("x\xCC\x81" "e");
+
+            ReverseStrUtf8(const_cast<char*>(input.c_str()), kReverseCodePoints);
+
+            Assert::AreEqual(0, expected.compare(input), Msg(expected, input).c_str());
+        }
+
+        TEST_METHOD(ReverseStrUtf8Tests_CombiningMarkGraphemes)
+        {
+            std::string input("e\xCC\x81x");
+            std::string expected("xe\xCC\x81");
+
+            ReverseStrUtf8(const_cast<char*>(input.c_str()), kReverseGraphemes);
+
+            Assert::AreEqual(0, expected.compare(input), Msg(expected, input).c_str());
+        }
+
+        TEST_METHOD(ReverseStrUtf8Tests_FlagsAndJoinersGraphemes)
+        {
+            // U+1F1FA U+1F1F8 and U+1F1EB U+1F1F7 are flags. U+1F468 U+200D U+1F469 is a single emoji.
+            const std::string us("\xF0\x9F\x87\xBA\xF0\x9F\x87\xB8");
+            const std::string fr("\xF0\x9F\x87\xAB\xF0\x9F\x87\xB7");
+            const std::string couple("\xF0\x9F\x91\xA8\xE2\x80\x8D\xF0\x9F\x91\xA9");
+            std::string input(us + fr + couple + "\r\n");
+            std::string expected("\r\n" + couple + fr + us);
+
+            ReverseStrUtf8(const_cast<char*>(input.c_str()), kReverseGraphemes);
+
+            Assert::AreEqual(0, expected.compare(input), Msg(expected, input).c_str());
+        }
+
+        TEST_METHOD(ReverseStrUtf8Tests_LongStringSpansChunks)
+        {
+            // Long enough to be split into several chunks, boundaries will fall inside sequences.
+            const std::string cluster("\xE2\x82\xAC" "e\xCC\x81" "\xF0\x9F\x98\x80" "abc");
+            std::string input;
+            while (input.size() < 1024 * 1024)
+                input += cluster;
+            std::string expected;
+            const std::string reversedCluster("cba" "\xF0\x9F\x98\x80" "e\xCC\x81" "\xE2\x82\xAC");
+            while (expected.size() < input.size())
+                expected += reversedCluster;
+
+            ReverseStrUtf8(const_cast<char*>(input.c_str()), kReverseGraphemes);
+
+            Assert::IsTrue(expected == input);
+        }
+    };
 }
\ No newline at end of file
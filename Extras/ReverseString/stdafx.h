@@ -8,4 +8,11 @@
 #include <utility>
 #include <iterator>
 #include <iostream>
+#include <fstream>
+#include <cstdio>
+#include <stdexcept>
+#include <algorithm>
+#include <vector>
+#include <emmintrin.h>
+#include <ppl.h>
 #include <amp.h>
\ No newline at end of file
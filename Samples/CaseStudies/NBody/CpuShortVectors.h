@@ -0,0 +1,645 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the 
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+#pragma once
+
+//--------------------------------------------------------------------------------------
+//  Short vector types for CPU code.
+//--------------------------------------------------------------------------------------
+//
+//  Builds that use C++ AMP take float_3, float_4 and the other short vectors from 
+//  amp_short_vectors.h. CPU only builds, on compilers other than Visual C++ or when 
+//  NBODY_CPU_SHORT_VECTORS is defined as it is by the NBodyHeadlessCpu project, use the 
+//  portable types below instead. They have the 
+//  same names, namespace, layout and API as the C++ AMP types so code written against 
+//  float_3 compiles unchanged and ParticleCpu keeps the layout expected by the renderer and 
+//  by checkpoint files. NBODY_CPU_SHORT_VECTORS must not be defined in a build that also 
+//  includes the C++ AMP headers.
+//
+//  The portable types support:
+//
+//  - Construction from a scalar, from components and explicit conversion between value types.
+//  - Component access with x, y, z and w, get_x(), set_x() and ref_x().
+//  - Swizzles with get_ and set_, for example v.get_zyx() and v.set_xy(float_2(1.0f, 2.0f)). 
+//    The C++ AMP swizzle properties, v.xy, rely on __declspec(property) which is not portable.
+//  - Component-wise arithmetic, compound assignment and comparison.
+//  - dot() and length() for all the value types.
+//  - norm and unorm, floats clamped to [-1, 1] and [0, 1].
+//
+//  float_4 arithmetic uses SSE or NEON registers. float_3 is 12 bytes and is kept scalar, 
+//  loading it into a register costs more than the arithmetic it would save, the compiler can 
+//  still vectorize loops over float_3 values.
+//
+//  Loops over many vectors are faster in SoA form, see the batch functions at the end of this 
+//  file which are available to all builds.
+
+#if !defined(_MSC_VER) && !defined(NBODY_CPU_SHORT_VECTORS)
+#define NBODY_CPU_SHORT_VECTORS
+#endif
+
+#if defined(_M_ARM) || defined(_M_ARM64) || defined(__ARM_NEON)
+#define NBODY_SHORT_VECTORS_NEON
+#include <arm_neon.h>
+#elif defined(_M_X64) || defined(_M_IX86) || defined(__SSE__)
+#define NBODY_SHORT_VECTORS_SSE
+#include <xmmintrin.h>
+#endif
+
+#include <math.h>
+#include <stddef.h>
+
+#if !defined(NBODY_CPU_SHORT_VECTORS)
+
+#include <amp_short_vectors.h>
+
+#else
+
+namespace concurrency
+{
+namespace graphics
+{
+
+//--------------------------------------------------------------------------------------
+//  norm and unorm.
+//--------------------------------------------------------------------------------------
+
+class norm
+{
+private:
+    float m_value;
+
+    static inline float Clamp(float v) { return (v < -1.0f) ? -1.0f : ((v > 1.0f) ? 1.0f : v); }
+
+public:
+    norm() : m_value(0.0f) { }
+    explicit norm(float v) : m_value(Clamp(v)) { }
+    explicit norm(double v) : m_value(Clamp(static_cast<float>(v))) { }
+    explicit norm(int v) : m_value(Clamp(static_cast<float>(v))) { }
+
+    operator float() const { return m_value; }
+
+    norm& operator+=(const norm& rhs) { m_value = Clamp(m_value + rhs.m_value); return *this; }
+    norm& operator-=(const norm& rhs) { m_value = Clamp(m_value - rhs.m_value); return *this; }
+    norm& operator*=(const norm& rhs) { m_value = Clamp(m_value * rhs.m_value); return *this; }
+    norm& operator/=(const norm& rhs) { m_value = Clamp(m_value / rhs.m_value); return *this; }
+    norm operator-() const { return norm(-m_value); }
+
+    friend norm operator+(norm lhs, const norm& rhs) { return lhs += rhs; }
+    friend norm operator-(norm lhs, const norm& rhs) { return lhs -= rhs; }
+    friend norm operator*(norm lhs, const norm& rhs) { return lhs *= rhs; }
+    friend norm operator/(norm lhs, const norm& rhs) { return lhs /= rhs; }
+};
+
+class unorm
+{
+private:
+    float m_value;
+
+    static inline float Clamp(float v) { return (v < 0.0f) ? 0.0f : ((v > 1.0f) ? 1.0f : v); }
+
+public:
+    unorm() : m_value(0.0f) { }
+    explicit unorm(float v) : m_value(Clamp(v)) { }
+    explicit unorm(double v) : m_value(Clamp(static_cast<float>(v))) { }
+    explicit unorm(int v) : m_value(Clamp(static_cast<float>(v))) { }
+
+    operator float() const { return m_value; }
+
+    unorm& operator+=(const unorm& rhs) { m_value = Clamp(m_value + rhs.m_value); return *this; }
+    unorm& operator-=(const unorm& rhs) { m_value = Clamp(m_value - rhs.m_value); return *this; }
+    unorm& operator*=(const unorm& rhs) { m_value = Clamp(m_value * rhs.m_value); return *this; }
+    unorm& operator/=(const unorm& rhs) { m_value = Clamp(m_value / rhs.m_value); return *this; }
+
+    friend unorm operator+(unorm lhs, const unorm& rhs) { return lhs += rhs; }
+    friend unorm operator-(unorm lhs, const unorm& rhs) { return lhs -= rhs; }
+    friend unorm operator*(unorm lhs, const unorm& rhs) { return lhs *= rhs; }
+    friend unorm operator/(unorm lhs, const unorm& rhs) { return lhs /= rhs; }
+};
+
+//--------------------------------------------------------------------------------------
+//  Component-wise operations.
+//--------------------------------------------------------------------------------------
+//
+//  Operations on the components of a vector. Each size is written out in full, compilers do 
+//  not reliably unroll a loop over the components at lower optimization levels and the loop 
+//  keeps the vector in memory rather than in registers. float_4 is specialized for SSE and NEON.
+
+template <typename T, int N>
+struct cpu_short_vector_ops;
+
+template <typename T>
+struct cpu_short_vector_ops<T, 2>
+{
+    static inline void add(const T* a, const T* b, T* r) { r[0] = a[0] + b[0]; r[1] = a[1] + b[1]; }
+    static inline void sub(const T* a, const T* b, T* r) { r[0] = a[0] - b[0]; r[1] = a[1] - b[1]; }
+    static inline void mul(const T* a, const T* b, T* r) { r[0] = a[0] * b[0]; r[1] = a[1] * b[1]; }
+    static inline void div(const T* a, const T* b, T* r) { r[0] = a[0] / b[0]; r[1] = a[1] / b[1]; }
+    static inline T dot(const T* a, const T* b) { return a[0] * b[0] + a[1] * b[1]; }
+};
+
+template <typename T>
+struct cpu_short_vector_ops<T, 3>
+{
+    static inline void add(const T* a, const T* b, T* r) { r[0] = a[0] + b[0]; r[1] = a[1] + b[1]; r[2] = a[2] + b[2]; }
+    static inline void sub(const T* a, const T* b, T* r) { r[0] = a[0] - b[0]; r[1] = a[1] - b[1]; r[2] = a[2] - b[2]; }
+    static inline void mul(const T* a, const T* b, T* r) { r[0] = a[0] * b[0]; r[1] = a[1] * b[1]; r[2] = a[2] * b[2]; }
+    static inline void div(const T* a, const T* b, T* r) { r[0] = a[0] / b[0]; r[1] = a[1] / b[1]; r[2] = a[2] / b[2]; }
+    static inline T dot(const T* a, const T* b) { return a[0] * b[0] + a[1] * b[1] + a[2] * b[2]; }
+};
+
+template <typename T>
+struct cpu_short_vector_ops<T, 4>
+{
+    static inline void add(const T* a, const T* b, T* r) { r[0] = a[0] + b[0]; r[1] = a[1] + b[1]; r[2] = a[2] + b[2]; r[3] = a[3] + b[3]; }
+    static inline void sub(const T* a, const T* b, T* r) { r[0] = a[0] - b[0]; r[1] = a[1] - b[1]; r[2] = a[2] - b[2]; r[3] = a[3] - b[3]; }
+    static inline void mul(const T* a, const T* b, T* r) { r[0] = a[0] * b[0]; r[1] = a[1] * b[1]; r[2] = a[2] * b[2]; r[3] = a[3] * b[3]; }
+    static inline void div(const T* a, const T* b, T* r) { r[0] = a[0] / b[0]; r[1] = a[1] / b[1]; r[2] = a[2] / b[2]; r[3] = a[3] / b[3]; }
+    static inline T dot(const T* a, const T* b) { return a[0] * b[0] + a[1] * b[1] + a[2] * b[2] + a[3] * b[3]; }
+};
+
+#if defined(NBODY_SHORT_VECTORS_SSE)
+
+template <>
+struct cpu_short_vector_ops<float, 4>
+{
+    static inline void add(const float* a, const float* b, float* r) { _mm_storeu_ps(r, _mm_add_ps(_mm_loadu_ps(a), _mm_loadu_ps(b))); }
+    static inline void sub(const float* a, const float* b, float* r) { _mm_storeu_ps(r, _mm_sub_ps(_mm_loadu_ps(a), _mm_loadu_ps(b))); }
+    static inline void mul(const float* a, const float* b, float* r) { _mm_storeu_ps(r, _mm_mul_ps(_mm_loadu_ps(a), _mm_loadu_ps(b))); }
+    static inline void div(const float* a, const float* b, float* r) { _mm_storeu_ps(r, _mm_div_ps(_mm_loadu_ps(a), _mm_loadu_ps(b))); }
+
+    static inline float dot(const float* a, const float* b)
+    {
+        const __m128 products = _mm_mul_ps(_mm_loadu_ps(a), _mm_loadu_ps(b));
+        const __m128 pairs = _mm_add_ps(products, _mm_movehl_ps(products, products));
+        return _mm_cvtss_f32(_mm_add_ss(pairs, _mm_shuffle_ps(pairs, pairs, _MM_SHUFFLE(1, 1, 1, 1))));
+    }
+};
+
+#elif defined(NBODY_SHORT_VECTORS_NEON)
+
+template <>
+struct cpu_short_vector_ops<float, 4>
+{
+    static inline void add(const float* a, const float* b, float* r) { vst1q_f32(r, vaddq_f32(vld1q_f32(a), vld1q_f32(b))); }
+    static inline void sub(const float* a, const float* b, float* r) { vst1q_f32(r, vsubq_f32(vld1q_f32(a), vld1q_f32(b))); }
+    static inline void mul(const float* a, const float* b, float* r) { vst1q_f32(r, vmulq_f32(vld1q_f32(a), vld1q_f32(b))); }
+
+    //  ARMv7 NEON has no vector divide, the components are divided separately.
+    static inline void div(const float* a, const float* b, float* r) { for (int i = 0; i < 4; ++i) r[i] = a[i] / b[i]; }
+
+    static inline float dot(const float* a, const float* b)
+    {
+        const float32x4_t products = vmulq_f32(vld1q_f32(a), vld1q_f32(b));
+        const float32x2_t pairs = vadd_f32(vget_low_f32(products), vget_high_f32(products));
+        return vget_lane_f32(vpadd_f32(pairs, pairs), 0);
+    }
+};
+
+#endif
+
+//--------------------------------------------------------------------------------------
+//  Short vector types.
+//--------------------------------------------------------------------------------------
+
+template <typename T, int N>
+class cpu_short_vector;
+
+//  Members shared by all the short vectors. The components are stored contiguously, starting 
+//  with x, so the vector can be treated as an array of N values.
+
+#define NBODY_SHORT_VECTOR_MEMBERS(N) \
+    typedef T value_type; \
+    static const int size = N; \
+    \
+    template <typename U> \
+    explicit cpu_short_vector(const cpu_short_vector<U, N>& v) \
+    { \
+        for (int i = 0; i < N; ++i) \
+            data()[i] = static_cast<T>(v.data()[i]); \
+    } \
+    \
+    inline T* data() { return &x; } \
+    inline const T* data() const { return &x; } \
+    \
+    cpu_short_vector& operator+=(const cpu_short_vector& rhs) { cpu_short_vector_ops<T, N>::add(data(), rhs.data(), data()); return *this; } \
+    cpu_short_vector& operator-=(const cpu_short_vector& rhs) { cpu_short_vector_ops<T, N>::sub(data(), rhs.data(), data()); return *this; } \
+    cpu_short_vector& operator*=(const cpu_short_vector& rhs) { cpu_short_vector_ops<T, N>::mul(data(), rhs.data(), data()); return *this; } \
+    cpu_short_vector& operator/=(const cpu_short_vector& rhs) { cpu_short_vector_ops<T, N>::div(data(), rhs.data(), data()); return *this; } \
+    \
+    cpu_short_vector operator-() const \
+    { \
+        cpu_short_vector result; \
+        cpu_short_vector_ops<T, N>::sub(result.data(), data(), result.data()); \
+        return result; \
+    } \
+    \
+    friend cpu_short_vector operator+(cpu_short_vector lhs, const cpu_short_vector& rhs) { return lhs += rhs; } \
+    friend cpu_short_vector operator-(cpu_short_vector lhs, const cpu_short_vector& rhs) { return lhs -= rhs; } \
+    friend cpu_short_vector operator*(cpu_short_vector lhs, const cpu_short_vector& rhs) { return lhs *= rhs; } \
+    friend cpu_short_vector operator/(cpu_short_vector lhs, const cpu_short_vector& rhs) { return lhs /= rhs; } \
+    \
+    friend bool operator==(const cpu_short_vector& lhs, const cpu_short_vector& rhs) \
+    { \
+        for (int i = 0; i < N; ++i) \
+        { \
+            if (!(lhs.data()[i] == rhs.data()[i])) \
+                return false; \
+        } \
+        return true; \
+    } \
+    friend bool operator!=(const cpu_short_vector& lhs, const cpu_short_vector& rhs) { return !(lhs == rhs); }
+
+#define NBODY_SHORT_VECTOR_COMPONENT(A) \
+    inline T get_##A() const { return A; } \
+    inline void set_##A(T v) { A = v; } \
+    inline T& ref_##A() { return A; }
+
+#define NBODY_SHORT_VECTOR_SWIZZLE2(A, B) \
+    inline cpu_short_vector<T, 2> get_##A##B() const { return cpu_short_vector<T, 2>(A, B); } \
+    inline void set_##A##B(const cpu_short_vector<T, 2>& v) { A = v.x; B = v.y; }
+
+#define NBODY_SHORT_VECTOR_SWIZZLE3(A, B, C) \
+    inline cpu_short_vector<T, 3> get_##A##B##C() const { return cpu_short_vector<T, 3>(A, B, C); } \
+    inline void set_##A##B##C(const cpu_short_vector<T, 3>& v) { A = v.x; B = v.y; C = v.z; }
+
+#define NBODY_SHORT_VECTOR_SWIZZLE4(A, B, C, D) \
+    inline cpu_short_vector<T, 4> get_##A##B##C##D() const { return cpu_short_vector<T, 4>(A, B, C, D); } \
+    inline void set_##A##B##C##D(const cpu_short_vector<T, 4>& v) { A = v.x; B = v.y; C = v.z; D = v.w; }
+
+template <typename T>
+class cpu_short_vector<T, 2>
+{
+public:
+    T x;
+    T y;
+
+    cpu_short_vector() : x(), y() { }
+    cpu_short_vector(T v) : x(v), y(v) { }
+    cpu_short_vector(T x, T y) : x(x), y(y) { }
+
+    NBODY_SHORT_VECTOR_MEMBERS(2)
+    NBODY_SHORT_VECTOR_COMPONENT(x)
+    NBODY_SHORT_VECTOR_COMPONENT(y)
+    NBODY_SHORT_VECTOR_SWIZZLE2(x, y)
+    NBODY_SHORT_VECTOR_SWIZZLE2(y, x)
+};
+
+template <typename T>
+class cpu_short_vector<T, 3>
+{
+public:
+    T x;
+    T y;
+    T z;
+
+    cpu_short_vector() : x(), y(), z() { }
+    cpu_short_vector(T v) : x(v), y(v), z(v) { }
+    cpu_short_vector(T x, T y, T z) : x(x), y(y), z(z) { }
+
+    NBODY_SHORT_VECTOR_MEMBERS(3)
+    NBODY_SHORT_VECTOR_COMPONENT(x)
+    NBODY_SHORT_VECTOR_COMPONENT(y)
+    NBODY_SHORT_VECTOR_COMPONENT(z)
+    NBODY_SHORT_VECTOR_SWIZZLE2(x, y)
+    NBODY_SHORT_VECTOR_SWIZZLE2(x, z)
+    NBODY_SHORT_VECTOR_SWIZZLE2(y, x)
+    NBODY_SHORT_VECTOR_SWIZZLE2(y, z)
+    NBODY_SHORT_VECTOR_SWIZZLE2(z, x)
+    NBODY_SHORT_VECTOR_SWIZZLE2(z, y)
+    NBODY_SHORT_VECTOR_SWIZZLE3(x, y, z)
+    NBODY_SHORT_VECTOR_SWIZZLE3(x, z, y)
+    NBODY_SHORT_VECTOR_SWIZZLE3(y, x, z)
+    NBODY_SHORT_VECTOR_SWIZZLE3(y, z, x)
+    NBODY_SHORT_VECTOR_SWIZZLE3(z, x, y)
+    NBODY_SHORT_VECTOR_SWIZZLE3(z, y, x)
+};
+
+template <typename T>
+class cpu_short_vector<T, 4>
+{
+public:
+    T x;
+    T y;
+    T z;
+    T w;
+
+    cpu_short_vector() : x(), y(), z(), w() { }
+    cpu_short_vector(T v) : x(v), y(v), z(v), w(v) { }
+    cpu_short_vector(T x, T y, T z, T w) : x(x), y(y), z(z), w(w) { }
+
+    NBODY_SHORT_VECTOR_MEMBERS(4)
+    NBODY_SHORT_VECTOR_COMPONENT(x)
+    NBODY_SHORT_VECTOR_COMPONENT(y)
+    NBODY_SHORT_VECTOR_COMPONENT(z)
+    NBODY_SHORT_VECTOR_COMPONENT(w)
+    NBODY_SHORT_VECTOR_SWIZZLE2(x, y)
+    NBODY_SHORT_VECTOR_SWIZZLE2(x, z)
+    NBODY_SHORT_VECTOR_SWIZZLE2(x, w)
+    NBODY_SHORT_VECTOR_SWIZZLE2(y, x)
+    NBODY_SHORT_VECTOR_SWIZZLE2(y, z)
+    NBODY_SHORT_VECTOR_SWIZZLE2(y, w)
+    NBODY_SHORT_VECTOR_SWIZZLE2(z, x)
+    NBODY_SHORT_VECTOR_SWIZZLE2(z, y)
+    NBODY_SHORT_VECTOR_SWIZZLE2(z, w)
+    NBODY_SHORT_VECTOR_SWIZZLE2(w, x)
+    NBODY_SHORT_VECTOR_SWIZZLE2(w, y)
+    NBODY_SHORT_VECTOR_SWIZZLE2(w, z)
+    NBODY_SHORT_VECTOR_SWIZZLE3(x, y, z)
+    NBODY_SHORT_VECTOR_SWIZZLE3(x, y, w)
+    NBODY_SHORT_VECTOR_SWIZZLE3(x, z, y)
+    NBODY_SHORT_VECTOR_SWIZZLE3(x, z, w)
+    NBODY_SHORT_VECTOR_SWIZZLE3(x, w, y)
+    NBODY_SHORT_VECTOR_SWIZZLE3(x, w, z)
+    NBODY_SHORT_VECTOR_SWIZZLE3(y, x, z)
+    NBODY_SHORT_VECTOR_SWIZZLE3(y, x, w)
+    NBODY_SHORT_VECTOR_SWIZZLE3(y, z, x)
+    NBODY_SHORT_VECTOR_SWIZZLE3(y, z, w)
+    NBODY_SHORT_VECTOR_SWIZZLE3(y, w, x)
+    NBODY_SHORT_VECTOR_SWIZZLE3(y, w, z)
+    NBODY_SHORT_VECTOR_SWIZZLE3(z, x, y)
+    NBODY_SHORT_VECTOR_SWIZZLE3(z, x, w)
+    NBODY_SHORT_VECTOR_SWIZZLE3(z, y, x)
+    NBODY_SHORT_VECTOR_SWIZZLE3(z, y, w)
+    NBODY_SHORT_VECTOR_SWIZZLE3(z, w, x)
+    NBODY_SHORT_VECTOR_SWIZZLE3(z, w, y)
+    NBODY_SHORT_VECTOR_SWIZZLE3(w, x, y)
+    NBODY_SHORT_VECTOR_SWIZZLE3(w, x, z)
+    NBODY_SHORT_VECTOR_SWIZZLE3(w, y, x)
+    NBODY_SHORT_VECTOR_SWIZZLE3(w, y, z)
+    NBODY_SHORT_VECTOR_SWIZZLE3(w, z, x)
+    NBODY_SHORT_VECTOR_SWIZZLE3(w, z, y)
+    NBODY_SHORT_VECTOR_SWIZZLE4(x, y, z, w)
+    NBODY_SHORT_VECTOR_SWIZZLE4(w, z, y, x)
+};
+
+#undef NBODY_SHORT_VECTOR_MEMBERS
+#undef NBODY_SHORT_VECTOR_COMPONENT
+#undef NBODY_SHORT_VECTOR_SWIZZLE2
+#undef NBODY_SHORT_VECTOR_SWIZZLE3
+#undef NBODY_SHORT_VECTOR_SWIZZLE4
+
+typedef cpu_short_vector<int, 2> int_2;
+typedef cpu_short_vector<int, 3> int_3;
+typedef cpu_short_vector<int, 4> int_4;
+typedef cpu_short_vector<unsigned int, 2> uint_2;
+typedef cpu_short_vector<unsigned int, 3> uint_3;
+typedef cpu_short_vector<unsigned int, 4> uint_4;
+typedef cpu_short_vector<float, 2> float_2;
+typedef cpu_short_vector<float, 3> float_3;
+typedef cpu_short_vector<float, 4> float_4;
+typedef cpu_short_vector<double, 2> double_2;
+typedef cpu_short_vector<double, 3> double_3;
+typedef cpu_short_vector<double, 4> double_4;
+typedef cpu_short_vector<norm, 2> norm_2;
+typedef cpu_short_vector<norm, 3> norm_3;
+typedef cpu_short_vector<norm, 4> norm_4;
+typedef cpu_short_vector<unorm, 2> unorm_2;
+typedef cpu_short_vector<unorm, 3> unorm_3;
+typedef cpu_short_vector<unorm, 4> unorm_4;
+
+//  The same type traits as C++ AMP. short_vector<T, 1>::type and short_vector_traits<T> for 
+//  a scalar T describe the scalar itself.
+
+template <typename T, int N>
+struct short_vector
+{
+    typedef cpu_short_vector<T, N> type;
+};
+
+template <typename T>
+struct short_vector<T, 1>
+{
+    typedef T type;
+};
+
+template <typename T>
+struct short_vector_traits
+{
+    typedef T value_type;
+    static const int size = 1;
+};
+
+template <typename T, int N>
+struct short_vector_traits<cpu_short_vector<T, N>>
+{
+    typedef T value_type;
+    static const int size = N;
+};
+
+//--------------------------------------------------------------------------------------
+//  Vector functions.
+//--------------------------------------------------------------------------------------
+
+template <typename T, int N>
+inline T dot(const cpu_short_vector<T, N>& a, const cpu_short_vector<T, N>& b)
+{
+    return cpu_short_vector_ops<T, N>::dot(a.data(), b.data());
+}
+
+template <typename T, int N>
+inline float length(const cpu_short_vector<T, N>& v)
+{
+    return sqrtf(static_cast<float>(dot(v, v)));
+}
+
+template <int N>
+inline double length(const cpu_short_vector<double, N>& v)
+{
+    return sqrt(dot(v, v));
+}
+
+}
+}
+
+#endif
+
+//--------------------------------------------------------------------------------------
+//  Batch operations on float_3 values stored as a structure of arrays.
+//--------------------------------------------------------------------------------------
+//
+//  Each function processes count vectors whose x, y and z components are held in separate 
+//  arrays, four at a time in SSE or NEON registers where available. The arrays do not need to
+//  be aligned. Gather and scatter convert to and from an array of structures, such as the pos
+//  member of ParticleCpu, given the stride between elements in bytes. Four vectors are loaded
+//  or stored as the rows of a register each and transposed.
+
+//  Each row load also reads the float after the vector, so the last vector is always copied
+//  on its own to avoid reading past the end of the array.
+
+inline void GatherFloat3(const concurrency::graphics::float_3* const pIn, size_t stride, int count, 
+    float* const x, float* const y, float* const z)
+{
+    const char* p = reinterpret_cast<const char*>(pIn);
+    int i = 0;
+#if defined(NBODY_SHORT_VECTORS_SSE)
+    for (; (i + 4) < count; i += 4, p += 4 * stride)
+    {
+        __m128 r0 = _mm_loadu_ps(reinterpret_cast<const float*>(p));
+        __m128 r1 = _mm_loadu_ps(reinterpret_cast<const float*>(p + stride));
+        __m128 r2 = _mm_loadu_ps(reinterpret_cast<const float*>(p + 2 * stride));
+        __m128 r3 = _mm_loadu_ps(reinterpret_cast<const float*>(p + 3 * stride));
+        _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+        _mm_storeu_ps(x + i, r0);
+        _mm_storeu_ps(y + i, r1);
+        _mm_storeu_ps(z + i, r2);
+    }
+#elif defined(NBODY_SHORT_VECTORS_NEON)
+    for (; (i + 4) < count; i += 4, p += 4 * stride)
+    {
+        const float32x4x2_t r01 = vtrnq_f32(vld1q_f32(reinterpret_cast<const float*>(p)), 
+            vld1q_f32(reinterpret_cast<const float*>(p + stride)));
+        const float32x4x2_t r23 = vtrnq_f32(vld1q_f32(reinterpret_cast<const float*>(p + 2 * stride)), 
+            vld1q_f32(reinterpret_cast<const float*>(p + 3 * stride)));
+        vst1q_f32(x + i, vcombine_f32(vget_low_f32(r01.val[0]), vget_low_f32(r23.val[0])));
+        vst1q_f32(y + i, vcombine_f32(vget_low_f32(r01.val[1]), vget_low_f32(r23.val[1])));
+        vst1q_f32(z + i, vcombine_f32(vget_high_f32(r01.val[0]), vget_high_f32(r23.val[0])));
+    }
+#endif
+    for (; i < count; ++i, p += stride)
+    {
+        const concurrency::graphics::float_3& v = *reinterpret_cast<const concurrency::graphics::float_3*>(p);
+        x[i] = v.x;
+        y[i] = v.y;
+        z[i] = v.z;
+    }
+}
+
+//  Only the 12 bytes of each vector are written, any padding after it is left unchanged.
+
+inline void ScatterFloat3(const float* const x, const float* const y, const float* const z, int count, 
+    concurrency::graphics::float_3* const pOut, size_t stride)
+{
+    char* p = reinterpret_cast<char*>(pOut);
+    int i = 0;
+#if defined(NBODY_SHORT_VECTORS_SSE)
+    for (; (i + 4) <= count; i += 4, p += 4 * stride)
+    {
+        __m128 rows[4] = { _mm_loadu_ps(x + i), _mm_loadu_ps(y + i), _mm_loadu_ps(z + i), _mm_setzero_ps() };
+        _MM_TRANSPOSE4_PS(rows[0], rows[1], rows[2], rows[3]);
+        for (int r = 0; r < 4; ++r)
+        {
+            float* const pRow = reinterpret_cast<float*>(p + r * stride);
+            _mm_storel_pi(reinterpret_cast<__m64*>(pRow), rows[r]);
+            _mm_store_ss(pRow + 2, _mm_movehl_ps(rows[r], rows[r]));
+        }
+    }
+#elif defined(NBODY_SHORT_VECTORS_NEON)
+    for (; (i + 4) <= count; i += 4, p += 4 * stride)
+    {
+        const float32x4x2_t xy = vtrnq_f32(vld1q_f32(x + i), vld1q_f32(y + i));
+        const float32x4_t vz = vld1q_f32(z + i);
+        float* const p0 = reinterpret_cast<float*>(p);
+        float* const p1 = reinterpret_cast<float*>(p + stride);
+        float* const p2 = reinterpret_cast<float*>(p + 2 * stride);
+        float* const p3 = reinterpret_cast<float*>(p + 3 * stride);
+        vst1_f32(p0, vget_low_f32(xy.val[0]));
+        vst1_f32(p1, vget_low_f32(xy.val[1]));
+        vst1_f32(p2, vget_high_f32(xy.val[0]));
+        vst1_f32(p3, vget_high_f32(xy.val[1]));
+        vst1q_lane_f32(p0 + 2, vz, 0);
+        vst1q_lane_f32(p1 + 2, vz, 1);
+        vst1q_lane_f32(p2 + 2, vz, 2);
+        vst1q_lane_f32(p3 + 2, vz, 3);
+    }
+#endif
+    for (; i < count; ++i, p += stride)
+        *reinterpret_cast<concurrency::graphics::float_3*>(p) = concurrency::graphics::float_3(x[i], y[i], z[i]);
+}
+
+//  (x, y, z) += scale * (sourceX, sourceY, sourceZ)
+
+inline void AddScaledFloat3(float* const x, float* const y, float* const z, 
+    const float* const sourceX, const float* const sourceY, const float* const sourceZ, float scale, int count)
+{
+    int i = 0;
+#if defined(NBODY_SHORT_VECTORS_SSE)
+    const __m128 s = _mm_set1_ps(scale);
+    for (; (i + 4) <= count; i += 4)
+    {
+        _mm_storeu_ps(x + i, _mm_add_ps(_mm_loadu_ps(x + i), _mm_mul_ps(s, _mm_loadu_ps(sourceX + i))));
+        _mm_storeu_ps(y + i, _mm_add_ps(_mm_loadu_ps(y + i), _mm_mul_ps(s, _mm_loadu_ps(sourceY + i))));
+        _mm_storeu_ps(z + i, _mm_add_ps(_mm_loadu_ps(z + i), _mm_mul_ps(s, _mm_loadu_ps(sourceZ + i))));
+    }
+#elif defined(NBODY_SHORT_VECTORS_NEON)
+    for (; (i + 4) <= count; i += 4)
+    {
+        vst1q_f32(x + i, vmlaq_n_f32(vld1q_f32(x + i), vld1q_f32(sourceX + i), scale));
+        vst1q_f32(y + i, vmlaq_n_f32(vld1q_f32(y + i), vld1q_f32(sourceY + i), scale));
+        vst1q_f32(z + i, vmlaq_n_f32(vld1q_f32(z + i), vld1q_f32(sourceZ + i), scale));
+    }
+#endif
+    for (; i < count; ++i)
+    {
+        x[i] += scale * sourceX[i];
+        y[i] += scale * sourceY[i];
+        z[i] += scale * sourceZ[i];
+    }
+}
+
+//  (x, y, z) *= scale
+
+inline void ScaleFloat3(float* const x, float* const y, float* const z, float scale, int count)
+{
+    int i = 0;
+#if defined(NBODY_SHORT_VECTORS_SSE)
+    const __m128 s = _mm_set1_ps(scale);
+    for (; (i + 4) <= count; i += 4)
+    {
+        _mm_storeu_ps(x + i, _mm_mul_ps(s, _mm_loadu_ps(x + i)));
+        _mm_storeu_ps(y + i, _mm_mul_ps(s, _mm_loadu_ps(y + i)));
+        _mm_storeu_ps(z + i, _mm_mul_ps(s, _mm_loadu_ps(z + i)));
+    }
+#elif defined(NBODY_SHORT_VECTORS_NEON)
+    for (; (i + 4) <= count; i += 4)
+    {
+        vst1q_f32(x + i, vmulq_n_f32(vld1q_f32(x + i), scale));
+        vst1q_f32(y + i, vmulq_n_f32(vld1q_f32(y + i), scale));
+        vst1q_f32(z + i, vmulq_n_f32(vld1q_f32(z + i), scale));
+    }
+#endif
+    for (; i < count; ++i)
+    {
+        x[i] *= scale;
+        y[i] *= scale;
+        z[i] *= scale;
+    }
+}
+
+//  result[i] = x[i] * x[i] + y[i] * y[i] + z[i] * z[i]
+
+inline void SqrLengthFloat3(const float* const x, const float* const y, const float* const z, float* const result, int count)
+{
+    int i = 0;
+#if defined(NBODY_SHORT_VECTORS_SSE)
+    for (; (i + 4) <= count; i += 4)
+    {
+        const __m128 vx = _mm_loadu_ps(x + i);
+        const __m128 vy = _mm_loadu_ps(y + i);
+        const __m128 vz = _mm_loadu_ps(z + i);
+        _mm_storeu_ps(result + i, _mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, vx), _mm_mul_ps(vy, vy)), _mm_mul_ps(vz, vz)));
+    }
+#elif defined(NBODY_SHORT_VECTORS_NEON)
+    for (; (i + 4) <= count; i += 4)
+    {
+        const float32x4_t vx = vld1q_f32(x + i);
+        const float32x4_t vy = vld1q_f32(y + i);
+        const float32x4_t vz = vld1q_f32(z + i);
+        vst1q_f32(result + i, vmlaq_f32(vmlaq_f32(vmulq_f32(vx, vx), vy, vy), vz, vz));
+    }
+#endif
+    for (; i < count; ++i)
+        result[i] = x[i] * x[i] + y[i] * y[i] + z[i] * z[i];
+}
@@ -0,0 +1,381 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the 
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <memory>
+#include <vector>
+#include <set>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <utility>
+#include <new>
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <psapi.h>
+#include <intrin.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <cpuid.h>
+#endif
+#endif
+
+#include "Common.h"
+#include "CpuTopology.h"
+
+//  Fallback values, the L1 default matches the one previously used by GetLevelOneCacheSize.
+
+const int kDefaultLevelOneCacheSize = 16 * 1024;
+const int kDefaultLevelTwoCacheSize = 256 * 1024;
+const int kDefaultCacheLineSize = 64;
+
+//  Record a cache reported by the operating system or CPUID. Instruction caches are ignored.
+
+void SetCacheSize(CpuTopology& topology, int level, int size, int lineSize)
+{
+    int* const sizes[] = { nullptr, &topology.levelOneCacheSize, &topology.levelTwoCacheSize, &topology.levelThreeCacheSize };
+    if ((level < 1) || (level > 3) || (size <= 0))
+        return;
+    if (*sizes[level] == 0)
+        *sizes[level] = size;
+    if ((topology.cacheLineSize == 0) && (lineSize > 0))
+        topology.cacheLineSize = lineSize;
+}
+
+//--------------------------------------------------------------------------------------
+//  CPUID.
+//--------------------------------------------------------------------------------------
+//
+//  Leaf 4 on Intel, and leaf 0x8000001D on AMD processors with topology extensions, 
+//  enumerate the caches. Each sub-leaf describes one cache until a cache type of zero:
+//
+//  EAX[4:0] type, EAX[7:5] level, EBX[11:0] line size - 1, EBX[21:12] partitions - 1, 
+//  EBX[31:22] ways - 1, ECX sets - 1.
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+
+inline void Cpuid(int info[4], int leaf, int subleaf)
+{
+#if defined(_WIN32)
+    __cpuidex(info, leaf, subleaf);
+#else
+    unsigned int regs[4];
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+    for (int i = 0; i < 4; ++i)
+        info[i] = static_cast<int>(regs[i]);
+#endif
+}
+
+void ReadCpuidCaches(CpuTopology& topology)
+{
+    int info[4];
+    Cpuid(info, 0, 0);
+    const int maxLeaf = info[0];
+    char vendor[13] = { 0 };
+    memcpy(vendor, &info[1], 4);
+    memcpy(vendor + 4, &info[3], 4);
+    memcpy(vendor + 8, &info[2], 4);
+
+    int cacheLeaf = 0;
+    if ((std::string(vendor) == "GenuineIntel") && (maxLeaf >= 4))
+    {
+        cacheLeaf = 4;
+    }
+    else if (std::string(vendor) == "AuthenticAMD")
+    {
+        Cpuid(info, 0x80000000, 0);
+        if (static_cast<unsigned int>(info[0]) >= 0x8000001D)
+            cacheLeaf = 0x8000001D;
+    }
+    if (cacheLeaf == 0)
+        return;
+
+    for (int subleaf = 0; subleaf < 16; ++subleaf)
+    {
+        Cpuid(info, cacheLeaf, subleaf);
+        const int type = info[0] & 0x1F;
+        if (type == 0)
+            break;
+        if (type == 2)
+            continue;
+        const int level = (info[0] >> 5) & 0x7;
+        const int lineSize = (info[1] & 0xFFF) + 1;
+        const int partitions = ((info[1] >> 12) & 0x3FF) + 1;
+        const int ways = ((static_cast<unsigned int>(info[1]) >> 22) & 0x3FF) + 1;
+        const int sets = info[2] + 1;
+        SetCacheSize(topology, level, ways * partitions * lineSize * sets, lineSize);
+    }
+}
+
+#else
+
+void ReadCpuidCaches(CpuTopology& topology)
+{
+}
+
+#endif
+
+#if defined(_WIN32)
+
+//--------------------------------------------------------------------------------------
+//  Windows.
+//--------------------------------------------------------------------------------------
+
+typedef BOOL (WINAPI* GetProcInfoFunc)(PSYSTEM_LOGICAL_PROCESSOR_INFORMATION, DWORD*);
+
+void ReadSystemTopology(CpuTopology& topology)
+{
+    GetProcInfoFunc funcptr = (GetProcInfoFunc)::GetProcAddress(GetModuleHandle(TEXT("kernel32")), "GetLogicalProcessorInformation");
+    if (nullptr == funcptr) 
+        return;
+
+    typedef std::unique_ptr<SYSTEM_LOGICAL_PROCESSOR_INFORMATION, FreeDeleter<SYSTEM_LOGICAL_PROCESSOR_INFORMATION>> BufferType;
+
+    BufferType buffer(nullptr);
+    DWORD bufferSize = 0;
+
+    // Loop through twice. First pass gets buffer size, second pass fills buffer.
+
+    while (true)
+    {
+        DWORD ret = funcptr(buffer.get(), &bufferSize);
+        if (0 != ret) 
+            break;
+
+        if (GetLastError() != ERROR_INSUFFICIENT_BUFFER) 
+            return;
+
+        buffer = BufferType((SYSTEM_LOGICAL_PROCESSOR_INFORMATION*)std::malloc(bufferSize));
+        if (nullptr == buffer.get()) 
+            return;
+    }
+
+    const int bufferLen = bufferSize / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION);
+    for (int i = 0; i < bufferLen; ++i)
+    {
+        const SYSTEM_LOGICAL_PROCESSOR_INFORMATION& r = buffer.get()[i];
+        switch (r.Relationship)
+        {
+        case RelationCache:
+            if (r.Cache.Type != CacheInstruction)
+                SetCacheSize(topology, r.Cache.Level, r.Cache.Size, r.Cache.LineSize);
+            break;
+        case RelationProcessorCore:
+            ++topology.numCores;
+            for (ULONG_PTR mask = r.ProcessorMask; mask != 0; mask &= mask - 1)
+                ++topology.numLogicalProcessors;
+            break;
+        case RelationNumaNode:
+            ++topology.numNumaNodes;
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+#else
+
+//--------------------------------------------------------------------------------------
+//  Linux.
+//--------------------------------------------------------------------------------------
+
+//  Read the first line of a sysfs file, returns an empty string if it does not exist.
+
+std::string ReadSysfsLine(const std::string& path)
+{
+    std::ifstream file(path.c_str());
+    std::string line;
+    std::getline(file, line);
+    return line;
+}
+
+//  Parse a size such as "32K" or "8M".
+
+int ParseSysfsSize(const std::string& value)
+{
+    char* pEnd = nullptr;
+    long size = strtol(value.c_str(), &pEnd, 10);
+    if (*pEnd == 'K')
+        size *= 1024;
+    else if (*pEnd == 'M')
+        size *= 1024 * 1024;
+    return static_cast<int>(size);
+}
+
+//  Count the entries in a list such as "0-3,8-11".
+
+int CountSysfsList(const std::string& value)
+{
+    int count = 0;
+    std::istringstream list(value);
+    std::string range;
+    while (std::getline(list, range, ','))
+    {
+        int first = 0;
+        int last = 0;
+        const int fields = sscanf(range.c_str(), "%d-%d", &first, &last);
+        if (fields == 1)
+            ++count;
+        else if (fields == 2)
+            count += last - first + 1;
+    }
+    return count;
+}
+
+void ReadSystemTopology(CpuTopology& topology)
+{
+    const std::string cpuRoot("/sys/devices/system/cpu/");
+
+    for (int index = 0; ; ++index)
+    {
+        std::ostringstream cache;
+        cache << cpuRoot << "cpu0/cache/index" << index << "/";
+        const std::string type = ReadSysfsLine(cache.str() + "type");
+        if (type.empty())
+            break;
+        if (type == "Instruction")
+            continue;
+        SetCacheSize(topology, atoi(ReadSysfsLine(cache.str() + "level").c_str()), ParseSysfsSize(ReadSysfsLine(cache.str() + "size")),
+            atoi(ReadSysfsLine(cache.str() + "coherency_line_size").c_str()));
+    }
+
+    // Each core is identified by its package and core id. Offline processors have no topology.
+    topology.numLogicalProcessors = CountSysfsList(ReadSysfsLine(cpuRoot + "online"));
+    const int numPossible = CountSysfsList(ReadSysfsLine(cpuRoot + "possible"));
+    std::set<std::pair<int, int>> cores;
+    for (int cpu = 0; cpu < numPossible; ++cpu)
+    {
+        std::ostringstream path;
+        path << cpuRoot << "cpu" << cpu << "/topology/";
+        const std::string package = ReadSysfsLine(path.str() + "physical_package_id");
+        const std::string core = ReadSysfsLine(path.str() + "core_id");
+        if (!package.empty() && !core.empty())
+            cores.insert(std::make_pair(atoi(package.c_str()), atoi(core.c_str())));
+    }
+    topology.numCores = static_cast<int>(cores.size());
+
+    topology.numNumaNodes = CountSysfsList(ReadSysfsLine("/sys/devices/system/node/online"));
+}
+
+#endif
+
+#if defined(_WIN32)
+
+void* AllocateNodeMemory(size_t size, int node)
+{
+    void* pMemory = (node < 0) ? VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE) :
+        VirtualAllocExNuma(GetCurrentProcess(), nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, static_cast<DWORD>(node));
+    if (pMemory == nullptr)
+        throw std::bad_alloc();
+    return pMemory;
+}
+
+#pragma warning(push)
+#pragma warning(disable:4100)   // Ignore unused parameter warning.
+
+void FreeNodeMemory(void* const pMemory, size_t size)
+{
+    VirtualFree(pMemory, 0, MEM_RELEASE);
+}
+
+#pragma warning(pop)
+
+int GetMemoryNode(const void* const pMemory)
+{
+    PSAPI_WORKING_SET_EX_INFORMATION info;
+    info.VirtualAddress = const_cast<void*>(pMemory);
+    if (!QueryWorkingSetEx(GetCurrentProcess(), &info, sizeof(info)) || !info.VirtualAttributes.Valid)
+        return -1;
+    return static_cast<int>(info.VirtualAttributes.Node);
+}
+
+#else
+
+//  The mempolicy constants from linux/mempolicy.h, the system calls are made directly so 
+//  libnuma is not required.
+
+const int kMpolPreferred = 1;
+const int kMpolFlagNode = 1 << 0;
+const int kMpolFlagAddress = 1 << 1;
+
+void* AllocateNodeMemory(size_t size, int node)
+{
+    void* pMemory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pMemory == MAP_FAILED)
+        throw std::bad_alloc();
+#if defined(SYS_mbind)
+    // A failure leaves the default first touch placement.
+    if (node >= 0)
+    {
+        const int bitsPerWord = 8 * sizeof(unsigned long);
+        std::vector<unsigned long> nodeMask(node / bitsPerWord + 1, 0);
+        nodeMask[node / bitsPerWord] = 1UL << (node % bitsPerWord);
+        syscall(SYS_mbind, pMemory, size, kMpolPreferred, &nodeMask[0], nodeMask.size() * bitsPerWord + 1, 0);
+    }
+#endif
+    return pMemory;
+}
+
+void FreeNodeMemory(void* const pMemory, size_t size)
+{
+    munmap(pMemory, size);
+}
+
+int GetMemoryNode(const void* const pMemory)
+{
+#if defined(SYS_get_mempolicy)
+    int node = -1;
+    if (syscall(SYS_get_mempolicy, &node, nullptr, 0, pMemory, kMpolFlagNode | kMpolFlagAddress) == 0)
+        return node;
+#endif
+    return -1;
+}
+
+#endif
+
+CpuTopology GetCpuTopology()
+{
+    CpuTopology topology;
+    ReadSystemTopology(topology);
+    ReadCpuidCaches(topology);
+
+    if (topology.levelOneCacheSize == 0)
+        topology.levelOneCacheSize = kDefaultLevelOneCacheSize;
+    if (topology.levelTwoCacheSize == 0)
+        topology.levelTwoCacheSize = kDefaultLevelTwoCacheSize;
+    if (topology.cacheLineSize == 0)
+        topology.cacheLineSize = kDefaultCacheLineSize;
+#if !defined(_WIN32)
+    if (topology.numLogicalProcessors == 0)
+        topology.numLogicalProcessors = static_cast<int>(sysconf(_SC_NPROCESSORS_ONLN));
+#endif
+    if (topology.numLogicalProcessors == 0)
+        topology.numLogicalProcessors = 1;
+    if ((topology.numCores == 0) || (topology.numCores > topology.numLogicalProcessors))
+        topology.numCores = topology.numLogicalProcessors;
+    if (topology.numNumaNodes == 0)
+        topology.numNumaNodes = 1;
+    return topology;
+}
@@ -0,0 +1,67 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the 
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+
+#pragma once
+
+//--------------------------------------------------------------------------------------
+//  Processor cache and core topology.
+//--------------------------------------------------------------------------------------
+//
+//  On Windows the topology is read with GetLogicalProcessorInformation. On Linux it is read 
+//  from sysfs, /sys/devices/system/cpu and /sys/devices/system/node. Cache sizes that are not
+//  reported by the operating system are read with CPUID leaf 4 (Intel) or 0x8000001D (AMD) 
+//  and anything still unknown is given a conservative default.
+//
+//  Cache sizes are for a single cache at each level, so an L2 shared by two cores is reported 
+//  at its full size. An absent L3 is reported as zero.
+
+struct CpuTopology
+{
+    int levelOneCacheSize;                                      // L1 data cache, in bytes.
+    int levelTwoCacheSize;
+    int levelThreeCacheSize;
+    int cacheLineSize;
+    int numCores;                                               // Physical cores in all packages.
+    int numLogicalProcessors;
+    int numNumaNodes;
+
+    CpuTopology() : levelOneCacheSize(0), levelTwoCacheSize(0), levelThreeCacheSize(0), cacheLineSize(0),
+        numCores(0), numLogicalProcessors(0), numNumaNodes(0) { }
+
+    inline int ThreadsPerCore() const { return (numCores > 0) ? numLogicalProcessors / numCores : 1; }
+};
+
+//  Probe the topology of the current machine. This queries the operating system each time it 
+//  is called so callers should keep the result.
+
+CpuTopology GetCpuTopology();
+
+//  Allocate memory directly from the operating system, the pages are zeroed and are not 
+//  placed in physical memory until they are first touched. node is the preferred NUMA node 
+//  for the pages, VirtualAllocExNuma on Windows and mbind on Linux, whichever thread touches 
+//  them first. A negative node, or a kernel without NUMA support, leaves each page on the node
+//  of the thread that first touches it.
+//
+//  Throws std::bad_alloc if the memory cannot be allocated.
+
+void* AllocateNodeMemory(size_t size, int node);
+void FreeNodeMemory(void* const pMemory, size_t size);
+
+//  The NUMA node of the physical page holding pMemory, or -1 if the page is not resident or 
+//  the operating system does not report it.
+
+int GetMemoryNode(const void* const pMemory);
@@ -0,0 +1,195 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the 
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+#pragma once
+
+#include <ppl.h>
+#include <vector>
+#include <numeric>
+#include <algorithm>
+#include <float.h>
+
+#include "Common.h"
+#include "ParticleCpu.h"
+
+//--------------------------------------------------------------------------------------
+//  Morton (Z-order) keys for particle positions.
+//--------------------------------------------------------------------------------------
+//
+//  A Morton key interleaves the bits of the x, y and z cell coordinates of a particle so 
+//  that sorting particles by key places them in depth first order of an octree. Each group
+//  of three bits, starting with the most significant, selects the octant at the next level 
+//  of the tree. Particles that are close together in space are usually close together in
+//  the sorted order, which improves cache locality.
+//
+//  Keys are stored in a size_t so that they can be sorted with parallel_radixsort. This 
+//  gives 21 bits, or levels, per axis on 64 bit platforms and 10 on 32 bit platforms.
+
+const int kMortonBitsPerAxis = (sizeof(size_t) * 8) / 3;
+
+//  Spread the low kMortonBitsPerAxis bits of v so there are two zero bits between each one.
+
+inline size_t MortonExpandBits(size_t v)
+{
+    size_t result = 0;
+    for (int i = 0; i < kMortonBitsPerAxis; ++i)
+        result |= ((v >> i) & 1) << (3 * i);
+    return result;
+}
+
+//  The cube that encloses a set of particles.
+
+struct MortonBounds
+{
+    float_3 origin;                     // Minimum corner.
+    float size;                         // Length of each edge.
+
+    MortonBounds() : origin(0.0f), size(1.0f) { }
+};
+
+//  Find the cube that encloses all particles. Each edge is slightly enlarged so that the 
+//  particles on the maximum faces still map to a valid cell.
+
+inline MortonBounds GetMortonBounds(const ParticleCpu* const pParticles, int numParticles)
+{
+    struct Extent
+    {
+        float_3 minPos;
+        float_3 maxPos;
+        Extent() : minPos(FLT_MAX), maxPos(-FLT_MAX) { }
+    };
+
+    concurrency::combinable<Extent> extents;
+    concurrency::parallel_for(0, numParticles, [=, &extents](int i)
+    {
+        Extent& e = extents.local();
+        const float_3 p = pParticles[i].pos;
+        e.minPos = float_3(std::min(e.minPos.x, p.x), std::min(e.minPos.y, p.y), std::min(e.minPos.z, p.z));
+        e.maxPos = float_3(std::max(e.maxPos.x, p.x), std::max(e.maxPos.y, p.y), std::max(e.maxPos.z, p.z));
+    });
+
+    Extent total;
+    extents.combine_each([&total](const Extent& e)
+    {
+        total.minPos = float_3(std::min(total.minPos.x, e.minPos.x), std::min(total.minPos.y, e.minPos.y), std::min(total.minPos.z, e.minPos.z));
+        total.maxPos = float_3(std::max(total.maxPos.x, e.maxPos.x), std::max(total.maxPos.y, e.maxPos.y), std::max(total.maxPos.z, e.maxPos.z));
+    });
+
+    MortonBounds bounds;
+    if (numParticles == 0)
+        return bounds;
+    const float_3 extent = total.maxPos - total.minPos;
+    bounds.origin = total.minPos;
+    bounds.size = std::max(std::max(extent.x, extent.y), std::max(extent.z, FLT_MIN)) * 1.001f;
+    return bounds;
+}
+
+//  Calculate the Morton key for the cell containing pos.
+
+inline size_t MortonKey(const float_3& pos, const MortonBounds& bounds)
+{
+    const float cells = static_cast<float>(size_t(1) << kMortonBitsPerAxis);
+    const float scale = cells / bounds.size;
+    const float_3 cell = (pos - bounds.origin) * scale;
+    const size_t maxCell = (size_t(1) << kMortonBitsPerAxis) - 1;
+
+    const size_t x = std::min(static_cast<size_t>(std::max(cell.x, 0.0f)), maxCell);
+    const size_t y = std::min(static_cast<size_t>(std::max(cell.y, 0.0f)), maxCell);
+    const size_t z = std::min(static_cast<size_t>(std::max(cell.z, 0.0f)), maxCell);
+    return (MortonExpandBits(x) << 2) | (MortonExpandBits(y) << 1) | MortonExpandBits(z);
+}
+
+//  Get the octant, 0 to 7, that a key falls into at a given level of the tree. The root
+//  node is level 0 and its children are selected by the octant at level 0.
+
+inline int MortonOctant(size_t key, int level)
+{
+    return static_cast<int>((key >> (3 * (kMortonBitsPerAxis - 1 - level))) & 0x7);
+}
+
+//--------------------------------------------------------------------------------------
+//  Periodic reordering of particle storage into Morton order.
+//--------------------------------------------------------------------------------------
+//
+//  Particles keep their initial order unless they are reordered, so as the clusters mix 
+//  particles that are close together in space become scattered through memory. Reorder 
+//  sorts the particles by Morton key with a parallel radix sort and then gathers them into 
+//  a second array in a single parallel pass, moving each particle's whole state. 
+//
+//  The order keeps the original index of the particle in each position so output, such as 
+//  checkpoints and trajectories, can be written in the original order with Restore. Integrators
+//  that keep their own per-particle state between steps must not be used with reordering.
+
+class MortonOrder
+{
+private:
+    typedef std::pair<size_t, int> KeyIndex;                    // Morton key and current particle index.
+
+    std::vector<KeyIndex> m_keys;
+    std::vector<int> m_ids;                                     // Original index of the particle in each position.
+    std::vector<int> m_newIds;
+
+public:
+    explicit MortonOrder(int numParticles) :
+        m_keys(numParticles),
+        m_ids(numParticles),
+        m_newIds(numParticles)
+    {
+        std::iota(m_ids.begin(), m_ids.end(), 0);
+    }
+
+    inline int Id(int i) const { return m_ids[i]; }
+
+    //  Write the particles in pIn to pOut in Morton order.
+    void Reorder(const ParticleCpu* const pIn, ParticleCpu* const pOut, int numParticles)
+    {
+        const MortonBounds bounds = GetMortonBounds(pIn, numParticles);
+        concurrency::parallel_for(0, numParticles, [=](int i)
+        {
+            m_keys[i] = KeyIndex(MortonKey(pIn[i].pos, bounds), i);
+        });
+        concurrency::parallel_radixsort(m_keys.begin(), m_keys.begin() + numParticles, [](const KeyIndex& k) { return k.first; });
+        concurrency::parallel_for(0, numParticles, [=](int i)
+        {
+            const int source = m_keys[i].second;
+            pOut[i] = pIn[source];
+            m_newIds[i] = m_ids[source];
+        });
+        std::swap(m_ids, m_newIds);
+    }
+
+    //  Write the particles in pIn to pOut in their original order.
+    void Restore(const ParticleCpu* const pIn, ParticleCpu* const pOut, int numParticles) const
+    {
+        concurrency::parallel_for(0, numParticles, [=](int i)
+        {
+            pOut[m_ids[i]] = pIn[i];
+        });
+    }
+
+    //  The mean distance between particles that are next to each other in memory. This is a 
+    //  simple measure of locality, it falls as particles that are close in space are stored 
+    //  close together.
+    static double MeanNeighborDistance(const ParticleCpu* const pParticles, int numParticles)
+    {
+        concurrency::combinable<double> sum;
+        concurrency::parallel_for(1, numParticles, [=, &sum](int i)
+        {
+            sum.local() += sqrt(SqrLength(pParticles[i].pos - pParticles[i - 1].pos));
+        });
+        return (numParticles > 1) ? sum.combine(std::plus<double>()) / (numParticles - 1) : 0.0;
+    }
+};
@@ -19,13 +19,14 @@
 #include <ppl.h>
 #include <concrtrm.h>
 #include <assert.h>
-#include <atlbase.h>
 #include <random>
 #include <memory>
 #include <algorithm>
 
 #include "Common.h"
+#include "CpuTopology.h"
 #include "NBodyAdvancedCpu.h"
+#include "NBodyKernels.h"
 
 using namespace concurrency;
 using namespace concurrency::graphics;
@@ -42,187 +43,275 @@ using namespace concurrency::graphics;
 //  http://software.intel.com/en-us/articles/a-cute-technique-for-avoiding-certain-race-conditions
 //  http://software.intel.com/en-us/blogs/2010/07/01/n-bodies-a-parallel-tbb-solution-parallel-code-balanced-recursive-parallelism-with-parallel_invoke/
 
-//  Select which interaction engine to use based on the available SSE support.
+//  The kernels are in NBodyKernels.h. The assert checks the alignment required by the SSE
+//  kernels, which load __m128 values directly from the particles.
 
-void NBodyAdvancedInteractionEngine::SelectCpuImplementation()
+template <CpuIsa Isa>
+inline void NBodyAdvancedInteractionEngine::BodyBodyInteraction(ParticleCpu* const pParticles, const size_t iBegin, const size_t iEnd, 
+    const size_t jBegin, const size_t jEnd) const
 {
-    switch (GetSSEType())
+    // The inner loop is not parallelized because Integrate and InteractionList are already running on all cores.
+
+    assert(((uintptr_t)pParticles % SSE_ALIGNMENTBOUNDARY) == 0);
+    ParticleKernel<Isa>::Symmetric(pParticles, iBegin, iEnd, jBegin, jEnd, m_softeningSquared, m_particleMass);
+}
+
+//--------------------------------------------------------------------------------------
+//  Advanced parallel, cache aware implementation of the n-body calculation.
+//--------------------------------------------------------------------------------------
+//
+// Particles are updated in place so the particleOut parameter is unused.
+//
+// Cells are never larger than 1/kMinCellsPerSide of the particles, so small problems still 
+// divide into enough parallel tasks to keep all the cores busy.
+
+const size_t kMinCellsPerSide = 16;
+
+#pragma warning(push)
+#pragma warning(disable:4100)   // Ignore unused parameter warning.
+
+void NBodyAdvanced::Integrate(ParticleCpu* const pParticles, ParticleCpu* const unused, int numParticles) const
+{
+    // Maintain local global reference to pBodies, saves pushing it on stack for each call.
+    m_pBodiesCache = pParticles;
+    m_activeCellSize = std::max(m_tileSize, std::min(m_cellSize, numParticles / kMinCellsPerSide));
+    m_counters = NBodyCounters();
+    m_taskCount = 0;
+    const MetricsClock::time_point start = MetricsClock::now();
+
+    switch (m_integrator)
     {
-    case kCpuSSE4:
-        m_funcptr = &NBodyAdvancedInteractionEngine::BodyBodyInteractionSSE4;
+    case kLeapfrog:
+        IntegrateLeapfrog(pParticles, numParticles);
         break;
-    case kCpuSSE:
-        m_funcptr = &NBodyAdvancedInteractionEngine::BodyBodyInteractionSSE;
+    case kVelocityVerlet:
+        IntegrateVelocityVerlet(pParticles, numParticles);
         break;
     default:
-        m_funcptr = &NBodyAdvancedInteractionEngine::BodyBodyInteraction;
+        IntegrateDampedEuler(pParticles, numParticles);
     }
-}
 
-void NBodyAdvancedInteractionEngine::BodyBodyInteraction(ParticleCpu* const pParticles, const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const
-{
-    // The inner loop is not parallelized because Integrate and InteractionList are already running on all cores.
+    m_counters.integrateSeconds = MetricsSeconds(start) - m_counters.forceSeconds;
+    m_counters.tasks = m_taskCount;
+}
 
-    for (size_t i = iBegin; i < iEnd; ++i)
-    {
-        for (size_t j = jBegin; j < jEnd; ++j)
-        {
-            const float_3 r = pParticles[j].pos - pParticles[i].pos;
-            const float distSqr = SqrLength(r) + m_softeningSquared;
+#pragma warning(pop)
 
-            float invDist = 1.0f / sqrt(distSqr);
-            float invDistCube =  invDist * invDist * invDist;
-            float s = m_particleMass * invDistCube;
+//  Select the specialization of the interaction schedule for the available instruction sets.
 
-            // Cache intermediate acceleration results for both particles in this interaction.
-            pParticles[i].acc += r * s;
-            pParticles[j].acc -= r * s;
-        }
+void NBodyAdvanced::SelectCpuImplementation()
+{
+#if defined(NBODY_ISA_NEON)
+    m_funcptr = &NBodyAdvanced::InteractionSchedule<kIsaNEON>;
+#else
+    switch (GetCpuIsa())
+    {
+    case kIsaAVX512:
+        m_funcptr = &NBodyAdvanced::InteractionSchedule<kIsaAVX512>;
+        break;
+    case kIsaAVX2:
+        m_funcptr = &NBodyAdvanced::InteractionSchedule<kIsaAVX2>;
+        break;
+    case kIsaSSE4:
+        m_funcptr = &NBodyAdvanced::InteractionSchedule<kIsaSSE4>;
+        break;
+    case kIsaSSE:
+        m_funcptr = &NBodyAdvanced::InteractionSchedule<kIsaSSE>;
+        break;
+    default:
+        m_funcptr = &NBodyAdvanced::InteractionSchedule<kIsaScalar>;
     }
+#endif
 }
 
-void NBodyAdvancedInteractionEngine::BodyBodyInteractionSSE(ParticleCpu* const pParticles, const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const
+void NBodyAdvanced::IntegrateDampedEuler(ParticleCpu* const pParticles, int numParticles) const
 {
-    ParticleSSE* const pParticlesSSE = reinterpret_cast<ParticleSSE* const>(pParticles);
-    const __m128 softeningSquared = _mm_load1_ps( &m_softeningSquared);
-    const __m128 particleMass = _mm_load1_ps( &m_particleMass );
-
-    // The inner loop is not parallelized because Integrate and InteractionList are already running on all cores.
+    // Break calculations down into chunks of interations whose particles fit into the L1 cache.
+    Interactions(numParticles);
 
-    for (size_t i = iBegin; i < iEnd; ++i)
+    parallel_for_each(pParticles, pParticles + numParticles, [=](ParticleCpu& b)
     {
-        for (size_t j = jBegin; j < jEnd; ++j)
-        {
-            //const float_3 r = pParticles[j].pos - pParticles[i].pos;
-            __m128 r = _mm_sub_ps(pParticlesSSE[j].pos, pParticlesSSE[i].pos);
-
-            //float distSqr = float_3::SqrLength(r) + m_softeningSquared;
-            __m128 distSqr = _mm_mul_ps(r, r);    //x    y    z    ?
-            __m128 rshuf = _mm_shuffle_ps(distSqr, distSqr, _MM_SHUFFLE(0,3,2,1));
-            distSqr = _mm_add_ps(distSqr, rshuf);  //x+y, y+z, z+?, ?+x
-            rshuf = _mm_shuffle_ps(distSqr, distSqr, _MM_SHUFFLE(1,0,3,2));
-            distSqr = _mm_add_ps(rshuf, distSqr);  //x+y+z+0, y+z+0+X, z+0+x+y, 0+x+y+z
-            distSqr = _mm_add_ps(distSqr, softeningSquared); 
-
-            //float invDist = 1.0f / sqrt(distSqr);
-            //float invDistCube =  invDist * invDist * invDist;
-            //float s = m_particleMass * invDistCube;
-            __m128 invDistSqr = _mm_rsqrt_ps(distSqr);
-            __m128 invDistCube = _mm_mul_ps(_mm_mul_ps(invDistSqr, invDistSqr), invDistSqr);            
-            __m128 s = _mm_mul_ps(particleMass, invDistCube); 
-
-            //m_pBodiesCache[i].acc += r * s;
-            //m_pBodiesCache[j].acc -= r * s;
-            __m128 k = _mm_mul_ps(r, s);
-            pParticlesSSE[i].acc = _mm_add_ps(pParticlesSSE[i].acc, k);
-            pParticlesSSE[j].acc = _mm_sub_ps(pParticlesSSE[j].acc, k);
-        }
-    }
+        b.vel += b.acc * m_deltaTime;
+        b.vel *= m_dampingFactor;
+        b.pos += b.vel * m_deltaTime;
+        // Reset acceleration values before starting next integration step.
+        b.acc = 0.0f;
+    });
 }
 
-void NBodyAdvancedInteractionEngine::BodyBodyInteractionSSE4(ParticleCpu* const pParticles, const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const
+//  Each step applies the closing half kick of the previous step and the opening half kick of
+//  this step as a single kick, followed by the drift. Only the first step uses a half kick.
+
+void NBodyAdvanced::IntegrateLeapfrog(ParticleCpu* const pParticles, int numParticles) const
 {
-    ParticleSSE* const pParticlesSSE = reinterpret_cast<ParticleSSE* const>(pParticles);
-    const __m128 softeningSquared = _mm_load1_ps( &m_softeningSquared);
-    const __m128 particleMass = _mm_load1_ps( &m_particleMass );
+    Interactions(numParticles);
 
-    // The inner loop is not parallelized because Integrate and InteractionList are already running on all cores.
+    const float kickTime = m_leapfrogStarted ? m_deltaTime : 0.5f * m_deltaTime;
+    parallel_for_each(pParticles, pParticles + numParticles, [=](ParticleCpu& b)
+    {
+        b.vel += b.acc * kickTime;
+        b.pos += b.vel * m_deltaTime;
+        b.acc = 0.0f;
+    });
+    m_leapfrogStarted = true;
+}
 
-    for (size_t i = iBegin; i < iEnd; ++i)
+//  The opening half kick and drift use the accelerations saved from the previous step, the 
+//  closing half kick uses the new accelerations. The first step also calculates the initial 
+//  accelerations.
+
+void NBodyAdvanced::IntegrateVelocityVerlet(ParticleCpu* const pParticles, int numParticles) const
+{
+    if (m_accPrevious.size() != size_t(numParticles))
     {
-        for (size_t j = jBegin; j < jEnd; ++j)
+        m_accPrevious.resize(numParticles);
+        Interactions(numParticles);
+        parallel_for(0, numParticles, [=](int i)
         {
-            //const float_3 r = m_pBodiesCache[j].pos - m_pBodiesCache[i].pos;
-            __m128 r = _mm_sub_ps(pParticlesSSE[j].pos, pParticlesSSE[i].pos);
-            //const float distSqr = SqrLength(r) + m_softeningSquared;
-            //This uses the additional SSE4 _mm_dp_ps intrinsic.
-            __m128 distSqr = _mm_add_ps(_mm_dp_ps(r, r, 0x7F), softeningSquared);
-
-            //float invDist = 1.0f / sqrt(distSqr);
-            //float invDistCube =  invDist * invDist * invDist;
-            //float s = m_particleMass * invDistCube;
-            __m128 invDistSqr = _mm_rsqrt_ps(distSqr);
-            __m128 invDistCube = _mm_mul_ps(_mm_mul_ps(invDistSqr, invDistSqr), invDistSqr);            
-            __m128 s = _mm_mul_ps(particleMass, invDistCube); 
-
-            //m_pBodiesCache[i].acc += r * s;
-            //m_pBodiesCache[j].acc -= r * s;
-            __m128 k = _mm_mul_ps(r, s);
-            pParticlesSSE[i].acc = _mm_add_ps(pParticlesSSE[i].acc, k);
-            pParticlesSSE[j].acc = _mm_sub_ps(pParticlesSSE[j].acc, k);
-        }
+            m_accPrevious[i] = pParticles[i].acc;
+            pParticles[i].acc = 0.0f;
+        });
     }
+
+    const float halfDeltaTime = 0.5f * m_deltaTime;
+    parallel_for(0, numParticles, [=](int i)
+    {
+        ParticleCpu& b = pParticles[i];
+        b.vel += m_accPrevious[i] * halfDeltaTime;
+        b.pos += b.vel * m_deltaTime;
+    });
+
+    Interactions(numParticles);
+
+    parallel_for(0, numParticles, [=](int i)
+    {
+        ParticleCpu& b = pParticles[i];
+        b.vel += b.acc * halfDeltaTime;
+        m_accPrevious[i] = b.acc;
+        b.acc = 0.0f;
+    });
 }
 
-//--------------------------------------------------------------------------------------
-//  Advanced parallel, cache aware implementation of the n-body calculation.
-//--------------------------------------------------------------------------------------
-//
-// Particles are updated in place so the particleOut parameter is unused.
+//  Calculate the accelerations of all the particles with the specialization for the instruction 
+//  set. Each pair is only calculated once but updates both particles.
 
-#pragma warning(push)
-#pragma warning(disable:4100)   // Ignore unused parameter warning.
+void NBodyAdvanced::Interactions(int numParticles) const
+{
+    const MetricsClock::time_point start = MetricsClock::now();
+    (this->*m_funcptr)(numParticles);
+    m_counters.forceSeconds += MetricsSeconds(start);
+    m_counters.interactions += double(numParticles) * double(numParticles);
+}
 
-void NBodyAdvanced::Integrate(ParticleCpu* const pParticles, ParticleCpu* const unused, int numParticles) const
+//  Calculate the accelerations of all the particles using the selected schedule.
+
+template <CpuIsa Isa>
+void NBodyAdvanced::InteractionSchedule(int numParticles) const
 {
-    // Maintain local global reference to pBodies, saves pushing it on stack for each call.
-    m_pBodiesCache = pParticles;
-    // Break calculations down into chunks of interations whose particles fit into the L1 cache.
-    InteractionList(0, numParticles);
+    if (m_schedule == kScheduleColored)
+        InteractionColored<Isa>(numParticles);
+    else
+        InteractionList<Isa>(0, numParticles);
+}
 
-    parallel_for_each(pParticles, pParticles + numParticles, [=](ParticleCpu& b)
+//  Schedule the pairs of blocks using the circle method. The last block is fixed and the others
+//  rotate, so in each of the numBlocks - 1 rounds every block is paired with exactly one other
+//  and every pair of blocks meets in exactly one round. A first round updates the pairs within
+//  each block. Blocks are no larger than a cell and there are at least two blocks for each 
+//  thread so every thread has work in every round.
+//
+//  The only cache lines shared by concurrent tasks are the ones that straddle the boundary
+//  between two blocks, when the particles are not aligned to a cache line.
+
+template <CpuIsa Isa>
+void NBodyAdvanced::InteractionColored(int numParticles) const
+{
+    int numThreads = static_cast<int>(CurrentScheduler::GetNumberOfVirtualProcessors());
+    if (numThreads <= 0)
+        numThreads = GetProcessorCount();
+
+    const size_t size = numParticles;
+    int numBlocks = std::max(2 * numThreads, static_cast<int>((size + m_activeCellSize - 1) / m_activeCellSize));
+    numBlocks += numBlocks % 2;
+    const size_t blockSize = (size + numBlocks - 1) / numBlocks;
+    auto blockBegin = [=](int b) { return std::min(b * blockSize, size); };
+    m_taskCount += numBlocks + (numBlocks - 1) * (numBlocks / 2);
+
+    parallel_for(0, numBlocks, [=](int b)
     {
-        b.vel += b.acc * m_deltaTime;
-        b.vel *= m_dampingFactor;
-        b.pos += b.vel * m_deltaTime;
-        // Reset acceleration values before starting next integration step.
-        b.acc = 0.0f;
+        InteractionList<Isa>(blockBegin(b), blockBegin(b + 1));
     });
-}
 
-#pragma warning(pop)
+    const int numRotating = numBlocks - 1;
+    for (int round = 0; round < numRotating; ++round)
+    {
+        parallel_for(0, numBlocks / 2, [=](int k)
+        {
+            const int a = (k == 0) ? numRotating : (round + k) % numRotating;
+            const int b = (round + numRotating - k) % numRotating;
+            InteractionTiles<Isa>(blockBegin(a), blockBegin(a + 1), blockBegin(b), blockBegin(b + 1));
+        });
+    }
+}
 
-//  Recursively break down the list into chunks that fit within the L1 cache.
+//  Recursively break down the list into chunks that fit within the L2 cache.
 
+template <CpuIsa Isa>
 void NBodyAdvanced::InteractionList(const size_t begin, const size_t end) const
 {
     const size_t width = end - begin;
 
-    if (width > m_tileSize)
+    if (width > m_activeCellSize)
     {
         const size_t middle = begin + (width / 2);
-        parallel_invoke([=] { InteractionList(begin, middle); },
-            [=] { InteractionList(middle, end); });
-        InteractionCell(begin, middle, middle, end);
+        m_taskCount += 2;
+        parallel_invoke([=] { InteractionList<Isa>(begin, middle); },
+            [=] { InteractionList<Isa>(middle, end); });
+        InteractionCell<Isa>(begin, middle, middle, end);
     }
     else if (width > 1)
     {
         const size_t middle = begin + (width / 2);
-        InteractionList(begin, middle);
-        InteractionList(middle, end);
-        InteractionCell(begin, middle, middle, end);
+        InteractionList<Isa>(begin, middle);
+        InteractionList<Isa>(middle, end);
+        InteractionCell<Isa>(begin, middle, middle, end);
     }
 }
 
-//  For each cell update the particles once they fit into L1 cache.
+//  For each cell update the particles once they fit into L2 cache.
 
+template <CpuIsa Isa>
 void NBodyAdvanced::InteractionCell(const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const
 {
     const size_t iWidth = iEnd - iBegin;
     const size_t jWidth = jEnd - jBegin;
 
-    if (iWidth > m_tileSize && jWidth > m_tileSize)
+    if (iWidth > m_activeCellSize && jWidth > m_activeCellSize)
     {
         const size_t iMiddle = iBegin + (iWidth / 2);
         const size_t jMiddle = jBegin + (jWidth / 2);
-        parallel_invoke([=] { InteractionCell(iBegin, iMiddle, jBegin, jMiddle); },
-            [=] { InteractionCell(iMiddle, iEnd, jMiddle, jEnd); });
-        parallel_invoke([=] { InteractionCell(iBegin, iMiddle, jMiddle, jEnd); },
-            [=] { InteractionCell(iMiddle, iEnd, jBegin, jMiddle); });
+        m_taskCount += 4;
+        parallel_invoke([=] { InteractionCell<Isa>(iBegin, iMiddle, jBegin, jMiddle); },
+            [=] { InteractionCell<Isa>(iMiddle, iEnd, jMiddle, jEnd); });
+        parallel_invoke([=] { InteractionCell<Isa>(iBegin, iMiddle, jMiddle, jEnd); },
+            [=] { InteractionCell<Isa>(iMiddle, iEnd, jBegin, jMiddle); });
     }
     else
     {
-        m_engine->InvokeBodyBodyInteraction(m_pBodiesCache, iBegin, iEnd, jBegin, jEnd);
+        InteractionTiles<Isa>(iBegin, iEnd, jBegin, jEnd);
+    }
+}
+
+//  Update a cell one pair of L1 tiles at a time. The inner loop reuses the same targets.
+
+template <CpuIsa Isa>
+void NBodyAdvanced::InteractionTiles(const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const
+{
+    for (size_t i = iBegin; i < iEnd; i += m_tileSize)
+    {
+        const size_t iTileEnd = std::min(i + m_tileSize, iEnd);
+        for (size_t j = jBegin; j < jEnd; j += m_tileSize)
+            m_engine->BodyBodyInteraction<Isa>(m_pBodiesCache, i, iTileEnd, j, std::min(j + m_tileSize, jEnd));
     }
 }
 
@@ -234,48 +323,13 @@ void NBodyAdvanced::InteractionCell(const size_t iBegin, const size_t iEnd, cons
 //
 //  Assume that all L1 caches for each logical processor are the same size and return the first one.
 
-typedef BOOL (WINAPI* GetProcInfoFunc)(PSYSTEM_LOGICAL_PROCESSOR_INFORMATION, DWORD*);
-
 int GetLevelOneCacheSize()
 {
-    //  If this code fails at any point then just default to 16k.
-    const int defaultCacheSize = 1024 * 16; 
-    GetProcInfoFunc funcptr = (GetProcInfoFunc)::GetProcAddress(GetModuleHandle(TEXT("kernel32")), "GetLogicalProcessorInformation");
-
-    if (nullptr == funcptr) 
-        return defaultCacheSize;
-
-    typedef std::unique_ptr<SYSTEM_LOGICAL_PROCESSOR_INFORMATION, FreeDeleter<SYSTEM_LOGICAL_PROCESSOR_INFORMATION>> BufferType;
-
-    BufferType buffer(nullptr);
-    DWORD bufferSize = 0;
-
-    // Loop through twice. First pass gets buffer size, second pass fills buffer.
-
-    while (true)
-    {
-        DWORD ret = funcptr(buffer.get(), &bufferSize);
-        if (0 != ret) 
-            break;
-
-        if (GetLastError() != ERROR_INSUFFICIENT_BUFFER) 
-            return defaultCacheSize;
-
-        buffer = BufferType((SYSTEM_LOGICAL_PROCESSOR_INFORMATION*)std::malloc(bufferSize));
-        if (nullptr == buffer.get()) 
-            return defaultCacheSize;
-    }
-
-    // Get all L1 cache sizes.
-
-    int bufferLen = bufferSize / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION);
-    std::vector<DWORD> cacheSizes(0);
-    std::for_each(buffer.get(), buffer.get() + bufferLen, [&cacheSizes](SYSTEM_LOGICAL_PROCESSOR_INFORMATION& r)
-    {
-        if ((RelationCache == r.Relationship) && (1 == r.Cache.Level))
-            cacheSizes.push_back(r.Cache.Size);
-    });
+    return GetCpuTopology().levelOneCacheSize;
+}
 
-    assert(std::count_if(cacheSizes.begin(), cacheSizes.end(), [cacheSizes](DWORD r){ return (r != cacheSizes[0]); }) == 0);
-    return cacheSizes[0];
+int GetLevelTwoCellSize()
+{
+    const CpuTopology topology = GetCpuTopology();
+    return topology.levelTwoCacheSize / (4 * topology.ThreadsPerCore() * sizeof(ParticleCpu));
 }
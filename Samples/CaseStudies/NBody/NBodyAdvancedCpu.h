@@ -16,11 +16,14 @@
 
 #pragma once
 
-#include <amp_short_vectors.h>
+#include "CpuShortVectors.h"
 #include <concrtrm.h>
+#include <vector>
+#include <atomic>
 
 #include "ParticleCpu.h"
 #include "NBodyCpu.h"
+#include "NBodyMetrics.h"
 
 
 //--------------------------------------------------------------------------------------
@@ -40,42 +43,48 @@
 //
 //  The SSE implementations also take advantage of the alignment of the __m128 data members to
 //  avoid doing unaligned load operations.
-
-class NBodyAdvancedInteractionEngine;
-
-typedef void (NBodyAdvancedInteractionEngine::* NBodyAdvancedFunc)(ParticleCpu* const pParticles, const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const;
+//
+//  The body-body interaction is a template on the instruction set, see ParticleKernel. 
+//  NBodyAdvanced selects the instruction set once and calls a specialization of its whole 
+//  interaction schedule, so the kernel is inlined into the loops over each cell.
 
 class NBodyAdvancedInteractionEngine
 {
 private:
     const float m_softeningSquared;
     const float m_particleMass;
-    NBodyAdvancedFunc m_funcptr;
 
 public:
     NBodyAdvancedInteractionEngine(float softeningSquared, float particleMass) :
         m_softeningSquared(softeningSquared),
-        m_particleMass(particleMass),
-        m_funcptr(nullptr)
+        m_particleMass(particleMass)
     {
-        SelectCpuImplementation();
     }
 
-    inline void InvokeBodyBodyInteraction(ParticleCpu* const pParticles, const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const
-    {
-        assert(((uintptr_t)pParticles % SSE_ALIGNMENTBOUNDARY) == 0);
-        (this->*m_funcptr)(pParticles, iBegin, iEnd, jBegin, jEnd); 
-    };
+    template <CpuIsa Isa>
+    void BodyBodyInteraction(ParticleCpu* const pParticles, const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const;
+};
 
-private:
-    void SelectCpuImplementation();
+//  How NBodyAdvanced divides the interactions between tasks. Both schedules update each pair 
+//  of particles once and apply the result to both particles.
+//
+//  kScheduleRecursive  - Recursively halve the particles and update the pairs of halves with 
+//                        parallel_invoke, ordered so that concurrent tasks never update the
+//                        same particles. Tasks at each level wait for the level below.
+//  kScheduleColored    - Divide the particles into blocks and update the pairs of blocks in 
+//                        rounds of a round robin tournament. Every pair in a round updates
+//                        different blocks, so each round is a single parallel_for with 
+//                        disjoint writes and equal work for every task.
+
+enum AdvancedSchedule
+{
+    kScheduleRecursive = 0,
+    kScheduleColored = 1
+};
 
-    // Different implementations of the body-body interaction.
+class NBodyAdvanced;
 
-    void BodyBodyInteraction(ParticleCpu* const pParticles, const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const;
-    void BodyBodyInteractionSSE(ParticleCpu* const pParticles, const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const;
-    void BodyBodyInteractionSSE4(ParticleCpu* const pParticles, const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const;
-};
+typedef void (NBodyAdvanced::* NBodyAdvancedFunc)(int numParticles) const;
 
 //--------------------------------------------------------------------------------------
 //  Advanced parallel, cache aware implementation of the n-body calculation.
@@ -84,32 +93,81 @@ private:
 //  This give a much better indication of what is possible on a CPU. When making direct
 //  performance comparisons it is important to compare algorithms and implementations that
 //  take advantage of the avainable hardware to the same degree.
+//
+//  The interactions are divided using a two level hierarchy. Cells, pairs of particle ranges
+//  that fit in the L2 cache, are updated in parallel. Within a cell the ranges are updated 
+//  serially in tiles that fit in the L1 cache, so each tile of targets stays in L1 while the
+//  tiles of sources are streamed from L2. A cellSize of zero divides the cells in parallel
+//  all the way down to L1 tiles.
+//
+//  The integrator parameter selects the time integration scheme, see IntegratorType. The
+//  velocity update for each scheme is fused into the pass that resets the accelerations. The
+//  schedule parameter selects how the interactions are divided between tasks, see 
+//  AdvancedSchedule.
 
-class NBodyAdvanced : public INBodyCpu
+class NBodyAdvanced : public INBodyCpu, public INBodyCounters
 {
 private:
     std::shared_ptr<NBodyAdvancedInteractionEngine> m_engine;
     const float m_deltaTime;
     const float m_dampingFactor;
     size_t m_tileSize;                                          // Number of particles that fit into an L1 cache.
+    size_t m_cellSize;                                          // Number of particles in each range of an L2 cell.
+    mutable size_t m_activeCellSize;                            // Cell size used for the current step.
     mutable ParticleCpu* m_pBodiesCache;
+    const IntegratorType m_integrator;
+    mutable bool m_leapfrogStarted;                             // The first leapfrog step applies a half kick.
+    mutable std::vector<float_3> m_accPrevious;                 // Velocity Verlet accelerations from the last step.
+    const AdvancedSchedule m_schedule;
+    NBodyAdvancedFunc m_funcptr;                                // Interactions specialized for the instruction set.
+    mutable NBodyCounters m_counters;
+    mutable std::atomic<unsigned long long> m_taskCount;        // Tasks created by the current step.
 
 public:
-    NBodyAdvanced(float softeningSquared, float dampingFactor, float deltaTime, float particleMass, int tileSize) :
+    NBodyAdvanced(float softeningSquared, float dampingFactor, float deltaTime, float particleMass, int tileSize, 
+        int cellSize, IntegratorType integrator = kDampedEuler, AdvancedSchedule schedule = kScheduleRecursive) :
         INBodyCpu(),
+        m_engine(new NBodyAdvancedInteractionEngine(softeningSquared, particleMass)),
         m_deltaTime(deltaTime),
         m_dampingFactor(dampingFactor),
-        m_engine(new NBodyAdvancedInteractionEngine(softeningSquared, particleMass)),
         m_tileSize(tileSize),
-        m_pBodiesCache(nullptr)
+        m_cellSize(cellSize),
+        m_activeCellSize(tileSize),
+        m_pBodiesCache(nullptr),
+        m_integrator(integrator),
+        m_leapfrogStarted(false),
+        m_schedule(schedule),
+        m_funcptr(nullptr),
+        m_taskCount(0)
     {
+        SelectCpuImplementation();
     }
 
     void Integrate(ParticleCpu* const pParticles, ParticleCpu* const unused, int numParticles) const;
 
+    inline const NBodyCounters& Counters() const { return m_counters; }
+
+    //  Continue a leapfrog run from a checkpoint whose velocities lag by half a step.
+
+    inline void ResumeLeapfrog() { m_leapfrogStarted = true; }
+
 private:
+    void IntegrateDampedEuler(ParticleCpu* const pParticles, int numParticles) const;
+    void IntegrateLeapfrog(ParticleCpu* const pParticles, int numParticles) const;
+    void IntegrateVelocityVerlet(ParticleCpu* const pParticles, int numParticles) const;
+    void SelectCpuImplementation();
+    void Interactions(int numParticles) const;
+
+    template <CpuIsa Isa>
+    void InteractionSchedule(int numParticles) const;
+    template <CpuIsa Isa>
+    void InteractionColored(int numParticles) const;
+    template <CpuIsa Isa>
     void InteractionList(const size_t begin, const size_t end) const;
+    template <CpuIsa Isa>
     void InteractionCell(const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const;
+    template <CpuIsa Isa>
+    void InteractionTiles(const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const;
 };
 
 //--------------------------------------------------------------------------------------
@@ -118,4 +176,9 @@ private:
 
 //  Get the size of the L1 cache.
 
-int GetLevelOneCacheSize();
\ No newline at end of file
+int GetLevelOneCacheSize();
+
+//  Get the number of particles in each range of a cell that fits in the L2 cache. Half the cache
+//  is used for the two ranges and the cache is shared by all the hardware threads on a core.
+
+int GetLevelTwoCellSize();
\ No newline at end of file
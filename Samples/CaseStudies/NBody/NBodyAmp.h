@@ -22,7 +22,6 @@
 #include <amprt.h>
 #include <assert.h>
 #include <atlbase.h>
-#include <random>
 #include <amp.h>
 #include <amp_graphics.h>
 #include <amp_math.h>
@@ -30,6 +29,7 @@
 #include "Common.h"
 #include "INBodyAmp.h"
 #include "AmpUtilities.h"
+#include "ParticleGenerator.h"
 
 using namespace concurrency;
 using namespace concurrency::graphics;
@@ -158,18 +158,15 @@ void BodyBodyInteraction(float_3& acc, const float_3 particlePosition,
 //  Utility functions.
 //--------------------------------------------------------------------------------------
 
-void LoadClusterParticles(ParticlesCpu& particles, int offset, int size, float_3 center, float_3 velocity, float spread)
-{
-    std::random_device rd; 
-    std::default_random_engine engine(rd()); 
-    std::uniform_real_distribution<float> randRadius(0.0f, spread);
-    std::uniform_real_distribution<float> randTheta(-1.0f, 1.0f);
-    std::uniform_real_distribution<float> randPhi(0.0f, 2.0f * static_cast<float>(std::_Pi));
+//  Generate the first size particles of a cluster into particles[offset, offset + size).
 
-    for (int i = offset; i < (offset + size); ++i)
+void LoadClusterParticles(ParticlesCpu& particles, int offset, int size, const ClusterDesc& cluster)
+{
+    float_3* const pPos = &particles.pos[0] + offset;
+    float_3* const pVel = &particles.vel[0] + offset;
+    GenerateCluster(cluster, 0, size, [=](int i, const float_3& pos, const float_3& vel)
     {
-        float_3 delta = PolarToCartesian(randRadius(engine), acos(randTheta(engine)), randPhi(engine));
-        particles.pos[i] = center + delta; 
-        particles.vel[i] = velocity;
-    };  
+        pPos[i] = pos; 
+        pVel[i] = vel;
+    });  
 }
@@ -23,9 +23,17 @@
 //--------------------------------------------------------------------------------------
 //
 //  This implementation loads all particles onto each available GPU but each GPU only 
-//  updates a range of particles. After updates are complete each updated range is copied 
-//  into the CPU memory (the m_hostPos and m_hostVel vectors). Once all the data is available 
-//  in CPU memory it is copied back to each GPU, which is now ready for the next integration.
+//  updates a range of particles. As soon as a GPU has updated its range that range, and only
+//  that range, is copied to the CPU once and then uploaded into the same range on every other
+//  GPU. Once all the copies are complete each GPU is ready for the next integration.
+//
+//  C++ AMP stages copies between accelerators through the CPU, so copying a range directly to
+//  each of the other GPUs would read it back numAccs - 1 times. Staging it explicitly moves 
+//  numAccs * numParticles positions and velocities across the bus each step, numParticles 
+//  read back and (numAccs - 1) * numParticles uploaded. Copying every range to the CPU and 
+//  then all the particles back to each GPU moved (numAccs + 1) * numParticles, and the direct 
+//  copies 2 * (numAccs - 1) * numParticles.
+//  See NBodyPartitioned for a CPU version that also overlaps the copies with computation.
 //
 //  The tile size is passed in as a template parameter allowing the calling code to easily create new 
 //  instances with different tile sizes. See NBodyFactory() in NBodyGravityApp.cpp for examples.
@@ -41,15 +49,16 @@ class NBodyAmpMultiTiled : public INBodyAmp
     NBodyAmpTiled<TSize> m_engine;
 
 public:
-    NBodyAmpMultiTiled(float softeningSquared, float dampingFactor, float deltaTime, float particleMass, int maxParticles) :
-        m_hostPos(maxParticles),
-        m_hostVel(maxParticles),
-        m_engine(softeningSquared, dampingFactor, deltaTime, particleMass)
+    NBodyAmpMultiTiled(float softeningSquared, float dampingFactor, float deltaTime, float particleMass, 
+        IntegratorType integrator = kDampedEuler) :
+        m_engine(softeningSquared, dampingFactor, deltaTime, particleMass, integrator)
     {
     }
 
     inline int TileSize() const { return m_engine.TileSize(); }
 
+    inline void ResumeLeapfrog() { m_engine.ResumeLeapfrog(); }
+
     void Integrate(const std::vector<std::shared_ptr<TaskData>>& particleData, int numParticles) const
     {
         assert(particleData.size() > 1);
@@ -57,34 +66,41 @@ public:
         const int tileSize = m_engine.TileSize();
         const int numAccs = int(particleData.size());
         const int rangeSize = ((numParticles / tileSize) / int(numAccs)) * tileSize;
-        std::vector<completion_future> copyResults(2 * numAccs);
+        std::vector<completion_future> copyResults(2 * numAccs * numAccs);
+        if (m_hostPos.size() < size_t(numParticles))
+        {
+            m_hostPos.resize(numParticles);
+            m_hostVel.resize(numParticles);
+        }
 
-        // Update range of particles on each accelerator using the same tiled implementation as NBodyAmpTiled
-        // Copy the results back to the CPU so they can be swapped with other GPUs.
+        // Update range of particles on each accelerator using the same tiled implementation as NBodyAmpTiled.
+        // Read the updated range back once, waiting for the kernel, and then upload it to the other 
+        // accelerators. Each accelerator's range of the host arrays is only used by its own task.
 
         parallel_for(0, numAccs, [=, this, &copyResults](int i)
         {
             const int rangeStart = static_cast<int>(i) * rangeSize;
             m_engine.TiledBodyBodyInteraction((*particleData[i]->DataOld), (*particleData[i]->DataNew), rangeStart, rangeSize, numParticles);
-            array_view<float_3, 1> posSrc = particleData[i]->DataNew->pos.section(rangeStart, rangeSize);
-            copyResults[i] = copy_async(posSrc, m_hostPos.begin() + rangeStart); 
-            array_view<float_3, 1> velSrc = particleData[i]->DataNew->vel.section(rangeStart, rangeSize);
-            copyResults[i + numAccs] = copy_async(velSrc, m_hostVel.begin() + rangeStart); 
+            const std::vector<float_3>::iterator posHost = m_hostPos.begin() + rangeStart;
+            const std::vector<float_3>::iterator velHost = m_hostVel.begin() + rangeStart;
+            copy(particleData[i]->DataNew->pos.section(rangeStart, rangeSize), posHost);
+            copy(particleData[i]->DataNew->vel.section(rangeStart, rangeSize), velHost);
+            for (int j = 0; j < numAccs; ++j)
+            {
+                if (j == i)
+                    continue;
+                const int k = 2 * (i * numAccs + j);
+                copyResults[k] = copy_async(posHost, posHost + rangeSize, particleData[j]->DataNew->pos.section(rangeStart, rangeSize));
+                copyResults[k + 1] = copy_async(velHost, velHost + rangeSize, particleData[j]->DataNew->vel.section(rangeStart, rangeSize));
+            }
         });
 
-        parallel_for_each(copyResults.cbegin(), copyResults.cend(), [](const completion_future& f) { f.get(); });
-
-        // Sync updated particles back onto all accelerators. Even for N=58368 simple copy is faster than
-        // only copying updated data to individual accelerator.
-
-        // TODO_AMP: Is this really the case? Try re-writing to only copy the required data and see if this is faster.
-
-        parallel_for(0, numAccs, [=, this, &copyResults] (int i)
-        {
-            copyResults[i] = copy_async(m_hostPos.begin(), particleData[i]->DataNew->pos);
-            copyResults[i + numAccs] = copy_async(m_hostVel.begin(), particleData[i]->DataNew->vel);
+        // Futures for an accelerator's copies to itself are never set.
+        parallel_for_each(copyResults.cbegin(), copyResults.cend(), [](const completion_future& f) 
+        { 
+            if (f.valid()) 
+                f.get(); 
         });
-
-        parallel_for_each(copyResults.cbegin(), copyResults.cend(), [] (const completion_future& f) { f.get(); });
+        m_engine.CompleteStep();
     }
 };
@@ -28,6 +28,10 @@
 //
 //  The calculation is broken up into two halves as TiledBodyBodyInteraction is also used by 
 //  NBodyAmpMultiTiled to execute a subset of the integration on different GPUs.
+//
+//  The integrator parameter selects kDampedEuler or kLeapfrog, the velocity update is fused 
+//  into the end of the kernel. kVelocityVerlet is not supported as it requires the previous
+//  accelerations to be stored on the accelerator.
 
 template <int TSize>
 class NBodyAmpTiled : public INBodyAmp
@@ -37,15 +41,21 @@ private:
     float m_dampingFactor;
     float m_deltaTime;
     float m_particleMass;
+    IntegratorType m_integrator;
+    mutable bool m_leapfrogStarted;                 // The first leapfrog step applies a half kick.
     static const int m_tileSize = TSize;
 
 public:
-    NBodyAmpTiled(float softeningSquared, float dampingFactor, float deltaTime, float particleMass) :
+    NBodyAmpTiled(float softeningSquared, float dampingFactor, float deltaTime, float particleMass, 
+        IntegratorType integrator = kDampedEuler) :
         m_softeningSquared(softeningSquared),
         m_dampingFactor(dampingFactor),
         m_deltaTime(deltaTime),
-        m_particleMass(particleMass)
+        m_particleMass(particleMass),
+        m_integrator(integrator),
+        m_leapfrogStarted(false)
     {
+        assert(integrator != kVelocityVerlet);
     }
 
     inline int TileSize() const { return m_tileSize; }
@@ -53,8 +63,17 @@ public:
     inline void Integrate(const std::vector<std::shared_ptr<TaskData>>& particleData, int numParticles) const
     {
         TiledBodyBodyInteraction(*particleData[0]->DataOld, *particleData[0]->DataNew, 0, numParticles, numParticles);
+        CompleteStep();
     }
 
+    //  Called once all the particles have been updated for a step.
+
+    inline void CompleteStep() const { m_leapfrogStarted = true; }
+
+    //  Continue a leapfrog run from a checkpoint whose velocities lag by half a step.
+
+    inline void ResumeLeapfrog() { m_leapfrogStarted = true; }
+
     //  Calculate interactions for a subset of particles in particlesIn, [rangeStart, rangeStart + rangeSize)
 
     void TiledBodyBodyInteraction(const ParticlesAmp& particlesIn, ParticlesAmp& particlesOut, 
@@ -68,8 +87,9 @@ public:
         extent<1> computeDomain(rangeSize);
         const int numTiles = numParticles / m_tileSize;
         const float softeningSquared = m_softeningSquared;
-        const float dampingFactor = m_dampingFactor;
         const float deltaTime = m_deltaTime;
+        const float dampingFactor = (m_integrator == kDampedEuler) ? m_dampingFactor : 1.0f;
+        const float kickTime = ((m_integrator == kLeapfrog) && !m_leapfrogStarted) ? 0.5f * deltaTime : deltaTime;
         const float particleMass = m_particleMass;
 
         parallel_for_each(computeDomain.tile<m_tileSize>(), [=] (tiled_index<m_tileSize> ti) restrict(amp)
@@ -107,7 +127,7 @@ public:
                 ti.barrier.wait();
             }
 
-            vel += acc * deltaTime;
+            vel += acc * kickTime;
             vel *= dampingFactor;
             pos += vel * deltaTime;
 
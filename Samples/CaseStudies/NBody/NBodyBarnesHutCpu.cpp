@@ -0,0 +1,249 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the 
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+#include <math.h>
+#include <ppl.h>
+#include <assert.h>
+#include <memory>
+#include <algorithm>
+#include <functional>
+
+#include "Common.h"
+#include "Morton.h"
+#include "NBodyBarnesHutCpu.h"
+
+using namespace concurrency;
+using namespace concurrency::graphics;
+
+//--------------------------------------------------------------------------------------
+//  Barnes-Hut implementation of the n-body calculation.
+//--------------------------------------------------------------------------------------
+
+void NBodyBarnesHut::Integrate(ParticleCpu* const pParticlesIn, ParticleCpu* const pParticlesOut, int numParticles) const
+{
+    m_counters = NBodyCounters();
+    if (numParticles == 0)
+        return;
+
+    // Sort the particles into Morton order.
+
+    const MetricsClock::time_point start = MetricsClock::now();
+    const MortonBounds bounds = GetMortonBounds(pParticlesIn, numParticles);
+    m_keys.resize(numParticles);
+    m_sortedPos.resize(numParticles);
+
+    parallel_for(0, numParticles, [=](int i)
+    {
+        m_keys[i] = KeyIndex(MortonKey(pParticlesIn[i].pos, bounds), i);
+    });
+    parallel_radixsort(m_keys.begin(), m_keys.end(), [](const KeyIndex& k) { return k.first; });
+    parallel_for(0, numParticles, [=](int s)
+    {
+        m_sortedPos[s] = pParticlesIn[m_keys[s].second].pos;
+    });
+
+    // Build the tree and calculate the multipole moments of each node.
+
+    m_nodes.clear();
+    m_nodes.grow_by(1);
+    BuildTree(0, 0, numParticles, 0, bounds.origin, bounds.size);
+
+    // Walk the tree for each particle.
+
+    combinable<double> interactions;
+    parallel_for(0, numParticles, [=, &interactions](int s)
+    {
+        const int i = m_keys[s].second;
+        int numInteractions = 0;
+        const float_3 acc = CalculateAcceleration(m_sortedPos[s], numInteractions);
+        interactions.local() += numInteractions;
+
+        float_3 vel = pParticlesIn[i].vel;
+        vel += acc * m_deltaTime;
+        vel *= m_dampingFactor;
+
+        pParticlesOut[i].pos = pParticlesIn[i].pos + vel * m_deltaTime;
+        pParticlesOut[i].vel = vel;
+    });
+    m_counters.interactions = interactions.combine(std::plus<double>());
+    m_counters.forceSeconds = MetricsSeconds(start);
+}
+
+//  Split a node's particles into octants and recursively build a child node for each 
+//  non-empty octant. The keys are sorted so each octant is a contiguous range of particles.
+//  The octant's bits select the upper half of the node in x, y and z, see MortonKey.
+//
+//  Nodes are added to a concurrent_vector, so children can be built in parallel. Growing a
+//  concurrent_vector does not move existing elements so the node reference remains valid.
+
+void NBodyBarnesHut::BuildTree(int nodeIndex, int begin, int end, int level, const float_3& origin, float size) const
+{
+    BarnesHutNode& node = m_nodes[nodeIndex];
+    node.begin = begin;
+    node.end = end;
+    node.origin = origin;
+    node.size = size;
+    node.firstChild = -1;
+    node.numChildren = 0;
+
+    if (((end - begin) <= m_leafSize) || (level == kMortonBitsPerAxis))
+    {
+        CalculateLeafMoments(node);
+        return;
+    }
+
+    int childBegin[8];
+    int childEnd[8];
+    float_3 childOrigin[8];
+    const float childSize = size * 0.5f;
+    int numChildren = 0;
+    int octantBegin = begin;
+    for (int octant = 0; octant < 8; ++octant)
+    {
+        const int octantEnd = static_cast<int>(std::partition_point(m_keys.begin() + octantBegin, m_keys.begin() + end, 
+            [=](const KeyIndex& k) { return MortonOctant(k.first, level) <= octant; }) - m_keys.begin());
+        if (octantEnd > octantBegin)
+        {
+            childBegin[numChildren] = octantBegin;
+            childEnd[numChildren] = octantEnd;
+            childOrigin[numChildren] = origin + float_3(float((octant >> 2) & 1), float((octant >> 1) & 1), float(octant & 1)) * childSize;
+            ++numChildren;
+        }
+        octantBegin = octantEnd;
+    }
+
+    const concurrent_vector<BarnesHutNode>::iterator children = m_nodes.grow_by(numChildren);
+    const int firstChild = static_cast<int>(children - m_nodes.begin());
+    node.firstChild = firstChild;
+    node.numChildren = numChildren;
+
+    if ((end - begin) > m_parallelBuildSize)
+    {
+        parallel_for(0, numChildren, [=](int c)
+        {
+            BuildTree(firstChild + c, childBegin[c], childEnd[c], level + 1, childOrigin[c], childSize);
+        });
+    }
+    else
+    {
+        for (int c = 0; c < numChildren; ++c)
+            BuildTree(firstChild + c, childBegin[c], childEnd[c], level + 1, childOrigin[c], childSize);
+    }
+    CalculateNodeMoments(node);
+}
+
+void NBodyBarnesHut::CalculateLeafMoments(BarnesHutNode& node) const
+{
+    float_3 sum(0.0f);
+    for (int j = node.begin; j < node.end; ++j)
+        sum += m_sortedPos[j];
+
+    const int count = node.end - node.begin;
+    node.mass = m_particleMass * count;
+    node.centerOfMass = sum * (1.0f / count);
+    node.quadrupole = QuadrupoleMoment();
+    for (int j = node.begin; j < node.end; ++j)
+        node.quadrupole.Add(m_sortedPos[j] - node.centerOfMass, m_particleMass);
+}
+
+//  Combine the children's moments. The quadrupole moment of each child is shifted from the
+//  child's center of mass to the parent's using the parallel axis theorem.
+
+void NBodyBarnesHut::CalculateNodeMoments(BarnesHutNode& node) const
+{
+    float_3 weightedSum(0.0f);
+    float mass = 0.0f;
+    for (int c = node.firstChild; c < node.firstChild + node.numChildren; ++c)
+    {
+        const BarnesHutNode& child = m_nodes[c];
+        weightedSum += child.centerOfMass * child.mass;
+        mass += child.mass;
+    }
+
+    node.mass = mass;
+    node.centerOfMass = weightedSum * (1.0f / mass);
+    node.quadrupole = QuadrupoleMoment();
+    for (int c = node.firstChild; c < node.firstChild + node.numChildren; ++c)
+    {
+        const BarnesHutNode& child = m_nodes[c];
+        QuadrupoleMoment& q = node.quadrupole;
+        q.xx += child.quadrupole.xx;
+        q.yy += child.quadrupole.yy;
+        q.zz += child.quadrupole.zz;
+        q.xy += child.quadrupole.xy;
+        q.xz += child.quadrupole.xz;
+        q.yz += child.quadrupole.yz;
+        q.Add(child.centerOfMass - node.centerOfMass, child.mass);
+    }
+}
+
+//  Walk the tree using an explicit stack. Nodes that are far enough away are approximated 
+//  by their monopole and quadrupole moments, the particles in nearby leaves are summed 
+//  directly. For theta > 1 / sqrt(3) the opening test alone can accept a node containing 
+//  the particle, when its center of mass is in a far corner, so such nodes are always opened.
+//
+//  With r the vector from the particle to a node's center of mass the acceleration is:
+//
+//  a = M r / |r|^3 - Q r / |r|^5 + 5/2 (r' Q r) r / |r|^7
+
+float_3 NBodyBarnesHut::CalculateAcceleration(const float_3& pos, int& numInteractions) const
+{
+    int stack[8 * (kMortonBitsPerAxis + 1)];
+    int top = 0;
+    stack[top++] = 0;
+    float_3 acc(0.0f);
+
+    while (top > 0)
+    {
+        const BarnesHutNode& node = m_nodes[stack[--top]];
+        const float_3 r = node.centerOfMass - pos;
+        const float distSqr = SqrLength(r) + m_softeningSquared;
+        const float_3 d = pos - node.origin;
+        const bool contains = (d.x >= 0.0f) && (d.y >= 0.0f) && (d.z >= 0.0f) && 
+            (d.x <= node.size) && (d.y <= node.size) && (d.z <= node.size);
+
+        if (!contains && ((node.size * node.size) < (m_thetaSquared * distSqr)))
+        {
+            const float invDist = 1.0f / sqrt(distSqr);
+            const float invDistSqr = invDist * invDist;
+            const float invDist3 = invDist * invDistSqr;
+            const float invDist5 = invDist3 * invDistSqr;
+            const float_3 qr = node.quadrupole.Multiply(r);
+            const float rqr = r.x * qr.x + r.y * qr.y + r.z * qr.z;
+
+            acc += r * (node.mass * invDist3 + 2.5f * rqr * invDist5 * invDistSqr);
+            acc -= qr * invDist5;
+            ++numInteractions;
+        }
+        else if (node.numChildren == 0)
+        {
+            for (int j = node.begin; j < node.end; ++j)
+            {
+                const float_3 rj = m_sortedPos[j] - pos;
+                const float distSqrj = SqrLength(rj) + m_softeningSquared;
+                const float invDist = 1.0f / sqrt(distSqrj);
+                acc += rj * (m_particleMass * invDist * invDist * invDist);
+            }
+            numInteractions += node.end - node.begin;
+        }
+        else
+        {
+            for (int c = node.firstChild; c < node.firstChild + node.numChildren; ++c)
+                stack[top++] = c;
+        }
+    }
+    return acc;
+}
@@ -0,0 +1,144 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the 
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+#pragma once
+
+#include <vector>
+#include <utility>
+#include <concurrent_vector.h>
+
+#include "Common.h"
+#include "INBodyCpu.h"
+#include "NBodyMetrics.h"
+#include "ParticleCpu.h"
+
+//--------------------------------------------------------------------------------------
+//  Data structures for the Barnes-Hut octree.
+//--------------------------------------------------------------------------------------
+
+//  Traceless quadrupole moment, sum of m * (3 * r * r' - |r|^2 * I) about the center of mass.
+
+struct QuadrupoleMoment
+{
+    float xx, yy, zz;
+    float xy, xz, yz;
+
+    QuadrupoleMoment() : xx(0.0f), yy(0.0f), zz(0.0f), xy(0.0f), xz(0.0f), yz(0.0f) { }
+
+    //  Add the moment of a mass m at offset r from the center of mass.
+    inline void Add(const float_3& r, float m)
+    {
+        const float r2 = SqrLength(r);
+        xx += m * (3.0f * r.x * r.x - r2);
+        yy += m * (3.0f * r.y * r.y - r2);
+        zz += m * (3.0f * r.z * r.z - r2);
+        xy += m * 3.0f * r.x * r.y;
+        xz += m * 3.0f * r.x * r.z;
+        yz += m * 3.0f * r.y * r.z;
+    }
+
+    inline float_3 Multiply(const float_3& r) const
+    {
+        return float_3(xx * r.x + xy * r.y + xz * r.z,
+            xy * r.x + yy * r.y + yz * r.z,
+            xz * r.x + yz * r.y + zz * r.z);
+    }
+};
+
+//  Each node covers a contiguous range of the Morton sorted particles. The children of a 
+//  node are stored consecutively starting at firstChild. Leaf nodes have no children.
+
+struct BarnesHutNode
+{
+    float_3 centerOfMass;
+    float mass;                         // Total mass, includes the gravitational constant.
+    QuadrupoleMoment quadrupole;
+    float_3 origin;                     // Minimum corner of the node's cube.
+    float size;                         // Edge length of the node's cube.
+    int begin;
+    int end;
+    int firstChild;
+    int numChildren;
+};
+
+//--------------------------------------------------------------------------------------
+//  Barnes-Hut implementation of the n-body calculation.
+//--------------------------------------------------------------------------------------
+//
+//  Rather than calculating all N^2 interactions this approximates the effect of distant 
+//  groups of particles using the multipole moments of the octree node that contains them.
+//  A node is used if size / distance < theta, otherwise its children are considered. This
+//  reduces the cost of each step to O(N log N). Larger values of theta are faster but less 
+//  accurate, theta = 0 is equivalent to direct summation. The distance is measured to the 
+//  node's center of mass, which can be far from a particle inside the same node, so a node
+//  whose cube contains the particle is always opened.
+//
+//  Each step:
+//
+//  1. Calculates a Morton key for each particle and sorts the particles by key with 
+//     parallel_radixsort.
+//  2. Builds the octree top down in parallel. Each node's range of particles is split into 
+//     octants by a binary search of the sorted keys. Monopole and quadrupole moments are
+//     calculated bottom up as the recursion unwinds.
+//  3. Walks the tree in parallel for each particle, in Morton order so that neighboring 
+//     tasks visit similar nodes.
+//
+//  The velocity update is done as each particle's walk completes, so the counters' force time
+//  covers the whole step. Each node expansion and each particle in an opened leaf counts as 
+//  one interaction.
+
+class NBodyBarnesHut : public INBodyCpu, public INBodyCounters
+{
+private:
+    typedef std::pair<size_t, int> KeyIndex;                    // Morton key and original particle index.
+
+    const float m_softeningSquared;
+    const float m_dampingFactor;
+    const float m_deltaTime;
+    const float m_particleMass;
+    const float m_thetaSquared;
+    const int m_leafSize;                                       // Maximum number of particles in a leaf.
+
+    mutable std::vector<KeyIndex> m_keys;
+    mutable std::vector<float_3> m_sortedPos;
+    mutable concurrency::concurrent_vector<BarnesHutNode> m_nodes;
+    mutable NBodyCounters m_counters;
+
+    static const int m_parallelBuildSize = 4096;                // Build children in parallel above this size.
+
+public:
+    NBodyBarnesHut(float softeningSquared, float dampingFactor, float deltaTime, float particleMass, 
+        float theta = 0.5f, int leafSize = 16) :
+        INBodyCpu(),
+        m_softeningSquared(softeningSquared),
+        m_dampingFactor(dampingFactor),
+        m_deltaTime(deltaTime),
+        m_particleMass(particleMass),
+        m_thetaSquared(theta * theta),
+        m_leafSize(leafSize)
+    {
+    }
+
+    void Integrate(ParticleCpu* const pParticlesIn, ParticleCpu* const pParticlesOut, int numParticles) const;
+
+    inline const NBodyCounters& Counters() const { return m_counters; }
+
+private:
+    void BuildTree(int nodeIndex, int begin, int end, int level, const float_3& origin, float size) const;
+    void CalculateLeafMoments(BarnesHutNode& node) const;
+    void CalculateNodeMoments(BarnesHutNode& node) const;
+    float_3 CalculateAcceleration(const float_3& pos, int& numInteractions) const;
+};
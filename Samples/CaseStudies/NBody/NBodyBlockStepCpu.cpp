@@ -0,0 +1,198 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the 
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+
+#include <math.h>
+#include <ppl.h>
+#include <assert.h>
+#include <algorithm>
+#include <functional>
+
+#include "Common.h"
+#include "ParallelScan.h"
+#include "NBodyBlockStepCpu.h"
+
+using namespace concurrency;
+using namespace concurrency::graphics;
+
+//--------------------------------------------------------------------------------------
+//  Hierarchical block timestep implementation of the n-body calculation.
+//--------------------------------------------------------------------------------------
+//
+//  Times are measured in units of the finest step, deltaTime / 2^maxLevel, so they can be
+//  compared exactly. A particle on level L takes steps of 2^(maxLevel - L) units.
+
+void NBodyBlockStep::Integrate(ParticleCpu* const pParticlesIn, ParticleCpu* const pParticlesOut, int numParticles) const
+{
+    assert(numParticles <= m_predicted.capacity());
+
+    m_counters = NBodyCounters();
+    const MetricsClock::time_point start = MetricsClock::now();
+    bool synchronized = (m_pos.size() == size_t(numParticles));
+    if (synchronized)
+    {
+        combinable<int> changed;
+        parallel_for(0, numParticles, [=, &changed](int i)
+        {
+            const float_3 pos = pParticlesIn[i].pos;
+            if ((pos.x != m_pos[i].x) || (pos.y != m_pos[i].y) || (pos.z != m_pos[i].z))
+                changed.local() = 1;
+        });
+        synchronized = (changed.combine(std::plus<int>()) == 0);
+    }
+    if (!synchronized)
+        Initialize(pParticlesIn, numParticles);
+
+    const int numTicks = 1 << m_maxLevel;
+    const float tickTime = m_deltaTime / numTicks;
+    const Float3SoA predicted = m_predicted.pos;
+    const Float3SoA targetAcc = m_targets.acc;
+    parallel_for(0, numParticles, [=](int i)
+    {
+        m_vel[i] = pParticlesIn[i].vel;
+        m_time[i] = 0;
+    });
+
+    m_forceCount = 0;
+    m_subStepCount = 0;
+    int time = 0;
+    while (time < numTicks)
+    {
+        // The next sub-step ends when the steps of the particles on the finest level end.
+        combinable<int> finestLevel;
+        parallel_for(0, numParticles, [=, &finestLevel](int i)
+        {
+            finestLevel.local() = std::max(finestLevel.local(), m_level[i]);
+        });
+        const int finestStep = numTicks >> finestLevel.combine([](int a, int b) { return std::max(a, b); });
+        const int next = (time / finestStep + 1) * finestStep;
+
+        parallel_for(0, numParticles, [=](int i)
+        {
+            const float h = (next - m_time[i]) * tickTime;
+            const float_3 pos = m_pos[i] + m_vel[i] * h + m_acc[i] * (0.5f * h * h);
+            predicted.x[i] = pos.x;
+            predicted.y[i] = pos.y;
+            predicted.z[i] = pos.z;
+        });
+
+        const int numActive = ParallelCompact(numParticles, [=](int i) 
+        { 
+            return (next - m_time[i]) == (numTicks >> m_level[i]); 
+        }, m_active.data());
+
+        CalculateAccelerations(numActive, numParticles);
+
+        parallel_for(0, numActive, [=](int k)
+        {
+            const int i = m_active[k];
+            const float h = (next - m_time[i]) * tickTime;
+            const float_3 acc(targetAcc.x[k], targetAcc.y[k], targetAcc.z[k]);
+
+            m_pos[i] = float_3(predicted.x[i], predicted.y[i], predicted.z[i]);
+            m_vel[i] += (m_acc[i] + acc) * (0.5f * h);
+            m_acc[i] = acc;
+            m_time[i] = next;
+
+            // Moving to a coarser level must keep the particle synchronized with that level.
+            const int current = m_level[i];
+            int level = SelectLevel(acc);
+            if (level < current)
+                level = ((next % (numTicks >> (current - 1))) == 0) ? current - 1 : current;
+            m_level[i] = level;
+        });
+
+        m_forceCount += numActive;
+        ++m_subStepCount;
+        time = next;
+    }
+
+    parallel_for(0, numParticles, [=](int i)
+    {
+        pParticlesOut[i].pos = m_pos[i];
+        pParticlesOut[i].vel = m_vel[i];
+    });
+    m_counters.integrateSeconds = MetricsSeconds(start) - m_counters.forceSeconds;
+}
+
+//  Calculate the accelerations of all the particles and their initial levels.
+
+void NBodyBlockStep::Initialize(const ParticleCpu* const pParticles, int numParticles) const
+{
+    m_pos.resize(numParticles);
+    m_vel.resize(numParticles);
+    m_acc.resize(numParticles);
+    m_level.resize(numParticles);
+    m_time.resize(numParticles);
+    m_active.resize(numParticles);
+
+    const Float3SoA predicted = m_predicted.pos;
+    parallel_for(0, numParticles, [=](int i)
+    {
+        m_pos[i] = pParticles[i].pos;
+        predicted.x[i] = m_pos[i].x;
+        predicted.y[i] = m_pos[i].y;
+        predicted.z[i] = m_pos[i].z;
+        m_active[i] = i;
+    });
+
+    CalculateAccelerations(numParticles, numParticles);
+
+    const Float3SoA targetAcc = m_targets.acc;
+    parallel_for(0, numParticles, [=](int i)
+    {
+        m_acc[i] = float_3(targetAcc.x[i], targetAcc.y[i], targetAcc.z[i]);
+        m_level[i] = SelectLevel(m_acc[i]);
+    });
+}
+
+//  Gather the predicted positions of the active particles into a contiguous array so that 
+//  the SIMD kernels can load consecutive targets, and calculate their accelerations due to 
+//  all the particles.
+
+void NBodyBlockStep::CalculateAccelerations(int numActive, int numParticles) const
+{
+    const MetricsClock::time_point start = MetricsClock::now();
+    const Float3SoA predicted = m_predicted.pos;
+    const Float3SoA targetPos = m_targets.pos;
+    const Float3SoA targetAcc = m_targets.acc;
+    parallel_for(0, numActive, [=](int k)
+    {
+        const int i = m_active[k];
+        targetPos.x[k] = predicted.x[i];
+        targetPos.y[k] = predicted.y[i];
+        targetPos.z[k] = predicted.z[i];
+        targetAcc.x[k] = targetAcc.y[k] = targetAcc.z[k] = 0.0f;
+    });
+
+    const ConstFloat3SoA sourcePos(predicted.x, predicted.y, predicted.z);
+    const ConstFloat3SoA activePos(targetPos.x, targetPos.y, targetPos.z);
+    m_counters.tasks += BlockedInteractions(*m_engine, activePos, targetAcc, numActive, sourcePos, numParticles);
+    m_counters.interactions += double(numActive) * double(numParticles);
+    m_counters.forceSeconds += MetricsSeconds(start);
+}
+
+//  The smallest level whose step is no larger than sqrt(2 * stepLength / |acc|).
+
+int NBodyBlockStep::SelectLevel(const float_3& acc) const
+{
+    const float accLength = sqrt(SqrLength(acc));
+    if (accLength == 0.0f)
+        return 0;
+    const float step = sqrt(2.0f * m_stepLength / accLength);
+    const int level = static_cast<int>(ceil(log(m_deltaTime / step) / log(2.0f)));
+    return std::min(m_maxLevel, std::max(0, level));
+}
@@ -0,0 +1,111 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the 
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+
+#pragma once
+
+#include <vector>
+#include <memory>
+
+#include "Common.h"
+#include "INBodyCpu.h"
+#include "NBodyMetrics.h"
+#include "ParticleCpu.h"
+#include "NBodySoACpu.h"
+
+//--------------------------------------------------------------------------------------
+//  Hierarchical block timestep implementation of the n-body calculation.
+//--------------------------------------------------------------------------------------
+//
+//  Each call to Integrate advances all the particles by deltaTime. Particles in dense
+//  regions need much smaller steps than those in the outskirts, so each particle is 
+//  assigned a level and advanced with a step of deltaTime / 2^level, up to maxLevel. 
+//  Steps are powers of two so particles on the same level are always updated together 
+//  and every particle is synchronized at the end of the call.
+//
+//  Each sub-step:
+//
+//  1. Predicts the positions of all particles at the end of the sub-step from their last 
+//     position, velocity and acceleration.
+//  2. Compacts the particles whose step ends at this time, the active particles, into a
+//     list with a parallel scan.
+//  3. Calculates the accelerations of the active particles due to the predicted positions
+//     of all particles using the SIMD kernels of NBodySoAInteractionEngine.
+//  4. Corrects the velocities of the active particles and picks their new levels.
+//
+//  The update for each particle is a velocity Verlet step so, unlike the other integrators,
+//  no damping is applied. The step for each particle is sqrt(2 * stepLength / |acc|), the 
+//  time taken for its acceleration alone to move it stepLength. A particle may move to a 
+//  finer level after any step but only to the next coarser level when that keeps it 
+//  synchronized with the particles on the coarser level.
+//
+//  Accelerations and levels are kept between calls. They are recalculated if the number
+//  of particles changes or the positions passed to Integrate are not those from the end 
+//  of the previous call.
+//
+//  Each sub-step counts numActive * numParticles interactions, and the counters' force time 
+//  is the time spent in CalculateAccelerations. Everything else is integration time.
+
+class NBodyBlockStep : public INBodyCpu, public INBodyCounters
+{
+private:
+    std::shared_ptr<NBodySoAInteractionEngine> m_engine;
+    const float m_deltaTime;
+    const float m_stepLength;
+    const int m_maxLevel;
+
+    mutable std::vector<float_3> m_pos;                         // State of each particle at the end of its last step.
+    mutable std::vector<float_3> m_vel;
+    mutable std::vector<float_3> m_acc;
+    mutable std::vector<int> m_level;
+    mutable std::vector<int> m_time;                            // Time of the last step in units of the finest step.
+    mutable std::vector<int> m_active;
+    mutable ParticlesSoA m_predicted;                           // Predicted positions of all the particles.
+    mutable ParticlesSoA m_targets;                             // Positions and accelerations of the active particles.
+    mutable long long m_forceCount;
+    mutable int m_subStepCount;
+    mutable NBodyCounters m_counters;
+
+public:
+    NBodyBlockStep(float softeningSquared, float deltaTime, float particleMass, int maxParticles, 
+        int maxLevel = 8, float stepLength = 0.01f) :
+        INBodyCpu(),
+        m_engine(std::make_shared<NBodySoAInteractionEngine>(softeningSquared, particleMass)),
+        m_deltaTime(deltaTime),
+        m_stepLength(stepLength),
+        m_maxLevel(maxLevel),
+        m_predicted(maxParticles),
+        m_targets(maxParticles),
+        m_forceCount(0),
+        m_subStepCount(0)
+    {
+    }
+
+    void Integrate(ParticleCpu* const pParticlesIn, ParticleCpu* const pParticlesOut, int numParticles) const;
+
+    //  Number of accelerations calculated, and sub-steps taken, by the last call to Integrate. 
+    //  A fixed step integrator calculates numParticles accelerations for each step.
+    inline long long ForceCount() const { return m_forceCount; }
+    inline int SubStepCount() const { return m_subStepCount; }
+    inline int MaxLevel() const { return m_maxLevel; }
+
+    inline const NBodyCounters& Counters() const { return m_counters; }
+
+private:
+    void Initialize(const ParticleCpu* const pParticles, int numParticles) const;
+    void CalculateAccelerations(int numActive, int numParticles) const;
+    int SelectLevel(const float_3& acc) const;
+};
@@ -0,0 +1,343 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the 
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+
+#include <math.h>
+#include <ppl.h>
+#include <assert.h>
+#include <algorithm>
+#include <functional>
+#include <immintrin.h>
+
+#include "Common.h"
+#include "ParallelScan.h"
+#include "NBodyCellListCpu.h"
+
+using namespace concurrency;
+using namespace concurrency::graphics;
+
+//--------------------------------------------------------------------------------------
+//  The SIMD interaction engine for neighbor lists.
+//--------------------------------------------------------------------------------------
+//
+//  The reciprocal square root is refined with a Newton-Raphson step as in the 
+//  NBodySoAInteractionEngine. Pairs outside the cutoff are removed by masking s, the
+//  magnitude of the interaction, to zero.
+
+void NBodyNeighborInteractionEngine::SelectCpuImplementation()
+{
+    if (GetAVXType() != kCpuNoAVX)
+    {
+        m_funcptr = &NBodyNeighborInteractionEngine::BodyNeighborInteractionAVX2;
+        return;
+    }
+
+    switch (GetSSEType())
+    {
+    case kCpuSSE4:
+    case kCpuSSE:
+        m_funcptr = &NBodyNeighborInteractionEngine::BodyNeighborInteractionSSE;
+        break;
+    default:
+        m_funcptr = &NBodyNeighborInteractionEngine::BodyNeighborInteraction;
+    }
+}
+
+float_3 NBodyNeighborInteractionEngine::BodyNeighborInteraction(ConstFloat3SoA pos, int target, const int* const pNeighbors, int numNeighbors) const
+{
+    const float_3 targetPos(pos.x[target], pos.y[target], pos.z[target]);
+    float_3 acc(0.0f);
+
+    for (int n = 0; n < numNeighbors; ++n)
+    {
+        const int j = pNeighbors[n];
+        const float_3 r = float_3(pos.x[j], pos.y[j], pos.z[j]) - targetPos;
+
+        const float rSqr = SqrLength(r);
+        if (rSqr >= m_cutoffSquared)
+            continue;
+        float invDist = 1.0f / sqrt(rSqr + m_softeningSquared);
+        float invDistCube =  invDist * invDist * invDist;
+        float s = m_particleMass * invDistCube;
+
+        acc += r * s;
+    }
+    return acc;
+}
+
+float_3 NBodyNeighborInteractionEngine::BodyNeighborInteractionSSE(ConstFloat3SoA pos, int target, const int* const pNeighbors, int numNeighbors) const
+{
+    const __m128 softeningSquared = _mm_set1_ps(m_softeningSquared);
+    const __m128 cutoffSquared = _mm_set1_ps(m_cutoffSquared);
+    const __m128 particleMass = _mm_set1_ps(m_particleMass);
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 threeHalves = _mm_set1_ps(1.5f);
+    const __m128 posX = _mm_set1_ps(pos.x[target]);
+    const __m128 posY = _mm_set1_ps(pos.y[target]);
+    const __m128 posZ = _mm_set1_ps(pos.z[target]);
+    const int width = 4;
+
+    __m128 accX = _mm_setzero_ps();
+    __m128 accY = _mm_setzero_ps();
+    __m128 accZ = _mm_setzero_ps();
+
+    int n = 0;
+    for (; n + width <= numNeighbors; n += width)
+    {
+        const int* const j = pNeighbors + n;
+        const __m128 rX = _mm_sub_ps(_mm_set_ps(pos.x[j[3]], pos.x[j[2]], pos.x[j[1]], pos.x[j[0]]), posX);
+        const __m128 rY = _mm_sub_ps(_mm_set_ps(pos.y[j[3]], pos.y[j[2]], pos.y[j[1]], pos.y[j[0]]), posY);
+        const __m128 rZ = _mm_sub_ps(_mm_set_ps(pos.z[j[3]], pos.z[j[2]], pos.z[j[1]], pos.z[j[0]]), posZ);
+
+        __m128 rSqr = _mm_mul_ps(rX, rX);
+        rSqr = _mm_add_ps(_mm_mul_ps(rY, rY), rSqr);
+        rSqr = _mm_add_ps(_mm_mul_ps(rZ, rZ), rSqr);
+        const __m128 distSqr = _mm_add_ps(rSqr, softeningSquared);
+
+        __m128 invDist = _mm_rsqrt_ps(distSqr);
+        invDist = _mm_mul_ps(invDist, _mm_sub_ps(threeHalves, 
+            _mm_mul_ps(_mm_mul_ps(half, distSqr), _mm_mul_ps(invDist, invDist))));
+
+        __m128 s = _mm_mul_ps(particleMass, _mm_mul_ps(_mm_mul_ps(invDist, invDist), invDist));
+        s = _mm_and_ps(s, _mm_cmplt_ps(rSqr, cutoffSquared));
+
+        accX = _mm_add_ps(_mm_mul_ps(rX, s), accX);
+        accY = _mm_add_ps(_mm_mul_ps(rY, s), accY);
+        accZ = _mm_add_ps(_mm_mul_ps(rZ, s), accZ);
+    }
+
+    float x[4], y[4], z[4];
+    _mm_storeu_ps(x, accX);
+    _mm_storeu_ps(y, accY);
+    _mm_storeu_ps(z, accZ);
+    const float_3 acc((x[0] + x[1]) + (x[2] + x[3]), (y[0] + y[1]) + (y[2] + y[3]), (z[0] + z[1]) + (z[2] + z[3]));
+
+    return acc + BodyNeighborInteraction(pos, target, pNeighbors + n, numNeighbors - n);
+}
+
+//  AVX2 provides gather instructions which load the positions of 8 neighbors into a 
+//  register with a single instruction.
+
+float_3 NBodyNeighborInteractionEngine::BodyNeighborInteractionAVX2(ConstFloat3SoA pos, int target, const int* const pNeighbors, int numNeighbors) const
+{
+    const __m256 softeningSquared = _mm256_set1_ps(m_softeningSquared);
+    const __m256 cutoffSquared = _mm256_set1_ps(m_cutoffSquared);
+    const __m256 particleMass = _mm256_set1_ps(m_particleMass);
+    const __m256 minusHalf = _mm256_set1_ps(-0.5f);
+    const __m256 threeHalves = _mm256_set1_ps(1.5f);
+    const __m256 posX = _mm256_broadcast_ss(pos.x + target);
+    const __m256 posY = _mm256_broadcast_ss(pos.y + target);
+    const __m256 posZ = _mm256_broadcast_ss(pos.z + target);
+    const int width = 8;
+
+    __m256 accX = _mm256_setzero_ps();
+    __m256 accY = _mm256_setzero_ps();
+    __m256 accZ = _mm256_setzero_ps();
+
+    int n = 0;
+    for (; n + width <= numNeighbors; n += width)
+    {
+        const __m256i j = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pNeighbors + n));
+        const __m256 rX = _mm256_sub_ps(_mm256_i32gather_ps(pos.x, j, sizeof(float)), posX);
+        const __m256 rY = _mm256_sub_ps(_mm256_i32gather_ps(pos.y, j, sizeof(float)), posY);
+        const __m256 rZ = _mm256_sub_ps(_mm256_i32gather_ps(pos.z, j, sizeof(float)), posZ);
+
+        __m256 rSqr = _mm256_mul_ps(rX, rX);
+        rSqr = _mm256_fmadd_ps(rY, rY, rSqr);
+        rSqr = _mm256_fmadd_ps(rZ, rZ, rSqr);
+        const __m256 distSqr = _mm256_add_ps(rSqr, softeningSquared);
+
+        __m256 invDist = _mm256_rsqrt_ps(distSqr);
+        const __m256 invDistSqr = _mm256_mul_ps(invDist, invDist);
+        invDist = _mm256_mul_ps(invDist, _mm256_fmadd_ps(_mm256_mul_ps(minusHalf, distSqr), invDistSqr, threeHalves));
+
+        __m256 s = _mm256_mul_ps(particleMass, _mm256_mul_ps(_mm256_mul_ps(invDist, invDist), invDist));
+        s = _mm256_and_ps(s, _mm256_cmp_ps(rSqr, cutoffSquared, _CMP_LT_OQ));
+
+        accX = _mm256_fmadd_ps(rX, s, accX);
+        accY = _mm256_fmadd_ps(rY, s, accY);
+        accZ = _mm256_fmadd_ps(rZ, s, accZ);
+    }
+
+    float x[8], y[8], z[8];
+    _mm256_storeu_ps(x, accX);
+    _mm256_storeu_ps(y, accY);
+    _mm256_storeu_ps(z, accZ);
+    float_3 acc(0.0f);
+    for (int lane = 0; lane < width; ++lane)
+        acc += float_3(x[lane], y[lane], z[lane]);
+
+    return acc + BodyNeighborInteraction(pos, target, pNeighbors + n, numNeighbors - n);
+}
+
+//--------------------------------------------------------------------------------------
+//  Cutoff radius implementation of the n-body calculation using a cell list.
+//--------------------------------------------------------------------------------------
+
+void NBodyCellList::Integrate(ParticleCpu* const pParticlesIn, ParticleCpu* const pParticlesOut, int numParticles) const
+{
+    assert(numParticles <= m_particles.capacity());
+
+    const MetricsClock::time_point start = MetricsClock::now();
+    if (UpdatePositions(pParticlesIn, numParticles))
+    {
+        BuildCells(pParticlesIn, numParticles);
+        BuildNeighborLists(numParticles);
+        ++m_rebuildCount;
+    }
+
+    const ConstFloat3SoA pos(m_particles.pos.x, m_particles.pos.y, m_particles.pos.z);
+    parallel_for(0, numParticles, [=](int k)
+    {
+        const int begin = m_neighborStarts[k];
+        const float_3 acc = m_engine->InvokeBodyNeighborInteraction(pos, k, m_neighbors.data() + begin, m_neighborStarts[k + 1] - begin);
+
+        const int i = m_order[k];
+        float_3 vel = pParticlesIn[i].vel;
+        vel += acc * m_deltaTime;
+        vel *= m_dampingFactor;
+
+        pParticlesOut[i].pos = pParticlesIn[i].pos + vel * m_deltaTime;
+        pParticlesOut[i].vel = vel;
+    });
+
+    m_counters = NBodyCounters();
+    m_counters.interactions = double(m_neighbors.size());
+    m_counters.forceSeconds = MetricsSeconds(start);
+}
+
+//  Copy the positions into bucket order and check how far each particle has moved since the 
+//  lists were built. Returns true if the lists must be rebuilt.
+
+bool NBodyCellList::UpdatePositions(const ParticleCpu* const pParticles, int numParticles) const
+{
+    if (m_order.size() != size_t(numParticles))
+        return true;
+
+    const Float3SoA pos = m_particles.pos;
+    combinable<int> moved;
+    parallel_for(0, numParticles, [=, &moved](int k)
+    {
+        const float_3 p = pParticles[m_order[k]].pos;
+        pos.x[k] = p.x;
+        pos.y[k] = p.y;
+        pos.z[k] = p.z;
+        if (SqrLength(p - m_buildPos[k]) > m_maxDisplacementSquared)
+            moved.local() = 1;
+    });
+    return moved.combine(std::plus<int>()) != 0;
+}
+
+//  Bin the particles into buckets with a counting sort. Particles are added to a bucket 
+//  in any order so each bucket is then sorted, this keeps the results repeatable.
+
+void NBodyCellList::BuildCells(const ParticleCpu* const pParticles, int numParticles) const
+{
+    int numBuckets = 1;
+    while (numBuckets < 2 * numParticles)
+        numBuckets *= 2;
+    if (numBuckets > m_numBuckets)
+        m_bucketCounts.reset(new std::atomic<int>[numBuckets]);
+    m_numBuckets = numBuckets;
+    m_buckets.resize(numParticles);
+    m_bucketStarts.resize(numBuckets + 1);
+    m_order.resize(numParticles);
+    m_buildPos.resize(numParticles);
+
+    std::atomic<int>* const pCounts = m_bucketCounts.get();
+    parallel_for(0, numBuckets, [=](int b) { pCounts[b] = 0; });
+    parallel_for(0, numParticles, [=](int i)
+    {
+        const float_3 p = pParticles[i].pos;
+        const int b = Bucket(CellCoordinate(p.x), CellCoordinate(p.y), CellCoordinate(p.z));
+        m_buckets[i] = b;
+        ++pCounts[b];
+    });
+
+    parallel_for(0, numBuckets, [=](int b) { m_bucketStarts[b] = pCounts[b]; });
+    m_bucketStarts[numBuckets] = ParallelExclusiveScan(m_bucketStarts.data(), m_bucketStarts.data(), numBuckets);
+
+    // The counts become the next free slot in each bucket.
+    parallel_for(0, numBuckets, [=](int b) { pCounts[b] = m_bucketStarts[b]; });
+    parallel_for(0, numParticles, [=](int i) { m_order[pCounts[m_buckets[i]]++] = i; });
+    parallel_for(0, numBuckets, [=](int b)
+    {
+        std::sort(m_order.begin() + m_bucketStarts[b], m_order.begin() + m_bucketStarts[b + 1]);
+    });
+
+    const Float3SoA pos = m_particles.pos;
+    parallel_for(0, numParticles, [=](int k)
+    {
+        const float_3 p = pParticles[m_order[k]].pos;
+        pos.x[k] = p.x;
+        pos.y[k] = p.y;
+        pos.z[k] = p.z;
+        m_buildPos[k] = p;
+    });
+}
+
+//  Each particle searches the cells within one cell of its own. Several of these cells may
+//  hash to the same bucket so each bucket is only searched once. The lists are built in two
+//  passes, the first counts the neighbors of each particle and the second fills in the lists
+//  at the offsets given by a scan of the counts.
+
+void NBodyCellList::BuildNeighborLists(int numParticles) const
+{
+    const ConstFloat3SoA pos(m_particles.pos.x, m_particles.pos.y, m_particles.pos.z);
+    const float listRadiusSquared = m_listRadius * m_listRadius;
+
+    auto search = [=](int k, int* pOut) -> int
+    {
+        const float_3 p(pos.x[k], pos.y[k], pos.z[k]);
+        const int cx = CellCoordinate(p.x);
+        const int cy = CellCoordinate(p.y);
+        const int cz = CellCoordinate(p.z);
+
+        int buckets[27];
+        int numBuckets = 0;
+        for (int z = cz - 1; z <= cz + 1; ++z)
+            for (int y = cy - 1; y <= cy + 1; ++y)
+                for (int x = cx - 1; x <= cx + 1; ++x)
+                {
+                    const int b = Bucket(x, y, z);
+                    if (std::find(buckets, buckets + numBuckets, b) == (buckets + numBuckets))
+                        buckets[numBuckets++] = b;
+                }
+
+        int count = 0;
+        for (int n = 0; n < numBuckets; ++n)
+        {
+            for (int j = m_bucketStarts[buckets[n]]; j < m_bucketStarts[buckets[n] + 1]; ++j)
+            {
+                const float_3 r = float_3(pos.x[j], pos.y[j], pos.z[j]) - p;
+                if ((j == k) || (SqrLength(r) >= listRadiusSquared))
+                    continue;
+                if (pOut != nullptr)
+                    pOut[count] = j;
+                ++count;
+            }
+        }
+        return count;
+    };
+
+    m_neighborStarts.resize(numParticles + 1);
+    parallel_for(0, numParticles, [=](int k) { m_neighborStarts[k] = search(k, nullptr); });
+    const int numNeighbors = ParallelExclusiveScan(m_neighborStarts.data(), m_neighborStarts.data(), numParticles);
+    m_neighborStarts[numParticles] = numNeighbors;
+
+    m_neighbors.resize(numNeighbors);
+    parallel_for(0, numParticles, [=](int k) { search(k, m_neighbors.data() + m_neighborStarts[k]); });
+}
@@ -0,0 +1,171 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the 
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+
+#pragma once
+
+#include <math.h>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+
+#include "Common.h"
+#include "INBodyCpu.h"
+#include "NBodyMetrics.h"
+#include "ParticleCpu.h"
+#include "NBodyCpu.h"
+#include "NBodySoACpu.h"
+
+//--------------------------------------------------------------------------------------
+//  A SIMD interaction engine for neighbor lists.
+//--------------------------------------------------------------------------------------
+//
+//  Each function calculates the acceleration of a single target particle due to a list 
+//  of neighbors. Unlike NBodySoAInteractionEngine the sources are not contiguous so their
+//  positions are gathered into the lanes of a register, 4 or 8 neighbors at a time. Pairs
+//  further apart than the cutoff radius are masked out.
+//
+//  As with the other engines the most performant implementation is picked on 
+//  initialization based on the available AVX or SSE support.
+
+class NBodyNeighborInteractionEngine;
+
+typedef float_3 (NBodyNeighborInteractionEngine::* NBodyNeighborFunc)(ConstFloat3SoA pos, int target, const int* const pNeighbors, int numNeighbors) const;
+
+class NBodyNeighborInteractionEngine
+{
+private:
+    const float m_softeningSquared;
+    const float m_particleMass;
+    const float m_cutoffSquared;
+    NBodyNeighborFunc m_funcptr;
+
+public:
+    NBodyNeighborInteractionEngine(float softeningSquared, float particleMass, float cutoff) :
+        m_softeningSquared(softeningSquared),
+        m_particleMass(particleMass),
+        m_cutoffSquared(cutoff * cutoff),
+        m_funcptr(nullptr)
+    {
+        SelectCpuImplementation();
+    }
+
+    inline float_3 InvokeBodyNeighborInteraction(ConstFloat3SoA pos, int target, const int* const pNeighbors, int numNeighbors) const
+    {
+        return (this->*m_funcptr)(pos, target, pNeighbors, numNeighbors);
+    };
+
+private:
+    void SelectCpuImplementation();
+
+    // Different implementations of the body-neighbor interaction.
+
+    float_3 BodyNeighborInteraction(ConstFloat3SoA pos, int target, const int* const pNeighbors, int numNeighbors) const;
+    float_3 BodyNeighborInteractionSSE(ConstFloat3SoA pos, int target, const int* const pNeighbors, int numNeighbors) const;
+    float_3 BodyNeighborInteractionAVX2(ConstFloat3SoA pos, int target, const int* const pNeighbors, int numNeighbors) const;
+};
+
+//--------------------------------------------------------------------------------------
+//  Cutoff radius implementation of the n-body calculation using a cell list.
+//--------------------------------------------------------------------------------------
+//
+//  Pairs further apart than the cutoff radius do not interact so each particle only 
+//  interacts with the particles in its neighbor list. This makes the cost of each step 
+//  O(N) for a fixed density of particles.
+//
+//  The neighbor lists include all the particles within cutoff + skin. They are only 
+//  rebuilt once a particle has moved more than half the skin since the last build, until
+//  then no particle can have moved within the cutoff of a particle that is not already 
+//  in its list. Each rebuild:
+//
+//  1. Bins the particles into a uniform grid of cells, cutoff + skin wide, with a parallel
+//     counting sort. The grid is unbounded, each cell is hashed into one of about two 
+//     buckets per particle, so particles ejected a long way from the clusters do not make 
+//     the grid large or sparse. The bucket counts are converted into offsets with a parallel
+//     scan and the particles are stored in bucket order so neighbors are close together 
+//     in memory.
+//  2. Searches the buckets of the 27 cells around each particle for neighbors. The number
+//     of neighbors of each particle is counted, scanned into offsets and then the lists are
+//     filled in, all in parallel.
+//
+//  The lists hold both halves of each pair so each particle's acceleration is updated by 
+//  a single task. Each entry counts as one interaction, including the pairs that have moved
+//  outside the cutoff and are masked out. The velocity update is done by the same task so 
+//  the counters' force time covers the whole step, including any rebuild.
+
+class NBodyCellList : public INBodyCpu, public INBodyCounters
+{
+private:
+    std::shared_ptr<NBodyNeighborInteractionEngine> m_engine;
+    const float m_deltaTime;
+    const float m_dampingFactor;
+    const float m_listRadius;                                   // Cutoff radius plus skin, also the cell size.
+    const float m_maxDisplacementSquared;                       // Rebuild once any particle moves this far.
+
+    mutable ParticlesSoA m_particles;                           // Positions and accelerations in bucket order.
+    mutable std::vector<int> m_order;                           // Original index of each particle in bucket order.
+    mutable std::vector<float_3> m_buildPos;                    // Positions, in bucket order, when the lists were built.
+    mutable std::vector<int> m_buckets;                         // Bucket of each particle in the original order.
+    mutable std::vector<int> m_bucketStarts;                    // Offset of the first particle in each bucket.
+    mutable std::unique_ptr<std::atomic<int>[]> m_bucketCounts;
+    mutable int m_numBuckets;                                   // A power of two.
+    mutable std::vector<int> m_neighborStarts;                  // Offset of each particle's neighbor list.
+    mutable std::vector<int> m_neighbors;
+    mutable int m_rebuildCount;
+    mutable NBodyCounters m_counters;
+
+public:
+    NBodyCellList(float softeningSquared, float dampingFactor, float deltaTime, float particleMass, int maxParticles, 
+        float cutoff, float skin) :
+        INBodyCpu(),
+        m_engine(std::make_shared<NBodyNeighborInteractionEngine>(softeningSquared, particleMass, cutoff)),
+        m_deltaTime(deltaTime),
+        m_dampingFactor(dampingFactor),
+        m_listRadius(cutoff + skin),
+        m_maxDisplacementSquared(0.25f * skin * skin),
+        m_particles(maxParticles),
+        m_numBuckets(0),
+        m_rebuildCount(0)
+    {
+    }
+
+    void Integrate(ParticleCpu* const pParticlesIn, ParticleCpu* const pParticlesOut, int numParticles) const;
+
+    //  Number of times the neighbor lists have been built and the number of entries in them.
+    inline int RebuildCount() const { return m_rebuildCount; }
+    inline size_t NeighborCount() const { return m_neighbors.size(); }
+
+    inline const NBodyCounters& Counters() const { return m_counters; }
+
+private:
+    bool UpdatePositions(const ParticleCpu* const pParticles, int numParticles) const;
+    void BuildCells(const ParticleCpu* const pParticles, int numParticles) const;
+    void BuildNeighborLists(int numParticles) const;
+
+    //  Coordinates are clamped so particles at extreme distances do not overflow.
+    inline int CellCoordinate(float pos) const
+    {
+        const float cell = floor(pos / m_listRadius);
+        return static_cast<int>(std::max(-1.0e9f, std::min(cell, 1.0e9f)));
+    }
+
+    inline int Bucket(int cx, int cy, int cz) const
+    {
+        const unsigned int hash = (unsigned(cx) * 73856093u) ^ (unsigned(cy) * 19349663u) ^ (unsigned(cz) * 83492791u);
+        return static_cast<int>(hash & unsigned(m_numBuckets - 1));
+    }
+};
@@ -0,0 +1,364 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the 
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+#include <string.h>
+#include <stddef.h>
+#include <limits.h>
+#include <cstdio>
+#include <algorithm>
+#include <stdexcept>
+#include <ppl.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "NBodyCheckpoint.h"
+
+using namespace concurrency;
+
+const char kCheckpointMagic[8] = { 'N', 'B', 'O', 'D', 'Y', 'C', 'K', 'P' };
+
+inline unsigned long long AlignCheckpointOffset(unsigned long long offset)
+{
+    return ((offset + kCheckpointAlignment - 1) / kCheckpointAlignment) * kCheckpointAlignment;
+}
+
+//--------------------------------------------------------------------------------------
+//  CheckpointWriter
+//--------------------------------------------------------------------------------------
+
+CheckpointWriter::CheckpointWriter(const std::string& path, IntegratorType scheme) : m_path(path), m_scheme(scheme)
+{
+}
+
+//  Destructors must not throw so any error from the last write is lost. Call Wait() first to
+//  find out whether the final checkpoint was written.
+
+CheckpointWriter::~CheckpointWriter()
+{
+    try
+    {
+        m_writeTask.wait();
+    }
+    catch (...)
+    {
+    }
+}
+
+void CheckpointWriter::Write(const ParticleCpu* const pParticles, int numParticles, unsigned long long step, double time)
+{
+    const size_t dataSize = sizeof(ParticleCpu) * numParticles;
+    char* const pData = Stage(kCheckpointAoS, numParticles, sizeof(ParticleCpu), 
+        sizeof(CheckpointHeader) + offsetof(ParticleCpu, vel), sizeof(CheckpointHeader) + dataSize, step, time);
+    memcpy(pData, pParticles, dataSize);
+
+    m_writeTask.run([this] { WriteFile(); });
+}
+
+void CheckpointWriter::Write(const float_3* const pPos, const float_3* const pVel, int numParticles, 
+    unsigned long long step, double time)
+{
+    const size_t arraySize = sizeof(float_3) * numParticles;
+    const unsigned long long velOffset = AlignCheckpointOffset(sizeof(CheckpointHeader) + arraySize);
+    char* const pData = Stage(kCheckpointSoA, numParticles, sizeof(float_3), velOffset, 
+        static_cast<size_t>(velOffset) + arraySize, step, time);
+    memcpy(pData, pPos, arraySize);
+    memcpy(pData + (velOffset - sizeof(CheckpointHeader)), pVel, arraySize);
+
+    m_writeTask.run([this] { WriteFile(); });
+}
+
+void CheckpointWriter::Wait()
+{
+    m_writeTask.wait();
+}
+
+//  Wait for any previous write to finish with the staging buffer and then fill in the header. 
+//  Returns a pointer to the start of the particle data. Every checkpoint follows at least one
+//  step so leapfrog velocities are always half a step behind.
+
+char* CheckpointWriter::Stage(CheckpointLayout layout, int numParticles, unsigned int stride, unsigned long long velOffset, 
+    size_t fileSize, unsigned long long step, double time)
+{
+    m_writeTask.wait();
+    m_staging.resize(fileSize);
+
+    CheckpointHeader& header = *reinterpret_cast<CheckpointHeader*>(&m_staging[0]);
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kCheckpointMagic, sizeof(header.magic));
+    header.version = kCheckpointVersion;
+    header.layout = layout;
+    header.numParticles = numParticles;
+    header.step = step;
+    header.time = time;
+    header.stride = stride;
+    header.headerSize = sizeof(CheckpointHeader);
+    header.posOffset = sizeof(CheckpointHeader);
+    header.velOffset = velOffset;
+    header.scheme = m_scheme;
+    header.halfStepVelocities = (m_scheme == kLeapfrog) ? 1 : 0;
+    return &m_staging[0] + sizeof(CheckpointHeader);
+}
+
+//  The temporary file is flushed to disk before it is renamed. Otherwise the rename could 
+//  reach the disk before the data and a power loss would leave a truncated checkpoint.
+
+#if defined(_WIN32)
+
+bool WriteAndFlush(const std::string& path, const char* pData, size_t size)
+{
+    const HANDLE file = CreateFileA(path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+    bool written = true;
+    while (written && (size > 0))
+    {
+        const DWORD chunk = static_cast<DWORD>(std::min<size_t>(size, 1 << 30));
+        DWORD bytesWritten = 0;
+        written = (::WriteFile(file, pData, chunk, &bytesWritten, nullptr) != FALSE) && (bytesWritten == chunk);
+        pData += chunk;
+        size -= chunk;
+    }
+    written = written && (FlushFileBuffers(file) != FALSE);
+    CloseHandle(file);
+    return written;
+}
+
+#else
+
+bool WriteAndFlush(const std::string& path, const char* pData, size_t size)
+{
+    const int file = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (file < 0)
+        return false;
+    bool written = true;
+    while (written && (size > 0))
+    {
+        const ssize_t bytesWritten = write(file, pData, size);
+        if ((bytesWritten < 0) && (errno == EINTR))
+            continue;
+        written = bytesWritten > 0;
+        if (written)
+        {
+            pData += bytesWritten;
+            size -= bytesWritten;
+        }
+    }
+    written = written && (fsync(file) == 0);
+    return (close(file) == 0) && written;
+}
+
+#endif
+
+void CheckpointWriter::WriteFile() const
+{
+    const std::string tempPath = m_path + ".tmp";
+    if (!WriteAndFlush(tempPath, &m_staging[0], m_staging.size()))
+        throw std::runtime_error("Unable to write checkpoint file.");
+
+#if defined(_WIN32)
+    const bool replaced = MoveFileExA(tempPath.c_str(), m_path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != FALSE;
+#else
+    const bool replaced = std::rename(tempPath.c_str(), m_path.c_str()) == 0;
+#endif
+    if (!replaced)
+        throw std::runtime_error("Unable to replace checkpoint file.");
+}
+
+//--------------------------------------------------------------------------------------
+//  MappedCheckpoint
+//--------------------------------------------------------------------------------------
+
+#if defined(_WIN32)
+
+MappedCheckpoint::MappedCheckpoint(const std::string& path) :
+    m_pView(nullptr),
+    m_length(0),
+    m_mapping(nullptr)
+{
+    m_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL, nullptr);
+    LARGE_INTEGER size;
+    if ((m_file == INVALID_HANDLE_VALUE) || !GetFileSizeEx(m_file, &size))
+    {
+        Close();
+        throw std::runtime_error("Unable to open checkpoint file.");
+    }
+    m_length = static_cast<size_t>(size.QuadPart);
+    if (m_length < sizeof(CheckpointHeader))
+    {
+        Close();
+        throw std::runtime_error("Checkpoint file is too small.");
+    }
+
+    // A copy-on-write view lets the integrators update the particles without changing the file.
+    m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+    if (m_mapping != nullptr)
+        m_pView = static_cast<char*>(MapViewOfFile(m_mapping, FILE_MAP_COPY, 0, 0, 0));
+    if (m_pView == nullptr)
+    {
+        Close();
+        throw std::runtime_error("Unable to map checkpoint file.");
+    }
+
+    try
+    {
+        Validate();
+    }
+    catch (...)
+    {
+        Close();
+        throw;
+    }
+}
+
+void MappedCheckpoint::Close()
+{
+    if (m_pView != nullptr)
+        UnmapViewOfFile(m_pView);
+    if (m_mapping != nullptr)
+        CloseHandle(m_mapping);
+    if (m_file != INVALID_HANDLE_VALUE)
+        CloseHandle(m_file);
+    m_pView = nullptr;
+    m_mapping = nullptr;
+    m_file = INVALID_HANDLE_VALUE;
+}
+
+#else
+
+MappedCheckpoint::MappedCheckpoint(const std::string& path) :
+    m_pView(nullptr),
+    m_length(0)
+{
+    m_file = open(path.c_str(), O_RDONLY);
+    struct stat status;
+    if ((m_file < 0) || (fstat(m_file, &status) != 0))
+    {
+        Close();
+        throw std::runtime_error("Unable to open checkpoint file.");
+    }
+    m_length = static_cast<size_t>(status.st_size);
+    if (m_length < sizeof(CheckpointHeader))
+    {
+        Close();
+        throw std::runtime_error("Checkpoint file is too small.");
+    }
+
+    // A private mapping lets the integrators update the particles without changing the file.
+    void* pView = mmap(nullptr, m_length, PROT_READ | PROT_WRITE, MAP_PRIVATE, m_file, 0);
+    if (pView == MAP_FAILED)
+    {
+        Close();
+        throw std::runtime_error("Unable to map checkpoint file.");
+    }
+    m_pView = static_cast<char*>(pView);
+
+    try
+    {
+        Validate();
+    }
+    catch (...)
+    {
+        Close();
+        throw;
+    }
+}
+
+void MappedCheckpoint::Close()
+{
+    if (m_pView != nullptr)
+        munmap(m_pView, m_length);
+    if (m_file >= 0)
+        close(m_file);
+    m_pView = nullptr;
+    m_file = -1;
+}
+
+#endif
+
+MappedCheckpoint::~MappedCheckpoint()
+{
+    Close();
+}
+
+//  Check the header describes arrays that lie within the file and are aligned for the layout.
+
+void MappedCheckpoint::Validate() const
+{
+    const CheckpointHeader& header = Header();
+    if (memcmp(header.magic, kCheckpointMagic, sizeof(header.magic)) != 0)
+        throw std::runtime_error("File is not a checkpoint.");
+    if (header.version != kCheckpointVersion)
+        throw std::runtime_error("Unsupported checkpoint version.");
+    if ((header.headerSize < sizeof(CheckpointHeader)) || (header.numParticles > INT_MAX) || (header.scheme > kVelocityVerlet) ||
+        ((header.halfStepVelocities != 0) && (header.scheme != kLeapfrog)))
+        throw std::runtime_error("Invalid checkpoint header.");
+
+    unsigned int expectedStride;
+    switch (header.layout)
+    {
+    case kCheckpointAoS:
+        expectedStride = sizeof(ParticleCpu);
+        break;
+    case kCheckpointSoA:
+        expectedStride = sizeof(float_3);
+        break;
+    default:
+        throw std::runtime_error("Unsupported checkpoint layout.");
+    }
+    if (header.stride != expectedStride)
+        throw std::runtime_error("Checkpoint particle size does not match this build.");
+    if ((header.posOffset < header.headerSize) || (header.velOffset < header.headerSize) || 
+        ((header.posOffset % SSE_ALIGNMENTBOUNDARY) != 0) || ((header.velOffset % SSE_ALIGNMENTBOUNDARY) != 0))
+        throw std::runtime_error("Invalid checkpoint data offset.");
+
+    // The last element of each array only needs to contain a float_3. The offsets come from the
+    // file so they are compared without adding them to the length, which could overflow.
+    const unsigned long long arrayLength = (header.numParticles == 0) ? 0 : 
+        (header.numParticles - 1) * header.stride + sizeof(float_3);
+    if ((header.posOffset > m_length) || (arrayLength > m_length - header.posOffset) || 
+        (header.velOffset > m_length) || (arrayLength > m_length - header.velOffset))
+        throw std::runtime_error("Checkpoint file is truncated.");
+}
+
+ParticleCpu* MappedCheckpoint::Particles() const
+{
+    if (Layout() != kCheckpointAoS)
+        throw std::runtime_error("Checkpoint does not contain ParticleCpu data.");
+    return reinterpret_cast<ParticleCpu*>(m_pView + Header().posOffset);
+}
+
+const float_3* MappedCheckpoint::Positions() const
+{
+    if (Layout() != kCheckpointSoA)
+        throw std::runtime_error("Checkpoint does not contain position arrays.");
+    return reinterpret_cast<const float_3*>(m_pView + Header().posOffset);
+}
+
+const float_3* MappedCheckpoint::Velocities() const
+{
+    if (Layout() != kCheckpointSoA)
+        throw std::runtime_error("Checkpoint does not contain velocity arrays.");
+    return reinterpret_cast<const float_3*>(m_pView + Header().velOffset);
+}
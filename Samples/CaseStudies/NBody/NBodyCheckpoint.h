@@ -0,0 +1,165 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the 
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <ppl.h>
+
+#include "Common.h"
+#include "ParticleCpu.h"
+
+//--------------------------------------------------------------------------------------
+//  Binary checkpoint format for particle state.
+//--------------------------------------------------------------------------------------
+//
+//  A checkpoint is a fixed size header followed by the position and velocity data exactly
+//  as it is laid out in memory by the integrators. The header describes each array as an
+//  offset and a stride so a reader can use the data in place without parsing it:
+//
+//  kCheckpointAoS  - An array of ParticleCpu records, as used by the CPU integrators.
+//  kCheckpointSoA  - A float_3 array of positions followed by a float_3 array of velocities,
+//                    as used by ParticlesCpu for the C++ AMP integrators.
+//
+//  Each array starts on a kCheckpointAlignment boundary. The file is mapped from offset zero 
+//  so the data is aligned in memory and can be passed directly to the SSE and AVX engines.
+//
+//  The header also records the integration scheme. Checkpoints are written between steps so
+//  kLeapfrog velocities lag the positions by half a step, a restart must continue with full 
+//  kicks rather than applying the initial half kick again.
+
+enum CheckpointLayout
+{
+    kCheckpointAoS = 0,
+    kCheckpointSoA = 1
+};
+
+const unsigned int kCheckpointVersion = 2;
+const unsigned int kCheckpointAlignment = 64;
+
+struct CheckpointHeader
+{
+    char magic[8];                              // "NBODYCKP"
+    unsigned int version;
+    unsigned int layout;                        // CheckpointLayout
+    unsigned long long numParticles;
+    unsigned long long step;
+    double time;
+    unsigned int stride;                        // Bytes between consecutive elements of each array.
+    unsigned int headerSize;
+    unsigned long long posOffset;               // File offsets of the first position and velocity.
+    unsigned long long velOffset;
+    unsigned int scheme;                        // IntegratorType
+    unsigned int halfStepVelocities;            // Non-zero if the velocities lag the positions by half a step.
+    char reserved[56];
+};
+
+static_assert(sizeof(CheckpointHeader) == 2 * kCheckpointAlignment, "CheckpointHeader must fill two aligned blocks.");
+
+//--------------------------------------------------------------------------------------
+//  Asynchronous checkpoint writer.
+//--------------------------------------------------------------------------------------
+//
+//  Write copies the particles into a staging buffer and returns, the file is written on
+//  another task while the integrator continues. The data is written to a temporary file,
+//  flushed to disk, and then replaces the checkpoint so a crash or power loss during a write
+//  never leaves a partial checkpoint. If the previous write has not finished Write waits for
+//  it to complete. 
+//
+//  Errors from a background write are thrown as std::runtime_error by the next call to
+//  Write or Wait.
+
+class CheckpointWriter
+{
+private:
+    std::string m_path;
+    IntegratorType m_scheme;
+    std::vector<char> m_staging;                // The complete file image, header and data.
+    concurrency::task_group m_writeTask;
+
+public:
+    explicit CheckpointWriter(const std::string& path, IntegratorType scheme = kDampedEuler);
+    ~CheckpointWriter();
+
+    void Write(const ParticleCpu* const pParticles, int numParticles, unsigned long long step, double time);
+    void Write(const float_3* const pPos, const float_3* const pVel, int numParticles, unsigned long long step, double time);
+
+    void Wait();
+
+private:
+    char* Stage(CheckpointLayout layout, int numParticles, unsigned int stride, unsigned long long velOffset, 
+        size_t fileSize, unsigned long long step, double time);
+    void WriteFile() const;
+
+    CheckpointWriter(const CheckpointWriter&);
+    CheckpointWriter& operator=(const CheckpointWriter&);
+};
+
+//--------------------------------------------------------------------------------------
+//  Memory mapped checkpoint reader.
+//--------------------------------------------------------------------------------------
+//
+//  The checkpoint file is mapped copy-on-write. The integrators can use the particle data 
+//  in place and update it without modifying the file. Particles() is only available for
+//  kCheckpointAoS files, Positions() and Velocities() only for kCheckpointSoA files.
+//  Position(i) and Velocity(i) work for either layout.
+//
+//  Throws std::runtime_error if the file cannot be opened or is not a valid checkpoint.
+
+class MappedCheckpoint
+{
+private:
+    char* m_pView;
+    size_t m_length;
+#if defined(_WIN32)
+    void* m_file;
+    void* m_mapping;
+#else
+    int m_file;
+#endif
+
+public:
+    explicit MappedCheckpoint(const std::string& path);
+    ~MappedCheckpoint();
+
+    inline const CheckpointHeader& Header() const { return *reinterpret_cast<const CheckpointHeader*>(m_pView); }
+    inline int NumParticles() const { return static_cast<int>(Header().numParticles); }
+    inline CheckpointLayout Layout() const { return static_cast<CheckpointLayout>(Header().layout); }
+    inline IntegratorType Scheme() const { return static_cast<IntegratorType>(Header().scheme); }
+    inline bool HalfStepVelocities() const { return Header().halfStepVelocities != 0; }
+
+    ParticleCpu* Particles() const;
+    const float_3* Positions() const;
+    const float_3* Velocities() const;
+
+    inline const float_3& Position(int i) const
+    {
+        return *reinterpret_cast<const float_3*>(m_pView + Header().posOffset + size_t(i) * Header().stride);
+    }
+
+    inline const float_3& Velocity(int i) const
+    {
+        return *reinterpret_cast<const float_3*>(m_pView + Header().velOffset + size_t(i) * Header().stride);
+    }
+
+private:
+    void Validate() const;
+    void Close();
+
+    MappedCheckpoint(const MappedCheckpoint&);
+    MappedCheckpoint& operator=(const MappedCheckpoint&);
+};
@@ -18,14 +18,14 @@
 #include <math.h>
 #include <ppl.h>
 #include <concrtrm.h>
-#include <amprt.h>
 #include <assert.h>
-#include <atlbase.h>
-#include <random>
 #include <memory>
+#include <intrin.h>
+#include <immintrin.h>
 
 #include "Common.h"
 #include "NBodyCpu.h"
+#include "NBodyKernels.h"
 
 using namespace concurrency;
 using namespace concurrency::graphics;
@@ -38,178 +38,85 @@ using namespace concurrency::graphics;
 //  This implementation does not store intermediate acceleration values. For a more efficient implementation
 //  see the advanced integrator.
 
-//  Select which interaction engine to use based on the available SSE support.
+//  Select which interaction engine to use based on the available instruction sets.
 
 void NBodySimpleInteractionEngine::SelectCpuImplementation()
 {
-    switch (GetSSEType())
+#if defined(NBODY_ISA_NEON)
+    SelectCpuImplementation<kIsaNEON>();
+#else
+    switch (GetCpuIsa())
     {
-    case kCpuSSE4:
-        m_funcptr = &NBodySimpleInteractionEngine::BodyBodyInteractionSSE4;
+    case kIsaAVX512:
+        SelectCpuImplementation<kIsaAVX512>();
         break;
-    case kCpuSSE:
-        m_funcptr = &NBodySimpleInteractionEngine::BodyBodyInteractionSSE;
+    case kIsaAVX2:
+        SelectCpuImplementation<kIsaAVX2>();
+        break;
+    case kIsaSSE4:
+        SelectCpuImplementation<kIsaSSE4>();
+        break;
+    case kIsaSSE:
+        SelectCpuImplementation<kIsaSSE>();
         break;
     default:
-        m_funcptr = &NBodySimpleInteractionEngine::BodyBodyInteraction;
+        SelectCpuImplementation<kIsaScalar>();
     }
+#endif
 }
 
-void NBodySimpleInteractionEngine::BodyBodyInteraction(const ParticleCpu* const pParticlesIn, 
-    ParticleCpu& particleOut, int numParticles) const 
+template <CpuIsa Isa>
+void NBodySimpleInteractionEngine::SelectCpuImplementation()
 {
-    float_3 pos(particleOut.pos);
-    float_3 vel(particleOut.vel);
-    float_3 acc(0.0f);
-
-    std::for_each(pParticlesIn, pParticlesIn + numParticles, [=, &acc](const ParticleCpu& p)
-    {  
-        const float_3 r = p.pos - pos;
-
-        float distSqr = SqrLength(r) + m_softeningSquared;
-        float invDist = 1.0f / sqrt(distSqr);
-        float invDistCube =  invDist * invDist * invDist;
-        float s = m_particleMass * invDistCube;
-
-        // Note: The book code contains typos, the = operator is used instead of +=. 
-        // The code below is correct.
-        acc += r * s;
-    });
-
-    vel += acc * m_deltaTime;
-    vel *= m_dampingFactor;
-    pos += vel * m_deltaTime;
-
-    particleOut.pos = pos;
-    particleOut.vel = vel;
+    m_funcptr = &NBodySimpleInteractionEngine::BodyBodyInteraction<Isa>;
+    m_blockedFuncptr = &NBodySimpleInteractionEngine::BlockedBodyBodyInteraction<Isa>;
 }
 
-void NBodySimpleInteractionEngine::BodyBodyInteractionSSE(const ParticleCpu* const pParticlesIn, ParticleCpu& particleOut, int numParticles) const 
+template <CpuIsa Isa>
+void NBodySimpleInteractionEngine::BodyBodyInteraction(const ParticleCpu* const pParticlesIn, ParticleCpu* const pParticlesOut, 
+    int begin, int end, int numParticles) const
 {
-    const __m128 softeningSquared = _mm_load1_ps( &m_softeningSquared);
-    const __m128 dampingFactor = _mm_load_ps1(&m_dampingFactor);
-    const __m128 deltaTime = _mm_load_ps1(&m_deltaTime);
-    const __m128 particleMass = _mm_load1_ps( &m_particleMass );
-
-    //float_3 pos(particleOut.pos);
-    //float_3 vel(particleOut.vel);
-    //float_3 acc(0.0f);
-    __m128 pos = _mm_loadu_ps((float*)&particleOut.pos);
-    __m128 vel = _mm_loadu_ps((float*)&particleOut.vel);
-    __m128 acc = _mm_setzero_ps();
-
-    // Cannot use lambdas here because __m128 is aligned.
-    for (int j = 0; j < numParticles; ++j)
-    {    
-        //float_3 r = p.pos - pos;
-        __m128 pos1 = _mm_loadu_ps((float*)&pParticlesIn[j].pos);
-        __m128 r = _mm_sub_ps(pos1, pos);
-
-        //float distSqr = float_3::SqrLength(r) + m_softeningSquared;
-        __m128 distSqr = _mm_mul_ps(r, r);    //x    y    z    ?
-        __m128 rshuf = _mm_shuffle_ps(distSqr, distSqr, _MM_SHUFFLE(0,3,2,1));
-        distSqr = _mm_add_ps(distSqr, rshuf);  //x+y, y+z, z+?, ?+x
-        rshuf = _mm_shuffle_ps(distSqr, distSqr, _MM_SHUFFLE(1,0,3,2));
-        distSqr = _mm_add_ps(rshuf, distSqr);  //x+y+z+0, y+z+0+X, z+0+x+y, 0+x+y+z
-        distSqr = _mm_add_ps(distSqr, softeningSquared); 
-
-        //float invDist = 1.0f / sqrt(distSqr);
-        //float invDistCube =  invDist * invDist * invDist;
-        //float s = m_particleMass * invDistCube;
-        __m128 invDistSqr = _mm_rsqrt_ps(distSqr);
-        __m128 invDistCube = _mm_mul_ps(_mm_mul_ps(invDistSqr, invDistSqr), invDistSqr);
-        __m128 s = _mm_mul_ps(particleMass, invDistCube); 
+    for (int i = begin; i < end; ++i)
+    {
+        ParticleCpu& particleOut = pParticlesOut[i];
+        particleOut = pParticlesIn[i];
 
-        //acc += r * s;
-        acc = _mm_add_ps( _mm_mul_ps(r, s), acc ); 
+        Integrate(particleOut, ParticleKernel<Isa>::Gather(pParticlesIn, numParticles, particleOut.pos, m_softeningSquared, m_particleMass));
     }
-
-    //vel += acc * m_deltaTime;
-    vel = _mm_add_ps( _mm_mul_ps(acc, deltaTime), vel ); 
-
-    //vel *= m_dampingFactor;   
-    vel = _mm_mul_ps(vel, dampingFactor); 
-
-    //pos += vel * m_deltaTime;
-    pos = _mm_add_ps( _mm_mul_ps(vel, deltaTime), pos ); 
-
-    // The r3 word in each register has an undefined value at this point but
-    // this isn't used elsewhere so there is no need to clear it.
-    //particleOut.pos = pos;
-    //particleOut.vel = vel;
-    _mm_storeu_ps((float*)&particleOut.pos, pos);
-    _mm_storeu_ps((float*)&particleOut.vel, vel);
 }
 
-void NBodySimpleInteractionEngine::BodyBodyInteractionSSE4(const ParticleCpu* const pParticlesIn, ParticleCpu& particleOut, int numParticles) const 
-{
-    const __m128 softeningSquared = _mm_load1_ps( &m_softeningSquared);
-    const __m128 dampingFactor = _mm_load_ps1(&m_dampingFactor);
-    const __m128 deltaTime = _mm_load_ps1(&m_deltaTime);
-    const __m128 particleMass = _mm_load1_ps( &m_particleMass );
-
-    //float_3 pos(particleOut.pos);
-    //float_3 vel(particleOut.vel);
-    //float_3 acc(0.0f);
-    __m128 pos = _mm_loadu_ps((float*)&particleOut.pos);
-    __m128 vel = _mm_loadu_ps((float*)&particleOut.vel);
-    __m128 acc = _mm_setzero_ps();
+//  Whole blocks of kTargetBlockSize particles are updated with a single pass over the source 
+//  particles, any remaining particles are updated one at a time.
 
-    // Cannot use lambdas here because __m128 is aligned.
-    for (int j = 0; j < numParticles; ++j)
+template <CpuIsa Isa>
+void NBodySimpleInteractionEngine::BlockedBodyBodyInteraction(const ParticleCpu* const pParticlesIn, ParticleCpu* const pParticlesOut, 
+    int begin, int end, int numParticles) const
+{
+    int i = begin;
+    for (; (i + kTargetBlockSize) <= end; i += kTargetBlockSize)
     {
-        //float_3 r = p.pos - pos;
-        __m128 pos1 = _mm_loadu_ps((float*)&pParticlesIn[j].pos);
-        __m128 r = _mm_sub_ps(pos1, pos);
-
-        //float distSqr = float_3::SqrLength(r) + m_softeningSquared;
-        //This uses the additional SSE4 _mm_dp_ps intrinsic.
-        __m128 distSqr = _mm_dp_ps(r, r, 0x7F);
-        distSqr = _mm_add_ps(distSqr, softeningSquared);
-
-        //float invDist = 1.0f / sqrt(distSqr);
-        //float invDistCube =  invDist * invDist * invDist;
-        //float s = m_particleMass * invDistCube;
-        __m128 invDistSqr = _mm_rsqrt_ps(distSqr);
-        __m128 invDistCube = _mm_mul_ps(_mm_mul_ps(invDistSqr, invDistSqr), invDistSqr);            
-        __m128 s = _mm_mul_ps(particleMass, invDistCube); 
-
-        //acc += r * s;
-        acc = _mm_add_ps( _mm_mul_ps(r, s), acc ); 
+        float_3 acc[kTargetBlockSize];
+        ParticleKernel<Isa>::GatherBlock(pParticlesIn, numParticles, pParticlesIn + i, acc, m_softeningSquared, m_particleMass);
+        for (int t = 0; t < kTargetBlockSize; ++t)
+        {
+            ParticleCpu& particleOut = pParticlesOut[i + t];
+            particleOut = pParticlesIn[i + t];
+            Integrate(particleOut, acc[t]);
+        }
     }
-
-    //vel += acc * m_deltaTime;
-    vel = _mm_add_ps( _mm_mul_ps(acc, deltaTime), vel ); 
-
-    //vel *= m_dampingFactor;
-    vel = _mm_mul_ps(vel, dampingFactor); 
-
-    //pos += vel * m_deltaTime;
-    pos = _mm_add_ps( _mm_mul_ps(vel, deltaTime), pos ); 
-
-    // The r3 word in each register has an undefined value at this point but
-    // this isn't used elsewhere so there is no need to clear it.
-    //particleOut.pos = pos;
-    //particleOut.vel = vel;
-    _mm_storeu_ps((float*)&particleOut.pos, pos);
-    _mm_storeu_ps((float*)&particleOut.vel, vel);   
+    BodyBodyInteraction<Isa>(pParticlesIn, pParticlesOut, i, end, numParticles);
 }
 
 //--------------------------------------------------------------------------------------
 //  The sequential integration engine to update all particles.
 //--------------------------------------------------------------------------------------
 //
-//  This updates all particles by calling the integration engine for each particle in the 
-//  list.
+//  This updates all particles with a single call to the integration engine.
 
 void NBodySimpleSingleCore::Integrate(ParticleCpu* const pParticlesIn, 
     ParticleCpu* const pParticlesOut, int numParticles) const
 {
-    for (int i = 0; i < numParticles; ++i)
-    {
-        pParticlesOut[i] = pParticlesIn[i];    
-        m_engine->InvokeBodyBodyInteraction(pParticlesIn, pParticlesOut[i], numParticles);
-    }
+    m_engine->InvokeBodyBodyInteraction(pParticlesIn, pParticlesOut, 0, numParticles, numParticles);
 }
 
 //--------------------------------------------------------------------------------------
@@ -222,48 +129,128 @@ void NBodySimpleSingleCore::Integrate(ParticleCpu* const pParticlesIn,
 //  Ensuring that the ParticleCpu struct is aligned and occupies a whole cache line reduces the 
 //  amount of false cache line shareing and improves performance. 
 
+const int kSimpleChunkSize = 16;
+
 void NBodySimpleMultiCore::Integrate(ParticleCpu* const pParticlesIn, ParticleCpu* const pParticlesOut, int numParticles) const
 {
-    parallel_for(0, numParticles, [=, this, &pParticlesOut](int i)
+    const int numChunks = (numParticles + kSimpleChunkSize - 1) / kSimpleChunkSize;
+    parallel_for(0, numChunks, [=](int c)
     {
-        pParticlesOut[i] = pParticlesIn[i];
-        m_engine->InvokeBodyBodyInteraction(pParticlesIn, pParticlesOut[i], numParticles);
+        const int begin = c * kSimpleChunkSize;
+        m_engine->InvokeBodyBodyInteraction(pParticlesIn, pParticlesOut, begin, std::min(begin + kSimpleChunkSize, numParticles), numParticles);
     });
 }
 
 //--------------------------------------------------------------------------------------
-//  Utility functions.
+//  The parallel register blocked integration engine to update all particles.
 //--------------------------------------------------------------------------------------
+//
+//  This is the same as NBodySimpleMultiCore except that each chunk is a whole number of blocks
+//  so only the last chunk has particles that are not part of a block.
+
+const int kBlockedChunkSize = 4 * kTargetBlockSize;
 
-void LoadClusterParticles(ParticleCpu* const pParticles, float_3 center, float_3 velocity, 
-    float spread, int numParticles)
+void NBodyBlockedMultiCore::Integrate(ParticleCpu* const pParticlesIn, ParticleCpu* const pParticlesOut, int numParticles) const
 {
-    std::random_device rd; 
-    std::default_random_engine engine(rd()); 
-    std::uniform_real_distribution<float> randRadius(0.0f, spread);
-    std::uniform_real_distribution<float> randTheta(-1.0f, 1.0f);
-    std::uniform_real_distribution<float> randPhi(0.0f, 2.0f * static_cast<float>(std::_Pi));
+    const int numChunks = (numParticles + kBlockedChunkSize - 1) / kBlockedChunkSize;
+    parallel_for(0, numChunks, [=](int c)
+    {
+        const int begin = c * kBlockedChunkSize;
+        m_engine->InvokeBlockedBodyBodyInteraction(pParticlesIn, pParticlesOut, begin, std::min(begin + kBlockedChunkSize, numParticles), numParticles);
+    });
+}
+
+//--------------------------------------------------------------------------------------
+//  Utility functions.
+//--------------------------------------------------------------------------------------
 
-    std::for_each(pParticles, pParticles + numParticles, 
-        [=, &engine, &randRadius, &randTheta, &randPhi](ParticleCpu& p)
+void LoadClusterParticles(ParticleCpu* const pParticles, const ClusterDesc& cluster, int first, int numParticles)
+{
+    GenerateCluster(cluster, first, numParticles, [=](int i, const float_3& pos, const float_3& vel)
     {
-        float_3 delta = PolarToCartesian(randRadius(engine), 
-            acos(randTheta(engine)), randPhi(engine));
-        p.pos = center + delta; 
-        p.vel = velocity;
-        p.acc = 0.0f;
+        pParticles[i].pos = pos; 
+        pParticles[i].vel = vel;
+        pParticles[i].acc = 0.0f;
     });  
 }
 
-inline CpuSSE GetSSEType()
+//  CPUID leaf 1 reports SSE and SSE2 in EDX bits 25 and 26, SSE4.1 in ECX bit 19, FMA in ECX
+//  bit 12, OSXSAVE in ECX bit 27 and AVX in ECX bit 28. Leaf 7 reports AVX2 in EBX bit 5 and
+//  AVX-512 Foundation in EBX bit 16.
+//
+//  AVX requires support from both the processor and the operating system, which must save
+//  the wider registers on a context switch. XCR0 bits 1 and 2 show that the XMM and YMM
+//  registers are saved, bits 5 to 7 the AVX-512 opmask and ZMM registers.
+
+CpuFeatures GetCpuFeatures()
 {
+    CpuFeatures features;
+#if defined(NBODY_ISA_NEON)
+    features.neon = true;
+#else
     int CpuInfo[4] = { -1 };
+    __cpuid(CpuInfo, 0);
+    const int maxLeaf = CpuInfo[0];
     __cpuid(CpuInfo, 1);
 
     // Note: The book code contains typos, the && operator is used instead of & and 
     // CpuInfo is capitalized incorrectly. The code below is correct.
 
-    if (CpuInfo[2] >> 19 & 0x1) return kCpuSSE4;
-    if (CpuInfo[3] >> 24 & 0x1) return kCpuSSE;
+    features.sse = (CpuInfo[3] >> 25 & 0x1) != 0;
+    features.sse2 = (CpuInfo[3] >> 26 & 0x1) != 0;
+    features.sse41 = (CpuInfo[2] >> 19 & 0x1) != 0;
+
+    const bool osxsave = (CpuInfo[2] >> 27 & 0x1) != 0;
+    const bool avx = (CpuInfo[2] >> 28 & 0x1) != 0;
+    const bool fma = (CpuInfo[2] >> 12 & 0x1) != 0;
+    if (!osxsave || !avx)
+        return features;
+
+    const unsigned long long xcr0 = _xgetbv(0);
+    if ((xcr0 & 0x6) != 0x6)
+        return features;
+    features.avx = true;
+    features.fma = fma;
+    if (maxLeaf < 7)
+        return features;
+
+    __cpuidex(CpuInfo, 7, 0);
+    features.avx2 = (CpuInfo[1] >> 5 & 0x1) != 0;
+    features.avx512f = ((xcr0 & 0xE6) == 0xE6) && (CpuInfo[1] >> 16 & 0x1);
+#endif
+    return features;
+}
+
+CpuIsa GetCpuIsa()
+{
+    const CpuFeatures features = GetCpuFeatures();
+    if (features.neon)
+        return kIsaNEON;
+    if (features.avx512f)
+        return kIsaAVX512;
+    if (features.avx2 && features.fma)
+        return kIsaAVX2;
+    if (features.sse41)
+        return kIsaSSE4;
+    if (features.sse)
+        return kIsaSSE;
+    return kIsaScalar;
+}
+
+CpuSSE GetSSEType()
+{
+    const CpuFeatures features = GetCpuFeatures();
+    if (features.sse41) return kCpuSSE4;
+    if (features.sse) return kCpuSSE;
     return kCpuNone;
 }
+
+CpuAVX GetAVXType()
+{
+    const CpuFeatures features = GetCpuFeatures();
+    if (features.avx512f)
+        return kCpuAVX512;
+    if (features.avx2 && features.fma)
+        return kCpuAVX2;
+    return kCpuNoAVX;
+}
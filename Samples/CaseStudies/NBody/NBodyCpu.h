@@ -20,6 +20,7 @@
 
 #include "INBodyCpu.h"
 #include "ParticleCpu.h"
+#include "ParticleGenerator.h"
 
 using namespace concurrency;
 using namespace concurrency::graphics;
@@ -30,7 +31,15 @@ enum ComputeType
 {
     kCpuSingle = 0,
     kCpuMulti = 1,
-    kCpuAdvanced = 2
+    kCpuAdvanced = 2,
+    kCpuSoA = 3,
+    kCpuBarnesHut = 4,
+    kCpuFmm = 5,
+    kCpuBlockStep = 6,
+    kCpuCellList = 7,
+    kCpuBlocked = 8,
+    kCpuNuma = 9,
+    kCpuPartitioned = 10
 };
 
 //  Level of SSE support available. Determined dynamically at runtime.
@@ -42,16 +51,65 @@ enum CpuSSE
     kCpuSSE4
 };
 
+//  Level of AVX support available. Determined dynamically at runtime.
+
+enum CpuAVX
+{
+    kCpuNoAVX = 0,
+    kCpuAVX2,                   // AVX2 and FMA3
+    kCpuAVX512                  // AVX-512 Foundation
+};
+
+//  Instruction sets that kernels are specialized for, see ParticleKernel. NEON is selected at 
+//  compile time for ARM builds, the others are determined dynamically at runtime.
+
+#if defined(_M_ARM) || defined(_M_ARM64) || defined(__ARM_NEON)
+#define NBODY_ISA_NEON
+#endif
+
+enum CpuIsa
+{
+    kIsaScalar = 0,
+    kIsaSSE,
+    kIsaSSE4,                   // SSE4.1
+    kIsaAVX2,                   // AVX2 and FMA3
+    kIsaAVX512,                 // AVX-512 Foundation
+    kIsaNEON
+};
+
+//  Instruction set extensions available. The AVX flags are only set if the operating system
+//  also saves the wider registers on a context switch.
+
+struct CpuFeatures
+{
+    bool sse;
+    bool sse2;
+    bool sse41;
+    bool avx;
+    bool avx2;
+    bool fma;
+    bool avx512f;
+    bool neon;
+
+    CpuFeatures() : sse(false), sse2(false), sse41(false), avx(false), avx2(false), fma(false), avx512f(false), neon(false) { }
+};
+
 //--------------------------------------------------------------------------------------
 //  A simple integration engine.
 //--------------------------------------------------------------------------------------
 //
 //  On initialization this picks the most performant integration engine and sets a function
 //  pointer. During calculations this is used to quickly call the correct integration code.
+//  Each call updates a range of particles with a loop that is specialized for the instruction
+//  set, so the interaction kernel, see ParticleKernel, is inlined into the loop.
+//
+//  The blocked loop updates kTargetBlockSize particles at a time. Each source particle is loaded
+//  once per block rather than once per target.
 
 class NBodySimpleInteractionEngine;
 
-typedef void (NBodySimpleInteractionEngine::* NBodySimpleFunc)(const ParticleCpu* const pParticlesIn, ParticleCpu& particleOut, int numParticles) const;
+typedef void (NBodySimpleInteractionEngine::* NBodySimpleFunc)(const ParticleCpu* const pParticlesIn, ParticleCpu* const pParticlesOut, 
+    int begin, int end, int numParticles) const;
 
 class NBodySimpleInteractionEngine
 {
@@ -61,6 +119,7 @@ private:
     float m_deltaTime;
     float m_particleMass;
     NBodySimpleFunc m_funcptr;
+    NBodySimpleFunc m_blockedFuncptr;
 
 public:
     NBodySimpleInteractionEngine(float softeningSquared, float dampingFactor, float deltaTime, float particleMass) :
@@ -68,24 +127,44 @@ public:
         m_dampingFactor(dampingFactor),
         m_deltaTime(deltaTime),
         m_particleMass(particleMass),
-        m_funcptr(nullptr)
+        m_funcptr(nullptr),
+        m_blockedFuncptr(nullptr)
     {
         SelectCpuImplementation();
     }
 
-    inline void InvokeBodyBodyInteraction(const ParticleCpu* const pParticlesIn, ParticleCpu& particleOut, int numParticles) const
+    //  Update particles [begin, end) of pParticlesOut using all the particles in pParticlesIn.
+
+    inline void InvokeBodyBodyInteraction(const ParticleCpu* const pParticlesIn, ParticleCpu* const pParticlesOut, 
+        int begin, int end, int numParticles) const
+    {
+        (this->*m_funcptr)(pParticlesIn, pParticlesOut, begin, end, numParticles); 
+    };
+
+    inline void InvokeBlockedBodyBodyInteraction(const ParticleCpu* const pParticlesIn, ParticleCpu* const pParticlesOut, 
+        int begin, int end, int numParticles) const
     {
-        (this->*m_funcptr)(pParticlesIn, particleOut, numParticles); 
+        (this->*m_blockedFuncptr)(pParticlesIn, pParticlesOut, begin, end, numParticles); 
     };
 
 private:
     void SelectCpuImplementation();
 
-    // Different implementations of the body-body interaction.
+    template <CpuIsa Isa>
+    void SelectCpuImplementation();
+
+    template <CpuIsa Isa>
+    void BodyBodyInteraction(const ParticleCpu* const pParticlesIn, ParticleCpu* const pParticlesOut, int begin, int end, int numParticles) const;
 
-    void BodyBodyInteraction(const ParticleCpu* const pParticlesIn, ParticleCpu& particleOut, int numParticles) const;
-    void BodyBodyInteractionSSE(const ParticleCpu* const pParticlesIn, ParticleCpu& particleOut, int numParticles) const;
-    void BodyBodyInteractionSSE4(const ParticleCpu* const pParticlesIn, ParticleCpu& particleOut, int numParticles) const;
+    template <CpuIsa Isa>
+    void BlockedBodyBodyInteraction(const ParticleCpu* const pParticlesIn, ParticleCpu* const pParticlesOut, int begin, int end, int numParticles) const;
+
+    inline void Integrate(ParticleCpu& particleOut, const float_3& acc) const
+    {
+        particleOut.vel += acc * m_deltaTime;
+        particleOut.vel *= m_dampingFactor;
+        particleOut.pos += particleOut.vel * m_deltaTime;
+    }
 };
 
 //--------------------------------------------------------------------------------------
@@ -132,15 +211,52 @@ public:
     void Integrate(ParticleCpu* const pParticlesIn, ParticleCpu* const pParticlesOut, int numParticles) const;
 };
 
+//--------------------------------------------------------------------------------------
+//  Parallel implementation of the n-body calculation with register blocking.
+//--------------------------------------------------------------------------------------
+//
+//  This is the CPU equivalent of NBodyAmpTiled. Where the tiled C++ AMP code loads each source
+//  particle into tile_static memory once for the whole tile, this holds a block of target
+//  particles in registers and reuses each source position loaded from memory for every target
+//  in the block. This raises the number of interactions calculated per byte loaded by the 
+//  block size.
+
+class NBodyBlockedMultiCore : public INBodyCpu
+{
+private:
+    std::shared_ptr<NBodySimpleInteractionEngine> m_engine;
+
+public:
+    NBodyBlockedMultiCore(float softeningSquared, float dampingFactor, float deltaTime, float particleMass) : 
+        INBodyCpu(),
+        m_engine(std::make_shared<NBodySimpleInteractionEngine>(softeningSquared, dampingFactor, deltaTime, particleMass))
+    {
+    }
+
+    void Integrate(ParticleCpu* const pParticlesIn, ParticleCpu* const pParticlesOut, int numParticles) const;
+};
+
 //--------------------------------------------------------------------------------------
 //  Utility functions.
 //--------------------------------------------------------------------------------------
 
-//  Generate a cluster of particles uniformly distributed within a sphere.
-//  This is not a physically realistic model but it is adequate for demonstration purposes.
+//  Generate particles [first, first + numParticles) of a cluster in parallel, see ParticleGenerator.h
+//  for the available distributions. The same seed and stream always give the same particles.
+
+void LoadClusterParticles(ParticleCpu* const pParticles, const ClusterDesc& cluster, int first, int numParticles);
 
-void LoadClusterParticles(ParticleCpu* const pParticles, float_3 center, float_3 velocity, float spread, int numParticles);
+//  Get the instruction set extensions available on the current hardware and operating system.
+
+CpuFeatures GetCpuFeatures();
+
+//  Get the best instruction set available for kernels specialized on CpuIsa.
+
+CpuIsa GetCpuIsa();
 
 //  Get the level of SSE support available on the current hardware. 
 
-inline CpuSSE GetSSEType();
+CpuSSE GetSSEType();
+
+//  Get the level of AVX support available on the current hardware and operating system.
+
+CpuAVX GetAVXType();
@@ -0,0 +1,210 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the 
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+
+#include <ppl.h>
+#include <assert.h>
+#include <string.h>
+#include <stdexcept>
+#include <algorithm>
+
+#include "Common.h"
+#include "NBodyDistributedCpu.h"
+
+using namespace concurrency;
+using namespace concurrency::graphics;
+
+//--------------------------------------------------------------------------------------
+//  The distributed integration engine.
+//--------------------------------------------------------------------------------------
+
+NBodyDistributed::NBodyDistributed(float softeningSquared, float dampingFactor, float deltaTime, float particleMass, int maxParticles, 
+    std::shared_ptr<ITransport> transport) :
+    INBodyCpu(),
+    m_engine(std::make_shared<NBodySoAInteractionEngine>(softeningSquared, particleMass)),
+    m_transport(transport),
+    m_deltaTime(deltaTime),
+    m_dampingFactor(dampingFactor),
+    m_local(maxParticles),
+    m_blocks(2)
+{
+    for (int i = 0; i < 2; ++i)
+        m_sources.push_back(std::make_shared<ParticlesSoA>(maxParticles));
+}
+
+//  Step s calculates the interactions with the block that started on rank - s while a task 
+//  sends that block to rank + 1 and receives and unpacks the block for step s + 1. The 
+//  received block is unpacked into the source buffer that is not being read.
+
+void NBodyDistributed::Integrate(ParticleCpu* const pParticlesIn, ParticleCpu* const pParticlesOut, int numParticles) const
+{
+    assert(numParticles <= m_local.capacity());
+
+    m_counters = NBodyCounters();
+    MetricsClock::time_point start = MetricsClock::now();
+    const Float3SoA pos = m_local.pos;
+    const Float3SoA acc = m_local.acc;
+    ForEachTargetBlock(numParticles, [=](int begin, int count)
+    {
+        GatherFloat3(&pParticlesIn[begin].pos, sizeof(ParticleCpu), count, pos.x + begin, pos.y + begin, pos.z + begin);
+        std::fill(acc.x + begin, acc.x + begin + count, 0.0f);
+        std::fill(acc.y + begin, acc.y + begin + count, 0.0f);
+        std::fill(acc.z + begin, acc.z + begin + count, 0.0f);
+    });
+    PackBlock(pParticlesIn, numParticles, m_blocks[0]);
+
+    const int numRanks = NumRanks();
+    const int nextRank = (Rank() + 1) % numRanks;
+    const int previousRank = (Rank() + numRanks - 1) % numRanks;
+    ConstFloat3SoA sourcePos(pos.x, pos.y, pos.z);
+    int numSources = numParticles;
+    int current = 0;
+
+    for (int s = 0; s < numRanks; ++s)
+    {
+        const bool exchanging = (s + 1) < numRanks;
+        const std::vector<char>& sendBlock = m_blocks[current];
+        std::vector<char>& receiveBlock = m_blocks[1 - current];
+        std::shared_ptr<ParticlesSoA>& receiveSource = m_sources[1 - current];
+        int numReceived = 0;
+        task_group exchange;
+        if (exchanging)
+        {
+            exchange.run([=, &sendBlock, &receiveBlock, &receiveSource, &numReceived]()
+            {
+                parallel_invoke(
+                    [=, &sendBlock]() { m_transport->Send(nextRank, sendBlock); },
+                    [=, &receiveBlock, &receiveSource, &numReceived]()
+                    {
+                        m_transport->Receive(previousRank, receiveBlock);
+                        numReceived = UnpackBlock(receiveBlock, receiveSource);
+                    });
+            });
+            m_counters.bytesMoved += sendBlock.size();
+            ++m_counters.tasks;
+        }
+
+        m_counters.tasks += BlockedInteractions(*m_engine, ConstFloat3SoA(pos.x, pos.y, pos.z), acc, numParticles, sourcePos, numSources);
+        m_counters.interactions += double(numParticles) * double(numSources);
+
+        const MetricsClock::time_point waitStart = MetricsClock::now();
+        exchange.wait();
+        m_counters.waitSeconds += MetricsSeconds(waitStart);
+
+        if (exchanging)
+        {
+            const Float3SoA received = receiveSource->pos;
+            sourcePos = ConstFloat3SoA(received.x, received.y, received.z);
+            numSources = numReceived;
+            current = 1 - current;
+        }
+    }
+    m_counters.forceSeconds = MetricsSeconds(start) - m_counters.waitSeconds;
+    start = MetricsClock::now();
+
+    // The local positions are reloaded at the start of every step so they are updated in place.
+    const ConstFloat3SoA constAcc(acc.x, acc.y, acc.z);
+    ForEachTargetBlock(numParticles, [=](int begin, int count)
+    {
+        UpdateSoABlock(pParticlesIn + begin, pParticlesOut + begin, pos.Offset(begin), constAcc.Offset(begin), count, 
+            m_deltaTime, m_dampingFactor);
+    });
+    m_counters.integrateSeconds = MetricsSeconds(start);
+}
+
+void NBodyDistributed::PackBlock(const ParticleCpu* const pParticles, int numParticles, std::vector<char>& block) const
+{
+    block.assign(sizeof(DistributedBlockHeader) + 3 * numParticles * sizeof(float), 0);
+    DistributedBlockHeader header = { numParticles, { 0, 0, 0 } };
+    memcpy(&block[0], &header, sizeof(header));
+
+    float* const pX = reinterpret_cast<float*>(&block[sizeof(header)]);
+    float* const pY = pX + numParticles;
+    float* const pZ = pY + numParticles;
+    GatherFloat3(&pParticles->pos, sizeof(ParticleCpu), numParticles, pX, pY, pZ);
+}
+
+//  The source buffer is replaced if the block is larger than its capacity. Returns the number 
+//  of particles in the block.
+
+int NBodyDistributed::UnpackBlock(const std::vector<char>& block, std::shared_ptr<ParticlesSoA>& source) const
+{
+    DistributedBlockHeader header;
+    if (block.size() < sizeof(header))
+        throw std::runtime_error("Received a truncated block of positions.");
+    memcpy(&header, &block[0], sizeof(header));
+    const int numParticles = header.numParticles;
+    if ((numParticles < 0) || (block.size() != sizeof(header) + 3 * static_cast<size_t>(numParticles) * sizeof(float)))
+        throw std::runtime_error("Received a malformed block of positions.");
+
+    if (numParticles > source->capacity())
+        source = std::make_shared<ParticlesSoA>(numParticles);
+    const float* const pX = reinterpret_cast<const float*>(&block[sizeof(header)]);
+    std::copy(pX, pX + numParticles, source->pos.x);
+    std::copy(pX + numParticles, pX + 2 * numParticles, source->pos.y);
+    std::copy(pX + 2 * numParticles, pX + 3 * numParticles, source->pos.z);
+    return numParticles;
+}
+
+//--------------------------------------------------------------------------------------
+//  All the ranks in one process.
+//--------------------------------------------------------------------------------------
+
+NBodyLocalRanks::NBodyLocalRanks(float softeningSquared, float dampingFactor, float deltaTime, float particleMass, int maxParticles, 
+    int numRanks) :
+    INBodyCpu(),
+    m_numRanks(numRanks),
+    m_group(std::make_shared<LocalTransportGroup>(numRanks))
+{
+    assert(numRanks > 0);
+    const int maxRankParticles = (maxParticles + numRanks - 1) / numRanks;
+    for (int r = 0; r < m_numRanks; ++r)
+    {
+        m_ranks.push_back(std::make_shared<NBodyDistributed>(softeningSquared, dampingFactor, deltaTime, particleMass, 
+            maxRankParticles, m_group->Endpoint(r)));
+    }
+}
+
+//  Each rank blocks while it waits for its neighbour's block so every rank must run as a 
+//  separate task, the receive is a cooperative wait so the scheduler can run the other ranks.
+
+void NBodyLocalRanks::Integrate(ParticleCpu* const pParticlesIn, ParticleCpu* const pParticlesOut, int numParticles) const
+{
+    task_group ranks;
+    for (int r = 0; r < m_numRanks; ++r)
+    {
+        const int rangeStart = DistributedRangeStart(r, m_numRanks, numParticles);
+        const int rangeSize = DistributedRangeStart(r + 1, m_numRanks, numParticles) - rangeStart;
+        const std::shared_ptr<NBodyDistributed> rank = m_ranks[r];
+        ranks.run([=]()
+        {
+            rank->Integrate(pParticlesIn + rangeStart, pParticlesOut + rangeStart, rangeSize);
+        });
+    }
+    ranks.wait();
+
+    m_counters = NBodyCounters();
+    std::for_each(m_ranks.begin(), m_ranks.end(), [this](const std::shared_ptr<NBodyDistributed>& rank)
+    {
+        const NBodyCounters& counters = rank->Counters();
+        m_counters.interactions += counters.interactions;
+        m_counters.forceSeconds = std::max(m_counters.forceSeconds, counters.forceSeconds);
+        m_counters.integrateSeconds = std::max(m_counters.integrateSeconds, counters.integrateSeconds);
+        m_counters.waitSeconds = std::max(m_counters.waitSeconds, counters.waitSeconds);
+        m_counters.tasks += counters.tasks;
+        m_counters.bytesMoved += counters.bytesMoved;
+    });
+}
@@ -0,0 +1,136 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the 
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <ppl.h>
+
+#include "Common.h"
+#include "INBodyCpu.h"
+#include "NBodyMetrics.h"
+#include "ParticleCpu.h"
+#include "NBodyCpu.h"
+#include "NBodySoACpu.h"
+#include "NBodyTransport.h"
+
+//--------------------------------------------------------------------------------------
+//  Distributed implementation of the n-body calculation.
+//--------------------------------------------------------------------------------------
+//
+//  The particles are divided between the ranks of an ITransport, each rank owns and updates
+//  the particles passed to its Integrate. The positions are circulated around a ring of ranks 
+//  (a systolic loop). Each step a rank holds one block of source positions, starting with its
+//  own, calculates the interactions of its particles with that block and at the same time 
+//  passes the block on to rank + 1 and receives the next one from rank - 1. After Size() - 1 
+//  exchanges every block has visited every rank.
+//
+//  Each rank keeps only two blocks of positions, so memory use does not grow with the total 
+//  number of particles, and the exchange overlaps with the calculation for all but the 
+//  smallest blocks. Every rank must call Integrate for each step, the ranks may own different
+//  numbers of particles.
+//
+//  A block is a DistributedBlockHeader followed by the x, y and z positions.
+//
+//  A rank's counters describe only its own particles, their interactions with every block, the
+//  bytes it sent and the time it waited for blocks. The force time excludes the wait.
+
+//  The particles are divided into contiguous ranges of equal size, except for the last. 
+//  Returns the start of the rank's range, the range ends at the start of rank + 1.
+
+inline int DistributedRangeStart(int rank, int numRanks, int numParticles)
+{
+    const int rangeSize = (numParticles + numRanks - 1) / numRanks;
+    return std::min(rank * rangeSize, numParticles);
+}
+
+struct DistributedBlockHeader
+{
+    int numParticles;
+    int reserved[3];                                            // Keeps the positions 16 byte aligned.
+};
+
+class NBodyDistributed : public INBodyCpu, public INBodyCounters
+{
+private:
+    std::shared_ptr<NBodySoAInteractionEngine> m_engine;
+    std::shared_ptr<ITransport> m_transport;
+    const float m_deltaTime;
+    const float m_dampingFactor;
+    mutable ParticlesSoA m_local;
+    mutable std::vector<std::shared_ptr<ParticlesSoA>> m_sources;   // The block being calculated and the block being received.
+    mutable std::vector<std::vector<char>> m_blocks;
+    mutable NBodyCounters m_counters;
+
+public:
+    NBodyDistributed(float softeningSquared, float dampingFactor, float deltaTime, float particleMass, int maxParticles, 
+        std::shared_ptr<ITransport> transport);
+
+    void Integrate(ParticleCpu* const pParticlesIn, ParticleCpu* const pParticlesOut, int numParticles) const;
+
+    inline int Rank() const { return m_transport->Rank(); }
+    inline int NumRanks() const { return m_transport->Size(); }
+
+    //  Bytes sent by this rank during the most recent step.
+    inline unsigned long long BytesSent() const { return m_counters.bytesMoved; }
+
+    //  Seconds this rank spent waiting for blocks after its calculation was complete, during
+    //  the most recent step.
+    inline double WaitSeconds() const { return m_counters.waitSeconds; }
+
+    inline const NBodyCounters& Counters() const { return m_counters; }
+
+private:
+    void PackBlock(const ParticleCpu* const pParticles, int numParticles, std::vector<char>& block) const;
+    int UnpackBlock(const std::vector<char>& block, std::shared_ptr<ParticlesSoA>& source) const;
+};
+
+//--------------------------------------------------------------------------------------
+//  Distributed implementation running all the ranks in one process.
+//--------------------------------------------------------------------------------------
+//
+//  Splits the particles into a contiguous range for each rank and runs the ranks as 
+//  concurrent tasks connected by a LocalTransportGroup. This runs the same code as ranks in 
+//  separate processes, so it can be compared with the other engines. The ranks run 
+//  concurrently so the phase times in the counters are those of the slowest rank.
+
+class NBodyLocalRanks : public INBodyCpu, public INBodyCounters
+{
+private:
+    const int m_numRanks;
+    std::shared_ptr<LocalTransportGroup> m_group;
+    std::vector<std::shared_ptr<NBodyDistributed>> m_ranks;
+    mutable NBodyCounters m_counters;
+
+public:
+    NBodyLocalRanks(float softeningSquared, float dampingFactor, float deltaTime, float particleMass, int maxParticles, 
+        int numRanks);
+
+    void Integrate(ParticleCpu* const pParticlesIn, ParticleCpu* const pParticlesOut, int numParticles) const;
+
+    inline int NumRanks() const { return m_numRanks; }
+
+    //  Total bytes sent by all the ranks during the most recent step.
+    inline unsigned long long BytesSent() const { return m_counters.bytesMoved; }
+
+    //  Longest time any rank spent waiting for blocks during the most recent step.
+    inline double WaitSeconds() const { return m_counters.waitSeconds; }
+
+    inline const NBodyCounters& Counters() const { return m_counters; }
+};
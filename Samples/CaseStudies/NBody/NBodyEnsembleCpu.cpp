@@ -0,0 +1,50 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the 
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+
+#include <ppl.h>
+#include <assert.h>
+#include <algorithm>
+
+#include "Common.h"
+#include "NBodyEnsembleCpu.h"
+
+using namespace concurrency;
+using namespace concurrency::graphics;
+
+//--------------------------------------------------------------------------------------
+//  The parallel integration engine to update all systems.
+//--------------------------------------------------------------------------------------
+//
+//  Work items are numbered system by system so each task's range of items covers as few
+//  systems as possible and the source particles it reads stay in cache. As with
+//  NBodySimpleMultiCore the systems are read from pParticlesIn and each element of 
+//  pParticlesOut is written by a single task.
+
+void NBodyEnsemble::Integrate(ParticleCpu* const pParticlesIn, ParticleCpu* const pParticlesOut, int numParticles) const
+{
+    assert((numParticles % m_numSystems) == 0);
+    const int systemSize = SystemSize(numParticles);
+    const int tilesPerSystem = (systemSize + kEnsembleTileSize - 1) / kEnsembleTileSize;
+
+    parallel_for(0, m_numSystems * tilesPerSystem, [=](int item)
+    {
+        const int offset = (item / tilesPerSystem) * systemSize;
+        const int begin = (item % tilesPerSystem) * kEnsembleTileSize;
+        const int end = std::min(begin + kEnsembleTileSize, systemSize);
+        m_engine->InvokeBlockedBodyBodyInteraction(pParticlesIn + offset, pParticlesOut + offset, begin, end, systemSize);
+    });
+}
@@ -0,0 +1,64 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the 
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+
+#pragma once
+
+#include <memory>
+
+#include "Common.h"
+#include "INBodyCpu.h"
+#include "ParticleCpu.h"
+#include "NBodyCpu.h"
+
+//--------------------------------------------------------------------------------------
+//  Ensemble implementation of the n-body calculation.
+//--------------------------------------------------------------------------------------
+//
+//  Integrates numSystems independent systems of equal size with a single call. The systems
+//  are stored one after another so system s occupies particles [s * n, (s + 1) * n) where 
+//  n = numParticles / numSystems, and particles only interact with particles in the same 
+//  system.
+//
+//  Running a few thousand particles through one of the other integrators does not give 
+//  each core enough work. Here every system is divided into tiles of kEnsembleTileSize 
+//  targets and all the (system, tile) work items are scheduled in a single parallel loop, 
+//  so the cores stay busy however small the systems are. Each tile is updated with the 
+//  register blocked loop of NBodySimpleInteractionEngine, so the SIMD lanes are filled with 
+//  targets from the same system.
+
+const int kEnsembleTileSize = 64;
+
+class NBodyEnsemble : public INBodyCpu
+{
+private:
+    std::shared_ptr<NBodySimpleInteractionEngine> m_engine;
+    const int m_numSystems;
+
+public:
+    NBodyEnsemble(float softeningSquared, float dampingFactor, float deltaTime, float particleMass, int numSystems) : 
+        INBodyCpu(),
+        m_engine(std::make_shared<NBodySimpleInteractionEngine>(softeningSquared, dampingFactor, deltaTime, particleMass)),
+        m_numSystems(numSystems)
+    {
+    }
+
+    //  numParticles must be a multiple of the number of systems.
+    void Integrate(ParticleCpu* const pParticlesIn, ParticleCpu* const pParticlesOut, int numParticles) const;
+
+    inline int NumSystems() const { return m_numSystems; }
+    inline int SystemSize(int numParticles) const { return numParticles / m_numSystems; }
+};
@@ -0,0 +1,546 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the 
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+#include <math.h>
+#include <ppl.h>
+#include <assert.h>
+#include <memory>
+#include <algorithm>
+#include <functional>
+
+#include "Common.h"
+#include "Morton.h"
+#include "NBodyFmmCpu.h"
+
+using namespace concurrency;
+using namespace concurrency::graphics;
+
+//--------------------------------------------------------------------------------------
+//  Cartesian Taylor expansions of 1/|r|.
+//--------------------------------------------------------------------------------------
+
+namespace
+{
+    double Binomial(int n, int k)
+    {
+        double result = 1.0;
+        for (int i = 1; i <= k; ++i)
+            result = result * (n - k + i) / i;
+        return result;
+    }
+
+    //  Binomial coefficient of two multi-indices, C(k, j) = C(kx, jx) * C(ky, jy) * C(kz, jz).
+
+    double Binomial(const int* const k, const int* const j)
+    {
+        return Binomial(k[0], j[0]) * Binomial(k[1], j[1]) * Binomial(k[2], j[2]);
+    }
+
+    inline void ToDouble(const float_3& v, double r[3])
+    {
+        r[0] = v.x;
+        r[1] = v.y;
+        r[2] = v.z;
+    }
+}
+
+CartesianExpansion::CartesianExpansion(int order) :
+    m_order(order),
+    m_indices((order + 1) * (order + 1) * (order + 1), -1)
+{
+    // Order 0 has no gradient, so at least order 1 is required.
+    assert((order >= 1) && (order <= kMaxOrder));
+
+    for (int degree = 0; degree <= order; ++degree)
+    {
+        for (int kx = degree; kx >= 0; --kx)
+        {
+            for (int ky = degree - kx; ky >= 0; --ky)
+            {
+                const int kz = degree - kx - ky;
+                m_indices[(kx * (m_order + 1) + ky) * (m_order + 1) + kz] = NumTerms();
+                m_k.push_back(kx);
+                m_k.push_back(ky);
+                m_k.push_back(kz);
+            }
+        }
+    }
+
+    const int numTerms = NumTerms();
+    m_lower.assign(3 * numTerms, -1);
+    m_lower2.assign(3 * numTerms, -1);
+    for (int a = 0; a < numTerms; ++a)
+    {
+        const int* const k = &m_k[3 * a];
+        if (k[0] >= 1) m_lower[3 * a] = IndexOf(k[0] - 1, k[1], k[2]);
+        if (k[1] >= 1) m_lower[3 * a + 1] = IndexOf(k[0], k[1] - 1, k[2]);
+        if (k[2] >= 1) m_lower[3 * a + 2] = IndexOf(k[0], k[1], k[2] - 1);
+        if (k[0] >= 2) m_lower2[3 * a] = IndexOf(k[0] - 2, k[1], k[2]);
+        if (k[1] >= 2) m_lower2[3 * a + 1] = IndexOf(k[0], k[1] - 2, k[2]);
+        if (k[2] >= 2) m_lower2[3 * a + 2] = IndexOf(k[0], k[1], k[2] - 2);
+
+        for (int b = 0; b < numTerms; ++b)
+        {
+            const int* const j = &m_k[3 * b];
+
+            //  M2M: M_k += C(k, j) d^(k - j) M'_j
+            //  L2L: L'_j += C(k, j) d^(k - j) L_k
+            if ((j[0] <= k[0]) && (j[1] <= k[1]) && (j[2] <= k[2]))
+            {
+                const int diff = IndexOf(k[0] - j[0], k[1] - j[1], k[2] - j[2]);
+                const Term m2m = { a, b, diff, Binomial(k, j) };
+                const Term l2l = { b, a, diff, Binomial(k, j) };
+                m_m2m.push_back(m2m);
+                m_l2l.push_back(l2l);
+            }
+
+            //  M2L: L_n += (-1)^|k| C(k + n, n) b_(k + n) M_k, where n = k and k = j here.
+            const int degree = k[0] + k[1] + k[2] + j[0] + j[1] + j[2];
+            if (degree <= order)
+            {
+                const int sum[3] = { k[0] + j[0], k[1] + j[1], k[2] + j[2] };
+                const double sign = ((j[0] + j[1] + j[2]) % 2 == 0) ? 1.0 : -1.0;
+                const Term m2l = { a, b, IndexOf(sum[0], sum[1], sum[2]), sign * Binomial(sum, k) };
+                m_m2l.push_back(m2l);
+            }
+        }
+
+        //  L2P: g_i += n_i L_n (x - z)^(n - e_i)
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            if (k[axis] == 0)
+                continue;
+            const Term l2p = { axis, a, m_lower[3 * a + axis], static_cast<double>(k[axis]) };
+            m_l2p.push_back(l2p);
+        }
+    }
+}
+
+void CartesianExpansion::Monomials(const double r[3], double* const pOut) const
+{
+    pOut[0] = 1.0;
+    for (int t = 1; t < NumTerms(); ++t)
+    {
+        const int* const lower = &m_lower[3 * t];
+        const int axis = (lower[0] >= 0) ? 0 : ((lower[1] >= 0) ? 1 : 2);
+        pOut[t] = pOut[lower[axis]] * r[axis];
+    }
+}
+
+void CartesianExpansion::Derivatives(const double r[3], double* const pOut) const
+{
+    const double distSqr = r[0] * r[0] + r[1] * r[1] + r[2] * r[2];
+    const double invDistSqr = 1.0 / distSqr;
+    pOut[0] = sqrt(invDistSqr);
+
+    for (int t = 1; t < NumTerms(); ++t)
+    {
+        const int* const k = &m_k[3 * t];
+        const int* const lower = &m_lower[3 * t];
+        const int* const lower2 = &m_lower2[3 * t];
+        const int degree = k[0] + k[1] + k[2];
+        double sum1 = 0.0;
+        double sum2 = 0.0;
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            if (lower[axis] >= 0)
+                sum1 += r[axis] * pOut[lower[axis]];
+            if (lower2[axis] >= 0)
+                sum2 += pOut[lower2[axis]];
+        }
+        pOut[t] = -((2 * degree - 1) * sum1 + (degree - 1) * sum2) * invDistSqr / degree;
+    }
+}
+
+void CartesianExpansion::ParticleToMultipole(const double r[3], double mass, double* const pMultipole) const
+{
+    double monomials[kMaxTerms];
+    Monomials(r, monomials);
+    for (int t = 0; t < NumTerms(); ++t)
+        pMultipole[t] += mass * monomials[t];
+}
+
+void CartesianExpansion::MultipoleToMultipole(const double d[3], const double* const pChild, double* const pParent) const
+{
+    double monomials[kMaxTerms];
+    Monomials(d, monomials);
+    for (auto t = m_m2m.cbegin(); t != m_m2m.cend(); ++t)
+        pParent[t->out] += t->factor * monomials[t->other] * pChild[t->in];
+}
+
+void CartesianExpansion::MultipoleToLocal(const double r[3], const double* const pMultipole, double* const pLocal) const
+{
+    double derivatives[kMaxTerms];
+    Derivatives(r, derivatives);
+    for (auto t = m_m2l.cbegin(); t != m_m2l.cend(); ++t)
+        pLocal[t->out] += t->factor * derivatives[t->other] * pMultipole[t->in];
+}
+
+void CartesianExpansion::LocalToLocal(const double d[3], const double* const pParent, double* const pChild) const
+{
+    double monomials[kMaxTerms];
+    Monomials(d, monomials);
+    for (auto t = m_l2l.cbegin(); t != m_l2l.cend(); ++t)
+        pChild[t->out] += t->factor * monomials[t->other] * pParent[t->in];
+}
+
+void CartesianExpansion::LocalToParticle(const double r[3], const double* const pLocal, double gradient[3]) const
+{
+    double monomials[kMaxTerms];
+    Monomials(r, monomials);
+    for (auto t = m_l2p.cbegin(); t != m_l2p.cend(); ++t)
+        gradient[t->out] += t->factor * monomials[t->other] * pLocal[t->in];
+}
+
+//--------------------------------------------------------------------------------------
+//  Fast multipole method implementation of the n-body calculation.
+//--------------------------------------------------------------------------------------
+
+void NBodyFmm::Integrate(ParticleCpu* const pParticlesIn, ParticleCpu* const pParticlesOut, int numParticles) const
+{
+    m_counters = NBodyCounters();
+    if (numParticles == 0)
+        return;
+
+    MetricsClock::time_point start = MetricsClock::now();
+    Accelerations(pParticlesIn, numParticles);
+    m_counters.forceSeconds = MetricsSeconds(start);
+    m_counters.interactions = CountInteractions();
+    start = MetricsClock::now();
+
+    const Float3SoA acc = m_particles->acc;
+    parallel_for(0, numParticles, [=](int s)
+    {
+        const int i = m_keys[s].second;
+
+        float_3 vel = pParticlesIn[i].vel;
+        vel += float_3(acc.x[s], acc.y[s], acc.z[s]) * m_deltaTime;
+        vel *= m_dampingFactor;
+
+        pParticlesOut[i].pos = pParticlesIn[i].pos + vel * m_deltaTime;
+        pParticlesOut[i].vel = vel;
+    });
+    m_counters.integrateSeconds = MetricsSeconds(start);
+}
+
+void NBodyFmm::CalculateAccelerations(const ParticleCpu* const pParticles, int numParticles, double_3* const pAcc) const
+{
+    if (numParticles == 0)
+        return;
+
+    Accelerations(pParticles, numParticles);
+
+    const Float3SoA acc = m_particles->acc;
+    parallel_for(0, numParticles, [=](int s)
+    {
+        pAcc[m_keys[s].second] = double_3(acc.x[s], acc.y[s], acc.z[s]);
+    });
+}
+
+void NBodyFmm::Accelerations(const ParticleCpu* const pParticles, int numParticles) const
+{
+    // Sort the particles into Morton order.
+
+    const MortonBounds bounds = GetMortonBounds(pParticles, numParticles);
+    m_keys.resize(numParticles);
+    parallel_for(0, numParticles, [=](int i)
+    {
+        m_keys[i] = KeyIndex(MortonKey(pParticles[i].pos, bounds), i);
+    });
+    parallel_radixsort(m_keys.begin(), m_keys.end(), [](const KeyIndex& k) { return k.first; });
+
+    if (!m_particles || (m_particles->capacity() < numParticles))
+        m_particles.reset(new ParticlesSoA(numParticles));
+    const Float3SoA pos = m_particles->pos;
+    const Float3SoA acc = m_particles->acc;
+    parallel_for(0, numParticles, [=](int s)
+    {
+        const float_3 p = pParticles[m_keys[s].second].pos;
+        pos.x[s] = p.x;
+        pos.y[s] = p.y;
+        pos.z[s] = p.z;
+        acc.x[s] = acc.y[s] = acc.z[s] = 0.0f;
+    });
+
+    // Build the tree and interaction lists and then evaluate them.
+
+    m_nodes.clear();
+    m_nodes.grow_by(1);
+    BuildTree(0, 0, numParticles, 0);
+
+    const int numNodes = static_cast<int>(m_nodes.size());
+    m_multipoles.assign(numNodes * m_expansion.NumTerms(), 0.0);
+    m_locals.assign(numNodes * m_expansion.NumTerms(), 0.0);
+    m_farLists.resize(numNodes);
+    m_nearLists.resize(numNodes);
+    parallel_for(0, numNodes, [=](int n)
+    {
+        m_farLists[n].clear();
+        m_nearLists[n].clear();
+    });
+
+    UpwardPass(0);
+    Interact(0, 0);
+    DownwardPass(0, -1);
+}
+
+//  Split a node's particles into octants and recursively build a child node for each 
+//  non-empty octant. Bounding boxes, and the expansion centers, are calculated as the 
+//  recursion unwinds.
+
+void NBodyFmm::BuildTree(int nodeIndex, int begin, int end, int level) const
+{
+    FmmNode& node = m_nodes[nodeIndex];
+    node.begin = begin;
+    node.end = end;
+    node.firstChild = -1;
+    node.numChildren = 0;
+
+    const Float3SoA pos = m_particles->pos;
+
+    if (((end - begin) <= m_leafSize) || (level == kMortonBitsPerAxis))
+    {
+        node.minPos = node.maxPos = float_3(pos.x[begin], pos.y[begin], pos.z[begin]);
+        for (int j = begin + 1; j < end; ++j)
+        {
+            node.minPos = float_3(std::min(node.minPos.x, pos.x[j]), std::min(node.minPos.y, pos.y[j]), std::min(node.minPos.z, pos.z[j]));
+            node.maxPos = float_3(std::max(node.maxPos.x, pos.x[j]), std::max(node.maxPos.y, pos.y[j]), std::max(node.maxPos.z, pos.z[j]));
+        }
+        node.center = (node.minPos + node.maxPos) * 0.5f;
+
+        float radiusSqr = 0.0f;
+        for (int j = begin; j < end; ++j)
+            radiusSqr = std::max(radiusSqr, SqrLength(float_3(pos.x[j], pos.y[j], pos.z[j]) - node.center));
+        node.radius = sqrt(radiusSqr);
+        return;
+    }
+
+    int childBegin[8];
+    int childEnd[8];
+    int numChildren = 0;
+    int octantBegin = begin;
+    for (int octant = 0; octant < 8; ++octant)
+    {
+        const int octantEnd = static_cast<int>(std::partition_point(m_keys.begin() + octantBegin, m_keys.begin() + end, 
+            [=](const KeyIndex& k) { return MortonOctant(k.first, level) <= octant; }) - m_keys.begin());
+        if (octantEnd > octantBegin)
+        {
+            childBegin[numChildren] = octantBegin;
+            childEnd[numChildren] = octantEnd;
+            ++numChildren;
+        }
+        octantBegin = octantEnd;
+    }
+
+    const concurrent_vector<FmmNode>::iterator children = m_nodes.grow_by(numChildren);
+    const int firstChild = static_cast<int>(children - m_nodes.begin());
+    node.firstChild = firstChild;
+    node.numChildren = numChildren;
+
+    if ((end - begin) > m_parallelSize)
+    {
+        parallel_for(0, numChildren, [=](int c)
+        {
+            BuildTree(firstChild + c, childBegin[c], childEnd[c], level + 1);
+        });
+    }
+    else
+    {
+        for (int c = 0; c < numChildren; ++c)
+            BuildTree(firstChild + c, childBegin[c], childEnd[c], level + 1);
+    }
+
+    node.minPos = m_nodes[firstChild].minPos;
+    node.maxPos = m_nodes[firstChild].maxPos;
+    for (int c = firstChild + 1; c < firstChild + numChildren; ++c)
+    {
+        const FmmNode& child = m_nodes[c];
+        node.minPos = float_3(std::min(node.minPos.x, child.minPos.x), std::min(node.minPos.y, child.minPos.y), std::min(node.minPos.z, child.minPos.z));
+        node.maxPos = float_3(std::max(node.maxPos.x, child.maxPos.x), std::max(node.maxPos.y, child.maxPos.y), std::max(node.maxPos.z, child.maxPos.z));
+    }
+    node.center = (node.minPos + node.maxPos) * 0.5f;
+
+    node.radius = 0.0f;
+    for (int c = firstChild; c < firstChild + numChildren; ++c)
+    {
+        const FmmNode& child = m_nodes[c];
+        node.radius = std::max(node.radius, sqrt(SqrLength(child.center - node.center)) + child.radius);
+    }
+}
+
+//  Calculate multipole expansions of leaves from their particles (P2M) and of other nodes 
+//  by translating their children's expansions (M2M).
+
+void NBodyFmm::UpwardPass(int nodeIndex) const
+{
+    const FmmNode& node = m_nodes[nodeIndex];
+    double* const pMultipole = Multipole(nodeIndex);
+
+    if (IsLeaf(node))
+    {
+        const Float3SoA pos = m_particles->pos;
+        for (int j = node.begin; j < node.end; ++j)
+        {
+            double r[3];
+            ToDouble(float_3(pos.x[j], pos.y[j], pos.z[j]) - node.center, r);
+            m_expansion.ParticleToMultipole(r, m_particleMass, pMultipole);
+        }
+        return;
+    }
+
+    if ((node.end - node.begin) > m_parallelSize)
+        parallel_for(node.firstChild, node.firstChild + node.numChildren, [=](int c) { UpwardPass(c); });
+    else
+        for (int c = node.firstChild; c < node.firstChild + node.numChildren; ++c)
+            UpwardPass(c);
+
+    for (int c = node.firstChild; c < node.firstChild + node.numChildren; ++c)
+    {
+        double d[3];
+        ToDouble(m_nodes[c].center - node.center, d);
+        m_expansion.MultipoleToMultipole(d, Multipole(c), pMultipole);
+    }
+}
+
+//  Dual tree traversal. Well separated pairs are added to the target's far list and pairs 
+//  of leaves to its near list. Otherwise the larger node is split. Only the lists of 
+//  nodes in the target's subtree are updated so splitting the target can be done in parallel.
+
+void NBodyFmm::Interact(int target, int source) const
+{
+    const FmmNode& a = m_nodes[target];
+    const FmmNode& b = m_nodes[source];
+    const bool parallel = ((a.end - a.begin) > m_parallelSize);
+
+    if (target == source)
+    {
+        if (IsLeaf(a))
+        {
+            m_nearLists[target].push_back(source);
+            return;
+        }
+
+        auto interactChildren = [=](int c)
+        {
+            for (int s = a.firstChild; s < a.firstChild + a.numChildren; ++s)
+                Interact(c, s);
+        };
+        if (parallel)
+            parallel_for(a.firstChild, a.firstChild + a.numChildren, interactChildren);
+        else
+            for (int c = a.firstChild; c < a.firstChild + a.numChildren; ++c)
+                interactChildren(c);
+        return;
+    }
+
+    const float radii = a.radius + b.radius;
+    if ((radii * radii) < (m_thetaSquared * SqrLength(a.center - b.center)))
+    {
+        m_farLists[target].push_back(source);
+        return;
+    }
+
+    if (IsLeaf(a) && IsLeaf(b))
+    {
+        m_nearLists[target].push_back(source);
+        return;
+    }
+
+    if (!IsLeaf(a) && (IsLeaf(b) || (a.radius >= b.radius)))
+    {
+        if (parallel)
+            parallel_for(a.firstChild, a.firstChild + a.numChildren, [=](int c) { Interact(c, source); });
+        else
+            for (int c = a.firstChild; c < a.firstChild + a.numChildren; ++c)
+                Interact(c, source);
+    }
+    else
+    {
+        for (int s = b.firstChild; s < b.firstChild + b.numChildren; ++s)
+            Interact(target, s);
+    }
+}
+
+//  Accumulate each node's local expansion from its parent (L2L) and far list (M2L). Leaves
+//  then evaluate the local expansion at each particle (L2P) and sum their near list (P2P).
+
+void NBodyFmm::DownwardPass(int nodeIndex, int parentIndex) const
+{
+    const FmmNode& node = m_nodes[nodeIndex];
+    double* const pLocal = Local(nodeIndex);
+
+    if (parentIndex >= 0)
+    {
+        double d[3];
+        ToDouble(node.center - m_nodes[parentIndex].center, d);
+        m_expansion.LocalToLocal(d, Local(parentIndex), pLocal);
+    }
+
+    const std::vector<int>& farList = m_farLists[nodeIndex];
+    for (auto s = farList.cbegin(); s != farList.cend(); ++s)
+    {
+        double r[3];
+        ToDouble(node.center - m_nodes[*s].center, r);
+        m_expansion.MultipoleToLocal(r, Multipole(*s), pLocal);
+    }
+
+    if (!IsLeaf(node))
+    {
+        if ((node.end - node.begin) > m_parallelSize)
+            parallel_for(node.firstChild, node.firstChild + node.numChildren, [=](int c) { DownwardPass(c, nodeIndex); });
+        else
+            for (int c = node.firstChild; c < node.firstChild + node.numChildren; ++c)
+                DownwardPass(c, nodeIndex);
+        return;
+    }
+
+    const Float3SoA pos = m_particles->pos;
+    const Float3SoA acc = m_particles->acc;
+    for (int j = node.begin; j < node.end; ++j)
+    {
+        double r[3];
+        double gradient[3] = { 0.0, 0.0, 0.0 };
+        ToDouble(float_3(pos.x[j], pos.y[j], pos.z[j]) - node.center, r);
+        m_expansion.LocalToParticle(r, pLocal, gradient);
+        acc.x[j] += static_cast<float>(gradient[0]);
+        acc.y[j] += static_cast<float>(gradient[1]);
+        acc.z[j] += static_cast<float>(gradient[2]);
+    }
+
+    const ConstFloat3SoA sourcePos(pos.x, pos.y, pos.z);
+    const std::vector<int>& nearList = m_nearLists[nodeIndex];
+    for (auto s = nearList.cbegin(); s != nearList.cend(); ++s)
+    {
+        const FmmNode& source = m_nodes[*s];
+        m_engine->InvokeBodyBodyInteraction(sourcePos.Offset(node.begin), acc.Offset(node.begin), node.end - node.begin,
+            sourcePos.Offset(source.begin), source.end - source.begin);
+    }
+}
+
+double NBodyFmm::CountInteractions() const
+{
+    combinable<double> interactions;
+    parallel_for(0, static_cast<int>(m_nodes.size()), [=, &interactions](int n)
+    {
+        const FmmNode& node = m_nodes[n];
+        int numSources = 0;
+        const std::vector<int>& nearList = m_nearLists[n];
+        for (auto s = nearList.cbegin(); s != nearList.cend(); ++s)
+            numSources += m_nodes[*s].end - m_nodes[*s].begin;
+        interactions.local() += m_farLists[n].size() + double(node.end - node.begin) * numSources;
+    });
+    return interactions.combine(std::plus<double>());
+}
@@ -0,0 +1,198 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the 
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+#pragma once
+
+#include <vector>
+#include <utility>
+#include <memory>
+#include <concurrent_vector.h>
+
+#include "Common.h"
+#include "INBodyCpu.h"
+#include "NBodyMetrics.h"
+#include "ParticleCpu.h"
+#include "NBodySoACpu.h"
+
+//--------------------------------------------------------------------------------------
+//  Cartesian Taylor expansions of 1/|r|.
+//--------------------------------------------------------------------------------------
+//
+//  Expansions of order p have one coefficient for each multi-index k = (kx, ky, kz) with
+//  |k| = kx + ky + kz <= p. The coefficients are ordered by increasing |k|. With
+//  r^k = rx^kx * ry^ky * rz^kz:
+//
+//  Multipole about c:  M_k = sum m_j (y_j - c)^k
+//  Local about z:      phi(x) = sum L_n (x - z)^n
+//
+//  The derivatives of 1/|r| are calculated as Taylor coefficients, b_k = D^k(1/|r|) / k!,
+//  using the recurrence:
+//
+//  |k| |r|^2 b_k + (2|k| - 1) sum_i r_i b_(k-e_i) + (|k| - 1) sum_i b_(k-2e_i) = 0
+//
+//  The translation operators are sums of products of coefficients. Each is stored as a 
+//  list of terms so that it can be applied with a single loop.
+
+class CartesianExpansion
+{
+public:
+    struct Term
+    {
+        int out;                        // Coefficient that is updated.
+        int in;                         // Coefficient of the input expansion.
+        int other;                      // Monomial or derivative coefficient.
+        double factor;
+    };
+
+private:
+    int m_order;
+    std::vector<int> m_indices;         // Coefficient index of (kx, ky, kz).
+    std::vector<int> m_k;               // kx, ky, kz of each coefficient.
+    std::vector<int> m_lower;           // Index of k - e_i for each axis, or -1.
+    std::vector<int> m_lower2;          // Index of k - 2e_i for each axis, or -1.
+    std::vector<Term> m_m2m;
+    std::vector<Term> m_m2l;
+    std::vector<Term> m_l2l;
+    std::vector<Term> m_l2p;            // The out member is the axis of the gradient.
+
+public:
+    static const int kMaxOrder = 10;
+    static const int kMaxTerms = (kMaxOrder + 1) * (kMaxOrder + 2) * (kMaxOrder + 3) / 6;
+
+    explicit CartesianExpansion(int order);
+
+    inline int Order() const { return m_order; }
+    inline int NumTerms() const { return static_cast<int>(m_k.size() / 3); }
+    inline int IndexOf(int kx, int ky, int kz) const { return m_indices[(kx * (m_order + 1) + ky) * (m_order + 1) + kz]; }
+
+    //  Calculate r^k for all coefficients.
+    void Monomials(const double r[3], double* const pOut) const;
+    //  Calculate b_k(r) for all coefficients.
+    void Derivatives(const double r[3], double* const pOut) const;
+
+    void ParticleToMultipole(const double r[3], double mass, double* const pMultipole) const;
+    void MultipoleToMultipole(const double d[3], const double* const pChild, double* const pParent) const;
+    void MultipoleToLocal(const double r[3], const double* const pMultipole, double* const pLocal) const;
+    void LocalToLocal(const double d[3], const double* const pParent, double* const pChild) const;
+    void LocalToParticle(const double r[3], const double* const pLocal, double gradient[3]) const;
+};
+
+//--------------------------------------------------------------------------------------
+//  Data structures for the FMM octree.
+//--------------------------------------------------------------------------------------
+
+//  Each node covers a contiguous range of the Morton sorted particles. Expansions are 
+//  centered on the center of the node's bounding box and radius bounds the distance
+//  of any particle from the center.
+
+struct FmmNode
+{
+    float_3 center;
+    float radius;
+    float_3 minPos;
+    float_3 maxPos;
+    int begin;
+    int end;
+    int firstChild;
+    int numChildren;
+};
+
+//--------------------------------------------------------------------------------------
+//  Fast multipole method implementation of the n-body calculation.
+//--------------------------------------------------------------------------------------
+//
+//  The cost of each step is O(N). Far field interactions between well separated nodes A and B, 
+//  where (radius A + radius B) < theta * |center A - center B|, are calculated by converting
+//  the multipole expansion of B into a local expansion about A. Near field interactions 
+//  between leaves are summed directly using the SIMD kernels of NBodySoAInteractionEngine.
+//  The accuracy is controlled by the expansion order and theta.
+//
+//  Each step:
+//
+//  1. Sorts the particles by Morton key and builds an adaptive octree in parallel.
+//  2. Upward pass, calculates multipole expansions of leaves (P2M) and translates them
+//     to their parents (M2M).
+//  3. Dual tree traversal, builds the far field (M2L) and near field (P2P) interaction lists
+//     of each node. Only the target node is split in parallel so each task updates the 
+//     lists of a separate subtree.
+//  4. Downward pass, each node applies its M2L list and translates its local expansion
+//     to its children (L2L). Leaves evaluate their local expansions (L2P) and P2P lists.
+//
+//  The counters' interactions are the M2L translations plus the particle pairs summed by the 
+//  P2P lists. All four stages are included in the force time.
+
+class NBodyFmm : public INBodyCpu, public INBodyCounters
+{
+private:
+    typedef std::pair<size_t, int> KeyIndex;                    // Morton key and original particle index.
+
+    std::shared_ptr<NBodySoAInteractionEngine> m_engine;
+    const CartesianExpansion m_expansion;
+    const float m_dampingFactor;
+    const float m_deltaTime;
+    const float m_particleMass;
+    const float m_thetaSquared;
+    const int m_leafSize;                                       // Maximum number of particles in a leaf.
+
+    mutable std::vector<KeyIndex> m_keys;
+    mutable std::unique_ptr<ParticlesSoA> m_particles;          // Positions and accelerations in Morton order.
+    mutable concurrency::concurrent_vector<FmmNode> m_nodes;
+    mutable std::vector<double> m_multipoles;
+    mutable std::vector<double> m_locals;
+    mutable std::vector<std::vector<int>> m_farLists;
+    mutable std::vector<std::vector<int>> m_nearLists;
+    mutable NBodyCounters m_counters;
+
+    static const int m_parallelSize = 4096;                     // Process children in parallel above this size.
+
+public:
+    NBodyFmm(float softeningSquared, float dampingFactor, float deltaTime, float particleMass, 
+        int order = 4, float theta = 0.5f, int leafSize = 128) :
+        INBodyCpu(),
+        m_engine(std::make_shared<NBodySoAInteractionEngine>(softeningSquared, particleMass)),
+        m_expansion(order),
+        m_dampingFactor(dampingFactor),
+        m_deltaTime(deltaTime),
+        m_particleMass(particleMass),
+        m_thetaSquared(theta * theta),
+        m_leafSize(leafSize)
+    {
+    }
+
+    void Integrate(ParticleCpu* const pParticlesIn, ParticleCpu* const pParticlesOut, int numParticles) const;
+
+    inline int Order() const { return m_expansion.Order(); }
+
+    inline const NBodyCounters& Counters() const { return m_counters; }
+
+    //  The accelerations of pParticles, in their original order, for comparison with direct 
+    //  summation. The particles are not updated.
+    void CalculateAccelerations(const ParticleCpu* const pParticles, int numParticles, double_3* const pAcc) const;
+
+private:
+    //  Calculates the accelerations in m_particles, in the Morton order given by m_keys.
+    void Accelerations(const ParticleCpu* const pParticles, int numParticles) const;
+    void BuildTree(int nodeIndex, int begin, int end, int level) const;
+    void UpwardPass(int nodeIndex) const;
+    void Interact(int target, int source) const;
+    void DownwardPass(int nodeIndex, int parentIndex) const;
+    //  The number of interactions in the current far and near field lists.
+    double CountInteractions() const;
+
+    inline bool IsLeaf(const FmmNode& node) const { return node.numChildren == 0; }
+    inline double* Multipole(int nodeIndex) const { return &m_multipoles[nodeIndex * m_expansion.NumTerms()]; }
+    inline double* Local(int nodeIndex) const { return &m_locals[nodeIndex * m_expansion.NumTerms()]; }
+};
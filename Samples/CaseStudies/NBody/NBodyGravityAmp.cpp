@@ -33,6 +33,7 @@
 #include "NBodyAmpSimple.h"
 #include "NBodyAmpTiled.h"
 #include "NBodyAmpMultiTiled.h"
+#include "RenderCommon.h"
 #include "resource.h"
 
 enum ComputeType
@@ -355,16 +356,16 @@ void LoadParticles()
 
     ParticlesCpu particles(g_maxParticles);
 
+    // Each block of g_particleNumStepSize particles has its own pair of streams so the particles
+    // are the same every time the sample is run.
+
     for (int i = 0; i < g_maxParticles; i += g_particleNumStepSize)
     {
+        const unsigned int stream = 2 * (i / g_particleNumStepSize);
         LoadClusterParticles(particles, i, (g_particleNumStepSize / 2),
-            float_3(centerSpread, 0.0f, 0.0f), 
-            float_3( 0, 0, -20),
-            g_Spread);
+            ClusterDesc(kDistributionCluster, float_3(centerSpread, 0.0f, 0.0f), float_3( 0, 0, -20), g_Spread, kDefaultSeed, stream));
         LoadClusterParticles(particles, (i + g_particleNumStepSize / 2), ((g_particleNumStepSize + 1) / 2),
-            float_3(-centerSpread, 0.0f, 0.0f), 
-            float_3( 0, 0, 20),
-            g_Spread);
+            ClusterDesc(kDistributionCluster, float_3(-centerSpread, 0.0f, 0.0f), float_3( 0, 0, 20), g_Spread, kDefaultSeed, stream + 1));
     }       
 
     // Copy particles to GPU memory.
@@ -410,19 +411,19 @@ std::shared_ptr<INBodyAmp> NBodyFactory(ComputeType type)
         break;
     case kMultiTile64:
         return std::make_shared<NBodyAmpMultiTiled<64>>(g_softeningSquared, g_dampingFactor, 
-            g_deltaTime, g_particleMass, g_maxParticles);
+            g_deltaTime, g_particleMass);
         break;
     case kMultiTile128:
         return std::make_shared<NBodyAmpMultiTiled<128>>(g_softeningSquared, g_dampingFactor, 
-            g_deltaTime, g_particleMass, g_maxParticles);
+            g_deltaTime, g_particleMass);
         break;
     case kMultiTile256:
         return std::make_shared<NBodyAmpMultiTiled<256>>(g_softeningSquared, g_dampingFactor, 
-            g_deltaTime, g_particleMass, g_maxParticles);
+            g_deltaTime, g_particleMass);
         break;
     case kMultiTile512:
         return std::make_shared<NBodyAmpMultiTiled<512>>(g_softeningSquared, g_dampingFactor, 
-            g_deltaTime, g_particleMass, g_maxParticles);
+            g_deltaTime, g_particleMass);
         break;
     default:
         assert(false);
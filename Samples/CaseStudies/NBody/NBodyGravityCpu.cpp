@@ -28,8 +28,17 @@
 #include "DXUTsettingsdlg.h"
 
 #include "Common.h"
+#include "RenderCommon.h"
 #include "NbodyCpu.h"
 #include "NbodyAdvancedCpu.h"
+#include "NBodySoACpu.h"
+#include "NBodyBarnesHutCpu.h"
+#include "NBodyFmmCpu.h"
+#include "NBodyBlockStepCpu.h"
+#include "NBodyCellListCpu.h"
+#include "NBodyNumaCpu.h"
+#include "NBodyPartitionedCpu.h"
+#include "NBodyMetrics.h"
 #include "resource.h"
 
 //--------------------------------------------------------------------------------------
@@ -45,6 +54,8 @@ const int g_maxParticles =          (15*1024);                  // Maximum numbe
 const int g_particleNumStepSize =   256;                        // Number of particles added for each slider tick
 
 const float g_Spread =              400.0f;                     // Separation between the two clusters.
+const float g_cutoffRadius =        20.0f;                      // Interaction radius of the cell list integrator.
+const float g_cutoffSkin =          5.0f;
 
 //--------------------------------------------------------------------------------------
 // Global variables
@@ -87,6 +98,21 @@ int                                 g_numParticles = 1024;                  // T
 ComputeType                         g_eComputeType = kCpuAdvanced;          // Default integrator compute type
 std::shared_ptr<INBodyCpu>          g_pNBody;                               // The current integrator
 
+// The FPS includes the time spent rendering. The integration is measured separately and the 
+// HUD shows the metrics for the last 10 steps.
+
+class HudMetricsSink : public INBodyMetricsSink
+{
+public:
+    NBodyMetrics last;
+
+    void Write(const NBodyMetrics& metrics) { last = metrics; }
+};
+
+std::shared_ptr<HudMetricsSink>     g_pHudMetrics = std::make_shared<HudMetricsSink>();
+NBodyMetricsRecorder                g_metricsRecorder(g_pHudMetrics, 10);
+unsigned long long                  g_stepNumber = 0;
+
 // This example uses fixed size arrays, rather that dynamic vectors, because during initialization
 // they are coupled to the DirectX rendering engine. Dynamically resizing them would mean re-initializing 
 // the DirectX buffers.
@@ -230,15 +256,31 @@ void InitApp()
         pComboBox->AddItem( L"CPU Single Core", nullptr );
         pComboBox->AddItem( L"CPU Multi Core", nullptr );
         pComboBox->AddItem( L"CPU Advanced", nullptr );
+        pComboBox->AddItem( L"CPU SIMD SoA", nullptr );
+        pComboBox->AddItem( L"CPU Barnes-Hut", nullptr );
+        pComboBox->AddItem( L"CPU FMM", nullptr );
+        pComboBox->AddItem( L"CPU Block Timestep", nullptr );
+        pComboBox->AddItem( L"CPU Cell List (cutoff)", nullptr );
+        pComboBox->AddItem( L"CPU Register Blocked", nullptr );
+        pComboBox->AddItem( L"CPU NUMA", nullptr );
+        pComboBox->AddItem( L"CPU Partitioned", nullptr );
     }
 
     g_HUD.GetSlider( IDC_NBODIES_SLIDER )->SetValue( (g_numParticles / g_particleNumStepSize) );
     g_HUD.GetComboBox( IDC_COMPUTETYPECOMBO )->SetSelectedByData( ( void* )g_eComputeType );
     pComboBox->SetSelectedByIndex(g_eComputeType);
-    g_particleColors.resize(3);
+    g_particleColors.resize(11);
     g_particleColors[kCpuSingle] =     D3DXCOLOR( 1.0f, 0.05f, 0.05f, 1.0f );
     g_particleColors[kCpuMulti] =      D3DXCOLOR( 0.8f, 0.0f, 0.0f, 1.0f );
     g_particleColors[kCpuAdvanced] =      D3DXCOLOR( 0.8f, 0.0f, 0.0f, 1.0f );
+    g_particleColors[kCpuSoA] =        D3DXCOLOR( 0.6f, 0.0f, 0.0f, 1.0f );
+    g_particleColors[kCpuBarnesHut] =  D3DXCOLOR( 0.2f, 0.6f, 1.0f, 1.0f );
+    g_particleColors[kCpuFmm] =        D3DXCOLOR( 0.2f, 1.0f, 0.4f, 1.0f );
+    g_particleColors[kCpuBlockStep] =  D3DXCOLOR( 1.0f, 0.8f, 0.2f, 1.0f );
+    g_particleColors[kCpuCellList] =   D3DXCOLOR( 0.8f, 0.4f, 1.0f, 1.0f );
+    g_particleColors[kCpuBlocked] =    D3DXCOLOR( 1.0f, 0.3f, 0.3f, 1.0f );
+    g_particleColors[kCpuNuma] =       D3DXCOLOR( 0.4f, 0.8f, 0.8f, 1.0f );
+    g_particleColors[kCpuPartitioned] = D3DXCOLOR( 0.8f, 0.8f, 0.4f, 1.0f );
     g_particleColor = g_particleColors[g_eComputeType];
 
     g_sampleUI.SetCallback( OnGUIEvent );
@@ -277,20 +319,22 @@ HRESULT CreateParticleBuffer( ID3D11Device* pd3dDevice )
 //  Load particles. Two clusters set to collide.
 //--------------------------------------------------------------------------------------
 
+//  Each block of g_particleNumStepSize particles has its own pair of streams so the particles
+//  are the same every time the sample is run.
+
 void LoadParticles()
 {
     const float centerSpread = g_Spread * 0.50f;
     for(size_t i = 0; i < g_maxParticles; i += g_particleNumStepSize)
     {
+        const unsigned int stream = static_cast<unsigned int>(2 * (i / g_particleNumStepSize));
         LoadClusterParticles(&g_pParticlesOld[i],
-            float_3(centerSpread, 0.0f, 0.0f), 
-            float_3( 0, 0, -20),
-            g_Spread, 
+            ClusterDesc(kDistributionCluster, float_3(centerSpread, 0.0f, 0.0f), float_3( 0, 0, -20), g_Spread, kDefaultSeed, stream),
+            0, 
             g_particleNumStepSize / 2);
         LoadClusterParticles( &g_pParticlesOld[i + g_particleNumStepSize / 2],
-            float_3(-centerSpread, 0.0f, 0.0f), 
-            float_3( 0, 0, 20),
-            g_Spread, 
+            ClusterDesc(kDistributionCluster, float_3(-centerSpread, 0.0f, 0.0f), float_3( 0, 0, 20), g_Spread, kDefaultSeed, stream + 1),
+            0, 
             (g_particleNumStepSize + 1) / 2);
     }
 }
@@ -315,9 +359,41 @@ std::shared_ptr<INBodyCpu> NBodyFactory(ComputeType type)
         {
             int tileSize = GetLevelOneCacheSize() / sizeof(ParticleCpu);
             return std::make_shared<NBodyAdvanced>(g_softeningSquared, g_dampingFactor, 
-                g_deltaTime, g_particleMass, tileSize);
+                g_deltaTime, g_particleMass, tileSize, GetLevelTwoCellSize());
         }
         break;
+    case kCpuSoA:
+        return std::make_shared<NBodySoA>(g_softeningSquared, g_dampingFactor, 
+            g_deltaTime, g_particleMass, g_maxParticles);
+        break;
+    case kCpuBarnesHut:
+        return std::make_shared<NBodyBarnesHut>(g_softeningSquared, g_dampingFactor, 
+            g_deltaTime, g_particleMass);
+        break;
+    case kCpuFmm:
+        return std::make_shared<NBodyFmm>(g_softeningSquared, g_dampingFactor, 
+            g_deltaTime, g_particleMass);
+        break;
+    case kCpuBlockStep:
+        return std::make_shared<NBodyBlockStep>(g_softeningSquared, g_deltaTime, 
+            g_particleMass, g_maxParticles);
+        break;
+    case kCpuCellList:
+        return std::make_shared<NBodyCellList>(g_softeningSquared, g_dampingFactor, 
+            g_deltaTime, g_particleMass, g_maxParticles, g_cutoffRadius, g_cutoffSkin);
+        break;
+    case kCpuBlocked:
+        return std::make_shared<NBodyBlockedMultiCore>(g_softeningSquared, g_dampingFactor, 
+            g_deltaTime, g_particleMass);
+        break;
+    case kCpuNuma:
+        return std::make_shared<NBodyNuma>(g_softeningSquared, g_dampingFactor, 
+            g_deltaTime, g_particleMass, g_maxParticles, true);
+        break;
+    case kCpuPartitioned:
+        return std::make_shared<NBodyPartitioned>(g_softeningSquared, g_dampingFactor, 
+            g_deltaTime, g_particleMass, g_maxParticles, 4);
+        break;
     default:
         assert(false);
         return nullptr;
@@ -418,7 +494,18 @@ bool CALLBACK ModifyDeviceSettings( DXUTDeviceSettings* pDeviceSettings, void* p
 
 void CALLBACK OnFrameMove(double fTime, float fElapsedTime, void* pUserContext)
 {
+    const MetricsClock::time_point start = MetricsClock::now();
     g_pNBody->Integrate(g_pParticlesOld, g_pParticlesNew, g_numParticles);
+    const double stepSeconds = MetricsSeconds(start);
+
+    // Only the direct summation integrators have no counters.
+    const std::shared_ptr<INBodyCounters> pCounters = std::dynamic_pointer_cast<INBodyCounters>(g_pNBody);
+    NBodyCounters counters;
+    if (pCounters)
+        counters = pCounters->Counters();
+    else
+        counters.interactions = double(g_numParticles) * double(g_numParticles);
+    g_metricsRecorder.Record(++g_stepNumber, g_numParticles, stepSeconds, counters);
 
     // Advanced integrator updates particles in place, so no need to swap the buffers.
     if (g_eComputeType != kCpuAdvanced)
@@ -668,9 +755,24 @@ void RenderText()
 
     // Estimate the number of FLOPs based on 20 FLOPs per particle-particle interaction.
     g_pTxtHelper->DrawFormattedTextLine( L"FPS:    %.2f", fps );
-    const float gflops = (g_numParticles / 1000.0f) * (g_numParticles / 1000.0f) * fps * 20 / 1000.0f;
+    const float gflops = (g_numParticles / 1000.0f) * (g_numParticles / 1000.0f) * fps * float(kFlopsPerInteraction) / 1000.0f;
     g_pTxtHelper->DrawFormattedTextLine( L"GFlops: %.2f ", gflops );
 
+    // The same estimate for the integration alone, without rendering.
+    const NBodyMetrics& metrics = g_pHudMetrics->last;
+    if (metrics.numSteps > 0)
+    {
+        const double stepMilliseconds = 1000.0 / metrics.numSteps;
+        g_pTxtHelper->DrawFormattedTextLine( L"Integrate: %.2f ms, %.2f GFlops", metrics.stepSeconds * stepMilliseconds, 
+            metrics.GigaFlops() );
+        if ((metrics.counters.forceSeconds + metrics.counters.integrateSeconds) > 0.0)
+        {
+            g_pTxtHelper->DrawFormattedTextLine( L"Force: %.2f ms, update: %.2f ms, wait: %.2f ms", 
+                metrics.counters.forceSeconds * stepMilliseconds, metrics.counters.integrateSeconds * stepMilliseconds, 
+                metrics.counters.waitSeconds * stepMilliseconds );
+        }
+    }
+
     g_pTxtHelper->End();
 }
 
@@ -0,0 +1,1536 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the 
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+//  A command line driver for the n-body integrators. This runs a simulation without the
+//  DXUT GUI and reports the performance, for example:
+//
+//  NBodyHeadless --particles 65536 --steps 100 --integrator cpu-soa --threads 8
+//
+//  Long runs can write a checkpoint every K steps and be restarted from it:
+//
+//  NBodyHeadless --steps 100000 --checkpoint run.ckp --checkpoint-interval 1000
+//  NBodyHeadless --steps 50000 --restart run.ckp --checkpoint run.ckp
+//
+//  Particle positions can be written to a compressed trajectory file every N steps:
+//
+//  NBodyHeadless --steps 1000 --trajectory run.trj --trajectory-interval 10 --trajectory-precision 0.01
+//
+//  The trajectory can be read back after the run and its last frame compared with the positions
+//  that were written:
+//
+//  NBodyHeadless --steps 100 --trajectory run.trj --verify-trajectory
+//
+//  The time integration scheme and step can be changed and the energy drift measured:
+//
+//  NBodyHeadless --integrator cpu-advanced --scheme leapfrog --dt 0.4 --energy
+//
+//  Initial conditions are generated from a seed so runs can be repeated, the clusters can be
+//  Plummer spheres or disks:
+//
+//  NBodyHeadless --distribution plummer --seed 42 --energy
+//
+//  The SoA integrator can calculate the energy, momentum and center of mass as part of each
+//  step, rather than with a separate direct summation:
+//
+//  NBodyHeadless --integrator cpu-soa --diagnostics
+//
+//  Many small independent systems can be integrated together, here 256 systems of 2048 particles:
+//
+//  NBodyHeadless --integrator cpu-ensemble --systems 256 --particles 524288
+//
+//  On NUMA machines each node can update its own range of particles from a local replica:
+//
+//  NBodyHeadless --integrator cpu-numa --replicate --particles 131072
+//
+//  Partitions that only exchange their updated ranges stand in for multiple accelerators:
+//
+//  NBodyHeadless --integrator cpu-partitioned --partitions 4
+//
+//  Ranks that circulate blocks of positions around a ring can run in one process or as
+//  separate processes connected by sockets, here two processes on one machine:
+//
+//  NBodyHeadless --integrator cpu-distributed --ranks 4
+//  NBodyHeadless --integrator cpu-distributed --transport socket --ranks 2 --rank 0 --hosts 127.0.0.1
+//  NBodyHeadless --integrator cpu-distributed --transport socket --ranks 2 --rank 1 --hosts 127.0.0.1
+//
+//  Particles can be sorted into Morton order every N steps so particles that are close in space
+//  are also close in memory, checkpoints and trajectories are still written in the original order:
+//
+//  NBodyHeadless --integrator cpu-soa --reorder 20 --steps 200
+//
+//  Interactions/s, GFlops and the time spent in each phase can be logged, or exported to a CSV 
+//  file, every N steps:
+//
+//  NBodyHeadless --steps 1000 --metrics console --metrics-interval 100
+//  NBodyHeadless --integrator cpu-partitioned --steps 1000 --metrics run.csv
+//
+//  The step time of direct summation and the Barnes-Hut tree code can be compared for doubling 
+//  particle counts, up to --particles, to find the point at which the tree code is faster:
+//
+//  NBodyHeadless --crossover --particles 262144 --steps 3 --theta 0.5
+//
+//  The FMM's expansion order and opening angle trade accuracy for speed, the force error is 
+//  measured against a double precision direct sum:
+//
+//  NBodyHeadless --integrator cpu-fmm --order 6 --theta 0.4
+//
+//  This is a Windows only headless mode, it does not run on Linux. The driver and every CPU 
+//  integrator are parallelized with the PPL and the Concurrency Runtime (ppl.h, concrt.h), 
+//  which only ship with Visual C++, and the only builds are the Visual Studio projects:
+//
+//  NBodyHeadless       All the integrators, the amp integrators require C++ AMP.
+//  NBodyHeadlessCpu    Defines NBODY_CPU_SHORT_VECTORS, which leaves out the amp integrators 
+//                      so the driver runs on Windows machines without a DirectX 11 accelerator.
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <functional>
+#include <cmath>
+#include <cfloat>
+#include <ppl.h>
+#include <concrt.h>
+
+#include "Common.h"
+#include "Morton.h"
+#include "NBodyCpu.h"
+#include "NBodyAdvancedCpu.h"
+#include "NBodySoACpu.h"
+#include "NBodyBarnesHutCpu.h"
+#include "NBodyFmmCpu.h"
+#include "NBodyBlockStepCpu.h"
+#include "NBodyCellListCpu.h"
+#include "NBodyPrecisionCpu.h"
+#include "NBodyEnsembleCpu.h"
+#include "NBodyNumaCpu.h"
+#include "NBodyPartitionedCpu.h"
+#include "NBodyDistributedCpu.h"
+#include "NBodyTransport.h"
+#include "CpuTopology.h"
+#include "NBodyCheckpoint.h"
+#include "NBodyTrajectory.h"
+#include "NBodyMetrics.h"
+#if !defined(NBODY_CPU_SHORT_VECTORS)
+#include "NBodyAmp.h"
+#include "NBodyAmpSimple.h"
+#include "NBodyAmpTiled.h"
+#include "NBodyAmpMultiTiled.h"
+#endif
+
+using namespace concurrency;
+
+//--------------------------------------------------------------------------------------
+// Global constants, these match the GUI samples.
+//--------------------------------------------------------------------------------------
+
+const float g_softeningSquared =    0.0000015625f;
+const float g_dampingFactor =       0.9995f;
+const float g_particleMass =        ((6.67300e-11f*10000.0f)*10000.0f*10000.0f);
+const float g_deltaTime =           0.1f;                       // The default time step.
+
+const float g_Spread =              400.0f;                     // Separation between the two clusters.
+
+//--------------------------------------------------------------------------------------
+//  Command line options.
+//--------------------------------------------------------------------------------------
+
+struct HeadlessOptions
+{
+    int numParticles;
+    int numSteps;
+    std::string integrator;
+    int numThreads;                                             // Zero uses all available cores.
+    std::string checkpointPath;                                 // Empty disables checkpoints.
+    int checkpointInterval;
+    std::string restartPath;                                    // Empty starts a new simulation.
+    std::string trajectoryPath;                                 // Empty disables trajectory output.
+    int trajectoryInterval;
+    float trajectoryPrecision;
+    bool verifyTrajectory;                                      // Read the trajectory back after the run.
+    IntegratorType scheme;
+    bool resumeLeapfrog;                                        // The restart's velocities lag by half a step.
+    float deltaTime;
+    bool measureEnergy;
+    bool diagnostics;                                           // Fused diagnostics for cpu-soa.
+    float cutoff;
+    float skin;
+    PrecisionMode precision;
+    int cellSize;                                               // Negative uses the L2 cache size.
+    AdvancedSchedule schedule;
+    int numSystems;                                             // Independent systems for cpu-ensemble.
+    bool replicate;                                             // Replicate positions on each NUMA node.
+    int numPartitions;                                          // Partitions for cpu-partitioned.
+    int numRanks;                                               // Ranks for cpu-distributed.
+    bool socketTransport;                                       // Ranks are separate processes.
+    int rank;                                                   // This process's rank when using sockets.
+    std::vector<std::string> hosts;                             // Host of each rank, or one host for all ranks.
+    int basePort;
+    ParticleDistribution distribution;                          // Shape of the initial clusters.
+    unsigned long long seed;
+    int reorderInterval;                                        // Zero never reorders the particles.
+    std::string metricsPath;                                    // Empty disables metrics, "console" writes to stdout.
+    int metricsInterval;
+    float theta;                                                // Opening angle for cpu-barneshut and cpu-fmm.
+    int order;                                                  // Expansion order for cpu-fmm.
+    bool crossover;                                             // Compare cpu-advanced and cpu-barneshut.
+
+    HeadlessOptions() : numParticles(16 * 1024), numSteps(100), integrator("cpu-advanced"), numThreads(0),
+        checkpointInterval(1000), trajectoryInterval(10), trajectoryPrecision(0.01f), verifyTrajectory(false), scheme(kDampedEuler), 
+        resumeLeapfrog(false), deltaTime(g_deltaTime), measureEnergy(false), diagnostics(false), cutoff(20.0f), skin(5.0f), precision(kPrecisionFloat), cellSize(-1), 
+        schedule(kScheduleRecursive), numSystems(64), replicate(false), numPartitions(4), numRanks(4), socketTransport(false),
+        rank(0), hosts(1, "127.0.0.1"), basePort(45000), distribution(kDistributionCluster), seed(kDefaultSeed), 
+        reorderInterval(0), metricsInterval(10), theta(0.5f), order(4), crossover(false) { }
+};
+
+void PrintUsage()
+{
+    std::cout << "Usage: NBodyHeadless [--particles n] [--steps n] [--integrator name] [--threads n]" << std::endl 
+        << "                     [--checkpoint file] [--checkpoint-interval n] [--restart file]" << std::endl
+        << "                     [--trajectory file] [--trajectory-interval n] [--trajectory-precision x]" << std::endl
+        << "                     [--verify-trajectory]" << std::endl
+        << "                     [--scheme name] [--dt x] [--energy] [--cutoff x] [--skin x]" << std::endl
+        << "                     [--precision float|mixed|double] [--cell n] [--schedule name]" << std::endl
+        << "                     [--systems n] [--replicate] [--partitions n]" << std::endl
+        << "                     [--ranks n] [--transport local|socket] [--rank n] [--hosts h0,h1,...] [--port n]" << std::endl
+        << "                     [--distribution cluster|plummer|disk] [--seed n] [--diagnostics]" << std::endl
+        << "                     [--reorder n] [--metrics console|file] [--metrics-interval n]" << std::endl
+        << "                     [--theta x] [--order n] [--crossover]" << std::endl
+        << std::endl
+        << "Integrators:" << std::endl
+        << "  cpu-single, cpu-multi, cpu-blocked, cpu-blockstep," << std::endl
+        << "  cpu-barneshut (nodes smaller than --theta times their distance are approximated)" << std::endl
+        << "  cpu-fmm (expansions of --order, at most 10, for pairs of nodes whose radii sum to less" << std::endl
+        << "           than --theta times their distance, the force error is reported against a" << std::endl
+        << "           double precision direct sum)" << std::endl
+        << "  cpu-soa (--diagnostics sums the energy, momentum and center of mass during each step)" << std::endl
+        << "  cpu-advanced (updated in parallel cells of --cell particles that fit in L2 and serial" << std::endl
+        << "                L1 tiles within each cell, --cell 0 uses L1 tiles only, --schedule" << std::endl
+        << "                recursive or colored selects how the cells are divided between tasks)" << std::endl
+        << "  cpu-celllist (interactions are limited to the --cutoff radius, neighbor lists include" << std::endl
+        << "                an extra --skin and are rebuilt once a particle moves half the skin)" << std::endl
+        << "  cpu-precision (the SoA engine with float, mixed or double --precision, the force" << std::endl
+        << "                 error is reported against a double precision direct sum)" << std::endl
+        << "  cpu-ensemble (--systems independent systems of equal size, --particles is the total" << std::endl
+        << "                and is rounded up to a multiple of the number of systems)" << std::endl
+        << "  cpu-numa (each NUMA node updates its own range of particles, --replicate copies the" << std::endl
+        << "            positions to every node each step)" << std::endl
+        << "  cpu-partitioned (--partitions groups of workers, like amp-multi's accelerators, each" << std::endl
+        << "                   update a range and copy only that range to the other partitions)" << std::endl
+        << "  cpu-distributed (--ranks each update a range of particles while passing blocks of" << std::endl
+        << "                   positions around a ring, --transport local runs all the ranks in this" << std::endl
+        << "                   process, socket runs --rank of them and connects to the other ranks" << std::endl
+        << "                   on --hosts, listening on --port + rank)" << std::endl
+#if !defined(NBODY_CPU_SHORT_VECTORS)
+        << "  amp-simple, amp-tiled, amp-multi" << std::endl
+#endif
+        << std::endl
+        << "Reordering:" << std::endl
+        << "  --reorder n sorts the particles into Morton order every n steps, it is not supported by" << std::endl
+        << "  cpu-blockstep, cpu-celllist, cpu-precision, cpu-ensemble, verlet or the amp integrators" << std::endl
+        << std::endl
+        << "Metrics:" << std::endl
+        << "  --metrics writes the interactions/s, GFlops and step time every --metrics-interval steps" << std::endl
+        << "  for the cpu integrators, all but cpu-single, cpu-multi, cpu-blocked, cpu-precision and" << std::endl
+        << "  cpu-ensemble also report the force, integrate and wait phase times, tasks created and" << std::endl
+        << "  bytes moved between partitions, nodes or ranks, the tree codes and cpu-celllist count" << std::endl
+        << "  only the interactions they calculate" << std::endl
+        << std::endl
+        << "Crossover:" << std::endl
+        << "  --crossover times --steps steps of cpu-advanced and cpu-barneshut for particle counts" << std::endl
+        << "  doubling from 1024 to --particles and reports the first count at which the tree is faster," << std::endl
+        << "  cpu-fmm is timed for the same counts" << std::endl
+        << std::endl
+        << "Schemes:" << std::endl
+        << "  euler      All integrators, cpu-blockstep always uses its own block timesteps" << std::endl
+        << "  leapfrog   cpu-advanced, amp-tiled, amp-multi" << std::endl
+        << "  verlet     cpu-advanced" << std::endl;
+}
+
+bool ParseOptions(int argc, char* argv[], HeadlessOptions& options)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg(argv[i]);
+        if (arg == "--energy")
+        {
+            options.measureEnergy = true;
+            continue;
+        }
+        if (arg == "--replicate")
+        {
+            options.replicate = true;
+            continue;
+        }
+        if (arg == "--diagnostics")
+        {
+            options.diagnostics = true;
+            continue;
+        }
+        if (arg == "--crossover")
+        {
+            options.crossover = true;
+            continue;
+        }
+        if (arg == "--verify-trajectory")
+        {
+            options.verifyTrajectory = true;
+            continue;
+        }
+        if ((i + 1) == argc)
+            return false;
+        const char* const value = argv[++i];
+
+        if (arg == "--particles")
+            options.numParticles = std::atoi(value);
+        else if (arg == "--steps")
+            options.numSteps = std::atoi(value);
+        else if (arg == "--integrator")
+            options.integrator = value;
+        else if (arg == "--threads")
+            options.numThreads = std::atoi(value);
+        else if (arg == "--checkpoint")
+            options.checkpointPath = value;
+        else if (arg == "--checkpoint-interval")
+            options.checkpointInterval = std::atoi(value);
+        else if (arg == "--restart")
+            options.restartPath = value;
+        else if (arg == "--trajectory")
+            options.trajectoryPath = value;
+        else if (arg == "--trajectory-interval")
+            options.trajectoryInterval = std::atoi(value);
+        else if (arg == "--trajectory-precision")
+            options.trajectoryPrecision = static_cast<float>(std::atof(value));
+        else if (arg == "--dt")
+            options.deltaTime = static_cast<float>(std::atof(value));
+        else if (arg == "--cutoff")
+            options.cutoff = static_cast<float>(std::atof(value));
+        else if (arg == "--skin")
+            options.skin = static_cast<float>(std::atof(value));
+        else if (arg == "--cell")
+            options.cellSize = std::atoi(value);
+        else if (arg == "--systems")
+            options.numSystems = std::atoi(value);
+        else if (arg == "--partitions")
+            options.numPartitions = std::atoi(value);
+        else if (arg == "--ranks")
+            options.numRanks = std::atoi(value);
+        else if (arg == "--rank")
+            options.rank = std::atoi(value);
+        else if (arg == "--port")
+            options.basePort = std::atoi(value);
+        else if (arg == "--reorder")
+            options.reorderInterval = std::atoi(value);
+        else if (arg == "--metrics")
+            options.metricsPath = value;
+        else if (arg == "--metrics-interval")
+            options.metricsInterval = std::atoi(value);
+        else if (arg == "--theta")
+            options.theta = static_cast<float>(std::atof(value));
+        else if (arg == "--order")
+            options.order = std::atoi(value);
+        else if (arg == "--seed")
+            options.seed = std::strtoull(value, nullptr, 10);
+        else if (arg == "--distribution")
+        {
+            const std::string distribution(value);
+            if (distribution == "cluster")
+                options.distribution = kDistributionCluster;
+            else if (distribution == "plummer")
+                options.distribution = kDistributionPlummer;
+            else if (distribution == "disk")
+                options.distribution = kDistributionDisk;
+            else
+                return false;
+        }
+        else if (arg == "--hosts")
+        {
+            options.hosts.clear();
+            std::istringstream hosts(value);
+            std::string host;
+            while (std::getline(hosts, host, ','))
+                options.hosts.push_back(host);
+        }
+        else if (arg == "--transport")
+        {
+            const std::string transport(value);
+            if (transport == "local")
+                options.socketTransport = false;
+            else if (transport == "socket")
+                options.socketTransport = true;
+            else
+                return false;
+        }
+        else if (arg == "--schedule")
+        {
+            const std::string schedule(value);
+            if (schedule == "recursive")
+                options.schedule = kScheduleRecursive;
+            else if (schedule == "colored")
+                options.schedule = kScheduleColored;
+            else
+                return false;
+        }
+        else if (arg == "--precision")
+        {
+            const std::string precision(value);
+            if (precision == "float")
+                options.precision = kPrecisionFloat;
+            else if (precision == "mixed")
+                options.precision = kPrecisionMixed;
+            else if (precision == "double")
+                options.precision = kPrecisionDouble;
+            else
+                return false;
+        }
+        else if (arg == "--scheme")
+        {
+            const std::string scheme(value);
+            if (scheme == "euler")
+                options.scheme = kDampedEuler;
+            else if (scheme == "leapfrog")
+                options.scheme = kLeapfrog;
+            else if (scheme == "verlet")
+                options.scheme = kVelocityVerlet;
+            else
+                return false;
+        }
+        else
+            return false;
+    }
+    return (options.numParticles > 0) && (options.numSteps > 0) && (options.numThreads >= 0) && 
+        (options.checkpointInterval > 0) && (options.trajectoryInterval > 0) && (options.trajectoryPrecision > 0.0f) &&
+        (options.deltaTime > 0.0f) && (options.cutoff > 0.0f) && (options.skin > 0.0f) && (options.numSystems > 0) && 
+        (options.numPartitions > 0) && (options.numRanks > 0) && (options.rank >= 0) && (options.rank < options.numRanks) && 
+        (options.basePort > 0) && !options.hosts.empty() && (options.reorderInterval >= 0) && 
+        (options.metricsInterval > 0) && (options.theta >= 0.0f) && (options.order >= 1) && 
+        (options.order <= CartesianExpansion::kMaxOrder);
+}
+
+//--------------------------------------------------------------------------------------
+//  Integrator class factories.
+//--------------------------------------------------------------------------------------
+
+inline int RoundUp(int value, int multiple)
+{
+    return ((value + multiple - 1) / multiple) * multiple;
+}
+
+//  NBodyAdvanced updates particles in place so the buffers must not be swapped after each step.
+//  Only NBodyAdvanced supports schemes other than kDampedEuler, a leapfrog restart continues 
+//  without the initial half kick. NBodyEnsemble requires a whole
+//  number of particles in each system, main rounds numParticles up before calling the factory.
+//  A distributed rank using sockets connects to the other ranks when it is created.
+
+std::shared_ptr<INBodyCpu> NBodyCpuFactory(HeadlessOptions& options, bool& inPlace)
+{
+    const std::string& name = options.integrator;
+    const float deltaTime = options.deltaTime;
+    inPlace = false;
+    if (name == "cpu-advanced")
+    {
+        inPlace = true;
+        const int tileSize = GetLevelOneCacheSize() / sizeof(ParticleCpu);
+        const int cellSize = (options.cellSize < 0) ? GetLevelTwoCellSize() : options.cellSize;
+        const std::shared_ptr<NBodyAdvanced> pAdvanced = std::make_shared<NBodyAdvanced>(g_softeningSquared, g_dampingFactor, 
+            deltaTime, g_particleMass, tileSize, cellSize, options.scheme, options.schedule);
+        if (options.resumeLeapfrog)
+            pAdvanced->ResumeLeapfrog();
+        return pAdvanced;
+    }
+    if (options.scheme != kDampedEuler)
+        return nullptr;
+    if (name == "cpu-single")
+        return std::make_shared<NBodySimpleSingleCore>(g_softeningSquared, g_dampingFactor, deltaTime, g_particleMass);
+    if (name == "cpu-multi")
+        return std::make_shared<NBodySimpleMultiCore>(g_softeningSquared, g_dampingFactor, deltaTime, g_particleMass);
+    if (name == "cpu-blocked")
+        return std::make_shared<NBodyBlockedMultiCore>(g_softeningSquared, g_dampingFactor, deltaTime, g_particleMass);
+    if (name == "cpu-soa")
+    {
+        const std::shared_ptr<NBodySoA> pSoA = std::make_shared<NBodySoA>(g_softeningSquared, g_dampingFactor, deltaTime, g_particleMass, 
+            options.numParticles);
+        pSoA->EnableDiagnostics(options.diagnostics);
+        return pSoA;
+    }
+    if (name == "cpu-barneshut")
+        return std::make_shared<NBodyBarnesHut>(g_softeningSquared, g_dampingFactor, deltaTime, g_particleMass, options.theta);
+    if (name == "cpu-fmm")
+        return std::make_shared<NBodyFmm>(g_softeningSquared, g_dampingFactor, deltaTime, g_particleMass, options.order, options.theta);
+    if (name == "cpu-blockstep")
+        return std::make_shared<NBodyBlockStep>(g_softeningSquared, deltaTime, g_particleMass, options.numParticles);
+    if (name == "cpu-celllist")
+        return std::make_shared<NBodyCellList>(g_softeningSquared, g_dampingFactor, deltaTime, g_particleMass, options.numParticles, 
+            options.cutoff, options.skin);
+    if (name == "cpu-precision")
+        return NBodyPrecisionFactory(options.precision, g_softeningSquared, g_dampingFactor, deltaTime, g_particleMass, options.numParticles);
+    if (name == "cpu-ensemble")
+        return std::make_shared<NBodyEnsemble>(g_softeningSquared, g_dampingFactor, deltaTime, g_particleMass, options.numSystems);
+    if (name == "cpu-partitioned")
+        return std::make_shared<NBodyPartitioned>(g_softeningSquared, g_dampingFactor, deltaTime, g_particleMass, options.numParticles, 
+            options.numPartitions);
+    if (name == "cpu-numa")
+        return std::make_shared<NBodyNuma>(g_softeningSquared, g_dampingFactor, deltaTime, g_particleMass, options.numParticles, 
+            options.replicate);
+    if ((name == "cpu-distributed") && !options.socketTransport)
+        return std::make_shared<NBodyLocalRanks>(g_softeningSquared, g_dampingFactor, deltaTime, g_particleMass, options.numParticles, 
+            options.numRanks);
+    if (name == "cpu-distributed")
+    {
+        const int maxParticles = (options.numParticles + options.numRanks - 1) / options.numRanks;
+        try
+        {
+            return std::make_shared<NBodyDistributed>(g_softeningSquared, g_dampingFactor, deltaTime, g_particleMass, maxParticles, 
+                std::make_shared<SocketTransport>(options.rank, options.numRanks, options.hosts, options.basePort));
+        }
+        catch (std::runtime_error& ex)
+        {
+            std::cout << ex.what() << std::endl;
+            return nullptr;
+        }
+    }
+    return nullptr;
+}
+
+#if !defined(NBODY_CPU_SHORT_VECTORS)
+
+//  The tiled integrators require a whole number of tiles on each accelerator so numParticles
+//  is rounded up. The multi-accelerator integrator requires at least two GPUs. The tiled 
+//  integrators support kDampedEuler and kLeapfrog.
+
+std::shared_ptr<INBodyAmp> NBodyAmpFactory(HeadlessOptions& options)
+{
+    const std::string& name = options.integrator;
+    const float deltaTime = options.deltaTime;
+    int& numParticles = options.numParticles;
+    const int tileSize = 256;
+    if (options.scheme == kVelocityVerlet)
+        return nullptr;
+    if (name == "amp-simple")
+    {
+        if (options.scheme != kDampedEuler)
+            return nullptr;
+        return std::make_shared<NBodyAmpSimple>(g_softeningSquared, g_dampingFactor, deltaTime, g_particleMass);
+    }
+    if (name == "amp-tiled")
+    {
+        numParticles = RoundUp(numParticles, tileSize);
+        const std::shared_ptr<NBodyAmpTiled<tileSize>> pTiled = std::make_shared<NBodyAmpTiled<tileSize>>(g_softeningSquared, 
+            g_dampingFactor, deltaTime, g_particleMass, options.scheme);
+        if (options.resumeLeapfrog)
+            pTiled->ResumeLeapfrog();
+        return pTiled;
+    }
+    if (name == "amp-multi")
+    {
+        const int numAccelerators = static_cast<int>(AmpUtils::GetGpuAccelerators().size());
+        if (numAccelerators < 2)
+        {
+            std::cout << "The amp-multi integrator requires at least two C++ AMP capable GPUs." << std::endl;
+            return nullptr;
+        }
+        numParticles = RoundUp(numParticles, numAccelerators * tileSize);
+        const std::shared_ptr<NBodyAmpMultiTiled<tileSize>> pMulti = std::make_shared<NBodyAmpMultiTiled<tileSize>>(g_softeningSquared, 
+            g_dampingFactor, deltaTime, g_particleMass, options.scheme);
+        if (options.resumeLeapfrog)
+            pMulti->ResumeLeapfrog();
+        return pMulti;
+    }
+    return nullptr;
+}
+
+#endif
+
+//--------------------------------------------------------------------------------------
+//  Run the simulation.
+//--------------------------------------------------------------------------------------
+//
+//  Each function returns the elapsed time in seconds for all the integration steps, 
+//  excluding initialization, and the total energy before and after the steps if requested.
+
+typedef std::chrono::high_resolution_clock Clock;
+
+struct RunResult
+{
+    double elapsed;
+    double initialization;                                      // Time to generate the initial conditions.
+    int initializedParticles;
+    double initialEnergy;
+    double finalEnergy;
+    double rmsForceError;
+    double maxForceError;
+    NBodyDiagnostics firstDiagnostics;                          // Fused diagnostics of the first and last steps.
+    NBodyDiagnostics lastDiagnostics;
+    int reorderCount;
+    double reorderSeconds;
+    int unorderedSteps;                                         // Steps before the first reorder.
+    double unorderedStepSeconds;                                // Total time of the steps before and after the first reorder.
+    double orderedStepSeconds;
+    double neighborDistanceBefore;                              // Mean distance between neighbors in memory, before and 
+    double neighborDistanceAfter;                               // after the first reorder.
+    unsigned long long lastFrameStep;                           // The last trajectory frame written, only kept 
+    std::vector<float_3> lastFramePos;                          // for --verify-trajectory.
+    double interactions;                                        // Total for all the steps, from the integrator's counters.
+
+    RunResult() : elapsed(0.0), initialization(0.0), initializedParticles(0), initialEnergy(0.0), finalEnergy(0.0), rmsForceError(0.0), maxForceError(0.0),
+        reorderCount(0), reorderSeconds(0.0), unorderedSteps(0), unorderedStepSeconds(0.0), orderedStepSeconds(0.0), 
+        neighborDistanceBefore(0.0), neighborDistanceAfter(0.0), lastFrameStep(0), interactions(0.0) { }
+};
+
+double ElapsedSeconds(const Clock::time_point& start, const Clock::time_point& end)
+{
+    return std::chrono::duration_cast<std::chrono::duration<double>>(end - start).count();
+}
+
+//  Total kinetic and potential energy divided by the particle mass, calculated by direct 
+//  summation in double precision with the same softening as the integrators. Leapfrog 
+//  velocities lag the positions by half a step so they are first synchronized with a half 
+//  kick, velocityKickTime, using the accelerations calculated here.
+
+double TotalEnergy(const std::vector<float_3>& pos, const std::vector<float_3>& vel, float velocityKickTime)
+{
+    const int numParticles = static_cast<int>(pos.size());
+    combinable<double> energy;
+    parallel_for(0, numParticles, [&](int i)
+    {
+        double potential = 0.0;
+        double acc[3] = { 0.0, 0.0, 0.0 };
+        for (int j = 0; j < numParticles; ++j)
+        {
+            if (j == i)
+                continue;
+            const double r[3] = { pos[j].x - pos[i].x, pos[j].y - pos[i].y, pos[j].z - pos[i].z };
+            const double invDist = 1.0 / sqrt(r[0] * r[0] + r[1] * r[1] + r[2] * r[2] + g_softeningSquared);
+            potential -= g_particleMass * invDist;
+            const double s = g_particleMass * invDist * invDist * invDist;
+            for (int c = 0; c < 3; ++c)
+                acc[c] += r[c] * s;
+        }
+        const double v[3] = { vel[i].x + acc[0] * velocityKickTime, vel[i].y + acc[1] * velocityKickTime, 
+            vel[i].z + acc[2] * velocityKickTime };
+
+        // Each pair's potential is counted by both particles.
+        energy.local() += 0.5 * (v[0] * v[0] + v[1] * v[1] + v[2] * v[2]) + 0.5 * potential;
+    });
+    return energy.combine(std::plus<double>());
+}
+
+//  Particles only interact with other particles in the same system so the energy of an 
+//  ensemble is the sum of the energies of its systems.
+
+double TotalEnergy(const ParticleCpu* const pParticles, int numParticles, int numSystems, float velocityKickTime)
+{
+    const int systemSize = numParticles / numSystems;
+    std::vector<float_3> pos(systemSize);
+    std::vector<float_3> vel(systemSize);
+    double energy = 0.0;
+    for (int s = 0; s < numSystems; ++s)
+    {
+        const ParticleCpu* const pSystem = pParticles + s * systemSize;
+        for (int i = 0; i < systemSize; ++i)
+        {
+            pos[i] = pSystem[i].pos;
+            vel[i] = pSystem[i].vel;
+        }
+        energy += TotalEnergy(pos, vel, velocityKickTime);
+    }
+    return energy;
+}
+
+//  Relative error of the accelerations, pAcc, calculated by a precision engine or the FMM for 
+//  a sample of particles, compared with direct summation in double precision.
+
+void ForceError(const double_3* const pAcc, const ParticleCpu* const pParticles, int numParticles, RunResult& result)
+{
+    const int numSamples = std::min(numParticles, 256);
+    const int stride = numParticles / numSamples;
+    combinable<double> sumSqr;
+    combinable<double> maxError;
+    parallel_for(0, numSamples, [&](int k)
+    {
+        const int i = k * stride;
+        double ref[3] = { 0.0, 0.0, 0.0 };
+        for (int j = 0; j < numParticles; ++j)
+        {
+            const double r[3] = { double(pParticles[j].pos.x) - pParticles[i].pos.x, double(pParticles[j].pos.y) - pParticles[i].pos.y, 
+                double(pParticles[j].pos.z) - pParticles[i].pos.z };
+            const double invDist = 1.0 / sqrt(r[0] * r[0] + r[1] * r[1] + r[2] * r[2] + g_softeningSquared);
+            const double s = double(g_particleMass) * invDist * invDist * invDist;
+            for (int c = 0; c < 3; ++c)
+                ref[c] += r[c] * s;
+        }
+        const double d[3] = { pAcc[i].x - ref[0], pAcc[i].y - ref[1], pAcc[i].z - ref[2] };
+        const double error = sqrt((d[0] * d[0] + d[1] * d[1] + d[2] * d[2]) / (ref[0] * ref[0] + ref[1] * ref[1] + ref[2] * ref[2]));
+        sumSqr.local() += error * error;
+        maxError.local() = std::max(maxError.local(), error);
+    });
+    result.rmsForceError = sqrt(sumSqr.combine(std::plus<double>()) / numSamples);
+    result.maxForceError = maxError.combine([](double a, double b) { return std::max(a, b); });
+}
+
+//  The initial conditions are two clusters set to collide in each system. Each cluster has its
+//  own stream of random numbers so any range of particles can be generated on its own, giving 
+//  the same particles as generating them all.
+
+ClusterDesc InitialCluster(const HeadlessOptions& options, int system, int cluster, int clusterSize)
+{
+    const float side = (cluster == 0) ? 1.0f : -1.0f;
+    ClusterDesc desc(options.distribution, float_3(side * g_Spread * 0.50f, 0.0f, 0.0f), float_3(0.0f, 0.0f, -20.0f * side), 
+        g_Spread, options.seed, 2 * system + cluster);
+    desc.gravitationalMass = g_particleMass * clusterSize;
+    return desc;
+}
+
+//  Generate particles [begin, end) of the initial conditions into pParticles.
+
+void LoadInitialConditions(const HeadlessOptions& options, int numSystems, ParticleCpu* const pParticles, int begin, int end)
+{
+    const int systemSize = options.numParticles / numSystems;
+    for (int s = 0; s < numSystems; ++s)
+    {
+        for (int c = 0; c < 2; ++c)
+        {
+            const int clusterStart = s * systemSize + ((c == 0) ? 0 : systemSize / 2);
+            const int clusterSize = (c == 0) ? systemSize / 2 : (systemSize + 1) / 2;
+            const int first = std::max(begin, clusterStart);
+            const int last = std::min(end, clusterStart + clusterSize);
+            if (first < last)
+                LoadClusterParticles(pParticles + (first - begin), InitialCluster(options, s, c, clusterSize), first - clusterStart, 
+                    last - first);
+        }
+    }
+}
+
+//  A restarted simulation uses the particles in a ParticleCpu checkpoint in place, the mapping 
+//  is copy-on-write so the checkpoint file is not modified. Checkpoints are written with the 
+//  same step numbering so a restarted run continues the original one.
+//
+//  Reordered particles are sorted from pParticlesOld into pParticlesNew, which both in place 
+//  and double buffered integrators leave free between steps, and the pointers are swapped.
+//  Checkpoints and trajectories are first restored to the original order.
+//
+//  Integrators without counters are assumed to calculate every interaction, as the report does.
+
+RunResult RunCpu(const HeadlessOptions& options, const std::shared_ptr<INBodyCpu>& pNBody, bool inPlace, 
+    const MappedCheckpoint* const pRestart, TrajectoryWriter* const pTrajectory, NBodyMetricsRecorder* const pMetrics)
+{
+    int numParticles = options.numParticles;
+    const std::shared_ptr<NBodyEnsemble> pEnsemble = std::dynamic_pointer_cast<NBodyEnsemble>(pNBody);
+    const int numSystems = pEnsemble ? pEnsemble->NumSystems() : 1;
+    std::vector<ParticleCpu> particlesOld;
+    std::vector<ParticleCpu> particlesNew(numParticles);
+    ParticleCpu* pParticlesOld = nullptr;
+    ParticleCpu* pParticlesNew = &particlesNew[0];
+    unsigned long long firstStep = 0;
+    double time = 0.0;
+    RunResult result;
+
+    // A rank in a separate process only generates and holds the particles it updates.
+    const std::shared_ptr<NBodyDistributed> pDistributed = std::dynamic_pointer_cast<NBodyDistributed>(pNBody);
+    int rangeStart = 0;
+    if (pDistributed)
+    {
+        rangeStart = DistributedRangeStart(pDistributed->Rank(), pDistributed->NumRanks(), numParticles);
+        numParticles = DistributedRangeStart(pDistributed->Rank() + 1, pDistributed->NumRanks(), numParticles) - rangeStart;
+        particlesNew.resize(numParticles);
+        pParticlesNew = particlesNew.data();
+    }
+
+    if (pRestart == nullptr)
+    {
+        particlesOld.resize(numParticles);
+        pParticlesOld = particlesOld.data();
+        const Clock::time_point initStart = Clock::now();
+        LoadInitialConditions(options, numSystems, pParticlesOld, rangeStart, rangeStart + numParticles);
+        result.initialization = ElapsedSeconds(initStart, Clock::now());
+        result.initializedParticles = numParticles;
+        particlesNew = particlesOld;
+    }
+    else
+    {
+        firstStep = pRestart->Header().step;
+        time = pRestart->Header().time;
+        if (pRestart->Layout() == kCheckpointAoS)
+        {
+            pParticlesOld = pRestart->Particles();
+        }
+        else
+        {
+            particlesOld.resize(numParticles);
+            pParticlesOld = &particlesOld[0];
+            for (int i = 0; i < numParticles; ++i)
+            {
+                particlesOld[i].pos = pRestart->Position(i);
+                particlesOld[i].vel = pRestart->Velocity(i);
+            }
+        }
+        std::copy(pParticlesOld, pParticlesOld + numParticles, pParticlesNew);
+    }
+
+    // The NUMA engine's arrays are placed on the nodes that own each range of particles.
+    const std::shared_ptr<NBodyNuma> pNuma = std::dynamic_pointer_cast<NBodyNuma>(pNBody);
+    std::unique_ptr<NumaParticleArray> numaOld;
+    std::unique_ptr<NumaParticleArray> numaNew;
+    if (pNuma)
+    {
+        const NumaPartition partition = pNuma->Partition(numParticles);
+        numaOld.reset(new NumaParticleArray(numParticles));
+        numaNew.reset(new NumaParticleArray(numParticles));
+        numaOld->CopyToNodes(pParticlesOld, partition);
+        numaNew->CopyToNodes(pParticlesOld, partition);
+        pParticlesOld = numaOld->Data();
+        pParticlesNew = numaNew->Data();
+    }
+
+    std::unique_ptr<CheckpointWriter> checkpoint;
+    if (!options.checkpointPath.empty())
+        checkpoint.reset(new CheckpointWriter(options.checkpointPath, options.scheme));
+
+    const float finalKickTime = (options.scheme == kLeapfrog) ? 0.5f * options.deltaTime : 0.0f;
+    if (options.measureEnergy)
+        result.initialEnergy = TotalEnergy(pParticlesOld, numParticles, numSystems, options.resumeLeapfrog ? finalKickTime : 0.0f);
+
+    // The force error is measured on the initial state, which the precision engine keeps for
+    // the first step.
+    const std::shared_ptr<NBodyPrecisionBase> pPrecision = std::dynamic_pointer_cast<NBodyPrecisionBase>(pNBody);
+    const std::shared_ptr<NBodyFmm> pFmm = std::dynamic_pointer_cast<NBodyFmm>(pNBody);
+    if (pPrecision || pFmm)
+    {
+        std::vector<double_3> acc(numParticles);
+        if (pPrecision)
+            pPrecision->CalculateAccelerations(pParticlesOld, numParticles, &acc[0]);
+        else
+            pFmm->CalculateAccelerations(pParticlesOld, numParticles, &acc[0]);
+        ForceError(&acc[0], pParticlesOld, numParticles, result);
+    }
+
+    std::unique_ptr<MortonOrder> order;
+    std::vector<ParticleCpu> particlesOriginal;
+    if (options.reorderInterval > 0)
+    {
+        order.reset(new MortonOrder(numParticles));
+        if (checkpoint || (pTrajectory != nullptr))
+            particlesOriginal.resize(numParticles);
+    }
+
+    const Clock::time_point start = Clock::now();
+    const std::shared_ptr<NBodySoA> pSoA = std::dynamic_pointer_cast<NBodySoA>(pNBody);
+    const std::shared_ptr<INBodyCounters> pCounters = std::dynamic_pointer_cast<INBodyCounters>(pNBody);
+    for (int step = 0; step < options.numSteps; ++step)
+    {
+        const Clock::time_point stepStart = Clock::now();
+        pNBody->Integrate(pParticlesOld, pParticlesNew, numParticles);
+        const double stepSeconds = ElapsedSeconds(stepStart, Clock::now());
+        if (!inPlace)
+            std::swap(pParticlesOld, pParticlesNew);
+        if (pSoA && (step == 0))
+            result.firstDiagnostics = pSoA->Diagnostics();
+        if (pCounters)
+            result.interactions += pCounters->Counters().interactions;
+        if (order)
+        {
+            if (result.reorderCount == 0)
+            {
+                result.unorderedStepSeconds += stepSeconds;
+                ++result.unorderedSteps;
+            }
+            else
+            {
+                result.orderedStepSeconds += stepSeconds;
+            }
+        }
+
+        time += options.deltaTime;
+        const unsigned long long stepNumber = firstStep + step + 1;
+        if (pMetrics != nullptr)
+        {
+            // Integrators without counters are direct summations.
+            NBodyCounters counters;
+            if (pCounters)
+                counters = pCounters->Counters();
+            else
+                counters.interactions = double(numParticles) * double(numParticles) / numSystems;
+            pMetrics->Record(stepNumber, numParticles, stepSeconds, counters);
+        }
+        if (order && (((step + 1) % options.reorderInterval) == 0))
+        {
+            if (result.reorderCount == 0)
+                result.neighborDistanceBefore = MortonOrder::MeanNeighborDistance(pParticlesOld, numParticles);
+            const Clock::time_point reorderStart = Clock::now();
+            order->Reorder(pParticlesOld, pParticlesNew, numParticles);
+            std::swap(pParticlesOld, pParticlesNew);
+            result.reorderSeconds += ElapsedSeconds(reorderStart, Clock::now());
+            if (result.reorderCount == 0)
+                result.neighborDistanceAfter = MortonOrder::MeanNeighborDistance(pParticlesOld, numParticles);
+            ++result.reorderCount;
+        }
+
+        const bool writeCheckpoint = checkpoint && ((stepNumber % options.checkpointInterval) == 0);
+        const bool writeTrajectory = (pTrajectory != nullptr) && ((stepNumber % options.trajectoryInterval) == 0);
+        const ParticleCpu* pOutput = pParticlesOld;
+        if (order && (writeCheckpoint || writeTrajectory))
+        {
+            order->Restore(pParticlesOld, particlesOriginal.data(), numParticles);
+            pOutput = particlesOriginal.data();
+        }
+        if (writeCheckpoint)
+            checkpoint->Write(pOutput, numParticles, stepNumber, time);
+        if (writeTrajectory)
+        {
+            pTrajectory->Write(pOutput, stepNumber);
+            if (options.verifyTrajectory)
+            {
+                result.lastFrameStep = stepNumber;
+                result.lastFramePos.resize(numParticles);
+                for (int i = 0; i < numParticles; ++i)
+                    result.lastFramePos[i] = pOutput[i].pos;
+            }
+        }
+    }
+    if (checkpoint)
+        checkpoint->Wait();
+    if (pTrajectory != nullptr)
+        pTrajectory->Close();
+    if (pMetrics != nullptr)
+        pMetrics->Flush();
+    result.elapsed = ElapsedSeconds(start, Clock::now());
+    if (pSoA)
+        result.lastDiagnostics = pSoA->Diagnostics();
+
+    if (options.measureEnergy)
+        result.finalEnergy = TotalEnergy(pParticlesOld, numParticles, numSystems, finalKickTime);
+    return result;
+}
+
+#if !defined(NBODY_CPU_SHORT_VECTORS)
+
+//  Checkpoints are written from the first accelerator, which holds all the particles after 
+//  each step. The kernels are compiled by running one step with a separate integrator, 
+//  pWarmup, so the state of the timed integrator is unchanged.
+
+RunResult RunAmp(const HeadlessOptions& options, const std::shared_ptr<INBodyAmp>& pNBody, 
+    const std::shared_ptr<INBodyAmp>& pWarmup, const MappedCheckpoint* const pRestart, TrajectoryWriter* const pTrajectory)
+{
+    const int numParticles = options.numParticles;
+    std::vector<std::shared_ptr<TaskData>> tasks = CreateTasks(numParticles, accelerator().default_view);
+    unsigned long long firstStep = 0;
+    double time = 0.0;
+    RunResult result;
+
+    ParticlesCpu particles(numParticles);
+    if (pRestart == nullptr)
+    {
+        const Clock::time_point initStart = Clock::now();
+        LoadClusterParticles(particles, 0, numParticles / 2, InitialCluster(options, 0, 0, numParticles / 2));
+        LoadClusterParticles(particles, numParticles / 2, (numParticles + 1) / 2, InitialCluster(options, 0, 1, (numParticles + 1) / 2));
+        result.initialization = ElapsedSeconds(initStart, Clock::now());
+        result.initializedParticles = numParticles;
+    }
+    else
+    {
+        firstStep = pRestart->Header().step;
+        time = pRestart->Header().time;
+        for (int i = 0; i < numParticles; ++i)
+        {
+            particles.pos[i] = pRestart->Position(i);
+            particles.vel[i] = pRestart->Velocity(i);
+        }
+    }
+    std::for_each(tasks.begin(), tasks.end(), [&particles](std::shared_ptr<TaskData>& t)
+    {
+        copy(particles.pos.begin(), t->DataOld->pos);
+        copy(particles.vel.begin(), t->DataOld->vel);
+    });
+
+    std::unique_ptr<CheckpointWriter> checkpoint;
+    if (!options.checkpointPath.empty())
+        checkpoint.reset(new CheckpointWriter(options.checkpointPath, options.scheme));
+
+    const float finalKickTime = (options.scheme == kLeapfrog) ? 0.5f * options.deltaTime : 0.0f;
+    if (options.measureEnergy)
+        result.initialEnergy = TotalEnergy(particles.pos, particles.vel, options.resumeLeapfrog ? finalKickTime : 0.0f);
+
+    // Run one step to JIT the kernels before timing.
+    pWarmup->Integrate(tasks, numParticles);
+    tasks[0]->DataNew->pos.get_accelerator_view().wait();
+
+    const Clock::time_point start = Clock::now();
+    for (int step = 0; step < options.numSteps; ++step)
+    {
+        pNBody->Integrate(tasks, numParticles);
+        std::for_each(tasks.begin(), tasks.end(), [](std::shared_ptr<TaskData>& t) 
+        { 
+            std::swap(t->DataOld, t->DataNew); 
+        });
+
+        time += options.deltaTime;
+        const unsigned long long stepNumber = firstStep + step + 1;
+        if (checkpoint && ((stepNumber % options.checkpointInterval) == 0))
+        {
+            copy(tasks[0]->DataOld->pos, particles.pos.begin());
+            copy(tasks[0]->DataOld->vel, particles.vel.begin());
+            checkpoint->Write(&particles.pos[0], &particles.vel[0], numParticles, stepNumber, time);
+        }
+        if ((pTrajectory != nullptr) && ((stepNumber % options.trajectoryInterval) == 0))
+        {
+            copy(tasks[0]->DataOld->pos, particles.pos.begin());
+            pTrajectory->Write(&particles.pos[0], stepNumber);
+            if (options.verifyTrajectory)
+            {
+                result.lastFrameStep = stepNumber;
+                result.lastFramePos = particles.pos;
+            }
+        }
+    }
+    std::for_each(tasks.begin(), tasks.end(), [](std::shared_ptr<TaskData>& t) 
+    { 
+        t->DataOld->pos.get_accelerator_view().wait(); 
+    });
+    if (checkpoint)
+        checkpoint->Wait();
+    if (pTrajectory != nullptr)
+        pTrajectory->Close();
+    result.elapsed = ElapsedSeconds(start, Clock::now());
+
+    if (options.measureEnergy)
+    {
+        copy(tasks[0]->DataOld->pos, particles.pos.begin());
+        copy(tasks[0]->DataOld->vel, particles.vel.begin());
+        result.finalEnergy = TotalEnergy(particles.pos, particles.vel, finalKickTime);
+    }
+    return result;
+}
+
+#endif
+
+//--------------------------------------------------------------------------------------
+//  Trajectory check.
+//--------------------------------------------------------------------------------------
+//
+//  Reads every frame of the trajectory with TrajectoryReader. The frames must be numFrames 
+//  steps that are multiples of the interval, and each coordinate of the last frame must be 
+//  within half the precision of the position that was written, allowing for float rounding. 
+//  Delta encoded frames are decoded from the previous frame so an error in any frame since the
+//  last keyframe shows up in the last frame.
+
+struct TrajectoryCheck
+{
+    int numFrames;
+    bool stepsMatch;
+    double maxError;
+    double tolerance;
+
+    TrajectoryCheck() : numFrames(0), stepsMatch(true), maxError(0.0), tolerance(0.0) { }
+
+    bool Passed(int expectedFrames) const { return (numFrames == expectedFrames) && stepsMatch && (maxError <= tolerance); }
+};
+
+TrajectoryCheck VerifyTrajectory(const HeadlessOptions& options, const RunResult& result)
+{
+    TrajectoryReader reader(options.trajectoryPath);
+    TrajectoryCheck check;
+    check.tolerance = 0.5 * reader.Precision() * (1.0 + 1.0e-3);
+    if (reader.NumParticles() != options.numParticles)
+    {
+        check.stepsMatch = false;
+        return check;
+    }
+
+    std::vector<float_3> pos;
+    unsigned long long step = 0;
+    unsigned long long previousStep = 0;
+    while (reader.ReadFrame(pos, step))
+    {
+        if (((step % options.trajectoryInterval) != 0) || (step <= previousStep))
+            check.stepsMatch = false;
+        previousStep = step;
+        ++check.numFrames;
+    }
+    if (check.numFrames == 0)
+        return check;
+    if ((step != result.lastFrameStep) || (pos.size() != result.lastFramePos.size()))
+    {
+        check.stepsMatch = false;
+        return check;
+    }
+
+    for (size_t i = 0; i < pos.size(); ++i)
+    {
+        const float_3 written = result.lastFramePos[i];
+        const double errors[3] = { std::abs(pos[i].x - written.x), std::abs(pos[i].y - written.y), std::abs(pos[i].z - written.z) };
+        const double magnitudes[3] = { std::abs(written.x), std::abs(written.y), std::abs(written.z) };
+        for (int c = 0; c < 3; ++c)
+        {
+            // The quantized value is converted back to a float, which rounds relative to its size.
+            const double error = errors[c] - 2.0 * FLT_EPSILON * magnitudes[c];
+            check.maxError = std::max(check.maxError, error);
+        }
+    }
+    return check;
+}
+
+//--------------------------------------------------------------------------------------
+//  Direct summation and tree code crossover.
+//--------------------------------------------------------------------------------------
+
+const int kCrossoverMinParticles = 1024;
+
+//  Average time of numSteps steps starting from the initial particles.
+
+double StepSeconds(const INBodyCpu& nbody, bool inPlace, const std::vector<ParticleCpu>& initial, int numSteps)
+{
+    const int numParticles = static_cast<int>(initial.size());
+    std::vector<ParticleCpu> particlesOld(initial);
+    std::vector<ParticleCpu> particlesNew(initial);
+    ParticleCpu* pParticlesOld = particlesOld.data();
+    ParticleCpu* pParticlesNew = particlesNew.data();
+
+    const Clock::time_point start = Clock::now();
+    for (int step = 0; step < numSteps; ++step)
+    {
+        nbody.Integrate(pParticlesOld, pParticlesNew, numParticles);
+        if (!inPlace)
+            std::swap(pParticlesOld, pParticlesNew);
+    }
+    return ElapsedSeconds(start, Clock::now()) / numSteps;
+}
+
+//  NBodyAdvanced is the fastest direct summation integrator for a single system. The FMM is 
+//  timed alongside the Barnes-Hut tree code, with the same --theta and an expansion of 
+//  --order, to show how both scale. All the integrators start from the same initial 
+//  conditions for each particle count.
+
+void RunCrossover(const HeadlessOptions& options)
+{
+    const int tileSize = GetLevelOneCacheSize() / sizeof(ParticleCpu);
+    const int cellSize = (options.cellSize < 0) ? GetLevelTwoCellSize() : options.cellSize;
+    const NBodyAdvanced direct(g_softeningSquared, g_dampingFactor, options.deltaTime, g_particleMass, tileSize, cellSize, 
+        kDampedEuler, options.schedule);
+    const NBodyBarnesHut tree(g_softeningSquared, g_dampingFactor, options.deltaTime, g_particleMass, options.theta);
+    const NBodyFmm fmm(g_softeningSquared, g_dampingFactor, options.deltaTime, g_particleMass, options.order, options.theta);
+
+    std::cout << "Theta:              " << options.theta << std::endl
+        << "Order:              " << options.order << std::endl
+        << "Steps:              " << options.numSteps << std::endl
+        << "Particles     Direct (ms)     Tree (ms)    Speedup      FMM (ms)" << std::endl;
+    int crossover = 0;
+    for (int numParticles = kCrossoverMinParticles; numParticles <= std::max(options.numParticles, kCrossoverMinParticles); numParticles *= 2)
+    {
+        HeadlessOptions sized(options);
+        sized.numParticles = numParticles;
+        std::vector<ParticleCpu> initial(numParticles);
+        LoadInitialConditions(sized, 1, initial.data(), 0, numParticles);
+
+        const double directSeconds = StepSeconds(direct, true, initial, options.numSteps);
+        const double treeSeconds = StepSeconds(tree, false, initial, options.numSteps);
+        const double fmmSeconds = StepSeconds(fmm, false, initial, options.numSteps);
+        if ((crossover == 0) && (treeSeconds < directSeconds))
+            crossover = numParticles;
+        std::cout << std::setw(9) << numParticles << std::fixed << std::setprecision(3) 
+            << std::setw(16) << directSeconds * 1000.0 << std::setw(14) << treeSeconds * 1000.0 
+            << std::setw(11) << directSeconds / treeSeconds << std::setw(14) << fmmSeconds * 1000.0 << std::endl;
+    }
+
+    if (crossover > 0)
+        std::cout << "Crossover:          " << crossover << " particles" << std::endl;
+    else
+        std::cout << "Crossover:          direct summation was faster for all particle counts" << std::endl;
+}
+
+//--------------------------------------------------------------------------------------
+//  Main.
+//--------------------------------------------------------------------------------------
+//
+//  Interactions per second are those counted by integrators with counters, so the tree codes
+//  and the cell list report the interactions they actually calculate and a rank in a separate
+//  process reports only its own. The other integrators are direct summations of N^2 
+//  interactions per step, ensembles only calculate interactions within each system, 
+//  N^2 / numSystems per step.
+
+int main(int argc, char* argv[])
+{
+    HeadlessOptions options;
+    if (!ParseOptions(argc, argv, options))
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    if (options.crossover)
+    {
+        if (options.numThreads > 0)
+            CurrentScheduler::Create(SchedulerPolicy(2, MinConcurrency, options.numThreads, MaxConcurrency, options.numThreads));
+        RunCrossover(options);
+        if (options.numThreads > 0)
+            CurrentScheduler::Detach();
+        return 0;
+    }
+
+    std::unique_ptr<MappedCheckpoint> restart;
+    if (!options.restartPath.empty())
+    {
+        try
+        {
+            restart.reset(new MappedCheckpoint(options.restartPath));
+        }
+        catch (std::runtime_error& ex)
+        {
+            std::cout << ex.what() << std::endl;
+            return 1;
+        }
+        options.numParticles = restart->NumParticles();
+
+        // The velocities only continue the same trajectory with the scheme that wrote them.
+        if (restart->Scheme() != options.scheme)
+        {
+            std::cout << "The checkpoint was written with a different --scheme." << std::endl;
+            return 1;
+        }
+        options.resumeLeapfrog = restart->HalfStepVelocities();
+    }
+
+    // Checked before the factory as socket ranks wait for the other ranks to connect.
+    if ((options.integrator == "cpu-distributed") && options.socketTransport && (!options.restartPath.empty() || 
+        options.measureEnergy || !options.checkpointPath.empty() || !options.trajectoryPath.empty()))
+    {
+        std::cout << "Ranks using sockets do not support restarts, checkpoints, trajectories or energy measurement." << std::endl;
+        return 1;
+    }
+
+    if (options.verifyTrajectory && options.trajectoryPath.empty())
+    {
+        std::cout << "--verify-trajectory requires a --trajectory file." << std::endl;
+        return 1;
+    }
+
+    if (options.diagnostics && (options.integrator != "cpu-soa"))
+    {
+        std::cout << "Fused diagnostics are only calculated by the cpu-soa integrator." << std::endl;
+        return 1;
+    }
+
+    // Integrators that keep their own per-particle state between steps, or that treat ranges of 
+    // particles as separate systems, would see a different particle in each slot after a reorder.
+    if ((options.reorderInterval > 0) && ((options.integrator == "cpu-blockstep") || (options.integrator == "cpu-celllist") || 
+        (options.integrator == "cpu-precision") || (options.integrator == "cpu-ensemble") || 
+        (options.integrator.compare(0, 4, "amp-") == 0) || (options.scheme == kVelocityVerlet)))
+    {
+        std::cout << "Reordering is not supported by " << options.integrator << " or the verlet scheme." << std::endl;
+        return 1;
+    }
+
+    // The amp integrators return before the accelerator completes each step.
+    if (!options.metricsPath.empty() && (options.integrator.compare(0, 4, "amp-") == 0))
+    {
+        std::cout << "Metrics are only recorded for the cpu integrators." << std::endl;
+        return 1;
+    }
+
+    // Each system in an ensemble has the same number of particles.
+    if (options.integrator == "cpu-ensemble")
+    {
+        if (restart && ((options.numParticles % options.numSystems) != 0))
+        {
+            std::cout << "The checkpoint's particle count is not a multiple of the number of systems, " << options.numSystems 
+                << "." << std::endl;
+            return 1;
+        }
+        options.numParticles = RoundUp(options.numParticles, options.numSystems);
+    }
+
+    bool inPlace = false;
+    std::shared_ptr<INBodyCpu> pNBodyCpu = NBodyCpuFactory(options, inPlace);
+#if !defined(NBODY_CPU_SHORT_VECTORS)
+    std::shared_ptr<INBodyAmp> pNBodyAmp = pNBodyCpu ? nullptr : NBodyAmpFactory(options);
+    if (!pNBodyCpu && !pNBodyAmp)
+#else
+    if (!pNBodyCpu)
+#endif
+    {
+        std::cout << "Unknown or unavailable integrator and scheme: " << options.integrator << std::endl << std::endl;
+        PrintUsage();
+        return 1;
+    }
+    if (restart && (options.numParticles != restart->NumParticles()))
+    {
+        std::cout << "The checkpoint's particle count is not a multiple of the integrator's tile size." << std::endl;
+        return 1;
+    }
+
+    std::unique_ptr<TrajectoryWriter> trajectory;
+    if (!options.trajectoryPath.empty())
+    {
+        try
+        {
+            trajectory.reset(new TrajectoryWriter(options.trajectoryPath, options.numParticles, options.trajectoryPrecision));
+        }
+        catch (std::runtime_error& ex)
+        {
+            std::cout << ex.what() << std::endl;
+            return 1;
+        }
+    }
+
+    std::unique_ptr<NBodyMetricsRecorder> metrics;
+    if (!options.metricsPath.empty())
+    {
+        try
+        {
+            std::shared_ptr<INBodyMetricsSink> sink;
+            if (options.metricsPath == "console")
+                sink = std::make_shared<ConsoleMetricsSink>();
+            else
+                sink = std::make_shared<CsvMetricsSink>(options.metricsPath);
+            metrics.reset(new NBodyMetricsRecorder(sink, options.metricsInterval));
+        }
+        catch (std::runtime_error& ex)
+        {
+            std::cout << ex.what() << std::endl;
+            return 1;
+        }
+    }
+
+    // Limit the number of threads used by the PPL on this thread.
+    if (options.numThreads > 0)
+        CurrentScheduler::Create(SchedulerPolicy(2, MinConcurrency, options.numThreads, MaxConcurrency, options.numThreads));
+
+    RunResult result;
+    try
+    {
+#if !defined(NBODY_CPU_SHORT_VECTORS)
+        if (pNBodyAmp)
+            result = RunAmp(options, pNBodyAmp, NBodyAmpFactory(options), restart.get(), trajectory.get());
+        else
+#endif
+            result = RunCpu(options, pNBodyCpu, inPlace, restart.get(), trajectory.get(), metrics.get());
+    }
+    catch (std::runtime_error& ex)
+    {
+        std::cout << ex.what() << std::endl;
+    }
+    if (options.numThreads > 0)
+        CurrentScheduler::Detach();
+    const double elapsed = result.elapsed;
+    if (elapsed == 0.0)
+        return 1;
+
+    const double stepsPerSecond = options.numSteps / elapsed;
+    const std::shared_ptr<NBodyEnsemble> pEnsemble = std::dynamic_pointer_cast<NBodyEnsemble>(pNBodyCpu);
+    const int numSystems = pEnsemble ? pEnsemble->NumSystems() : 1;
+    const bool counted = (std::dynamic_pointer_cast<INBodyCounters>(pNBodyCpu) != nullptr);
+    const double interactionsPerSecond = counted ? result.interactions / elapsed :
+        stepsPerSecond * double(options.numParticles) * double(options.numParticles) / numSystems;
+    const bool socketRank = (std::dynamic_pointer_cast<NBodyDistributed>(pNBodyCpu) != nullptr);
+    std::cout << "Integrator:         " << options.integrator << std::endl
+        << "Particles:          " << options.numParticles << std::endl;
+    if (pEnsemble)
+        std::cout << "Systems:            " << numSystems << " of " << pEnsemble->SystemSize(options.numParticles) << " particles" << std::endl;
+    std::cout << "Steps:              " << options.numSteps << std::endl
+        << "Threads:            " << (options.numThreads > 0 ? options.numThreads : GetProcessorCount()) << std::endl
+        << std::fixed << std::setprecision(3)
+        << "Elapsed (s):        " << elapsed << std::endl
+        << "Steps/s:            " << stepsPerSecond << std::endl
+        << std::scientific << std::setprecision(3)
+        << "Interactions/s:     " << interactionsPerSecond << (socketRank ? " (this rank)" : "") << std::endl
+        << std::fixed << std::setprecision(3)
+        << "Simulated time/s:   " << options.numSteps * options.deltaTime / elapsed << std::endl;
+
+    // Restarted simulations do not generate initial conditions.
+    if (result.initialization > 0.0)
+    {
+        std::cout << "Initialization (s): " << result.initialization << " (" << std::scientific << std::setprecision(3) 
+            << result.initializedParticles / result.initialization << " particles/s)" << std::endl;
+    }
+
+    if (pNBodyCpu)
+    {
+        const CpuTopology topology = GetCpuTopology();
+        std::cout << "Caches (KB):        L1 " << topology.levelOneCacheSize / 1024 << ", L2 " << topology.levelTwoCacheSize / 1024 
+                << ", L3 " << topology.levelThreeCacheSize / 1024 << ", " << topology.cacheLineSize << " byte lines" << std::endl
+            << "Topology:           " << topology.numCores << " cores, " << topology.numLogicalProcessors << " logical processors, " 
+                << topology.numNumaNodes << " NUMA nodes" << std::endl;
+    }
+
+    // Energy drift is relative to the magnitude of the initial energy.
+    if (options.measureEnergy)
+    {
+        std::cout << std::scientific << std::setprecision(6)
+            << "Initial energy:     " << result.initialEnergy << std::endl
+            << "Final energy:       " << result.finalEnergy << std::endl
+            << std::scientific << std::setprecision(3)
+            << "Energy drift:       " << (result.finalEnergy - result.initialEnergy) / std::abs(result.initialEnergy) << std::endl;
+    }
+
+    // The fused diagnostics describe the state at the start of the first and last steps.
+    if (options.diagnostics)
+    {
+        const NBodyDiagnostics& first = result.firstDiagnostics;
+        const NBodyDiagnostics& last = result.lastDiagnostics;
+        std::cout << std::scientific << std::setprecision(6)
+            << "Fused energy:       " << first.TotalEnergy() << " -> " << last.TotalEnergy() << std::endl
+            << "Kinetic energy:     " << first.kineticEnergy << " -> " << last.kineticEnergy << std::endl
+            << "Potential energy:   " << first.potentialEnergy << " -> " << last.potentialEnergy << std::endl
+            << std::setprecision(3)
+            << "Fused drift:        " << (last.TotalEnergy() - first.TotalEnergy()) / std::abs(first.TotalEnergy()) << std::endl
+            << "Momentum:           (" << first.momentum[0] << ", " << first.momentum[1] << ", " << first.momentum[2] << ") -> (" 
+                << last.momentum[0] << ", " << last.momentum[1] << ", " << last.momentum[2] << ")" << std::endl
+            << "Center of mass:     (" << first.centerOfMass[0] << ", " << first.centerOfMass[1] << ", " << first.centerOfMass[2] 
+                << ") -> (" << last.centerOfMass[0] << ", " << last.centerOfMass[1] << ", " << last.centerOfMass[2] << ")" << std::endl;
+    }
+
+    // Block timesteps are compared with a fixed step small enough for the finest level.
+    const std::shared_ptr<NBodyBlockStep> pBlockStep = std::dynamic_pointer_cast<NBodyBlockStep>(pNBodyCpu);
+    if (pBlockStep)
+    {
+        const double fixedForceCount = double(options.numParticles) * double(1 << pBlockStep->MaxLevel());
+        std::cout << std::fixed << std::setprecision(3)
+            << "Sub-steps:          " << pBlockStep->SubStepCount() << " (last step)" << std::endl
+            << "Accelerations:      " << pBlockStep->ForceCount() << " (last step, " 
+            << 100.0 * pBlockStep->ForceCount() / fixedForceCount << "% of fixed step)" << std::endl;
+    }
+
+    const std::shared_ptr<NBodyCellList> pCellList = std::dynamic_pointer_cast<NBodyCellList>(pNBodyCpu);
+    if (pCellList)
+    {
+        std::cout << std::fixed << std::setprecision(1)
+            << "Neighbors/particle: " << double(pCellList->NeighborCount()) / options.numParticles << std::endl
+            << "List rebuilds:      " << pCellList->RebuildCount() << std::endl;
+    }
+
+    const std::shared_ptr<NBodyPartitioned> pPartitioned = std::dynamic_pointer_cast<NBodyPartitioned>(pNBodyCpu);
+    if (pPartitioned)
+    {
+        std::cout << "Partitions:         " << pPartitioned->NumPartitions() << std::endl
+            << "Exchanged/step:     " << pPartitioned->BytesExchanged() << " bytes (" 
+            << std::fixed << std::setprecision(1) << double(pPartitioned->BytesExchanged()) / options.numParticles 
+            << " bytes/particle)" << std::endl;
+    }
+
+    // Ranks in separate processes report their own exchange, ranks in this process report the 
+    // total bytes sent and the longest wait of any rank.
+    const std::shared_ptr<NBodyDistributed> pDistributed = std::dynamic_pointer_cast<NBodyDistributed>(pNBodyCpu);
+    const std::shared_ptr<NBodyLocalRanks> pLocalRanks = std::dynamic_pointer_cast<NBodyLocalRanks>(pNBodyCpu);
+    if (pLocalRanks)
+    {
+        std::cout << "Ranks:              " << pLocalRanks->NumRanks() << " (local)" << std::endl
+            << "Sent/step:          " << pLocalRanks->BytesSent() << " bytes" << std::endl
+            << std::fixed << std::setprecision(3)
+            << "Exchange wait:      " << pLocalRanks->WaitSeconds() * 1000.0 << " ms (last step)" << std::endl;
+    }
+    if (pDistributed)
+    {
+        std::cout << "Rank:               " << pDistributed->Rank() << " of " << pDistributed->NumRanks() << " (socket)" << std::endl
+            << "Sent/step:          " << pDistributed->BytesSent() << " bytes" << std::endl
+            << std::fixed << std::setprecision(3)
+            << "Exchange wait:      " << pDistributed->WaitSeconds() * 1000.0 << " ms (last step)" << std::endl;
+    }
+
+    // Bandwidth is for the last step, in GB/s.
+    const std::shared_ptr<NBodyNuma> pNuma = std::dynamic_pointer_cast<NBodyNuma>(pNBodyCpu);
+    if (pNuma)
+    {
+        std::cout << "Replicated:         " << (pNuma->ReplicatePositions() ? "yes" : "no") << std::endl;
+        for (int node = 0; node < pNuma->NumNodes(); ++node)
+        {
+            const NumaNodeCounters& counters = pNuma->Counters(node);
+            const double gigabytesPerSecond = (counters.seconds > 0.0) ? 1.0e-9 / counters.seconds : 0.0;
+            std::cout << "Node " << std::setw(2) << node << ":            " << counters.numParticles << " particles, " 
+                << std::fixed << std::setprecision(3) << counters.seconds * 1000.0 << " ms, source " 
+                << counters.sourceBytes * gigabytesPerSecond << " GB/s, replica " 
+                << counters.replicaBytes * gigabytesPerSecond << " GB/s, write " << counters.writeBytes * gigabytesPerSecond 
+                << " GB/s";
+            if (pNuma->ReplicatePositions())
+                std::cout << ", replica " << std::setprecision(1) << 100.0 * pNuma->ReplicaLocality(node, options.numParticles) 
+                    << "% local";
+            std::cout << std::endl;
+        }
+    }
+
+    // Step times exclude the reordering. The distance between particles that are next to each 
+    // other in memory stands in for cache misses, which are not measured.
+    if (result.reorderCount > 0)
+    {
+        const int orderedSteps = options.numSteps - result.unorderedSteps;
+        std::cout << std::fixed << std::setprecision(3)
+            << "Reorders:           " << result.reorderCount << ", " << result.reorderSeconds * 1000.0 / result.reorderCount 
+                << " ms each (" << 100.0 * result.reorderSeconds / elapsed << "% of elapsed)" << std::endl
+            << "Step (ms):          " << result.unorderedStepSeconds * 1000.0 / result.unorderedSteps << " -> ";
+        if (orderedSteps > 0)
+            std::cout << result.orderedStepSeconds * 1000.0 / orderedSteps << std::endl;
+        else
+            std::cout << "none after the last reorder" << std::endl;
+        std::cout << "Neighbor distance:  " << result.neighborDistanceBefore << " -> " << result.neighborDistanceAfter << std::endl;
+    }
+
+    const std::shared_ptr<NBodyPrecisionBase> pPrecision = std::dynamic_pointer_cast<NBodyPrecisionBase>(pNBodyCpu);
+    if (pPrecision)
+    {
+        const char* const modes[] = { "float", "mixed", "double" };
+        std::cout << "Precision:          " << modes[pPrecision->Mode()] << std::endl
+            << std::scientific << std::setprecision(3)
+            << "Force error (rms):  " << result.rmsForceError << std::endl
+            << "Force error (max):  " << result.maxForceError << std::endl;
+    }
+
+    const std::shared_ptr<NBodyFmm> pFmm = std::dynamic_pointer_cast<NBodyFmm>(pNBodyCpu);
+    if (pFmm)
+    {
+        std::cout << "Order:              " << pFmm->Order() << std::endl
+            << "Theta:              " << options.theta << std::endl
+            << std::scientific << std::setprecision(3)
+            << "Force error (rms):  " << result.rmsForceError << std::endl
+            << "Force error (max):  " << result.maxForceError << std::endl;
+    }
+
+    // The trajectory overhead is the time the integration loop spent waiting for and copying 
+    // into trajectory buffers, the encoding runs concurrently with the integration.
+    if (trajectory)
+    {
+        const double rawBytes = double(trajectory->FrameCount()) * options.numParticles * sizeof(float_3);
+        std::cout << std::fixed << std::setprecision(3)
+            << "Trajectory frames:  " << trajectory->FrameCount() << std::endl
+            << "Trajectory (s):     " << trajectory->WriteSeconds() << " (" 
+            << 100.0 * trajectory->WriteSeconds() / elapsed << "% of elapsed)" << std::endl
+            << "Compression ratio:  " << rawBytes / trajectory->EncodedBytes() << std::endl;
+    }
+
+    if (trajectory && options.verifyTrajectory)
+    {
+        try
+        {
+            const TrajectoryCheck check = VerifyTrajectory(options, result);
+            const bool passed = check.Passed(trajectory->FrameCount());
+            std::cout << std::scientific << std::setprecision(3)
+                << "Trajectory check:   " << (passed ? "passed" : "FAILED") << ", " << check.numFrames << " of " 
+                    << trajectory->FrameCount() << " frames read, " << "max error " << check.maxError 
+                    << " (limit " << check.tolerance << ")" << (check.stepsMatch ? "" : ", steps do not match") << std::endl;
+            if (!passed)
+                return 1;
+        }
+        catch (std::runtime_error& ex)
+        {
+            std::cout << "Trajectory check:   FAILED, " << ex.what() << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,586 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the 
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+
+#pragma once
+
+#include <math.h>
+#include <algorithm>
+
+#include "Common.h"
+#include "NBodyCpu.h"
+#include "ParticleCpu.h"
+
+#if defined(NBODY_ISA_NEON)
+#include <arm_neon.h>
+#else
+#include <immintrin.h>
+#endif
+
+//--------------------------------------------------------------------------------------
+//  Body-body interaction kernels for ParticleCpu, specialized for each instruction set.
+//--------------------------------------------------------------------------------------
+//
+//  Each specialization of ParticleKernel provides three static functions:
+//
+//  Gather      - Return the acceleration of a particle at pos due to all the particles in 
+//                [pParticles, pParticles + numParticles). Used by NBodySimpleInteractionEngine.
+//  GatherBlock - Calculate the accelerations of kTargetBlockSize particles, pTargets, due to all
+//                the particles in [pParticles, pParticles + numParticles). The targets are held
+//                in registers, one target per element, and each source position is loaded once
+//                for the whole block. Used by NBodyBlockedMultiCore.
+//  Symmetric   - Update the accelerations of both particles for every pair in [iBegin, iEnd) 
+//                x [jBegin, jEnd). The ranges must not overlap and the particles must be aligned
+//                to SSE_ALIGNMENTBOUNDARY. Used by NBodyAdvancedInteractionEngine.
+//
+//  Engines select a specialization once, when they are constructed, and call a loop that is 
+//  itself a template on CpuIsa, so the kernel is inlined into the engine's loops. The SSE and
+//  SSE4 kernels are the original engine implementations. The AVX2 and AVX-512 kernels 
+//  interact a target with two or four sources at once by placing one ParticleCpu position in
+//  each 128 bit lane. All the kernels except AVX-512 use a 12 bit reciprocal square root 
+//  estimate, AVX-512 uses a 14 bit estimate.
+//
+//  The padding float after each float_3 is assumed to be zero, as it is for particles 
+//  created by LoadClusterParticles.
+
+const int kTargetBlockSize = 8;
+
+template <CpuIsa Isa>
+struct ParticleKernel;
+
+template <>
+struct ParticleKernel<kIsaScalar>
+{
+    static inline float_3 Gather(const ParticleCpu* const pParticles, int numParticles, const float_3& pos, 
+        float softeningSquared, float particleMass)
+    {
+        float_3 acc(0.0f);
+        for (int j = 0; j < numParticles; ++j)
+        {
+            const float_3 r = pParticles[j].pos - pos;
+
+            float distSqr = SqrLength(r) + softeningSquared;
+            float invDist = 1.0f / sqrt(distSqr);
+            float invDistCube =  invDist * invDist * invDist;
+            float s = particleMass * invDistCube;
+
+            // Note: The book code contains typos, the = operator is used instead of +=. 
+            // The code below is correct.
+            acc += r * s;
+        }
+        return acc;
+    }
+
+    static inline void GatherBlock(const ParticleCpu* const pParticles, int numParticles, const ParticleCpu* const pTargets, 
+        float_3* const pAcc, float softeningSquared, float particleMass)
+    {
+        for (int t = 0; t < kTargetBlockSize; ++t)
+            pAcc[t] = float_3(0.0f);
+
+        for (int j = 0; j < numParticles; ++j)
+        {
+            const float_3 source = pParticles[j].pos;
+            for (int t = 0; t < kTargetBlockSize; ++t)
+            {
+                const float_3 r = source - pTargets[t].pos;
+
+                float distSqr = SqrLength(r) + softeningSquared;
+                float invDist = 1.0f / sqrt(distSqr);
+                float invDistCube =  invDist * invDist * invDist;
+                pAcc[t] += r * (particleMass * invDistCube);
+            }
+        }
+    }
+
+    static inline void Symmetric(ParticleCpu* const pParticles, const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd, 
+        float softeningSquared, float particleMass)
+    {
+        for (size_t i = iBegin; i < iEnd; ++i)
+        {
+            for (size_t j = jBegin; j < jEnd; ++j)
+            {
+                const float_3 r = pParticles[j].pos - pParticles[i].pos;
+                const float distSqr = SqrLength(r) + softeningSquared;
+
+                float invDist = 1.0f / sqrt(distSqr);
+                float invDistCube =  invDist * invDist * invDist;
+                float s = particleMass * invDistCube;
+
+                // Cache intermediate acceleration results for both particles in this interaction.
+                pParticles[i].acc += r * s;
+                pParticles[j].acc -= r * s;
+            }
+        }
+    }
+};
+
+#if !defined(NBODY_ISA_NEON)
+
+//  Squared length of r broadcast to all four elements. SSE4 adds the _mm_dp_ps intrinsic.
+
+template <CpuIsa Isa>
+inline __m128 SqrLengthSSE(const __m128 r);
+
+template <>
+inline __m128 SqrLengthSSE<kIsaSSE>(const __m128 r)
+{
+    __m128 distSqr = _mm_mul_ps(r, r);    //x    y    z    ?
+    __m128 rshuf = _mm_shuffle_ps(distSqr, distSqr, _MM_SHUFFLE(0,3,2,1));
+    distSqr = _mm_add_ps(distSqr, rshuf);  //x+y, y+z, z+?, ?+x
+    rshuf = _mm_shuffle_ps(distSqr, distSqr, _MM_SHUFFLE(1,0,3,2));
+    return _mm_add_ps(rshuf, distSqr);     //x+y+z+0, y+z+0+X, z+0+x+y, 0+x+y+z
+}
+
+template <>
+inline __m128 SqrLengthSSE<kIsaSSE4>(const __m128 r)
+{
+    return _mm_dp_ps(r, r, 0x7F);
+}
+
+inline float_3 ToFloat3(const __m128 value)
+{
+    float result[4];
+    _mm_storeu_ps(result, value);
+    return float_3(result[0], result[1], result[2]);
+}
+
+//  The acceleration of pos due to the particle at posSource, multiplied by r.
+
+template <CpuIsa Isa>
+inline __m128 InteractionSSE(const __m128 pos, const __m128 posSource, const __m128 softeningSquared, const __m128 particleMass)
+{
+    //const float_3 r = pParticles[j].pos - pos;
+    const __m128 r = _mm_sub_ps(posSource, pos);
+
+    //float distSqr = float_3::SqrLength(r) + m_softeningSquared;
+    const __m128 distSqr = _mm_add_ps(SqrLengthSSE<Isa>(r), softeningSquared);
+
+    //float invDist = 1.0f / sqrt(distSqr);
+    //float invDistCube =  invDist * invDist * invDist;
+    //float s = m_particleMass * invDistCube;
+    const __m128 invDist = _mm_rsqrt_ps(distSqr);
+    const __m128 invDistCube = _mm_mul_ps(_mm_mul_ps(invDist, invDist), invDist);
+    const __m128 s = _mm_mul_ps(particleMass, invDistCube);
+
+    return _mm_mul_ps(r, s);
+}
+
+template <CpuIsa Isa>
+struct ParticleKernelSSE
+{
+    static inline float_3 Gather(const ParticleCpu* const pParticles, int numParticles, const float_3& pos, 
+        float softeningSquared, float particleMass)
+    {
+        const __m128 softening = _mm_set1_ps(softeningSquared);
+        const __m128 mass = _mm_set1_ps(particleMass);
+        const __m128 target = _mm_set_ps(0.0f, pos.z, pos.y, pos.x);
+        __m128 acc = _mm_setzero_ps();
+
+        for (int j = 0; j < numParticles; ++j)
+            acc = _mm_add_ps(InteractionSSE<Isa>(target, _mm_loadu_ps((const float*)&pParticles[j].pos), softening, mass), acc);
+        return ToFloat3(acc);
+    }
+
+    //  The targets are transposed into two groups of four, each with an x, y and z register.
+
+    static inline void GatherBlock(const ParticleCpu* const pParticles, int numParticles, const ParticleCpu* const pTargets, 
+        float_3* const pAcc, float softeningSquared, float particleMass)
+    {
+        const int numGroups = kTargetBlockSize / 4;
+        const __m128 softening = _mm_set1_ps(softeningSquared);
+        const __m128 mass = _mm_set1_ps(particleMass);
+        __m128 posX[numGroups], posY[numGroups], posZ[numGroups];
+        __m128 accX[numGroups], accY[numGroups], accZ[numGroups];
+        for (int g = 0; g < numGroups; ++g)
+        {
+            const ParticleCpu* const p = pTargets + 4 * g;
+            posX[g] = _mm_set_ps(p[3].pos.x, p[2].pos.x, p[1].pos.x, p[0].pos.x);
+            posY[g] = _mm_set_ps(p[3].pos.y, p[2].pos.y, p[1].pos.y, p[0].pos.y);
+            posZ[g] = _mm_set_ps(p[3].pos.z, p[2].pos.z, p[1].pos.z, p[0].pos.z);
+            accX[g] = accY[g] = accZ[g] = _mm_setzero_ps();
+        }
+
+        for (int j = 0; j < numParticles; ++j)
+        {
+            const __m128 sourceX = _mm_load1_ps(&pParticles[j].pos.x);
+            const __m128 sourceY = _mm_load1_ps(&pParticles[j].pos.y);
+            const __m128 sourceZ = _mm_load1_ps(&pParticles[j].pos.z);
+            for (int g = 0; g < numGroups; ++g)
+            {
+                const __m128 rX = _mm_sub_ps(sourceX, posX[g]);
+                const __m128 rY = _mm_sub_ps(sourceY, posY[g]);
+                const __m128 rZ = _mm_sub_ps(sourceZ, posZ[g]);
+                __m128 distSqr = _mm_add_ps(_mm_mul_ps(rX, rX), softening);
+                distSqr = _mm_add_ps(_mm_mul_ps(rY, rY), distSqr);
+                distSqr = _mm_add_ps(_mm_mul_ps(rZ, rZ), distSqr);
+
+                const __m128 invDist = _mm_rsqrt_ps(distSqr);
+                const __m128 s = _mm_mul_ps(mass, _mm_mul_ps(_mm_mul_ps(invDist, invDist), invDist));
+                accX[g] = _mm_add_ps(_mm_mul_ps(rX, s), accX[g]);
+                accY[g] = _mm_add_ps(_mm_mul_ps(rY, s), accY[g]);
+                accZ[g] = _mm_add_ps(_mm_mul_ps(rZ, s), accZ[g]);
+            }
+        }
+
+        for (int g = 0; g < numGroups; ++g)
+        {
+            float x[4], y[4], z[4];
+            _mm_storeu_ps(x, accX[g]);
+            _mm_storeu_ps(y, accY[g]);
+            _mm_storeu_ps(z, accZ[g]);
+            for (int t = 0; t < 4; ++t)
+                pAcc[4 * g + t] = float_3(x[t], y[t], z[t]);
+        }
+    }
+
+    static inline void Symmetric(ParticleCpu* const pParticles, const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd, 
+        float softeningSquared, float particleMass)
+    {
+        ParticleSSE* const pParticlesSSE = reinterpret_cast<ParticleSSE*>(pParticles);
+        const __m128 softening = _mm_set1_ps(softeningSquared);
+        const __m128 mass = _mm_set1_ps(particleMass);
+
+        for (size_t i = iBegin; i < iEnd; ++i)
+        {
+            const __m128 pos = pParticlesSSE[i].pos;
+            __m128 acc = _mm_setzero_ps();
+            for (size_t j = jBegin; j < jEnd; ++j)
+            {
+                //m_pBodiesCache[i].acc += r * s;
+                //m_pBodiesCache[j].acc -= r * s;
+                const __m128 k = InteractionSSE<Isa>(pos, pParticlesSSE[j].pos, softening, mass);
+                acc = _mm_add_ps(acc, k);
+                pParticlesSSE[j].acc = _mm_sub_ps(pParticlesSSE[j].acc, k);
+            }
+            pParticlesSSE[i].acc = _mm_add_ps(pParticlesSSE[i].acc, acc);
+        }
+    }
+};
+
+template <>
+struct ParticleKernel<kIsaSSE> : public ParticleKernelSSE<kIsaSSE>
+{
+};
+
+template <>
+struct ParticleKernel<kIsaSSE4> : public ParticleKernelSSE<kIsaSSE4>
+{
+};
+
+//  AVX2 kernels, two sources in each register. _mm256_dp_ps calculates a dot product within 
+//  each 128 bit lane. The last source of an odd sized range uses the SSE4 kernel.
+
+inline __m256 LoadPositionsAVX2(const ParticleCpu* const pParticles)
+{
+    return _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps((const float*)&pParticles[0].pos)), 
+        _mm_loadu_ps((const float*)&pParticles[1].pos), 1);
+}
+
+inline __m256 InteractionAVX2(const __m256 pos, const __m256 posSource, const __m256 softeningSquared, const __m256 particleMass)
+{
+    const __m256 r = _mm256_sub_ps(posSource, pos);
+    const __m256 distSqr = _mm256_add_ps(_mm256_dp_ps(r, r, 0x7F), softeningSquared);
+    const __m256 invDist = _mm256_rsqrt_ps(distSqr);
+    const __m256 s = _mm256_mul_ps(particleMass, _mm256_mul_ps(_mm256_mul_ps(invDist, invDist), invDist));
+    return _mm256_mul_ps(r, s);
+}
+
+inline __m128 SumLanesAVX2(const __m256 value)
+{
+    return _mm_add_ps(_mm256_castps256_ps128(value), _mm256_extractf128_ps(value, 1));
+}
+
+template <>
+struct ParticleKernel<kIsaAVX2>
+{
+    static inline float_3 Gather(const ParticleCpu* const pParticles, int numParticles, const float_3& pos, 
+        float softeningSquared, float particleMass)
+    {
+        const __m256 softening = _mm256_set1_ps(softeningSquared);
+        const __m256 mass = _mm256_set1_ps(particleMass);
+        const __m256 target = _mm256_set_ps(0.0f, pos.z, pos.y, pos.x, 0.0f, pos.z, pos.y, pos.x);
+        __m256 acc = _mm256_setzero_ps();
+
+        int j = 0;
+        for (; j + 2 <= numParticles; j += 2)
+            acc = _mm256_add_ps(InteractionAVX2(target, LoadPositionsAVX2(pParticles + j), softening, mass), acc);
+        return ToFloat3(SumLanesAVX2(acc)) + 
+            ParticleKernel<kIsaSSE4>::Gather(pParticles + j, numParticles - j, pos, softeningSquared, particleMass);
+    }
+
+    //  The targets are transposed into an x, y and z register, one target in each element.
+
+    static inline void GatherBlock(const ParticleCpu* const pParticles, int numParticles, const ParticleCpu* const pTargets, 
+        float_3* const pAcc, float softeningSquared, float particleMass)
+    {
+        static_assert(kTargetBlockSize == 8, "The AVX2 kernel holds one block of targets in each register.");
+        const __m256 softening = _mm256_set1_ps(softeningSquared);
+        const __m256 mass = _mm256_set1_ps(particleMass);
+        const ParticleCpu* const p = pTargets;
+        const __m256 posX = _mm256_set_ps(p[7].pos.x, p[6].pos.x, p[5].pos.x, p[4].pos.x, p[3].pos.x, p[2].pos.x, p[1].pos.x, p[0].pos.x);
+        const __m256 posY = _mm256_set_ps(p[7].pos.y, p[6].pos.y, p[5].pos.y, p[4].pos.y, p[3].pos.y, p[2].pos.y, p[1].pos.y, p[0].pos.y);
+        const __m256 posZ = _mm256_set_ps(p[7].pos.z, p[6].pos.z, p[5].pos.z, p[4].pos.z, p[3].pos.z, p[2].pos.z, p[1].pos.z, p[0].pos.z);
+        __m256 accX = _mm256_setzero_ps();
+        __m256 accY = _mm256_setzero_ps();
+        __m256 accZ = _mm256_setzero_ps();
+
+        for (int j = 0; j < numParticles; ++j)
+        {
+            const __m256 rX = _mm256_sub_ps(_mm256_broadcast_ss(&pParticles[j].pos.x), posX);
+            const __m256 rY = _mm256_sub_ps(_mm256_broadcast_ss(&pParticles[j].pos.y), posY);
+            const __m256 rZ = _mm256_sub_ps(_mm256_broadcast_ss(&pParticles[j].pos.z), posZ);
+            __m256 distSqr = _mm256_fmadd_ps(rX, rX, softening);
+            distSqr = _mm256_fmadd_ps(rY, rY, distSqr);
+            distSqr = _mm256_fmadd_ps(rZ, rZ, distSqr);
+
+            const __m256 invDist = _mm256_rsqrt_ps(distSqr);
+            const __m256 s = _mm256_mul_ps(mass, _mm256_mul_ps(_mm256_mul_ps(invDist, invDist), invDist));
+            accX = _mm256_fmadd_ps(rX, s, accX);
+            accY = _mm256_fmadd_ps(rY, s, accY);
+            accZ = _mm256_fmadd_ps(rZ, s, accZ);
+        }
+
+        float x[8], y[8], z[8];
+        _mm256_storeu_ps(x, accX);
+        _mm256_storeu_ps(y, accY);
+        _mm256_storeu_ps(z, accZ);
+        for (int t = 0; t < kTargetBlockSize; ++t)
+            pAcc[t] = float_3(x[t], y[t], z[t]);
+    }
+
+    static inline void Symmetric(ParticleCpu* const pParticles, const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd, 
+        float softeningSquared, float particleMass)
+    {
+        ParticleSSE* const pParticlesSSE = reinterpret_cast<ParticleSSE*>(pParticles);
+        const __m256 softening = _mm256_set1_ps(softeningSquared);
+        const __m256 mass = _mm256_set1_ps(particleMass);
+
+        size_t jPairsEnd = jBegin + ((jEnd - jBegin) & ~size_t(1));
+        for (size_t i = iBegin; i < iEnd; ++i)
+        {
+            const __m256 pos = _mm256_broadcast_ps(&pParticlesSSE[i].pos);
+            __m256 acc = _mm256_setzero_ps();
+            for (size_t j = jBegin; j < jPairsEnd; j += 2)
+            {
+                const __m256 k = InteractionAVX2(pos, LoadPositionsAVX2(pParticles + j), softening, mass);
+                acc = _mm256_add_ps(acc, k);
+                pParticlesSSE[j].acc = _mm_sub_ps(pParticlesSSE[j].acc, _mm256_castps256_ps128(k));
+                pParticlesSSE[j + 1].acc = _mm_sub_ps(pParticlesSSE[j + 1].acc, _mm256_extractf128_ps(k, 1));
+            }
+            pParticlesSSE[i].acc = _mm_add_ps(pParticlesSSE[i].acc, SumLanesAVX2(acc));
+        }
+        ParticleKernel<kIsaSSE4>::Symmetric(pParticles, iBegin, iEnd, jPairsEnd, jEnd, softeningSquared, particleMass);
+    }
+};
+
+//  AVX-512 kernels, four sources in each register. There is no 512 bit dot product so the 
+//  squared length is summed within each 128 bit lane with two permutes. The w element is
+//  masked out so the padding does not contribute. Ranges that are not a multiple of four 
+//  finish with the AVX2 kernel.
+
+inline __m512 LoadPositionsAVX512(const ParticleCpu* const pParticles)
+{
+    __m512 pos = _mm512_castps128_ps512(_mm_loadu_ps((const float*)&pParticles[0].pos));
+    pos = _mm512_insertf32x4(pos, _mm_loadu_ps((const float*)&pParticles[1].pos), 1);
+    pos = _mm512_insertf32x4(pos, _mm_loadu_ps((const float*)&pParticles[2].pos), 2);
+    return _mm512_insertf32x4(pos, _mm_loadu_ps((const float*)&pParticles[3].pos), 3);
+}
+
+inline __m512 InteractionAVX512(const __m512 pos, const __m512 posSource, const __m512 softeningSquared, const __m512 particleMass)
+{
+    const __m512 r = _mm512_sub_ps(posSource, pos);
+    __m512 distSqr = _mm512_maskz_mul_ps(0x7777, r, r);
+    distSqr = _mm512_add_ps(distSqr, _mm512_permute_ps(distSqr, _MM_SHUFFLE(2,3,0,1)));
+    distSqr = _mm512_add_ps(distSqr, _mm512_permute_ps(distSqr, _MM_SHUFFLE(1,0,3,2)));
+    distSqr = _mm512_add_ps(distSqr, softeningSquared);
+    const __m512 invDist = _mm512_rsqrt14_ps(distSqr);
+    const __m512 s = _mm512_mul_ps(particleMass, _mm512_mul_ps(_mm512_mul_ps(invDist, invDist), invDist));
+    return _mm512_mul_ps(r, s);
+}
+
+inline __m128 SumLanesAVX512(const __m512 value)
+{
+    return _mm_add_ps(_mm_add_ps(_mm512_castps512_ps128(value), _mm512_extractf32x4_ps(value, 1)), 
+        _mm_add_ps(_mm512_extractf32x4_ps(value, 2), _mm512_extractf32x4_ps(value, 3)));
+}
+
+template <>
+struct ParticleKernel<kIsaAVX512>
+{
+    static inline float_3 Gather(const ParticleCpu* const pParticles, int numParticles, const float_3& pos, 
+        float softeningSquared, float particleMass)
+    {
+        const __m512 softening = _mm512_set1_ps(softeningSquared);
+        const __m512 mass = _mm512_set1_ps(particleMass);
+        const __m512 target = _mm512_broadcast_f32x4(_mm_set_ps(0.0f, pos.z, pos.y, pos.x));
+        __m512 acc = _mm512_setzero_ps();
+
+        int j = 0;
+        for (; j + 4 <= numParticles; j += 4)
+            acc = _mm512_add_ps(InteractionAVX512(target, LoadPositionsAVX512(pParticles + j), softening, mass), acc);
+        return ToFloat3(SumLanesAVX512(acc)) + 
+            ParticleKernel<kIsaAVX2>::Gather(pParticles + j, numParticles - j, pos, softeningSquared, particleMass);
+    }
+
+    //  A block of eight targets fills a 256 bit register so this is the AVX2 kernel.
+
+    static inline void GatherBlock(const ParticleCpu* const pParticles, int numParticles, const ParticleCpu* const pTargets, 
+        float_3* const pAcc, float softeningSquared, float particleMass)
+    {
+        ParticleKernel<kIsaAVX2>::GatherBlock(pParticles, numParticles, pTargets, pAcc, softeningSquared, particleMass);
+    }
+
+    static inline void Symmetric(ParticleCpu* const pParticles, const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd, 
+        float softeningSquared, float particleMass)
+    {
+        ParticleSSE* const pParticlesSSE = reinterpret_cast<ParticleSSE*>(pParticles);
+        const __m512 softening = _mm512_set1_ps(softeningSquared);
+        const __m512 mass = _mm512_set1_ps(particleMass);
+
+        size_t jQuadsEnd = jBegin + ((jEnd - jBegin) & ~size_t(3));
+        for (size_t i = iBegin; i < iEnd; ++i)
+        {
+            const __m512 pos = _mm512_broadcast_f32x4(pParticlesSSE[i].pos);
+            __m512 acc = _mm512_setzero_ps();
+            for (size_t j = jBegin; j < jQuadsEnd; j += 4)
+            {
+                const __m512 k = InteractionAVX512(pos, LoadPositionsAVX512(pParticles + j), softening, mass);
+                acc = _mm512_add_ps(acc, k);
+                pParticlesSSE[j].acc = _mm_sub_ps(pParticlesSSE[j].acc, _mm512_castps512_ps128(k));
+                pParticlesSSE[j + 1].acc = _mm_sub_ps(pParticlesSSE[j + 1].acc, _mm512_extractf32x4_ps(k, 1));
+                pParticlesSSE[j + 2].acc = _mm_sub_ps(pParticlesSSE[j + 2].acc, _mm512_extractf32x4_ps(k, 2));
+                pParticlesSSE[j + 3].acc = _mm_sub_ps(pParticlesSSE[j + 3].acc, _mm512_extractf32x4_ps(k, 3));
+            }
+            pParticlesSSE[i].acc = _mm_add_ps(pParticlesSSE[i].acc, SumLanesAVX512(acc));
+        }
+        ParticleKernel<kIsaAVX2>::Symmetric(pParticles, iBegin, iEnd, jQuadsEnd, jEnd, softeningSquared, particleMass);
+    }
+};
+
+#else
+
+//  NEON kernel for ARM. The reciprocal square root estimate is refined with one vrsqrts step
+//  to match the accuracy of the SSE estimate.
+
+inline float32x4_t InteractionNEON(const float32x4_t pos, const float32x4_t posSource, float softeningSquared, float particleMass)
+{
+    const float32x4_t r = vsubq_f32(posSource, pos);
+    const float32x4_t r2 = vmulq_f32(r, r);
+    float32x2_t distSqr = vadd_f32(vget_low_f32(r2), vset_lane_f32(0.0f, vget_high_f32(r2), 1));
+    distSqr = vadd_f32(vpadd_f32(distSqr, distSqr), vdup_n_f32(softeningSquared));
+
+    float32x2_t invDist = vrsqrte_f32(distSqr);
+    invDist = vmul_f32(invDist, vrsqrts_f32(vmul_f32(distSqr, invDist), invDist));
+    const float s = particleMass * vget_lane_f32(vmul_f32(vmul_f32(invDist, invDist), invDist), 0);
+    return vmulq_n_f32(r, s);
+}
+
+inline float_3 ToFloat3(const float32x4_t value)
+{
+    return float_3(vgetq_lane_f32(value, 0), vgetq_lane_f32(value, 1), vgetq_lane_f32(value, 2));
+}
+
+template <>
+struct ParticleKernel<kIsaNEON>
+{
+    static inline float_3 Gather(const ParticleCpu* const pParticles, int numParticles, const float_3& pos, 
+        float softeningSquared, float particleMass)
+    {
+        const float targetValues[4] = { pos.x, pos.y, pos.z, 0.0f };
+        const float32x4_t target = vld1q_f32(targetValues);
+        float32x4_t acc = vdupq_n_f32(0.0f);
+
+        for (int j = 0; j < numParticles; ++j)
+            acc = vaddq_f32(InteractionNEON(target, vld1q_f32((const float*)&pParticles[j].pos), softeningSquared, particleMass), acc);
+        return ToFloat3(acc);
+    }
+
+    static inline void GatherBlock(const ParticleCpu* const pParticles, int numParticles, const ParticleCpu* const pTargets, 
+        float_3* const pAcc, float softeningSquared, float particleMass)
+    {
+        const int numGroups = kTargetBlockSize / 4;
+        float32x4_t posX[numGroups], posY[numGroups], posZ[numGroups];
+        float32x4_t accX[numGroups], accY[numGroups], accZ[numGroups];
+        for (int g = 0; g < numGroups; ++g)
+        {
+            float x[4], y[4], z[4];
+            for (int t = 0; t < 4; ++t)
+            {
+                x[t] = pTargets[4 * g + t].pos.x;
+                y[t] = pTargets[4 * g + t].pos.y;
+                z[t] = pTargets[4 * g + t].pos.z;
+            }
+            posX[g] = vld1q_f32(x);
+            posY[g] = vld1q_f32(y);
+            posZ[g] = vld1q_f32(z);
+            accX[g] = accY[g] = accZ[g] = vdupq_n_f32(0.0f);
+        }
+
+        for (int j = 0; j < numParticles; ++j)
+        {
+            const float32x4_t sourceX = vdupq_n_f32(pParticles[j].pos.x);
+            const float32x4_t sourceY = vdupq_n_f32(pParticles[j].pos.y);
+            const float32x4_t sourceZ = vdupq_n_f32(pParticles[j].pos.z);
+            for (int g = 0; g < numGroups; ++g)
+            {
+                const float32x4_t rX = vsubq_f32(sourceX, posX[g]);
+                const float32x4_t rY = vsubq_f32(sourceY, posY[g]);
+                const float32x4_t rZ = vsubq_f32(sourceZ, posZ[g]);
+                float32x4_t distSqr = vmlaq_f32(vdupq_n_f32(softeningSquared), rX, rX);
+                distSqr = vmlaq_f32(distSqr, rY, rY);
+                distSqr = vmlaq_f32(distSqr, rZ, rZ);
+
+                float32x4_t invDist = vrsqrteq_f32(distSqr);
+                invDist = vmulq_f32(invDist, vrsqrtsq_f32(vmulq_f32(distSqr, invDist), invDist));
+                const float32x4_t s = vmulq_n_f32(vmulq_f32(vmulq_f32(invDist, invDist), invDist), particleMass);
+                accX[g] = vmlaq_f32(accX[g], rX, s);
+                accY[g] = vmlaq_f32(accY[g], rY, s);
+                accZ[g] = vmlaq_f32(accZ[g], rZ, s);
+            }
+        }
+
+        for (int g = 0; g < numGroups; ++g)
+        {
+            float x[4], y[4], z[4];
+            vst1q_f32(x, accX[g]);
+            vst1q_f32(y, accY[g]);
+            vst1q_f32(z, accZ[g]);
+            for (int t = 0; t < 4; ++t)
+                pAcc[4 * g + t] = float_3(x[t], y[t], z[t]);
+        }
+    }
+
+    static inline void Symmetric(ParticleCpu* const pParticles, const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd, 
+        float softeningSquared, float particleMass)
+    {
+        for (size_t i = iBegin; i < iEnd; ++i)
+        {
+            const float32x4_t pos = vld1q_f32((const float*)&pParticles[i].pos);
+            float32x4_t acc = vdupq_n_f32(0.0f);
+            for (size_t j = jBegin; j < jEnd; ++j)
+            {
+                const float32x4_t k = InteractionNEON(pos, vld1q_f32((const float*)&pParticles[j].pos), softeningSquared, particleMass);
+                acc = vaddq_f32(acc, k);
+                float* const pAcc = (float*)&pParticles[j].acc;
+                vst1q_f32(pAcc, vsubq_f32(vld1q_f32(pAcc), k));
+            }
+            float* const pAcc = (float*)&pParticles[i].acc;
+            vst1q_f32(pAcc, vaddq_f32(vld1q_f32(pAcc), acc));
+        }
+    }
+};
+
+#endif
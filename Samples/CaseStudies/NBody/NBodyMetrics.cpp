@@ -0,0 +1,90 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the 
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+
+#include "NBodyMetrics.h"
+
+//--------------------------------------------------------------------------------------
+//  Metrics sinks.
+//--------------------------------------------------------------------------------------
+
+//  Times, tasks and bytes are averages for each step. The phases are left out for integrators
+//  without counters. The line is formatted in a local stream so the format flags of m_stream, 
+//  often std::cout, are unchanged.
+
+void ConsoleMetricsSink::Write(const NBodyMetrics& metrics)
+{
+    const double stepMilliseconds = 1000.0 / metrics.numSteps;
+    std::ostringstream line;
+    line << "Step " << std::setw(8) << metrics.lastStep << ": " 
+        << std::scientific << std::setprecision(3) << metrics.InteractionsPerSecond() << " interactions/s, "
+        << std::fixed << std::setprecision(2) << metrics.GigaFlops() << " GFlops, step " 
+        << metrics.stepSeconds * stepMilliseconds << " ms";
+    if ((metrics.counters.forceSeconds + metrics.counters.integrateSeconds) > 0.0)
+    {
+        line << ", force " << metrics.counters.forceSeconds * stepMilliseconds << " ms, integrate " 
+            << metrics.counters.integrateSeconds * stepMilliseconds << " ms, wait " 
+            << metrics.counters.waitSeconds * stepMilliseconds << " ms, " << metrics.counters.tasks / metrics.numSteps 
+            << " tasks, " << metrics.counters.bytesMoved / metrics.numSteps << " bytes moved";
+    }
+    m_stream << line.str() << std::endl;
+}
+
+CsvMetricsSink::CsvMetricsSink(const std::string& path) :
+    m_file(path.c_str())
+{
+    if (!m_file)
+        throw std::runtime_error("Unable to create metrics file.");
+    m_file << "step,steps,particles,step_seconds,interactions,interactions_per_second,gflops,"
+        << "force_seconds,integrate_seconds,wait_seconds,tasks,bytes_moved" << std::endl;
+}
+
+//  Each row is flushed so the file can be followed while the simulation runs.
+
+void CsvMetricsSink::Write(const NBodyMetrics& metrics)
+{
+    m_file << metrics.lastStep << "," << metrics.numSteps << "," << metrics.numParticles << "," 
+        << std::scientific << std::setprecision(6) << metrics.stepSeconds << "," << metrics.counters.interactions << "," 
+        << metrics.InteractionsPerSecond() << "," << metrics.GigaFlops() << "," << metrics.counters.forceSeconds << "," 
+        << metrics.counters.integrateSeconds << "," << metrics.counters.waitSeconds << "," << metrics.counters.tasks << "," 
+        << metrics.counters.bytesMoved << std::endl;
+}
+
+//--------------------------------------------------------------------------------------
+//  Metrics recorder.
+//--------------------------------------------------------------------------------------
+
+void NBodyMetricsRecorder::Record(unsigned long long step, int numParticles, double stepSeconds, const NBodyCounters& counters)
+{
+    m_metrics.lastStep = step;
+    m_metrics.numParticles = numParticles;
+    m_metrics.stepSeconds += stepSeconds;
+    m_metrics.counters += counters;
+    if (++m_metrics.numSteps == m_interval)
+        Flush();
+}
+
+void NBodyMetricsRecorder::Flush()
+{
+    if (m_metrics.numSteps == 0)
+        return;
+    m_sink->Write(m_metrics);
+    m_metrics = NBodyMetrics();
+}
@@ -0,0 +1,156 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the 
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+
+#pragma once
+
+#include <string>
+#include <memory>
+#include <fstream>
+#include <iostream>
+#include <chrono>
+
+//--------------------------------------------------------------------------------------
+//  Performance counters for the CPU integrators.
+//--------------------------------------------------------------------------------------
+//
+//  Integrators that implement INBodyCounters as well as INBodyCpu update their counters during
+//  each call to Integrate, the counters describe the most recent step. Interactions are counted 
+//  as a direct sum would count them, so each pair updated by a symmetric kernel counts twice.
+//  The approximate integrators count the interactions they actually calculate, each use of a 
+//  tree node's expansion counts as one interaction. Integrators without counters calculate 
+//  every interaction.
+//
+//  Where the velocity update is fused into the force calculation its time is included in the 
+//  force time. Time spent waiting for other partitions or ranks is not included in either.
+//
+//  Only the tasks created to calculate the interactions or exchange data are counted, the 
+//  tasks created by parallel_for loops over all the particles are not.
+
+const double kFlopsPerInteraction = 20.0;
+
+typedef std::chrono::high_resolution_clock MetricsClock;
+
+inline double MetricsSeconds(const MetricsClock::time_point& start)
+{
+    return std::chrono::duration_cast<std::chrono::duration<double>>(MetricsClock::now() - start).count();
+}
+
+struct NBodyCounters
+{
+    double interactions;
+    double forceSeconds;                                        // Calculating the accelerations.
+    double integrateSeconds;                                    // Updating the velocities and positions.
+    double waitSeconds;                                         // Waiting for data from other partitions or ranks.
+    unsigned long long tasks;
+    unsigned long long bytesMoved;                              // Copied between partitions, nodes or ranks.
+
+    NBodyCounters() : interactions(0.0), forceSeconds(0.0), integrateSeconds(0.0), waitSeconds(0.0), tasks(0), bytesMoved(0) { }
+
+    NBodyCounters& operator+=(const NBodyCounters& rhs)
+    {
+        interactions += rhs.interactions;
+        forceSeconds += rhs.forceSeconds;
+        integrateSeconds += rhs.integrateSeconds;
+        waitSeconds += rhs.waitSeconds;
+        tasks += rhs.tasks;
+        bytesMoved += rhs.bytesMoved;
+        return *this;
+    }
+};
+
+class INBodyCounters
+{
+public:
+    virtual const NBodyCounters& Counters() const = 0;
+};
+
+//--------------------------------------------------------------------------------------
+//  Metrics sinks.
+//--------------------------------------------------------------------------------------
+//
+//  The metrics for an interval of steps are the totals of the counters for each step and the 
+//  wall clock time of the steps. The phase times are zero for integrators without counters.
+
+struct NBodyMetrics
+{
+    unsigned long long lastStep;
+    int numSteps;
+    int numParticles;
+    double stepSeconds;
+    NBodyCounters counters;
+
+    NBodyMetrics() : lastStep(0), numSteps(0), numParticles(0), stepSeconds(0.0) { }
+
+    inline double InteractionsPerSecond() const { return (stepSeconds > 0.0) ? counters.interactions / stepSeconds : 0.0; }
+    inline double GigaFlops() const { return InteractionsPerSecond() * kFlopsPerInteraction * 1.0e-9; }
+};
+
+class INBodyMetricsSink
+{
+public:
+    virtual ~INBodyMetricsSink() { }
+
+    virtual void Write(const NBodyMetrics& metrics) = 0;
+};
+
+//  Writes one line for each interval to a stream, usually std::cout.
+
+class ConsoleMetricsSink : public INBodyMetricsSink
+{
+private:
+    std::ostream& m_stream;
+
+public:
+    explicit ConsoleMetricsSink(std::ostream& stream = std::cout) : m_stream(stream) { }
+
+    void Write(const NBodyMetrics& metrics);
+};
+
+//  Writes a header and one row for each interval to a CSV file. Throws std::runtime_error if 
+//  the file cannot be created.
+
+class CsvMetricsSink : public INBodyMetricsSink
+{
+private:
+    std::ofstream m_file;
+
+public:
+    explicit CsvMetricsSink(const std::string& path);
+
+    void Write(const NBodyMetrics& metrics);
+};
+
+//  Adds up the metrics for each step and passes them to the sink every interval steps. Flush 
+//  writes a final partial interval.
+
+class NBodyMetricsRecorder
+{
+private:
+    std::shared_ptr<INBodyMetricsSink> m_sink;
+    const int m_interval;
+    NBodyMetrics m_metrics;
+
+public:
+    NBodyMetricsRecorder(const std::shared_ptr<INBodyMetricsSink>& sink, int interval) : 
+        m_sink(sink), 
+        m_interval(interval)
+    {
+    }
+
+    void Record(unsigned long long step, int numParticles, double stepSeconds, const NBodyCounters& counters);
+    void Flush();
+};
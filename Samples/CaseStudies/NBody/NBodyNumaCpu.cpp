@@ -0,0 +1,145 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the 
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+
+#include <ppl.h>
+#include <assert.h>
+#include <algorithm>
+#include <chrono>
+
+#include "Common.h"
+#include "NBodyKernels.h"
+#include "NBodyNumaCpu.h"
+
+using namespace concurrency;
+using namespace concurrency::graphics;
+
+//--------------------------------------------------------------------------------------
+//  NUMA particle arrays.
+//--------------------------------------------------------------------------------------
+
+void NumaParticleArray::CopyToNodes(const ParticleCpu* const pSource, const NumaPartition& partition)
+{
+    ParticleCpu* const pParticles = m_pParticles;
+    partition.ForEachNode([=, &partition](int node)
+    {
+        std::copy(pSource + partition.Begin(node), pSource + partition.End(node), pParticles + partition.Begin(node));
+    });
+}
+
+//  The array is allocated on a page boundary so every page overlapping the range lies within
+//  it. The system only reports the node of a resident page.
+
+double NumaParticleArray::NodeFraction(int node, int begin, int end) const
+{
+    if (begin >= end)
+        return 0.0;
+    const size_t kPageSize = 4096;
+    const size_t firstByte = (begin * sizeof(ParticleCpu) / kPageSize) * kPageSize;
+    const size_t endByte = end * sizeof(ParticleCpu);
+    const char* const pBase = reinterpret_cast<const char*>(m_pParticles);
+    int numPages = 0;
+    int numLocal = 0;
+    for (size_t offset = firstByte; offset < endByte; offset += kPageSize)
+    {
+        ++numPages;
+        if (GetMemoryNode(pBase + offset) == node)
+            ++numLocal;
+    }
+    return double(numLocal) / numPages;
+}
+
+//--------------------------------------------------------------------------------------
+//  The NUMA aware integration engine.
+//--------------------------------------------------------------------------------------
+//
+//  Replicas are allocated with their node as the preferred node when the engine is created, 
+//  so a copy task stolen by a processor on another node still writes pages on the replica's 
+//  node. Where the operating system cannot place them the first copy places them, and stolen
+//  copies may leave some pages remote, see ReplicaLocality.
+
+const int kNumaChunkSize = 4 * kTargetBlockSize;
+
+typedef std::chrono::high_resolution_clock NumaClock;
+
+NBodyNuma::NBodyNuma(float softeningSquared, float dampingFactor, float deltaTime, float particleMass, int maxParticles, 
+    bool replicatePositions) :
+    INBodyCpu(),
+    m_engine(std::make_shared<NBodySimpleInteractionEngine>(softeningSquared, dampingFactor, deltaTime, particleMass)),
+    m_numNodes(GetCpuTopology().numNumaNodes),
+    m_replicatePositions(replicatePositions),
+    m_counters(m_numNodes)
+{
+    if (m_replicatePositions)
+    {
+        for (int node = 0; node < m_numNodes; ++node)
+            m_replicas.push_back(std::make_shared<NumaParticleArray>(maxParticles, node));
+    }
+}
+
+//  Each node's step is timed separately so a node with remote memory, or fewer processors, 
+//  shows up as a slower node.
+
+void NBodyNuma::Integrate(ParticleCpu* const pParticlesIn, ParticleCpu* const pParticlesOut, int numParticles) const
+{
+    const NumaPartition partition = Partition(numParticles);
+    partition.ForEachNode([=, &partition](int node)
+    {
+        const NumaClock::time_point start = NumaClock::now();
+        NumaNodeCounters counters;
+        counters.numParticles = partition.End(node) - partition.Begin(node);
+
+        const ParticleCpu* pSources = pParticlesIn;
+        if (m_replicatePositions)
+        {
+            ParticleCpu* const pReplica = m_replicas[node]->Data();
+            const int numPages = (numParticles + kNumaPageParticles - 1) / kNumaPageParticles;
+            parallel_for(0, numPages, [=](int p)
+            {
+                const int begin = p * kNumaPageParticles;
+                std::copy(pParticlesIn + begin, pParticlesIn + std::min(begin + kNumaPageParticles, numParticles), pReplica + begin);
+            });
+            pSources = pReplica;
+            counters.replicaBytes = static_cast<unsigned long long>(numParticles) * sizeof(ParticleCpu);
+        }
+
+        const int rangeStart = partition.Begin(node);
+        const int rangeEnd = partition.End(node);
+        const int numChunks = (counters.numParticles + kNumaChunkSize - 1) / kNumaChunkSize;
+        parallel_for(0, numChunks, [=](int c)
+        {
+            const int begin = rangeStart + c * kNumaChunkSize;
+            m_engine->InvokeBlockedBodyBodyInteraction(pSources, pParticlesOut, begin, std::min(begin + kNumaChunkSize, rangeEnd), numParticles);
+        });
+
+        // Particles that do not fill a block each read all the sources.
+        const unsigned long long numBlocks = counters.numParticles / kTargetBlockSize + counters.numParticles % kTargetBlockSize;
+        counters.sourceBytes = numBlocks * numParticles * sizeof(ParticleCpu);
+        counters.writeBytes = static_cast<unsigned long long>(counters.numParticles) * sizeof(ParticleCpu);
+        counters.seconds = std::chrono::duration_cast<std::chrono::duration<double>>(NumaClock::now() - start).count();
+        m_counters[node] = counters;
+    });
+
+    m_totals = NBodyCounters();
+    for (int node = 0; node < m_numNodes; ++node)
+    {
+        const NumaNodeCounters& counters = m_counters[node];
+        m_totals.interactions += double(counters.numParticles) * double(numParticles);
+        m_totals.forceSeconds = std::max(m_totals.forceSeconds, counters.seconds);
+        m_totals.tasks += (counters.numParticles + kNumaChunkSize - 1) / kNumaChunkSize;
+        m_totals.bytesMoved += counters.replicaBytes;
+    }
+}
@@ -0,0 +1,174 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the 
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <ppl.h>
+
+#include "Common.h"
+#include "INBodyCpu.h"
+#include "NBodyMetrics.h"
+#include "ParticleCpu.h"
+#include "NBodyCpu.h"
+#include "CpuTopology.h"
+
+//--------------------------------------------------------------------------------------
+//  Static partition of the particles between NUMA nodes.
+//--------------------------------------------------------------------------------------
+//
+//  Each node owns a contiguous range of particles, the node's workers are the only ones that
+//  update them. Ranges are a whole number of pages so no page is shared between nodes.
+//
+//  ForEachNode runs a task on each node using a PPL location. Locations are a hint to the
+//  scheduler, tasks created by the node's task, for example by a parallel_for, are placed on
+//  the same node but may be stolen by idle processors on other nodes.
+
+const int kNumaPageParticles = 4096 / sizeof(ParticleCpu);
+
+class NumaPartition
+{
+private:
+    int m_numNodes;
+    int m_numParticles;
+    int m_rangeSize;
+
+public:
+    NumaPartition(int numNodes, int numParticles) :
+        m_numNodes(numNodes),
+        m_numParticles(numParticles),
+        m_rangeSize((((numParticles + numNodes - 1) / numNodes + kNumaPageParticles - 1) / kNumaPageParticles) * kNumaPageParticles)
+    {
+    }
+
+    inline int NumNodes() const { return m_numNodes; }
+    inline int Begin(int node) const { return std::min(node * m_rangeSize, m_numParticles); }
+    inline int End(int node) const { return std::min((node + 1) * m_rangeSize, m_numParticles); }
+
+    template <typename Func>
+    void ForEachNode(const Func& func) const
+    {
+        concurrency::task_group tasks;
+        for (int node = 0; node < m_numNodes; ++node)
+        {
+            concurrency::location placement = concurrency::location::from_numa_node(static_cast<unsigned short>(node));
+            tasks.run([=, &func]() { func(node); }, placement);
+        }
+        tasks.wait();
+    }
+};
+
+//--------------------------------------------------------------------------------------
+//  An array of particles allocated directly from the operating system.
+//--------------------------------------------------------------------------------------
+//
+//  Unlike a std::vector the particles are not initialized when the array is created, so 
+//  each page is placed on the node of the first task to write to it, see CopyToNodes. If a 
+//  node is given the pages are placed on that node where the operating system supports it.
+
+class NumaParticleArray
+{
+private:
+    ParticleCpu* m_pParticles;
+    size_t m_size;
+
+public:
+    explicit NumaParticleArray(int numParticles, int node = -1) :
+        m_pParticles(static_cast<ParticleCpu*>(AllocateNodeMemory(numParticles * sizeof(ParticleCpu), node))),
+        m_size(numParticles * sizeof(ParticleCpu))
+    {
+    }
+
+    ~NumaParticleArray()
+    {
+        FreeNodeMemory(m_pParticles, m_size);
+    }
+
+    inline ParticleCpu* Data() const { return m_pParticles; }
+
+    //  Copy pSource into the array, each node's range is written by a task on that node.
+    void CopyToNodes(const ParticleCpu* const pSource, const NumaPartition& partition);
+
+    //  Fraction of the pages holding particles [begin, end) that are resident on node.
+    double NodeFraction(int node, int begin, int end) const;
+
+private:
+    NumaParticleArray(const NumaParticleArray&);
+    NumaParticleArray& operator=(const NumaParticleArray&);
+};
+
+//--------------------------------------------------------------------------------------
+//  NUMA aware parallel implementation of the n-body calculation.
+//--------------------------------------------------------------------------------------
+//
+//  This is the CPU equivalent of NBodyAmpMultiTiled with each NUMA node in place of an 
+//  accelerator. Each node updates the range of particles it owns, see NumaPartition, with 
+//  the register blocked loop used by NBodyBlockedMultiCore. For the best performance the 
+//  particle arrays should be NumaParticleArrays filled with CopyToNodes using Partition(), so
+//  each node writes to local memory.
+//
+//  Every node reads all the particle positions each step. If replicatePositions is set each 
+//  node first copies the particles into its own replica, like NBodyAmpMultiTiled copying the
+//  particles to every accelerator, so all these reads are from local memory. ReplicaLocality
+//  measures where the operating system actually placed each replica.
+//
+//  Counters for each node record the bytes read and written by the most recent step and the 
+//  time the node took. Source bytes count every source particle passed to the kernel, most of
+//  these reads are served from cache so this is the effective bandwidth the kernel sees.
+//
+//  The nodes' counters are also totaled as NBodyCounters. The velocity update is fused into 
+//  the kernel so the force time is that of the slowest node, including its replica copy, and 
+//  the bytes moved are the bytes copied into the replicas.
+
+struct NumaNodeCounters
+{
+    int numParticles;                                           // Particles owned by the node.
+    unsigned long long sourceBytes;                             // Source particles read by the kernel.
+    unsigned long long replicaBytes;                            // Particles copied into the node's replica.
+    unsigned long long writeBytes;                              // Updated particles written.
+    double seconds;
+
+    NumaNodeCounters() : numParticles(0), sourceBytes(0), replicaBytes(0), writeBytes(0), seconds(0.0) { }
+};
+
+class NBodyNuma : public INBodyCpu, public INBodyCounters
+{
+private:
+    std::shared_ptr<NBodySimpleInteractionEngine> m_engine;
+    const int m_numNodes;
+    const bool m_replicatePositions;
+    std::vector<std::shared_ptr<NumaParticleArray>> m_replicas;
+    mutable std::vector<NumaNodeCounters> m_counters;
+    mutable NBodyCounters m_totals;
+
+public:
+    NBodyNuma(float softeningSquared, float dampingFactor, float deltaTime, float particleMass, int maxParticles, 
+        bool replicatePositions);
+
+    void Integrate(ParticleCpu* const pParticlesIn, ParticleCpu* const pParticlesOut, int numParticles) const;
+
+    inline NumaPartition Partition(int numParticles) const { return NumaPartition(m_numNodes, numParticles); }
+    inline int NumNodes() const { return m_numNodes; }
+    inline bool ReplicatePositions() const { return m_replicatePositions; }
+    inline const NumaNodeCounters& Counters(int node) const { return m_counters[node]; }
+    inline const NBodyCounters& Counters() const { return m_totals; }
+
+    //  Fraction of node's replica pages on that node, after a step with numParticles.
+    inline double ReplicaLocality(int node, int numParticles) const { return m_replicas[node]->NodeFraction(node, 0, numParticles); }
+};
@@ -0,0 +1,196 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the 
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+
+#include <ppl.h>
+#include <assert.h>
+#include <algorithm>
+#include <functional>
+
+#include "Common.h"
+#include "NBodyPartitionedCpu.h"
+
+using namespace concurrency;
+using namespace concurrency::graphics;
+
+//--------------------------------------------------------------------------------------
+//  The partitioned integration engine.
+//--------------------------------------------------------------------------------------
+
+NBodyPartitioned::NBodyPartitioned(float softeningSquared, float dampingFactor, float deltaTime, float particleMass, int maxParticles, 
+    int numPartitions) :
+    INBodyCpu(),
+    m_engine(std::make_shared<NBodySoAInteractionEngine>(softeningSquared, particleMass)),
+    m_deltaTime(deltaTime),
+    m_dampingFactor(dampingFactor),
+    m_numPartitions(numPartitions),
+    m_current(0),
+    m_numParticles(0),
+    m_bytesExchanged(0),
+    m_partitionCounters(numPartitions)
+{
+    assert(numPartitions > 0);
+    for (int p = 0; p < 2 * m_numPartitions; ++p)
+        m_buffers.push_back(std::make_shared<ParticlesSoA>(maxParticles));
+    for (int p = 0; p < m_numPartitions; ++p)
+        m_exchanges.push_back(std::make_shared<task_group>());
+}
+
+NBodyPartitioned::~NBodyPartitioned()
+{
+    WaitForExchanges();
+}
+
+//  Each partition:
+//
+//  1. Calculates the interactions between the particles in its own range, these positions 
+//     were written by the partition itself.
+//  2. Waits for the other partitions' ranges from the previous step to arrive.
+//  3. Adds the interactions with the particles in the other ranges.
+//  4. Updates its range and starts copying the new positions to the other partitions.
+//
+//  Copies are added to the task_group of the receiving partition. A partition's task_group is
+//  only waited on by that partition, after all the copies from the previous step were started.
+
+void NBodyPartitioned::Integrate(ParticleCpu* const pParticlesIn, ParticleCpu* const pParticlesOut, int numParticles) const
+{
+    LoadState(pParticlesIn, numParticles);
+
+    const int current = m_current;
+    const int next = 1 - current;
+    parallel_for(0, m_numPartitions, [=](int p)
+    {
+        const MetricsClock::time_point start = MetricsClock::now();
+        NBodyCounters& counters = m_partitionCounters[p];
+        const ParticlesSoA& buffer = Buffer(p, current);
+        const ConstFloat3SoA pos(buffer.pos.x, buffer.pos.y, buffer.pos.z);
+        const Float3SoA acc = buffer.acc;
+        const int rangeStart = RangeStart(p, numParticles);
+        const int rangeEnd = RangeStart(p + 1, numParticles);
+
+        std::fill(acc.x + rangeStart, acc.x + rangeEnd, 0.0f);
+        std::fill(acc.y + rangeStart, acc.y + rangeEnd, 0.0f);
+        std::fill(acc.z + rangeStart, acc.z + rangeEnd, 0.0f);
+        counters.tasks = Interactions(pos, acc, rangeStart, rangeEnd, rangeStart, rangeEnd);
+
+        const MetricsClock::time_point waitStart = MetricsClock::now();
+        m_exchanges[p]->wait();
+        counters.waitSeconds = MetricsSeconds(waitStart);
+        counters.tasks += Interactions(pos, acc, rangeStart, rangeEnd, 0, rangeStart);
+        counters.tasks += Interactions(pos, acc, rangeStart, rangeEnd, rangeEnd, numParticles);
+        counters.forceSeconds = MetricsSeconds(start) - counters.waitSeconds;
+
+        // The new positions are written to the next buffer, which is then copied to the others.
+        const Float3SoA nextPos = Buffer(p, next).pos;
+        const ConstFloat3SoA constAcc(acc.x, acc.y, acc.z);
+        ForEachTargetBlock(rangeEnd - rangeStart, [=](int offset, int count)
+        {
+            const int begin = rangeStart + offset;
+            std::copy(pos.x + begin, pos.x + begin + count, nextPos.x + begin);
+            std::copy(pos.y + begin, pos.y + begin + count, nextPos.y + begin);
+            std::copy(pos.z + begin, pos.z + begin + count, nextPos.z + begin);
+            UpdateSoABlock(pParticlesIn + begin, pParticlesOut + begin, nextPos.Offset(begin), constAcc.Offset(begin), count, 
+                m_deltaTime, m_dampingFactor);
+        });
+        counters.integrateSeconds = MetricsSeconds(start) - counters.forceSeconds - counters.waitSeconds;
+
+        for (int q = 0; q < m_numPartitions; ++q)
+        {
+            if (q == p)
+                continue;
+            const Float3SoA destPos = Buffer(q, next).pos;
+            m_exchanges[q]->run([=]()
+            {
+                std::copy(nextPos.x + rangeStart, nextPos.x + rangeEnd, destPos.x + rangeStart);
+                std::copy(nextPos.y + rangeStart, nextPos.y + rangeEnd, destPos.y + rangeStart);
+                std::copy(nextPos.z + rangeStart, nextPos.z + rangeEnd, destPos.z + rangeStart);
+            });
+            ++counters.tasks;
+        }
+    });
+
+    m_current = next;
+    m_bytesExchanged = static_cast<unsigned long long>(numParticles) * (m_numPartitions - 1) * 3 * sizeof(float);
+
+    m_counters = NBodyCounters();
+    m_counters.interactions = double(numParticles) * double(numParticles);
+    m_counters.tasks = m_numPartitions;
+    m_counters.bytesMoved = m_bytesExchanged;
+    std::for_each(m_partitionCounters.begin(), m_partitionCounters.end(), [this](const NBodyCounters& counters)
+    {
+        m_counters.forceSeconds = std::max(m_counters.forceSeconds, counters.forceSeconds);
+        m_counters.integrateSeconds = std::max(m_counters.integrateSeconds, counters.integrateSeconds);
+        m_counters.waitSeconds = std::max(m_counters.waitSeconds, counters.waitSeconds);
+        m_counters.tasks += counters.tasks;
+    });
+}
+
+//  Each position is compared with the copy held by the partition that owns it, the exchange 
+//  never writes to a partition's own range. If any have changed all the exchanges are 
+//  completed and every partition's buffer is reloaded.
+
+void NBodyPartitioned::LoadState(const ParticleCpu* const pParticles, int numParticles) const
+{
+    assert(numParticles <= Buffer(0, 0).capacity());
+
+    const int current = m_current;
+    if (numParticles == m_numParticles)
+    {
+        combinable<int> changed;
+        parallel_for(0, m_numPartitions, [=, &changed](int p)
+        {
+            const Float3SoA pos = Buffer(p, current).pos;
+            for (int i = RangeStart(p, numParticles); i < RangeStart(p + 1, numParticles); ++i)
+            {
+                if ((pParticles[i].pos.x != pos.x[i]) || (pParticles[i].pos.y != pos.y[i]) || (pParticles[i].pos.z != pos.z[i]))
+                {
+                    changed.local() = 1;
+                    break;
+                }
+            }
+        });
+        if (changed.combine(std::plus<int>()) == 0)
+            return;
+    }
+
+    WaitForExchanges();
+    parallel_for(0, m_numPartitions, [=](int p)
+    {
+        const Float3SoA pos = Buffer(p, current).pos;
+        GatherFloat3(&pParticles->pos, sizeof(ParticleCpu), numParticles, pos.x, pos.y, pos.z);
+    });
+    m_numParticles = numParticles;
+}
+
+void NBodyPartitioned::WaitForExchanges() const
+{
+    std::for_each(m_exchanges.begin(), m_exchanges.end(), [](const std::shared_ptr<task_group>& exchange)
+    {
+        exchange->wait();
+    });
+}
+
+//  Add the interactions of the targets in [rangeStart, rangeEnd) with the sources in 
+//  [sourceStart, sourceEnd) to the target accelerations. Returns the number of tasks created.
+
+int NBodyPartitioned::Interactions(ConstFloat3SoA pos, Float3SoA acc, int rangeStart, int rangeEnd, int sourceStart, int sourceEnd) const
+{
+    if (sourceEnd <= sourceStart)
+        return 0;
+
+    return BlockedInteractions(*m_engine, pos.Offset(rangeStart), acc.Offset(rangeStart), rangeEnd - rangeStart, 
+        pos.Offset(sourceStart), sourceEnd - sourceStart);
+}
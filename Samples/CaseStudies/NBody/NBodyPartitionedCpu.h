@@ -0,0 +1,97 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the 
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <ppl.h>
+
+#include "Common.h"
+#include "INBodyCpu.h"
+#include "ParticleCpu.h"
+#include "NBodyCpu.h"
+#include "NBodySoACpu.h"
+#include "NBodyMetrics.h"
+
+//--------------------------------------------------------------------------------------
+//  Partitioned implementation of the n-body calculation with a direct exchange.
+//--------------------------------------------------------------------------------------
+//
+//  This is the CPU equivalent of NBodyAmpMultiTiled with a group of worker tasks standing in
+//  for each accelerator. Each partition owns a copy of all the particle positions and updates
+//  a contiguous range of them. After each step a partition copies only its updated range 
+//  directly into the buffers of the other partitions, there is no gather into a shared copy.
+//
+//  Each partition has two position buffers. Step t reads buffer t % 2 and the updated ranges
+//  are written into buffer (t + 1) % 2 of every partition, so the copies never overwrite 
+//  positions that are still being read. The copies run as tasks that are only waited for 
+//  part way through the next step, after each partition has calculated the interactions 
+//  between its own particles, so the exchange overlaps with the local interactions.
+//
+//  As with NBodySoA velocities are read from pParticlesIn. The positions are reloaded from
+//  pParticlesIn whenever they differ from the positions written by the previous step.
+//
+//  The partitions run concurrently, so the phase times in the counters are those of the slowest
+//  partition. The time a partition waits for the other partitions' ranges is counted as wait
+//  time, not force time.
+
+class NBodyPartitioned : public INBodyCpu, public INBodyCounters
+{
+private:
+    std::shared_ptr<NBodySoAInteractionEngine> m_engine;
+    const float m_deltaTime;
+    const float m_dampingFactor;
+    const int m_numPartitions;
+    std::vector<std::shared_ptr<ParticlesSoA>> m_buffers;       // Two for each partition.
+    mutable std::vector<std::shared_ptr<concurrency::task_group>> m_exchanges;
+    mutable int m_current;                                      // Buffer read by the next step.
+    mutable int m_numParticles;
+    mutable unsigned long long m_bytesExchanged;
+    mutable std::vector<NBodyCounters> m_partitionCounters;
+    mutable NBodyCounters m_counters;
+
+public:
+    NBodyPartitioned(float softeningSquared, float dampingFactor, float deltaTime, float particleMass, int maxParticles, 
+        int numPartitions);
+    ~NBodyPartitioned();
+
+    void Integrate(ParticleCpu* const pParticlesIn, ParticleCpu* const pParticlesOut, int numParticles) const;
+
+    inline int NumPartitions() const { return m_numPartitions; }
+
+    //  Bytes copied between partitions by the most recent step.
+    inline unsigned long long BytesExchanged() const { return m_bytesExchanged; }
+
+    inline const NBodyCounters& Counters() const { return m_counters; }
+
+private:
+    //  Ranges start on a multiple of the alignment boundary so partitions write to separate cache lines.
+    inline int RangeStart(int partition, int numParticles) const
+    {
+        const int floatsPerLine = AVX_ALIGNMENTBOUNDARY / sizeof(float);
+        const int rangeSize = (((numParticles + m_numPartitions - 1) / m_numPartitions + floatsPerLine - 1) / floatsPerLine) * floatsPerLine;
+        return std::min(partition * rangeSize, numParticles);
+    }
+
+    inline const ParticlesSoA& Buffer(int partition, int index) const { return *m_buffers[2 * partition + index]; }
+
+    void LoadState(const ParticleCpu* const pParticles, int numParticles) const;
+    void WaitForExchanges() const;
+    int Interactions(ConstFloat3SoA pos, Float3SoA acc, int rangeStart, int rangeEnd, int sourceStart, int sourceEnd) const;
+};
@@ -0,0 +1,574 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the 
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+
+#include <math.h>
+#include <ppl.h>
+#include <assert.h>
+#include <memory>
+#include <algorithm>
+#include <functional>
+#include <immintrin.h>
+
+#include "Common.h"
+#include "NBodyPrecisionCpu.h"
+
+using namespace concurrency;
+using namespace concurrency::graphics;
+
+//--------------------------------------------------------------------------------------
+//  The mixed precision SIMD interaction engine.
+//--------------------------------------------------------------------------------------
+//
+//  Interactions are calculated exactly as in NBodySoAInteractionEngine. Each contribution 
+//  is then widened to double precision, which needs two double registers for each float 
+//  register, and added to double precision accumulators.
+
+void NBodyMixedInteractionEngine::SelectCpuImplementation()
+{
+    switch (GetAVXType())
+    {
+    case kCpuAVX512:
+        m_funcptr = &NBodyMixedInteractionEngine::BodyBodyInteractionAVX512;
+        return;
+    case kCpuAVX2:
+        m_funcptr = &NBodyMixedInteractionEngine::BodyBodyInteractionAVX2;
+        return;
+    default:
+        break;
+    }
+
+    switch (GetSSEType())
+    {
+    case kCpuSSE4:
+    case kCpuSSE:
+        m_funcptr = &NBodyMixedInteractionEngine::BodyBodyInteractionSSE;
+        break;
+    default:
+        m_funcptr = &NBodyMixedInteractionEngine::BodyBodyInteraction;
+    }
+}
+
+void NBodyMixedInteractionEngine::BodyBodyInteraction(ConstFloat3SoA targetPos, Float3Arrays<double> targetAcc, int numTargets, ConstFloat3SoA sourcePos, int numSources) const
+{
+    for (int i = 0; i < numTargets; ++i)
+    {
+        const float_3 pos(targetPos.x[i], targetPos.y[i], targetPos.z[i]);
+        double accX = 0.0;
+        double accY = 0.0;
+        double accZ = 0.0;
+
+        for (int j = 0; j < numSources; ++j)
+        {
+            const float_3 r = float_3(sourcePos.x[j], sourcePos.y[j], sourcePos.z[j]) - pos;
+
+            float distSqr = SqrLength(r) + m_softeningSquared;
+            float invDist = 1.0f / sqrt(distSqr);
+            float invDistCube =  invDist * invDist * invDist;
+            float s = m_particleMass * invDistCube;
+
+            accX += r.x * s;
+            accY += r.y * s;
+            accZ += r.z * s;
+        }
+
+        targetAcc.x[i] += accX;
+        targetAcc.y[i] += accY;
+        targetAcc.z[i] += accZ;
+    }
+}
+
+//  Add the four floats in value to the two double registers lo and hi.
+
+inline void AccumulateSSE(const __m128 value, __m128d& lo, __m128d& hi)
+{
+    lo = _mm_add_pd(lo, _mm_cvtps_pd(value));
+    hi = _mm_add_pd(hi, _mm_cvtps_pd(_mm_movehl_ps(value, value)));
+}
+
+void NBodyMixedInteractionEngine::BodyBodyInteractionSSE(ConstFloat3SoA targetPos, Float3Arrays<double> targetAcc, int numTargets, ConstFloat3SoA sourcePos, int numSources) const
+{
+    const __m128 softeningSquared = _mm_set1_ps(m_softeningSquared);
+    const __m128 particleMass = _mm_set1_ps(m_particleMass);
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 threeHalves = _mm_set1_ps(1.5f);
+    const int width = 4;
+
+    int i = 0;
+    for (; i + width <= numTargets; i += width)
+    {
+        const __m128 posX = _mm_loadu_ps(targetPos.x + i);
+        const __m128 posY = _mm_loadu_ps(targetPos.y + i);
+        const __m128 posZ = _mm_loadu_ps(targetPos.z + i);
+        __m128d accX[2] = { _mm_setzero_pd(), _mm_setzero_pd() };
+        __m128d accY[2] = { _mm_setzero_pd(), _mm_setzero_pd() };
+        __m128d accZ[2] = { _mm_setzero_pd(), _mm_setzero_pd() };
+
+        for (int j = 0; j < numSources; ++j)
+        {
+            const __m128 rX = _mm_sub_ps(_mm_set1_ps(sourcePos.x[j]), posX);
+            const __m128 rY = _mm_sub_ps(_mm_set1_ps(sourcePos.y[j]), posY);
+            const __m128 rZ = _mm_sub_ps(_mm_set1_ps(sourcePos.z[j]), posZ);
+
+            __m128 distSqr = _mm_add_ps(_mm_mul_ps(rX, rX), softeningSquared);
+            distSqr = _mm_add_ps(_mm_mul_ps(rY, rY), distSqr);
+            distSqr = _mm_add_ps(_mm_mul_ps(rZ, rZ), distSqr);
+
+            __m128 invDist = _mm_rsqrt_ps(distSqr);
+            invDist = _mm_mul_ps(invDist, _mm_sub_ps(threeHalves, 
+                _mm_mul_ps(_mm_mul_ps(half, distSqr), _mm_mul_ps(invDist, invDist))));
+
+            const __m128 s = _mm_mul_ps(particleMass, _mm_mul_ps(_mm_mul_ps(invDist, invDist), invDist));
+
+            AccumulateSSE(_mm_mul_ps(rX, s), accX[0], accX[1]);
+            AccumulateSSE(_mm_mul_ps(rY, s), accY[0], accY[1]);
+            AccumulateSSE(_mm_mul_ps(rZ, s), accZ[0], accZ[1]);
+        }
+
+        for (int h = 0; h < 2; ++h)
+        {
+            const int offset = i + 2 * h;
+            _mm_storeu_pd(targetAcc.x + offset, _mm_add_pd(_mm_loadu_pd(targetAcc.x + offset), accX[h]));
+            _mm_storeu_pd(targetAcc.y + offset, _mm_add_pd(_mm_loadu_pd(targetAcc.y + offset), accY[h]));
+            _mm_storeu_pd(targetAcc.z + offset, _mm_add_pd(_mm_loadu_pd(targetAcc.z + offset), accZ[h]));
+        }
+    }
+
+    BodyBodyInteraction(targetPos.Offset(i), targetAcc.Offset(i), numTargets - i, sourcePos, numSources);
+}
+
+inline void AccumulateAVX2(const __m256 value, __m256d& lo, __m256d& hi)
+{
+    lo = _mm256_add_pd(lo, _mm256_cvtps_pd(_mm256_castps256_ps128(value)));
+    hi = _mm256_add_pd(hi, _mm256_cvtps_pd(_mm256_extractf128_ps(value, 1)));
+}
+
+void NBodyMixedInteractionEngine::BodyBodyInteractionAVX2(ConstFloat3SoA targetPos, Float3Arrays<double> targetAcc, int numTargets, ConstFloat3SoA sourcePos, int numSources) const
+{
+    const __m256 softeningSquared = _mm256_set1_ps(m_softeningSquared);
+    const __m256 particleMass = _mm256_set1_ps(m_particleMass);
+    const __m256 minusHalf = _mm256_set1_ps(-0.5f);
+    const __m256 threeHalves = _mm256_set1_ps(1.5f);
+    const int width = 8;
+
+    int i = 0;
+    for (; i + width <= numTargets; i += width)
+    {
+        const __m256 posX = _mm256_loadu_ps(targetPos.x + i);
+        const __m256 posY = _mm256_loadu_ps(targetPos.y + i);
+        const __m256 posZ = _mm256_loadu_ps(targetPos.z + i);
+        __m256d accX[2] = { _mm256_setzero_pd(), _mm256_setzero_pd() };
+        __m256d accY[2] = { _mm256_setzero_pd(), _mm256_setzero_pd() };
+        __m256d accZ[2] = { _mm256_setzero_pd(), _mm256_setzero_pd() };
+
+        for (int j = 0; j < numSources; ++j)
+        {
+            const __m256 rX = _mm256_sub_ps(_mm256_broadcast_ss(sourcePos.x + j), posX);
+            const __m256 rY = _mm256_sub_ps(_mm256_broadcast_ss(sourcePos.y + j), posY);
+            const __m256 rZ = _mm256_sub_ps(_mm256_broadcast_ss(sourcePos.z + j), posZ);
+
+            __m256 distSqr = _mm256_fmadd_ps(rX, rX, softeningSquared);
+            distSqr = _mm256_fmadd_ps(rY, rY, distSqr);
+            distSqr = _mm256_fmadd_ps(rZ, rZ, distSqr);
+
+            __m256 invDist = _mm256_rsqrt_ps(distSqr);
+            const __m256 invDistSqr = _mm256_mul_ps(invDist, invDist);
+            invDist = _mm256_mul_ps(invDist, _mm256_fmadd_ps(_mm256_mul_ps(minusHalf, distSqr), invDistSqr, threeHalves));
+
+            const __m256 s = _mm256_mul_ps(particleMass, _mm256_mul_ps(_mm256_mul_ps(invDist, invDist), invDist));
+
+            AccumulateAVX2(_mm256_mul_ps(rX, s), accX[0], accX[1]);
+            AccumulateAVX2(_mm256_mul_ps(rY, s), accY[0], accY[1]);
+            AccumulateAVX2(_mm256_mul_ps(rZ, s), accZ[0], accZ[1]);
+        }
+
+        for (int h = 0; h < 2; ++h)
+        {
+            const int offset = i + 4 * h;
+            _mm256_storeu_pd(targetAcc.x + offset, _mm256_add_pd(_mm256_loadu_pd(targetAcc.x + offset), accX[h]));
+            _mm256_storeu_pd(targetAcc.y + offset, _mm256_add_pd(_mm256_loadu_pd(targetAcc.y + offset), accY[h]));
+            _mm256_storeu_pd(targetAcc.z + offset, _mm256_add_pd(_mm256_loadu_pd(targetAcc.z + offset), accZ[h]));
+        }
+    }
+
+    BodyBodyInteraction(targetPos.Offset(i), targetAcc.Offset(i), numTargets - i, sourcePos, numSources);
+}
+
+inline void AccumulateAVX512(const __m512 value, __m512d& lo, __m512d& hi)
+{
+    lo = _mm512_add_pd(lo, _mm512_cvtps_pd(_mm512_castps512_ps256(value)));
+    hi = _mm512_add_pd(hi, _mm512_cvtps_pd(_mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(value), 1))));
+}
+
+void NBodyMixedInteractionEngine::BodyBodyInteractionAVX512(ConstFloat3SoA targetPos, Float3Arrays<double> targetAcc, int numTargets, ConstFloat3SoA sourcePos, int numSources) const
+{
+    const __m512 softeningSquared = _mm512_set1_ps(m_softeningSquared);
+    const __m512 particleMass = _mm512_set1_ps(m_particleMass);
+    const __m512 minusHalf = _mm512_set1_ps(-0.5f);
+    const __m512 threeHalves = _mm512_set1_ps(1.5f);
+    const int width = 16;
+
+    int i = 0;
+    for (; i + width <= numTargets; i += width)
+    {
+        const __m512 posX = _mm512_loadu_ps(targetPos.x + i);
+        const __m512 posY = _mm512_loadu_ps(targetPos.y + i);
+        const __m512 posZ = _mm512_loadu_ps(targetPos.z + i);
+        __m512d accX[2] = { _mm512_setzero_pd(), _mm512_setzero_pd() };
+        __m512d accY[2] = { _mm512_setzero_pd(), _mm512_setzero_pd() };
+        __m512d accZ[2] = { _mm512_setzero_pd(), _mm512_setzero_pd() };
+
+        for (int j = 0; j < numSources; ++j)
+        {
+            const __m512 rX = _mm512_sub_ps(_mm512_set1_ps(sourcePos.x[j]), posX);
+            const __m512 rY = _mm512_sub_ps(_mm512_set1_ps(sourcePos.y[j]), posY);
+            const __m512 rZ = _mm512_sub_ps(_mm512_set1_ps(sourcePos.z[j]), posZ);
+
+            __m512 distSqr = _mm512_fmadd_ps(rX, rX, softeningSquared);
+            distSqr = _mm512_fmadd_ps(rY, rY, distSqr);
+            distSqr = _mm512_fmadd_ps(rZ, rZ, distSqr);
+
+            __m512 invDist = _mm512_rsqrt14_ps(distSqr);
+            const __m512 invDistSqr = _mm512_mul_ps(invDist, invDist);
+            invDist = _mm512_mul_ps(invDist, _mm512_fmadd_ps(_mm512_mul_ps(minusHalf, distSqr), invDistSqr, threeHalves));
+
+            const __m512 s = _mm512_mul_ps(particleMass, _mm512_mul_ps(_mm512_mul_ps(invDist, invDist), invDist));
+
+            AccumulateAVX512(_mm512_mul_ps(rX, s), accX[0], accX[1]);
+            AccumulateAVX512(_mm512_mul_ps(rY, s), accY[0], accY[1]);
+            AccumulateAVX512(_mm512_mul_ps(rZ, s), accZ[0], accZ[1]);
+        }
+
+        for (int h = 0; h < 2; ++h)
+        {
+            const int offset = i + 8 * h;
+            _mm512_storeu_pd(targetAcc.x + offset, _mm512_add_pd(_mm512_loadu_pd(targetAcc.x + offset), accX[h]));
+            _mm512_storeu_pd(targetAcc.y + offset, _mm512_add_pd(_mm512_loadu_pd(targetAcc.y + offset), accY[h]));
+            _mm512_storeu_pd(targetAcc.z + offset, _mm512_add_pd(_mm512_loadu_pd(targetAcc.z + offset), accZ[h]));
+        }
+    }
+
+    BodyBodyInteraction(targetPos.Offset(i), targetAcc.Offset(i), numTargets - i, sourcePos, numSources);
+}
+
+//--------------------------------------------------------------------------------------
+//  The double precision SIMD interaction engine.
+//--------------------------------------------------------------------------------------
+//
+//  There is no double precision reciprocal square root estimate before AVX-512 so the SSE
+//  and AVX2 implementations use a square root and a division. AVX-512 provides a 14 bit 
+//  estimate which two Newton-Raphson steps refine to full double precision.
+
+void NBodyDoubleInteractionEngine::SelectCpuImplementation()
+{
+    switch (GetAVXType())
+    {
+    case kCpuAVX512:
+        m_funcptr = &NBodyDoubleInteractionEngine::BodyBodyInteractionAVX512;
+        return;
+    case kCpuAVX2:
+        m_funcptr = &NBodyDoubleInteractionEngine::BodyBodyInteractionAVX2;
+        return;
+    default:
+        break;
+    }
+
+    switch (GetSSEType())
+    {
+    case kCpuSSE4:
+    case kCpuSSE:
+        m_funcptr = &NBodyDoubleInteractionEngine::BodyBodyInteractionSSE;
+        break;
+    default:
+        m_funcptr = &NBodyDoubleInteractionEngine::BodyBodyInteraction;
+    }
+}
+
+void NBodyDoubleInteractionEngine::BodyBodyInteraction(Float3Arrays<const double> targetPos, Float3Arrays<double> targetAcc, int numTargets, Float3Arrays<const double> sourcePos, int numSources) const
+{
+    for (int i = 0; i < numTargets; ++i)
+    {
+        double accX = 0.0;
+        double accY = 0.0;
+        double accZ = 0.0;
+
+        for (int j = 0; j < numSources; ++j)
+        {
+            const double rX = sourcePos.x[j] - targetPos.x[i];
+            const double rY = sourcePos.y[j] - targetPos.y[i];
+            const double rZ = sourcePos.z[j] - targetPos.z[i];
+
+            double distSqr = rX * rX + rY * rY + rZ * rZ + m_softeningSquared;
+            double invDist = 1.0 / sqrt(distSqr);
+            double invDistCube =  invDist * invDist * invDist;
+            double s = m_particleMass * invDistCube;
+
+            accX += rX * s;
+            accY += rY * s;
+            accZ += rZ * s;
+        }
+
+        targetAcc.x[i] += accX;
+        targetAcc.y[i] += accY;
+        targetAcc.z[i] += accZ;
+    }
+}
+
+void NBodyDoubleInteractionEngine::BodyBodyInteractionSSE(Float3Arrays<const double> targetPos, Float3Arrays<double> targetAcc, int numTargets, Float3Arrays<const double> sourcePos, int numSources) const
+{
+    const __m128d softeningSquared = _mm_set1_pd(m_softeningSquared);
+    const __m128d particleMass = _mm_set1_pd(m_particleMass);
+    const __m128d one = _mm_set1_pd(1.0);
+    const int width = 2;
+
+    int i = 0;
+    for (; i + width <= numTargets; i += width)
+    {
+        const __m128d posX = _mm_loadu_pd(targetPos.x + i);
+        const __m128d posY = _mm_loadu_pd(targetPos.y + i);
+        const __m128d posZ = _mm_loadu_pd(targetPos.z + i);
+        __m128d accX = _mm_setzero_pd();
+        __m128d accY = _mm_setzero_pd();
+        __m128d accZ = _mm_setzero_pd();
+
+        for (int j = 0; j < numSources; ++j)
+        {
+            const __m128d rX = _mm_sub_pd(_mm_set1_pd(sourcePos.x[j]), posX);
+            const __m128d rY = _mm_sub_pd(_mm_set1_pd(sourcePos.y[j]), posY);
+            const __m128d rZ = _mm_sub_pd(_mm_set1_pd(sourcePos.z[j]), posZ);
+
+            __m128d distSqr = _mm_add_pd(_mm_mul_pd(rX, rX), softeningSquared);
+            distSqr = _mm_add_pd(_mm_mul_pd(rY, rY), distSqr);
+            distSqr = _mm_add_pd(_mm_mul_pd(rZ, rZ), distSqr);
+
+            const __m128d invDist = _mm_div_pd(one, _mm_sqrt_pd(distSqr));
+            const __m128d s = _mm_mul_pd(particleMass, _mm_mul_pd(_mm_mul_pd(invDist, invDist), invDist));
+
+            accX = _mm_add_pd(_mm_mul_pd(rX, s), accX);
+            accY = _mm_add_pd(_mm_mul_pd(rY, s), accY);
+            accZ = _mm_add_pd(_mm_mul_pd(rZ, s), accZ);
+        }
+
+        _mm_storeu_pd(targetAcc.x + i, _mm_add_pd(_mm_loadu_pd(targetAcc.x + i), accX));
+        _mm_storeu_pd(targetAcc.y + i, _mm_add_pd(_mm_loadu_pd(targetAcc.y + i), accY));
+        _mm_storeu_pd(targetAcc.z + i, _mm_add_pd(_mm_loadu_pd(targetAcc.z + i), accZ));
+    }
+
+    BodyBodyInteraction(targetPos.Offset(i), targetAcc.Offset(i), numTargets - i, sourcePos, numSources);
+}
+
+void NBodyDoubleInteractionEngine::BodyBodyInteractionAVX2(Float3Arrays<const double> targetPos, Float3Arrays<double> targetAcc, int numTargets, Float3Arrays<const double> sourcePos, int numSources) const
+{
+    const __m256d softeningSquared = _mm256_set1_pd(m_softeningSquared);
+    const __m256d particleMass = _mm256_set1_pd(m_particleMass);
+    const __m256d one = _mm256_set1_pd(1.0);
+    const int width = 4;
+
+    int i = 0;
+    for (; i + width <= numTargets; i += width)
+    {
+        const __m256d posX = _mm256_loadu_pd(targetPos.x + i);
+        const __m256d posY = _mm256_loadu_pd(targetPos.y + i);
+        const __m256d posZ = _mm256_loadu_pd(targetPos.z + i);
+        __m256d accX = _mm256_setzero_pd();
+        __m256d accY = _mm256_setzero_pd();
+        __m256d accZ = _mm256_setzero_pd();
+
+        for (int j = 0; j < numSources; ++j)
+        {
+            const __m256d rX = _mm256_sub_pd(_mm256_broadcast_sd(sourcePos.x + j), posX);
+            const __m256d rY = _mm256_sub_pd(_mm256_broadcast_sd(sourcePos.y + j), posY);
+            const __m256d rZ = _mm256_sub_pd(_mm256_broadcast_sd(sourcePos.z + j), posZ);
+
+            __m256d distSqr = _mm256_fmadd_pd(rX, rX, softeningSquared);
+            distSqr = _mm256_fmadd_pd(rY, rY, distSqr);
+            distSqr = _mm256_fmadd_pd(rZ, rZ, distSqr);
+
+            const __m256d invDist = _mm256_div_pd(one, _mm256_sqrt_pd(distSqr));
+            const __m256d s = _mm256_mul_pd(particleMass, _mm256_mul_pd(_mm256_mul_pd(invDist, invDist), invDist));
+
+            accX = _mm256_fmadd_pd(rX, s, accX);
+            accY = _mm256_fmadd_pd(rY, s, accY);
+            accZ = _mm256_fmadd_pd(rZ, s, accZ);
+        }
+
+        _mm256_storeu_pd(targetAcc.x + i, _mm256_add_pd(_mm256_loadu_pd(targetAcc.x + i), accX));
+        _mm256_storeu_pd(targetAcc.y + i, _mm256_add_pd(_mm256_loadu_pd(targetAcc.y + i), accY));
+        _mm256_storeu_pd(targetAcc.z + i, _mm256_add_pd(_mm256_loadu_pd(targetAcc.z + i), accZ));
+    }
+
+    BodyBodyInteraction(targetPos.Offset(i), targetAcc.Offset(i), numTargets - i, sourcePos, numSources);
+}
+
+void NBodyDoubleInteractionEngine::BodyBodyInteractionAVX512(Float3Arrays<const double> targetPos, Float3Arrays<double> targetAcc, int numTargets, Float3Arrays<const double> sourcePos, int numSources) const
+{
+    const __m512d softeningSquared = _mm512_set1_pd(m_softeningSquared);
+    const __m512d particleMass = _mm512_set1_pd(m_particleMass);
+    const __m512d minusHalf = _mm512_set1_pd(-0.5);
+    const __m512d threeHalves = _mm512_set1_pd(1.5);
+    const int width = 8;
+
+    int i = 0;
+    for (; i + width <= numTargets; i += width)
+    {
+        const __m512d posX = _mm512_loadu_pd(targetPos.x + i);
+        const __m512d posY = _mm512_loadu_pd(targetPos.y + i);
+        const __m512d posZ = _mm512_loadu_pd(targetPos.z + i);
+        __m512d accX = _mm512_setzero_pd();
+        __m512d accY = _mm512_setzero_pd();
+        __m512d accZ = _mm512_setzero_pd();
+
+        for (int j = 0; j < numSources; ++j)
+        {
+            const __m512d rX = _mm512_sub_pd(_mm512_set1_pd(sourcePos.x[j]), posX);
+            const __m512d rY = _mm512_sub_pd(_mm512_set1_pd(sourcePos.y[j]), posY);
+            const __m512d rZ = _mm512_sub_pd(_mm512_set1_pd(sourcePos.z[j]), posZ);
+
+            __m512d distSqr = _mm512_fmadd_pd(rX, rX, softeningSquared);
+            distSqr = _mm512_fmadd_pd(rY, rY, distSqr);
+            distSqr = _mm512_fmadd_pd(rZ, rZ, distSqr);
+
+            // Each Newton-Raphson step doubles the number of accurate bits, 14 to 28 to 56.
+            __m512d invDist = _mm512_rsqrt14_pd(distSqr);
+            const __m512d halfDistSqr = _mm512_mul_pd(minusHalf, distSqr);
+            invDist = _mm512_mul_pd(invDist, _mm512_fmadd_pd(halfDistSqr, _mm512_mul_pd(invDist, invDist), threeHalves));
+            invDist = _mm512_mul_pd(invDist, _mm512_fmadd_pd(halfDistSqr, _mm512_mul_pd(invDist, invDist), threeHalves));
+
+            const __m512d s = _mm512_mul_pd(particleMass, _mm512_mul_pd(_mm512_mul_pd(invDist, invDist), invDist));
+
+            accX = _mm512_fmadd_pd(rX, s, accX);
+            accY = _mm512_fmadd_pd(rY, s, accY);
+            accZ = _mm512_fmadd_pd(rZ, s, accZ);
+        }
+
+        _mm512_storeu_pd(targetAcc.x + i, _mm512_add_pd(_mm512_loadu_pd(targetAcc.x + i), accX));
+        _mm512_storeu_pd(targetAcc.y + i, _mm512_add_pd(_mm512_loadu_pd(targetAcc.y + i), accY));
+        _mm512_storeu_pd(targetAcc.z + i, _mm512_add_pd(_mm512_loadu_pd(targetAcc.z + i), accZ));
+    }
+
+    BodyBodyInteraction(targetPos.Offset(i), targetAcc.Offset(i), numTargets - i, sourcePos, numSources);
+}
+
+//--------------------------------------------------------------------------------------
+//  Parallel SIMD implementation of the n-body calculation with selectable precision.
+//--------------------------------------------------------------------------------------
+//
+//  The members of NBodyPrecision are defined here and instantiated for the three policies
+//  by NBodyPrecisionFactory.
+
+template <typename Precision>
+void NBodyPrecision<Precision>::Integrate(ParticleCpu* const pParticlesIn, ParticleCpu* const pParticlesOut, int numParticles) const
+{
+    LoadState(pParticlesIn, numParticles);
+    Accelerations(numParticles);
+
+    const Float3Arrays<Storage> pos = m_pos.arrays;
+    const Float3Arrays<Storage> vel = m_vel.arrays;
+    const Float3Arrays<Accumulator> acc = m_acc.arrays;
+    const Storage deltaTime = m_deltaTime;
+    const Storage dampingFactor = m_dampingFactor;
+    parallel_for(0, numParticles, [=](int i)
+    {
+        vel.x[i] = (vel.x[i] + Storage(acc.x[i]) * deltaTime) * dampingFactor;
+        vel.y[i] = (vel.y[i] + Storage(acc.y[i]) * deltaTime) * dampingFactor;
+        vel.z[i] = (vel.z[i] + Storage(acc.z[i]) * deltaTime) * dampingFactor;
+        pos.x[i] += vel.x[i] * deltaTime;
+        pos.y[i] += vel.y[i] * deltaTime;
+        pos.z[i] += vel.z[i] * deltaTime;
+
+        pParticlesOut[i].pos = float_3(float(pos.x[i]), float(pos.y[i]), float(pos.z[i]));
+        pParticlesOut[i].vel = float_3(float(vel.x[i]), float(vel.y[i]), float(vel.z[i]));
+    });
+}
+
+template <typename Precision>
+void NBodyPrecision<Precision>::CalculateAccelerations(const ParticleCpu* const pParticles, int numParticles, double_3* const pAcc) const
+{
+    LoadState(pParticles, numParticles);
+    Accelerations(numParticles);
+
+    const Float3Arrays<Accumulator> acc = m_acc.arrays;
+    parallel_for(0, numParticles, [=](int i)
+    {
+        pAcc[i] = double_3(acc.x[i], acc.y[i], acc.z[i]);
+    });
+}
+
+//  Reload the state unless it is the state written by the previous step. Comparing the 
+//  rounded state is enough, any change made to the particles is at least one float ulp.
+
+template <typename Precision>
+void NBodyPrecision<Precision>::LoadState(const ParticleCpu* const pParticles, int numParticles) const
+{
+    assert(numParticles <= m_pos.capacity());
+
+    const Float3Arrays<Storage> pos = m_pos.arrays;
+    const Float3Arrays<Storage> vel = m_vel.arrays;
+    if (numParticles == m_numParticles)
+    {
+        combinable<int> changed;
+        parallel_for(0, numParticles, [=, &changed](int i)
+        {
+            const ParticleCpu& p = pParticles[i];
+            if ((p.pos.x != float(pos.x[i])) || (p.pos.y != float(pos.y[i])) || (p.pos.z != float(pos.z[i])) ||
+                (p.vel.x != float(vel.x[i])) || (p.vel.y != float(vel.y[i])) || (p.vel.z != float(vel.z[i])))
+                changed.local() = 1;
+        });
+        if (changed.combine(std::plus<int>()) == 0)
+            return;
+    }
+
+    parallel_for(0, numParticles, [=](int i)
+    {
+        const ParticleCpu& p = pParticles[i];
+        pos.x[i] = p.pos.x;
+        pos.y[i] = p.pos.y;
+        pos.z[i] = p.pos.z;
+        vel.x[i] = p.vel.x;
+        vel.y[i] = p.vel.y;
+        vel.z[i] = p.vel.z;
+    });
+    m_numParticles = numParticles;
+}
+
+//  Each task updates a block of targets against all the particles.
+
+template <typename Precision>
+void NBodyPrecision<Precision>::Accelerations(int numParticles) const
+{
+    const Float3Arrays<Accumulator> acc = m_acc.arrays;
+    parallel_for(0, numParticles, [=](int i)
+    {
+        acc.x[i] = acc.y[i] = acc.z[i] = Accumulator(0);
+    });
+
+    const Float3Arrays<const Storage> pos = m_pos.ConstArrays();
+    BlockedInteractions(*m_engine, pos, acc, numParticles, pos, numParticles);
+}
+
+std::shared_ptr<NBodyPrecisionBase> NBodyPrecisionFactory(PrecisionMode mode, float softeningSquared, float dampingFactor, 
+    float deltaTime, float particleMass, int maxParticles)
+{
+    switch (mode)
+    {
+    case kPrecisionMixed:
+        return std::make_shared<NBodyPrecision<MixedPrecision>>(softeningSquared, dampingFactor, deltaTime, particleMass, maxParticles);
+    case kPrecisionDouble:
+        return std::make_shared<NBodyPrecision<DoublePrecision>>(softeningSquared, dampingFactor, deltaTime, particleMass, maxParticles);
+    default:
+        return std::make_shared<NBodyPrecision<FloatPrecision>>(softeningSquared, dampingFactor, deltaTime, particleMass, maxParticles);
+    }
+}
@@ -0,0 +1,255 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the 
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+
+#pragma once
+
+#include <memory>
+#include <new>
+#include <algorithm>
+
+#include "Common.h"
+#include "INBodyCpu.h"
+#include "ParticleCpu.h"
+#include "NBodyCpu.h"
+#include "NBodySoACpu.h"
+
+//--------------------------------------------------------------------------------------
+//  Precision of the force calculation.
+//--------------------------------------------------------------------------------------
+//
+//  kPrecisionFloat   Single precision throughout, the reciprocal square root estimate is 
+//                    refined with one Newton-Raphson step. This is NBodySoA's fast path.
+//  kPrecisionMixed   Each interaction is calculated in single precision but accelerations
+//                    are accumulated in double precision, removing the rounding error that
+//                    grows with the number of particles.
+//  kPrecisionDouble  Double precision throughout, including the particle state between 
+//                    steps.
+
+enum PrecisionMode
+{
+    kPrecisionFloat = 0,
+    kPrecisionMixed = 1,
+    kPrecisionDouble = 2
+};
+
+//--------------------------------------------------------------------------------------
+//  SIMD interaction engines for mixed and double precision.
+//--------------------------------------------------------------------------------------
+//
+//  These have the same interface as NBodySoAInteractionEngine but with different storage
+//  and accumulation types. As with the other engines the most performant implementation 
+//  is picked on initialization based on the available AVX or SSE support.
+
+class NBodyMixedInteractionEngine;
+
+typedef void (NBodyMixedInteractionEngine::* NBodyMixedFunc)(ConstFloat3SoA targetPos, Float3Arrays<double> targetAcc, int numTargets, ConstFloat3SoA sourcePos, int numSources) const;
+
+class NBodyMixedInteractionEngine
+{
+private:
+    const float m_softeningSquared;
+    const float m_particleMass;
+    NBodyMixedFunc m_funcptr;
+
+public:
+    NBodyMixedInteractionEngine(float softeningSquared, float particleMass) :
+        m_softeningSquared(softeningSquared),
+        m_particleMass(particleMass),
+        m_funcptr(nullptr)
+    {
+        SelectCpuImplementation();
+    }
+
+    inline void InvokeBodyBodyInteraction(ConstFloat3SoA targetPos, Float3Arrays<double> targetAcc, int numTargets, ConstFloat3SoA sourcePos, int numSources) const
+    {
+        (this->*m_funcptr)(targetPos, targetAcc, numTargets, sourcePos, numSources);
+    };
+
+private:
+    void SelectCpuImplementation();
+
+    void BodyBodyInteraction(ConstFloat3SoA targetPos, Float3Arrays<double> targetAcc, int numTargets, ConstFloat3SoA sourcePos, int numSources) const;
+    void BodyBodyInteractionSSE(ConstFloat3SoA targetPos, Float3Arrays<double> targetAcc, int numTargets, ConstFloat3SoA sourcePos, int numSources) const;
+    void BodyBodyInteractionAVX2(ConstFloat3SoA targetPos, Float3Arrays<double> targetAcc, int numTargets, ConstFloat3SoA sourcePos, int numSources) const;
+    void BodyBodyInteractionAVX512(ConstFloat3SoA targetPos, Float3Arrays<double> targetAcc, int numTargets, ConstFloat3SoA sourcePos, int numSources) const;
+};
+
+class NBodyDoubleInteractionEngine;
+
+typedef void (NBodyDoubleInteractionEngine::* NBodyDoubleFunc)(Float3Arrays<const double> targetPos, Float3Arrays<double> targetAcc, int numTargets, Float3Arrays<const double> sourcePos, int numSources) const;
+
+class NBodyDoubleInteractionEngine
+{
+private:
+    const double m_softeningSquared;
+    const double m_particleMass;
+    NBodyDoubleFunc m_funcptr;
+
+public:
+    NBodyDoubleInteractionEngine(float softeningSquared, float particleMass) :
+        m_softeningSquared(softeningSquared),
+        m_particleMass(particleMass),
+        m_funcptr(nullptr)
+    {
+        SelectCpuImplementation();
+    }
+
+    inline void InvokeBodyBodyInteraction(Float3Arrays<const double> targetPos, Float3Arrays<double> targetAcc, int numTargets, Float3Arrays<const double> sourcePos, int numSources) const
+    {
+        (this->*m_funcptr)(targetPos, targetAcc, numTargets, sourcePos, numSources);
+    };
+
+private:
+    void SelectCpuImplementation();
+
+    void BodyBodyInteraction(Float3Arrays<const double> targetPos, Float3Arrays<double> targetAcc, int numTargets, Float3Arrays<const double> sourcePos, int numSources) const;
+    void BodyBodyInteractionSSE(Float3Arrays<const double> targetPos, Float3Arrays<double> targetAcc, int numTargets, Float3Arrays<const double> sourcePos, int numSources) const;
+    void BodyBodyInteractionAVX2(Float3Arrays<const double> targetPos, Float3Arrays<double> targetAcc, int numTargets, Float3Arrays<const double> sourcePos, int numSources) const;
+    void BodyBodyInteractionAVX512(Float3Arrays<const double> targetPos, Float3Arrays<double> targetAcc, int numTargets, Float3Arrays<const double> sourcePos, int numSources) const;
+};
+
+//--------------------------------------------------------------------------------------
+//  Precision policies.
+//--------------------------------------------------------------------------------------
+//
+//  Each policy gives the type used to store particle positions and velocities, the type 
+//  accelerations are accumulated in and the interaction engine that calculates them.
+
+struct FloatPrecision
+{
+    typedef float Storage;
+    typedef float Accumulator;
+    typedef NBodySoAInteractionEngine Engine;
+    static const PrecisionMode Mode = kPrecisionFloat;
+};
+
+struct MixedPrecision
+{
+    typedef float Storage;
+    typedef double Accumulator;
+    typedef NBodyMixedInteractionEngine Engine;
+    static const PrecisionMode Mode = kPrecisionMixed;
+};
+
+struct DoublePrecision
+{
+    typedef double Storage;
+    typedef double Accumulator;
+    typedef NBodyDoubleInteractionEngine Engine;
+    static const PrecisionMode Mode = kPrecisionDouble;
+};
+
+//  Three arrays of T, each aligned to, and padded to a multiple of, the size of an 
+//  AVX-512 register.
+
+template <typename T>
+class AlignedFloat3Arrays
+{
+private:
+    int m_capacity;
+    std::unique_ptr<T, AlignedFreeDeleter<T>> m_data;
+
+public:
+    Float3Arrays<T> arrays;
+
+    explicit AlignedFloat3Arrays(int size) :
+        m_capacity(PaddedSize(size)),
+        m_data(static_cast<T*>(_aligned_malloc(3 * PaddedSize(size) * sizeof(T), AVX_ALIGNMENTBOUNDARY))),
+        arrays(nullptr, nullptr, nullptr)
+    {
+        T* const p = m_data.get();
+        if (p == nullptr)
+            throw std::bad_alloc();
+        std::fill(p, p + 3 * m_capacity, T(0));
+        arrays = Float3Arrays<T>(p, p + m_capacity, p + 2 * m_capacity);
+    }
+
+    inline int capacity() const { return m_capacity; }
+    inline Float3Arrays<const T> ConstArrays() const { return Float3Arrays<const T>(arrays.x, arrays.y, arrays.z); }
+
+private:
+    static int PaddedSize(int size)
+    {
+        const int valuesPerLine = AVX_ALIGNMENTBOUNDARY / sizeof(T);
+        return ((size + valuesPerLine - 1) / valuesPerLine) * valuesPerLine;
+    }
+
+    AlignedFloat3Arrays(const AlignedFloat3Arrays&);
+    AlignedFloat3Arrays& operator=(const AlignedFloat3Arrays&);
+};
+
+//--------------------------------------------------------------------------------------
+//  Parallel SIMD implementation of the n-body calculation with selectable precision.
+//--------------------------------------------------------------------------------------
+//
+//  NBodyPrecision<Precision> is NBodySoA with the storage, accumulation and engine types
+//  taken from a precision policy. The particle state is kept in Precision::Storage between 
+//  steps and is only reloaded from pParticlesIn if it no longer matches, for example after
+//  the particles are reset. The state written to pParticlesOut is rounded to float.
+//
+//  NBodyPrecisionBase allows the precision to be picked at runtime, see 
+//  NBodyPrecisionFactory, and exposes the accelerations so their error can be measured.
+
+class NBodyPrecisionBase : public INBodyCpu
+{
+public:
+    virtual PrecisionMode Mode() const = 0;
+
+    //  Calculate the acceleration of every particle without updating them.
+    virtual void CalculateAccelerations(const ParticleCpu* const pParticles, int numParticles, double_3* const pAcc) const = 0;
+};
+
+template <typename Precision>
+class NBodyPrecision : public NBodyPrecisionBase
+{
+private:
+    typedef typename Precision::Storage Storage;
+    typedef typename Precision::Accumulator Accumulator;
+
+    std::shared_ptr<typename Precision::Engine> m_engine;
+    const float m_deltaTime;
+    const float m_dampingFactor;
+    mutable AlignedFloat3Arrays<Storage> m_pos;
+    mutable AlignedFloat3Arrays<Storage> m_vel;
+    mutable AlignedFloat3Arrays<Accumulator> m_acc;
+    mutable int m_numParticles;                                 // Number of particles in m_pos and m_vel.
+
+public:
+    NBodyPrecision(float softeningSquared, float dampingFactor, float deltaTime, float particleMass, int maxParticles) :
+        NBodyPrecisionBase(),
+        m_engine(std::make_shared<typename Precision::Engine>(softeningSquared, particleMass)),
+        m_deltaTime(deltaTime),
+        m_dampingFactor(dampingFactor),
+        m_pos(maxParticles),
+        m_vel(maxParticles),
+        m_acc(maxParticles),
+        m_numParticles(0)
+    {
+    }
+
+    PrecisionMode Mode() const { return Precision::Mode; }
+
+    void Integrate(ParticleCpu* const pParticlesIn, ParticleCpu* const pParticlesOut, int numParticles) const;
+    void CalculateAccelerations(const ParticleCpu* const pParticles, int numParticles, double_3* const pAcc) const;
+
+private:
+    void LoadState(const ParticleCpu* const pParticles, int numParticles) const;
+    void Accelerations(int numParticles) const;
+};
+
+std::shared_ptr<NBodyPrecisionBase> NBodyPrecisionFactory(PrecisionMode mode, float softeningSquared, float dampingFactor, 
+    float deltaTime, float particleMass, int maxParticles);
@@ -0,0 +1,431 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the 
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+#include <math.h>
+#include <ppl.h>
+#include <concrtrm.h>
+#include <assert.h>
+#include <memory>
+#include <algorithm>
+#include <immintrin.h>
+
+#include "Common.h"
+#include "NBodySoACpu.h"
+
+using namespace concurrency;
+using namespace concurrency::graphics;
+
+//--------------------------------------------------------------------------------------
+//  The SIMD interaction engine for particles stored as a structure of arrays.
+//--------------------------------------------------------------------------------------
+//
+//  Each function processes targets a register width at a time and then calls the scalar
+//  implementation for any remaining targets. The reciprocal square root estimate is 
+//  refined with a single Newton-Raphson step:
+//
+//  y' = y * (1.5 - 0.5 * x * y * y)
+//
+//  which gives close to full single precision accuracy.
+
+//  Select which interaction engine to use based on the available AVX and SSE support.
+
+void NBodySoAInteractionEngine::SelectCpuImplementation()
+{
+    switch (GetAVXType())
+    {
+    case kCpuAVX512:
+        m_funcptr = &NBodySoAInteractionEngine::BodyBodyInteractionAVX512<false>;
+        m_potentialFuncptr = &NBodySoAInteractionEngine::BodyBodyInteractionAVX512<true>;
+        m_width = 16;
+        return;
+    case kCpuAVX2:
+        m_funcptr = &NBodySoAInteractionEngine::BodyBodyInteractionAVX2<false>;
+        m_potentialFuncptr = &NBodySoAInteractionEngine::BodyBodyInteractionAVX2<true>;
+        m_width = 8;
+        return;
+    default:
+        break;
+    }
+
+    switch (GetSSEType())
+    {
+    case kCpuSSE4:
+    case kCpuSSE:
+        m_funcptr = &NBodySoAInteractionEngine::BodyBodyInteractionSSE<false>;
+        m_potentialFuncptr = &NBodySoAInteractionEngine::BodyBodyInteractionSSE<true>;
+        m_width = 4;
+        break;
+    default:
+        m_funcptr = &NBodySoAInteractionEngine::BodyBodyInteraction<false>;
+        m_potentialFuncptr = &NBodySoAInteractionEngine::BodyBodyInteraction<true>;
+        m_width = 1;
+    }
+}
+
+//  A particle's interaction with itself has r = 0, so it is calculated by giving the selected
+//  implementation a register of targets, and then a single target, at the same position as 
+//  a single source.
+
+void NBodySoAInteractionEngine::CalculateSelfPotential()
+{
+    const int kMaxWidth = 16;
+    float zero[kMaxWidth] = { 0.0f };
+    float accX[kMaxWidth] = { 0.0f };
+    float accY[kMaxWidth] = { 0.0f };
+    float accZ[kMaxWidth] = { 0.0f };
+    float potential[kMaxWidth] = { 0.0f };
+    const ConstFloat3SoA pos(zero, zero, zero);
+    const Float3SoA acc(accX, accY, accZ);
+
+    InvokePotentialInteraction(pos, acc, potential, m_width, pos, 1);
+    m_vectorSelfPotential = potential[0];
+    potential[0] = 0.0f;
+    BodyBodyInteraction<true>(pos, acc, potential, 1, pos, 1);
+    m_scalarSelfPotential = potential[0];
+}
+
+template <bool Potential>
+void NBodySoAInteractionEngine::BodyBodyInteraction(ConstFloat3SoA targetPos, Float3SoA targetAcc, float* const targetPotential, int numTargets, 
+    ConstFloat3SoA sourcePos, int numSources) const
+{
+    for (int i = 0; i < numTargets; ++i)
+    {
+        float_3 pos(targetPos.x[i], targetPos.y[i], targetPos.z[i]);
+        float_3 acc(0.0f);
+        float potential = 0.0f;
+
+        for (int j = 0; j < numSources; ++j)
+        {
+            const float_3 r = float_3(sourcePos.x[j], sourcePos.y[j], sourcePos.z[j]) - pos;
+
+            float distSqr = SqrLength(r) + m_softeningSquared;
+            float invDist = 1.0f / sqrt(distSqr);
+            float invDistCube =  invDist * invDist * invDist;
+            float s = m_particleMass * invDistCube;
+
+            acc += r * s;
+            if (Potential)
+                potential -= invDist;
+        }
+
+        targetAcc.x[i] += acc.x;
+        targetAcc.y[i] += acc.y;
+        targetAcc.z[i] += acc.z;
+        if (Potential)
+            targetPotential[i] += m_particleMass * potential;
+    }
+}
+
+template <bool Potential>
+void NBodySoAInteractionEngine::BodyBodyInteractionSSE(ConstFloat3SoA targetPos, Float3SoA targetAcc, float* const targetPotential, int numTargets, 
+    ConstFloat3SoA sourcePos, int numSources) const
+{
+    const __m128 softeningSquared = _mm_set1_ps(m_softeningSquared);
+    const __m128 particleMass = _mm_set1_ps(m_particleMass);
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 threeHalves = _mm_set1_ps(1.5f);
+    const int width = 4;
+
+    int i = 0;
+    for (; i + width <= numTargets; i += width)
+    {
+        const __m128 posX = _mm_loadu_ps(targetPos.x + i);
+        const __m128 posY = _mm_loadu_ps(targetPos.y + i);
+        const __m128 posZ = _mm_loadu_ps(targetPos.z + i);
+        __m128 accX = _mm_setzero_ps();
+        __m128 accY = _mm_setzero_ps();
+        __m128 accZ = _mm_setzero_ps();
+        __m128 potential = _mm_setzero_ps();
+
+        for (int j = 0; j < numSources; ++j)
+        {
+            //const float_3 r = p.pos - pos;
+            const __m128 rX = _mm_sub_ps(_mm_set1_ps(sourcePos.x[j]), posX);
+            const __m128 rY = _mm_sub_ps(_mm_set1_ps(sourcePos.y[j]), posY);
+            const __m128 rZ = _mm_sub_ps(_mm_set1_ps(sourcePos.z[j]), posZ);
+
+            //float distSqr = SqrLength(r) + m_softeningSquared;
+            __m128 distSqr = _mm_add_ps(_mm_mul_ps(rX, rX), softeningSquared);
+            distSqr = _mm_add_ps(_mm_mul_ps(rY, rY), distSqr);
+            distSqr = _mm_add_ps(_mm_mul_ps(rZ, rZ), distSqr);
+
+            //float invDist = 1.0f / sqrt(distSqr);
+            __m128 invDist = _mm_rsqrt_ps(distSqr);
+            invDist = _mm_mul_ps(invDist, _mm_sub_ps(threeHalves, 
+                _mm_mul_ps(_mm_mul_ps(half, distSqr), _mm_mul_ps(invDist, invDist))));
+
+            //float s = m_particleMass * invDist * invDist * invDist;
+            const __m128 s = _mm_mul_ps(particleMass, _mm_mul_ps(_mm_mul_ps(invDist, invDist), invDist));
+
+            //acc += r * s;
+            accX = _mm_add_ps(_mm_mul_ps(rX, s), accX);
+            accY = _mm_add_ps(_mm_mul_ps(rY, s), accY);
+            accZ = _mm_add_ps(_mm_mul_ps(rZ, s), accZ);
+            if (Potential)
+                potential = _mm_sub_ps(potential, invDist);
+        }
+
+        _mm_storeu_ps(targetAcc.x + i, _mm_add_ps(_mm_loadu_ps(targetAcc.x + i), accX));
+        _mm_storeu_ps(targetAcc.y + i, _mm_add_ps(_mm_loadu_ps(targetAcc.y + i), accY));
+        _mm_storeu_ps(targetAcc.z + i, _mm_add_ps(_mm_loadu_ps(targetAcc.z + i), accZ));
+        if (Potential)
+            _mm_storeu_ps(targetPotential + i, _mm_add_ps(_mm_loadu_ps(targetPotential + i), _mm_mul_ps(particleMass, potential)));
+    }
+
+    BodyBodyInteraction<Potential>(targetPos.Offset(i), targetAcc.Offset(i), Potential ? targetPotential + i : nullptr, numTargets - i, 
+        sourcePos, numSources);
+}
+
+//  The AVX2 implementation also uses fused multiply-add (FMA3) instructions, these are 
+//  always available on processors that support AVX2.
+
+template <bool Potential>
+void NBodySoAInteractionEngine::BodyBodyInteractionAVX2(ConstFloat3SoA targetPos, Float3SoA targetAcc, float* const targetPotential, int numTargets, 
+    ConstFloat3SoA sourcePos, int numSources) const
+{
+    const __m256 softeningSquared = _mm256_set1_ps(m_softeningSquared);
+    const __m256 particleMass = _mm256_set1_ps(m_particleMass);
+    const __m256 minusHalf = _mm256_set1_ps(-0.5f);
+    const __m256 threeHalves = _mm256_set1_ps(1.5f);
+    const int width = 8;
+
+    int i = 0;
+    for (; i + width <= numTargets; i += width)
+    {
+        const __m256 posX = _mm256_loadu_ps(targetPos.x + i);
+        const __m256 posY = _mm256_loadu_ps(targetPos.y + i);
+        const __m256 posZ = _mm256_loadu_ps(targetPos.z + i);
+        __m256 accX = _mm256_setzero_ps();
+        __m256 accY = _mm256_setzero_ps();
+        __m256 accZ = _mm256_setzero_ps();
+        __m256 potential = _mm256_setzero_ps();
+
+        for (int j = 0; j < numSources; ++j)
+        {
+            const __m256 rX = _mm256_sub_ps(_mm256_broadcast_ss(sourcePos.x + j), posX);
+            const __m256 rY = _mm256_sub_ps(_mm256_broadcast_ss(sourcePos.y + j), posY);
+            const __m256 rZ = _mm256_sub_ps(_mm256_broadcast_ss(sourcePos.z + j), posZ);
+
+            __m256 distSqr = _mm256_fmadd_ps(rX, rX, softeningSquared);
+            distSqr = _mm256_fmadd_ps(rY, rY, distSqr);
+            distSqr = _mm256_fmadd_ps(rZ, rZ, distSqr);
+
+            __m256 invDist = _mm256_rsqrt_ps(distSqr);
+            const __m256 invDistSqr = _mm256_mul_ps(invDist, invDist);
+            invDist = _mm256_mul_ps(invDist, _mm256_fmadd_ps(_mm256_mul_ps(minusHalf, distSqr), invDistSqr, threeHalves));
+
+            const __m256 s = _mm256_mul_ps(particleMass, _mm256_mul_ps(_mm256_mul_ps(invDist, invDist), invDist));
+
+            accX = _mm256_fmadd_ps(rX, s, accX);
+            accY = _mm256_fmadd_ps(rY, s, accY);
+            accZ = _mm256_fmadd_ps(rZ, s, accZ);
+            if (Potential)
+                potential = _mm256_sub_ps(potential, invDist);
+        }
+
+        _mm256_storeu_ps(targetAcc.x + i, _mm256_add_ps(_mm256_loadu_ps(targetAcc.x + i), accX));
+        _mm256_storeu_ps(targetAcc.y + i, _mm256_add_ps(_mm256_loadu_ps(targetAcc.y + i), accY));
+        _mm256_storeu_ps(targetAcc.z + i, _mm256_add_ps(_mm256_loadu_ps(targetAcc.z + i), accZ));
+        if (Potential)
+            _mm256_storeu_ps(targetPotential + i, _mm256_fmadd_ps(particleMass, potential, _mm256_loadu_ps(targetPotential + i)));
+    }
+
+    BodyBodyInteraction<Potential>(targetPos.Offset(i), targetAcc.Offset(i), Potential ? targetPotential + i : nullptr, numTargets - i, 
+        sourcePos, numSources);
+}
+
+//  AVX-512 provides a more accurate reciprocal square root estimate (relative error < 2^-14)
+//  so the Newton-Raphson step gives a fully accurate result.
+
+template <bool Potential>
+void NBodySoAInteractionEngine::BodyBodyInteractionAVX512(ConstFloat3SoA targetPos, Float3SoA targetAcc, float* const targetPotential, int numTargets, 
+    ConstFloat3SoA sourcePos, int numSources) const
+{
+    const __m512 softeningSquared = _mm512_set1_ps(m_softeningSquared);
+    const __m512 particleMass = _mm512_set1_ps(m_particleMass);
+    const __m512 minusHalf = _mm512_set1_ps(-0.5f);
+    const __m512 threeHalves = _mm512_set1_ps(1.5f);
+    const int width = 16;
+
+    int i = 0;
+    for (; i + width <= numTargets; i += width)
+    {
+        const __m512 posX = _mm512_loadu_ps(targetPos.x + i);
+        const __m512 posY = _mm512_loadu_ps(targetPos.y + i);
+        const __m512 posZ = _mm512_loadu_ps(targetPos.z + i);
+        __m512 accX = _mm512_setzero_ps();
+        __m512 accY = _mm512_setzero_ps();
+        __m512 accZ = _mm512_setzero_ps();
+        __m512 potential = _mm512_setzero_ps();
+
+        for (int j = 0; j < numSources; ++j)
+        {
+            const __m512 rX = _mm512_sub_ps(_mm512_set1_ps(sourcePos.x[j]), posX);
+            const __m512 rY = _mm512_sub_ps(_mm512_set1_ps(sourcePos.y[j]), posY);
+            const __m512 rZ = _mm512_sub_ps(_mm512_set1_ps(sourcePos.z[j]), posZ);
+
+            __m512 distSqr = _mm512_fmadd_ps(rX, rX, softeningSquared);
+            distSqr = _mm512_fmadd_ps(rY, rY, distSqr);
+            distSqr = _mm512_fmadd_ps(rZ, rZ, distSqr);
+
+            __m512 invDist = _mm512_rsqrt14_ps(distSqr);
+            const __m512 invDistSqr = _mm512_mul_ps(invDist, invDist);
+            invDist = _mm512_mul_ps(invDist, _mm512_fmadd_ps(_mm512_mul_ps(minusHalf, distSqr), invDistSqr, threeHalves));
+
+            const __m512 s = _mm512_mul_ps(particleMass, _mm512_mul_ps(_mm512_mul_ps(invDist, invDist), invDist));
+
+            accX = _mm512_fmadd_ps(rX, s, accX);
+            accY = _mm512_fmadd_ps(rY, s, accY);
+            accZ = _mm512_fmadd_ps(rZ, s, accZ);
+            if (Potential)
+                potential = _mm512_sub_ps(potential, invDist);
+        }
+
+        _mm512_storeu_ps(targetAcc.x + i, _mm512_add_ps(_mm512_loadu_ps(targetAcc.x + i), accX));
+        _mm512_storeu_ps(targetAcc.y + i, _mm512_add_ps(_mm512_loadu_ps(targetAcc.y + i), accY));
+        _mm512_storeu_ps(targetAcc.z + i, _mm512_add_ps(_mm512_loadu_ps(targetAcc.z + i), accZ));
+        if (Potential)
+            _mm512_storeu_ps(targetPotential + i, _mm512_fmadd_ps(particleMass, potential, _mm512_loadu_ps(targetPotential + i)));
+    }
+
+    BodyBodyInteraction<Potential>(targetPos.Offset(i), targetAcc.Offset(i), Potential ? targetPotential + i : nullptr, numTargets - i, 
+        sourcePos, numSources);
+}
+
+//--------------------------------------------------------------------------------------
+//  Updating a block of particles.
+//--------------------------------------------------------------------------------------
+//
+//  The velocities are gathered into arrays on the stack so the whole update runs on 
+//  structures of arrays, four particles at a time, and is scattered back into pParticlesOut.
+
+void UpdateSoABlock(const ParticleCpu* const pParticlesIn, ParticleCpu* const pParticlesOut, Float3SoA pos, ConstFloat3SoA acc, 
+    int count, float deltaTime, float dampingFactor, float* const sqrSpeed)
+{
+    assert(count <= kSoATargetBlockSize);
+
+    float velX[kSoATargetBlockSize];
+    float velY[kSoATargetBlockSize];
+    float velZ[kSoATargetBlockSize];
+    GatherFloat3(&pParticlesIn->vel, sizeof(ParticleCpu), count, velX, velY, velZ);
+    if (sqrSpeed != nullptr)
+        SqrLengthFloat3(velX, velY, velZ, sqrSpeed, count);
+
+    AddScaledFloat3(velX, velY, velZ, acc.x, acc.y, acc.z, deltaTime, count);
+    ScaleFloat3(velX, velY, velZ, dampingFactor, count);
+    AddScaledFloat3(pos.x, pos.y, pos.z, velX, velY, velZ, deltaTime, count);
+
+    ScatterFloat3(pos.x, pos.y, pos.z, count, &pParticlesOut->pos, sizeof(ParticleCpu));
+    ScatterFloat3(velX, velY, velZ, count, &pParticlesOut->vel, sizeof(ParticleCpu));
+}
+
+//--------------------------------------------------------------------------------------
+//  Parallel SIMD implementation of the n-body calculation using a structure of arrays.
+//--------------------------------------------------------------------------------------
+//
+//  Each task updates a block of targets against all the particles. Blocks start on a multiple
+//  of the alignment boundary so no two tasks write to the same cache line of accelerations.
+//
+//  The update is also done a block at a time, see UpdateSoABlock, which moves the positions 
+//  in the SoA cache as well. With diagnostics enabled each block adds its sums to the thread's
+//  partial sum once.
+
+void NBodySoA::Integrate(ParticleCpu* const pParticlesIn, ParticleCpu* const pParticlesOut, int numParticles) const
+{
+    assert(numParticles <= m_particles.capacity());
+
+    const Float3SoA pos = m_particles.pos;
+    const Float3SoA acc = m_particles.acc;
+    float* const potential = m_diagnosticsEnabled ? &m_potential[0] : nullptr;
+
+    // The copy into the SoA cache is part of the force phase.
+    MetricsClock::time_point start = MetricsClock::now();
+    ForEachTargetBlock(numParticles, [=](int begin, int count)
+    {
+        GatherFloat3(&pParticlesIn[begin].pos, sizeof(ParticleCpu), count, pos.x + begin, pos.y + begin, pos.z + begin);
+        std::fill(acc.x + begin, acc.x + begin + count, 0.0f);
+        std::fill(acc.y + begin, acc.y + begin + count, 0.0f);
+        std::fill(acc.z + begin, acc.z + begin + count, 0.0f);
+        if (potential != nullptr)
+            std::fill(potential + begin, potential + begin + count, 0.0f);
+    });
+
+    const ConstFloat3SoA sourcePos(pos.x, pos.y, pos.z);
+    int numBlocks = 0;
+    if (potential == nullptr)
+    {
+        numBlocks = BlockedInteractions(*m_engine, sourcePos, acc, numParticles, sourcePos, numParticles);
+    }
+    else
+    {
+        numBlocks = ForEachTargetBlock(numParticles, [=](int begin, int count)
+        {
+            m_engine->InvokePotentialInteraction(sourcePos.Offset(begin), acc.Offset(begin), potential + begin, count, sourcePos, numParticles);
+        });
+    }
+    m_counters.interactions = double(numParticles) * double(numParticles);
+    m_counters.forceSeconds = MetricsSeconds(start);
+    m_counters.tasks = numBlocks;
+    start = MetricsClock::now();
+
+    const ConstFloat3SoA constAcc(acc.x, acc.y, acc.z);
+    if (potential == nullptr)
+    {
+        ForEachTargetBlock(numParticles, [=](int begin, int count)
+        {
+            UpdateSoABlock(pParticlesIn + begin, pParticlesOut + begin, pos.Offset(begin), constAcc.Offset(begin), count, 
+                m_deltaTime, m_dampingFactor);
+        });
+        m_counters.integrateSeconds = MetricsSeconds(start);
+        return;
+    }
+
+    // Each pair's potential is counted by both particles. The blocks match the force calculation's
+    // so each self term is removed as that call calculated it.
+    combinable<NBodyDiagnostics> partials;
+    ForEachTargetBlock(numParticles, [=, &partials](int begin, int count)
+    {
+        NBodyDiagnostics block;
+        for (int i = begin; i < begin + count; ++i)
+        {
+            const float_3 p = pParticlesIn[i].pos;
+            const float_3 v = pParticlesIn[i].vel;
+            block.potentialEnergy += 0.5 * (potential[i] - m_engine->SelfPotential(i - begin, count));
+            block.momentum[0] += v.x;
+            block.momentum[1] += v.y;
+            block.momentum[2] += v.z;
+            block.centerOfMass[0] += p.x;
+            block.centerOfMass[1] += p.y;
+            block.centerOfMass[2] += p.z;
+        }
+
+        float sqrSpeed[kSoATargetBlockSize];
+        UpdateSoABlock(pParticlesIn + begin, pParticlesOut + begin, pos.Offset(begin), constAcc.Offset(begin), count, 
+            m_deltaTime, m_dampingFactor, sqrSpeed);
+        for (int k = 0; k < count; ++k)
+            block.kineticEnergy += 0.5 * sqrSpeed[k];
+        partials.local() += block;
+    });
+
+    m_diagnostics = partials.combine([](const NBodyDiagnostics& a, const NBodyDiagnostics& b)
+    {
+        NBodyDiagnostics sum(a);
+        return sum += b;
+    });
+    for (int c = 0; c < 3; ++c)
+        m_diagnostics.centerOfMass[c] /= std::max(numParticles, 1);
+    m_counters.integrateSeconds = MetricsSeconds(start);
+}
@@ -0,0 +1,313 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the 
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+#pragma once
+
+#include <memory>
+#include <new>
+#include <vector>
+#include <algorithm>
+#include <ppl.h>
+#include <concrtrm.h>
+
+#include "Common.h"
+#include "INBodyCpu.h"
+#include "NBodyMetrics.h"
+#include "ParticleCpu.h"
+#include "NBodyCpu.h"
+
+//--------------------------------------------------------------------------------------
+//  Data structures for storing particles as a structure of arrays.
+//--------------------------------------------------------------------------------------
+
+//  Pointers to the x, y and z components of a range of vectors stored in separate arrays.
+
+template <typename T>
+struct Float3Arrays
+{
+    T* x;
+    T* y;
+    T* z;
+
+    Float3Arrays(T* x, T* y, T* z) : x(x), y(y), z(z) { }
+
+    inline Float3Arrays<T> Offset(int i) const { return Float3Arrays<T>(x + i, y + i, z + i); }
+};
+
+typedef Float3Arrays<float> Float3SoA;
+typedef Float3Arrays<const float> ConstFloat3SoA;
+
+//  Positions and accelerations stored as a structure of arrays. Each array is aligned 
+//  to, and padded to a multiple of, the size of an AVX-512 register. This allows the 
+//  SIMD interaction engine to load 4, 8 or 16 consecutive particles into a single register.
+//
+//  Unlike ParticleCpu no space is wasted on padding, a cache line holds the x component 
+//  for 16 particles rather than the whole state of a single particle.
+
+#define AVX_ALIGNMENTBOUNDARY 64
+
+struct ParticlesSoA
+{
+private:
+    int m_capacity;
+    std::unique_ptr<float, AlignedFreeDeleter<float>> m_data;
+
+public:
+    Float3SoA pos;
+    Float3SoA acc;
+
+    ParticlesSoA(int size) :
+        m_capacity(PaddedSize(size)),
+        m_data(static_cast<float*>(_aligned_malloc(6 * PaddedSize(size) * sizeof(float), AVX_ALIGNMENTBOUNDARY))),
+        pos(nullptr, nullptr, nullptr),
+        acc(nullptr, nullptr, nullptr)
+    {
+        float* const p = m_data.get();
+        if (p == nullptr)
+            throw std::bad_alloc();
+        std::fill(p, p + 6 * m_capacity, 0.0f);
+        pos = Float3SoA(p, p + m_capacity, p + 2 * m_capacity);
+        acc = Float3SoA(p + 3 * m_capacity, p + 4 * m_capacity, p + 5 * m_capacity);
+    }
+
+    inline int capacity() const { return m_capacity; }
+
+private:
+    static int PaddedSize(int size)
+    {
+        const int floatsPerLine = AVX_ALIGNMENTBOUNDARY / sizeof(float);
+        return ((size + floatsPerLine - 1) / floatsPerLine) * floatsPerLine;
+    }
+
+    ParticlesSoA(const ParticlesSoA&);
+    ParticlesSoA& operator=(const ParticlesSoA&);
+};
+
+//--------------------------------------------------------------------------------------
+//  A SIMD integration engine for particles stored as a structure of arrays.
+//--------------------------------------------------------------------------------------
+//
+//  Each function calculates the acceleration of a range of target particles due to a 
+//  range of source particles and adds it to the target accelerations. Consecutive targets
+//  are loaded into the lanes of a register and each source position is broadcast to all 
+//  lanes, so every instruction calculates 4, 8 or 16 interactions. Only positions are 
+//  read in the inner loop.
+//
+//  As with the other engines the most performant implementation is picked on 
+//  initialization based on the available AVX or SSE support.
+//
+//  Each implementation is a template on whether it also sums the gravitational potential of
+//  each target, -particleMass / |r| over all the sources. This adds one subtraction to the 
+//  inner loop. The sum includes a target's interaction with itself, -particleMass / softening,
+//  if the target is one of the sources. SelfPotential returns this term as the implementation
+//  calculates it, with the reciprocal square root estimate for targets in a register and the
+//  exact square root for the remaining targets, so it can be removed without adding a bias.
+
+class NBodySoAInteractionEngine;
+
+typedef void (NBodySoAInteractionEngine::* NBodySoAFunc)(ConstFloat3SoA targetPos, Float3SoA targetAcc, float* const targetPotential, int numTargets, 
+    ConstFloat3SoA sourcePos, int numSources) const;
+
+class NBodySoAInteractionEngine
+{
+private:
+    const float m_softeningSquared;
+    const float m_particleMass;
+    NBodySoAFunc m_funcptr;
+    NBodySoAFunc m_potentialFuncptr;
+    int m_width;                                                // Targets processed in each register.
+    float m_vectorSelfPotential;
+    float m_scalarSelfPotential;
+
+public:
+    NBodySoAInteractionEngine(float softeningSquared, float particleMass) :
+        m_softeningSquared(softeningSquared),
+        m_particleMass(particleMass),
+        m_funcptr(nullptr),
+        m_potentialFuncptr(nullptr),
+        m_width(1),
+        m_vectorSelfPotential(0.0f),
+        m_scalarSelfPotential(0.0f)
+    {
+        SelectCpuImplementation();
+        CalculateSelfPotential();
+    }
+
+    inline void InvokeBodyBodyInteraction(ConstFloat3SoA targetPos, Float3SoA targetAcc, int numTargets, ConstFloat3SoA sourcePos, int numSources) const
+    {
+        (this->*m_funcptr)(targetPos, targetAcc, nullptr, numTargets, sourcePos, numSources);
+    };
+
+    //  As InvokeBodyBodyInteraction and also adds each target's potential to targetPotential.
+    inline void InvokePotentialInteraction(ConstFloat3SoA targetPos, Float3SoA targetAcc, float* const targetPotential, int numTargets, 
+        ConstFloat3SoA sourcePos, int numSources) const
+    {
+        (this->*m_potentialFuncptr)(targetPos, targetAcc, targetPotential, numTargets, sourcePos, numSources);
+    };
+
+    //  The potential target i of a call with numTargets targets adds for its interaction with itself.
+    inline float SelfPotential(int i, int numTargets) const
+    {
+        return (i < (numTargets / m_width) * m_width) ? m_vectorSelfPotential : m_scalarSelfPotential;
+    }
+
+private:
+    void SelectCpuImplementation();
+    void CalculateSelfPotential();
+
+    // Different implementations of the body-body interaction.
+
+    template <bool Potential>
+    void BodyBodyInteraction(ConstFloat3SoA targetPos, Float3SoA targetAcc, float* const targetPotential, int numTargets, 
+        ConstFloat3SoA sourcePos, int numSources) const;
+    template <bool Potential>
+    void BodyBodyInteractionSSE(ConstFloat3SoA targetPos, Float3SoA targetAcc, float* const targetPotential, int numTargets, 
+        ConstFloat3SoA sourcePos, int numSources) const;
+    template <bool Potential>
+    void BodyBodyInteractionAVX2(ConstFloat3SoA targetPos, Float3SoA targetAcc, float* const targetPotential, int numTargets, 
+        ConstFloat3SoA sourcePos, int numSources) const;
+    template <bool Potential>
+    void BodyBodyInteractionAVX512(ConstFloat3SoA targetPos, Float3SoA targetAcc, float* const targetPotential, int numTargets, 
+        ConstFloat3SoA sourcePos, int numSources) const;
+};
+
+//--------------------------------------------------------------------------------------
+//  Parallel blocks of targets.
+//--------------------------------------------------------------------------------------
+//
+//  The engines that use structures of arrays divide the targets into blocks and update each
+//  block on its own task. Blocks start on a multiple of the block size, and so of the 
+//  alignment boundary, so no two tasks write to the same cache line of accelerations.
+
+const int kSoATargetBlockSize = 256;                            // Number of targets updated by each task.
+
+//  Call func(begin, count) in parallel for each block of numTargets targets. Returns the 
+//  number of tasks created.
+
+template <typename Func>
+int ForEachTargetBlock(int numTargets, const Func& func)
+{
+    const int numBlocks = (numTargets + kSoATargetBlockSize - 1) / kSoATargetBlockSize;
+    concurrency::parallel_for(0, numBlocks, [numTargets, &func](int b)
+    {
+        const int begin = b * kSoATargetBlockSize;
+        func(begin, std::min(kSoATargetBlockSize, numTargets - begin));
+    });
+    return numBlocks;
+}
+
+//  Add the interactions of numTargets targets with numSources sources to the target 
+//  accelerations using any of the SoA engines. Returns the number of tasks created.
+
+template <typename Engine, typename TargetPos, typename TargetAcc, typename SourcePos>
+int BlockedInteractions(const Engine& engine, TargetPos targetPos, TargetAcc targetAcc, int numTargets, 
+    SourcePos sourcePos, int numSources)
+{
+    return ForEachTargetBlock(numTargets, [&](int begin, int count)
+    {
+        engine.InvokeBodyBodyInteraction(targetPos.Offset(begin), targetAcc.Offset(begin), count, sourcePos, numSources);
+    });
+}
+
+//  Update the velocities and positions of a block of count particles, at most 
+//  kSoATargetBlockSize, from their accelerations in acc. The velocities are read from 
+//  pParticlesIn, and pos holds the positions at the start of the step and is updated in place.
+//  The new state is written to pParticlesOut, which may be pParticlesIn. If sqrSpeed is not
+//  null it receives each particle's squared speed at the start of the step.
+
+void UpdateSoABlock(const ParticleCpu* const pParticlesIn, ParticleCpu* const pParticlesOut, Float3SoA pos, ConstFloat3SoA acc, 
+    int count, float deltaTime, float dampingFactor, float* const sqrSpeed = nullptr);
+
+//--------------------------------------------------------------------------------------
+//  Conserved quantities of the particles.
+//--------------------------------------------------------------------------------------
+//
+//  As with the headless driver's TotalEnergy all the quantities are divided by the particle 
+//  mass, the momentum is the sum of the velocities and the center of mass the mean position.
+
+struct NBodyDiagnostics
+{
+    double kineticEnergy;
+    double potentialEnergy;
+    double momentum[3];
+    double centerOfMass[3];
+
+    NBodyDiagnostics() : kineticEnergy(0.0), potentialEnergy(0.0)
+    {
+        std::fill(momentum, momentum + 3, 0.0);
+        std::fill(centerOfMass, centerOfMass + 3, 0.0);
+    }
+
+    inline double TotalEnergy() const { return kineticEnergy + potentialEnergy; }
+
+    NBodyDiagnostics& operator+=(const NBodyDiagnostics& rhs)
+    {
+        kineticEnergy += rhs.kineticEnergy;
+        potentialEnergy += rhs.potentialEnergy;
+        for (int c = 0; c < 3; ++c)
+        {
+            momentum[c] += rhs.momentum[c];
+            centerOfMass[c] += rhs.centerOfMass[c];
+        }
+        return *this;
+    }
+};
+
+//--------------------------------------------------------------------------------------
+//  Parallel SIMD implementation of the n-body calculation using a structure of arrays.
+//--------------------------------------------------------------------------------------
+//
+//  Positions are copied from pParticlesIn into a structure of arrays at the start of each
+//  integration. This is O(N) and the cost is small compared with the O(N^2) force 
+//  calculation, which then runs entirely on the aligned arrays.
+//
+//  If diagnostics are enabled the force calculation also sums each particle's potential and 
+//  the update sums the other quantities, with a partial sum for each thread that is combined
+//  once per step. The diagnostics describe pParticlesIn, the state at the start of the step.
+
+class NBodySoA : public INBodyCpu, public INBodyCounters
+{
+private:
+    std::shared_ptr<NBodySoAInteractionEngine> m_engine;
+    const float m_deltaTime;
+    const float m_dampingFactor;
+    mutable ParticlesSoA m_particles;                           // Cache of positions and accelerations.
+    mutable std::vector<float> m_potential;
+    bool m_diagnosticsEnabled;
+    mutable NBodyDiagnostics m_diagnostics;
+    mutable NBodyCounters m_counters;
+
+public:
+    NBodySoA(float softeningSquared, float dampingFactor, float deltaTime, float particleMass, int maxParticles) :
+        INBodyCpu(),
+        m_engine(std::make_shared<NBodySoAInteractionEngine>(softeningSquared, particleMass)),
+        m_deltaTime(deltaTime),
+        m_dampingFactor(dampingFactor),
+        m_particles(maxParticles),
+        m_potential(maxParticles),
+        m_diagnosticsEnabled(false)
+    {
+    }
+
+    void Integrate(ParticleCpu* const pParticlesIn, ParticleCpu* const pParticlesOut, int numParticles) const;
+
+    inline void EnableDiagnostics(bool enable) { m_diagnosticsEnabled = enable; }
+
+    //  Diagnostics for the start of the most recent step, if enabled.
+    inline const NBodyDiagnostics& Diagnostics() const { return m_diagnostics; }
+
+    inline const NBodyCounters& Counters() const { return m_counters; }
+};
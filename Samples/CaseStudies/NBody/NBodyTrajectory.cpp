@@ -0,0 +1,282 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the 
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+#include <math.h>
+#include <string.h>
+#include <chrono>
+#include <algorithm>
+#include <stdexcept>
+#include <agents.h>
+
+#include "NBodyTrajectory.h"
+
+using namespace concurrency;
+
+const char kTrajectoryMagic[8] = { 'N', 'B', 'O', 'D', 'Y', 'T', 'R', 'J' };
+
+//--------------------------------------------------------------------------------------
+//  Encoding helpers.
+//--------------------------------------------------------------------------------------
+
+//  Positions outside +/- kMaxQuantized * precision are clamped.
+
+const double kMaxQuantized = 1073741823.0;
+
+inline int Quantize(float value, double scale)
+{
+    const double q = floor(value * scale + 0.5);
+    return static_cast<int>(std::max(-kMaxQuantized, std::min(kMaxQuantized, q)));
+}
+
+//  Map signed values to unsigned values so that small magnitudes have small encodings:
+//  0, -1, 1, -2, 2... map to 0, 1, 2, 3, 4...
+
+inline unsigned int ZigZagEncode(int value)
+{
+    return (static_cast<unsigned int>(value) << 1) ^ static_cast<unsigned int>(value >> 31);
+}
+
+inline int ZigZagDecode(unsigned int value)
+{
+    return static_cast<int>(value >> 1) ^ -static_cast<int>(value & 1);
+}
+
+inline void AppendVarint(std::vector<unsigned char>& buffer, unsigned int value)
+{
+    while (value >= 0x80)
+    {
+        buffer.push_back(static_cast<unsigned char>(value | 0x80));
+        value >>= 7;
+    }
+    buffer.push_back(static_cast<unsigned char>(value));
+}
+
+inline unsigned int ReadVarint(const unsigned char*& pData, const unsigned char* const pEnd)
+{
+    unsigned int value = 0;
+    for (int shift = 0; shift < 35; shift += 7)
+    {
+        if (pData == pEnd)
+            break;
+        const unsigned char byte = *pData++;
+        value |= static_cast<unsigned int>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+            return value;
+    }
+    throw std::runtime_error("Corrupt trajectory chunk.");
+}
+
+//--------------------------------------------------------------------------------------
+//  TrajectoryWriter
+//--------------------------------------------------------------------------------------
+
+TrajectoryWriter::TrajectoryWriter(const std::string& path, int numParticles, float precision, int keyframeInterval) :
+    m_file(path.c_str(), std::ios::binary | std::ios::trunc),
+    m_numParticles(numParticles),
+    m_precision(precision),
+    m_keyframeInterval(std::max(1, keyframeInterval)),
+    m_previous(3 * numParticles),
+    m_frameCount(0),
+    m_failed(false),
+    m_writeSeconds(0.0),
+    m_encodedBytes(0),
+    m_closed(false)
+{
+    if (!m_file)
+        throw std::runtime_error("Unable to create trajectory file.");
+    if (!(precision > 0.0f))
+        throw std::runtime_error("Trajectory precision must be greater than zero.");
+
+    TrajectoryHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kTrajectoryMagic, sizeof(header.magic));
+    header.version = kTrajectoryVersion;
+    header.numParticles = numParticles;
+    header.precision = precision;
+    header.keyframeInterval = m_keyframeInterval;
+    m_file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    m_encodedBytes = sizeof(header);
+
+    for (int i = 0; i < kTrajectoryBuffers; ++i)
+    {
+        m_frames.push_back(std::unique_ptr<Frame>(new Frame()));
+        m_frames.back()->pos.resize(numParticles);
+        send(m_free, m_frames.back().get());
+    }
+    start();
+}
+
+//  Destructors must not throw so errors are lost unless Close was called first.
+
+TrajectoryWriter::~TrajectoryWriter()
+{
+    try
+    {
+        Close();
+    }
+    catch (...)
+    {
+    }
+}
+
+void TrajectoryWriter::Write(const ParticleCpu* const pParticles, unsigned long long step)
+{
+    const std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+    Frame* const pFrame = receive(m_free);
+    pFrame->step = step;
+    for (int i = 0; i < m_numParticles; ++i)
+        pFrame->pos[i] = pParticles[i].pos;
+    send(m_pending, pFrame);
+    m_writeSeconds += std::chrono::duration_cast<std::chrono::duration<double>>(
+        std::chrono::high_resolution_clock::now() - start).count();
+}
+
+void TrajectoryWriter::Write(const float_3* const pPos, unsigned long long step)
+{
+    const std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+    Frame* const pFrame = receive(m_free);
+    pFrame->step = step;
+    std::copy(pPos, pPos + m_numParticles, pFrame->pos.begin());
+    send(m_pending, pFrame);
+    m_writeSeconds += std::chrono::duration_cast<std::chrono::duration<double>>(
+        std::chrono::high_resolution_clock::now() - start).count();
+}
+
+void TrajectoryWriter::Close()
+{
+    if (m_closed)
+        return;
+    m_closed = true;
+
+    send(m_pending, static_cast<Frame*>(nullptr));
+    agent::wait(this);
+    m_file.close();
+    if (m_failed || !m_file)
+        throw std::runtime_error("Unable to write trajectory file.");
+}
+
+//  Encode and write frames until a nullptr is received. Frames are always returned to the pool 
+//  so Write never blocks indefinitely, even after an error.
+
+void TrajectoryWriter::run()
+{
+    Frame* pFrame = receive(m_pending);
+    while (pFrame != nullptr)
+    {
+        if (!m_failed)
+        {
+            try
+            {
+                EncodeFrame(*pFrame);
+            }
+            catch (std::exception&)
+            {
+                m_failed = true;
+            }
+        }
+        send(m_free, pFrame);
+        pFrame = receive(m_pending);
+    }
+    done();
+}
+
+void TrajectoryWriter::EncodeFrame(const Frame& frame)
+{
+    const bool keyframe = (m_frameCount % m_keyframeInterval) == 0;
+    const double scale = 1.0 / m_precision;
+
+    m_chunk.clear();
+    for (int i = 0; i < m_numParticles; ++i)
+    {
+        const int q[3] = 
+        { 
+            Quantize(frame.pos[i].x, scale), 
+            Quantize(frame.pos[i].y, scale), 
+            Quantize(frame.pos[i].z, scale) 
+        };
+        int* const pPrevious = &m_previous[3 * i];
+        for (int c = 0; c < 3; ++c)
+        {
+            AppendVarint(m_chunk, ZigZagEncode(keyframe ? q[c] : (q[c] - pPrevious[c])));
+            pPrevious[c] = q[c];
+        }
+    }
+
+    TrajectoryChunkHeader header;
+    header.step = frame.step;
+    header.keyframe = keyframe ? 1 : 0;
+    header.size = static_cast<unsigned int>(m_chunk.size());
+    m_file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    if (!m_chunk.empty())
+        m_file.write(reinterpret_cast<const char*>(&m_chunk[0]), m_chunk.size());
+    if (!m_file)
+        m_failed = true;
+
+    ++m_frameCount;
+    m_encodedBytes += sizeof(header) + m_chunk.size();
+}
+
+//--------------------------------------------------------------------------------------
+//  TrajectoryReader
+//--------------------------------------------------------------------------------------
+
+TrajectoryReader::TrajectoryReader(const std::string& path) :
+    m_file(path.c_str(), std::ios::binary)
+{
+    m_file.read(reinterpret_cast<char*>(&m_header), sizeof(m_header));
+    if (!m_file || (memcmp(m_header.magic, kTrajectoryMagic, sizeof(m_header.magic)) != 0))
+        throw std::runtime_error("File is not a trajectory.");
+    if (m_header.version != kTrajectoryVersion)
+        throw std::runtime_error("Unsupported trajectory version.");
+}
+
+bool TrajectoryReader::ReadFrame(std::vector<float_3>& pos, unsigned long long& step)
+{
+    TrajectoryChunkHeader header;
+    m_file.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (m_file.gcount() == 0)
+        return false;
+    if (!m_file)
+        throw std::runtime_error("Trajectory file is truncated.");
+
+    m_chunk.resize(header.size);
+    if (header.size > 0)
+        m_file.read(reinterpret_cast<char*>(&m_chunk[0]), header.size);
+    if (!m_file)
+        throw std::runtime_error("Trajectory file is truncated.");
+
+    // Delta encoded frames can only be read after a keyframe.
+    if ((header.keyframe == 0) && m_previous.empty())
+        throw std::runtime_error("Trajectory does not start with a keyframe.");
+    m_previous.resize(3 * m_header.numParticles);
+
+    const unsigned char* pData = m_chunk.empty() ? nullptr : &m_chunk[0];
+    const unsigned char* const pEnd = pData + m_chunk.size();
+    const float precision = m_header.precision;
+    pos.resize(m_header.numParticles);
+    for (unsigned int i = 0; i < m_header.numParticles; ++i)
+    {
+        int* const pPrevious = &m_previous[3 * i];
+        for (int c = 0; c < 3; ++c)
+        {
+            const int value = ZigZagDecode(ReadVarint(pData, pEnd));
+            pPrevious[c] = (header.keyframe != 0) ? value : (pPrevious[c] + value);
+        }
+        pos[i] = float_3(pPrevious[0] * precision, pPrevious[1] * precision, pPrevious[2] * precision);
+    }
+    step = header.step;
+    return true;
+}
@@ -0,0 +1,155 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the 
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <agents.h>
+
+#include "Common.h"
+#include "ParticleCpu.h"
+
+//--------------------------------------------------------------------------------------
+//  Compressed trajectory format.
+//--------------------------------------------------------------------------------------
+//
+//  A trajectory file is a TrajectoryHeader followed by one chunk per frame. Each chunk is a
+//  TrajectoryChunkHeader followed by the encoded particle positions:
+//
+//  1. Each coordinate is quantized to a multiple of the header's precision.
+//  2. Keyframes store the quantized values, other frames store the difference from the 
+//     previous frame. Particles move a small distance each step so the differences are small.
+//  3. The signed values are zigzag encoded and written as variable length integers, seven
+//     bits per byte with the high bit set on all but the last byte.
+//
+//  A keyframe is written every keyframeInterval frames so a reader can start from any 
+//  keyframe without decoding the whole file.
+
+const unsigned int kTrajectoryVersion = 1;
+
+struct TrajectoryHeader
+{
+    char magic[8];                              // "NBODYTRJ"
+    unsigned int version;
+    unsigned int numParticles;
+    float precision;                            // Quantization step size for each coordinate.
+    unsigned int keyframeInterval;
+};
+
+struct TrajectoryChunkHeader
+{
+    unsigned long long step;
+    unsigned int keyframe;                      // Non-zero if the frame is not delta encoded.
+    unsigned int size;                          // Size in bytes of the encoded positions.
+};
+
+//--------------------------------------------------------------------------------------
+//  Asynchronous trajectory writer.
+//--------------------------------------------------------------------------------------
+//
+//  The writer is an agent with a fixed pool of frame buffers. Write takes a free buffer from 
+//  the pool, copies the positions into it and sends it to the agent, which encodes and writes 
+//  the frame before returning the buffer to the pool. The integration loop only waits if 
+//  all the buffers are still being encoded, so the time it spends in Write is bounded by 
+//  one copy of the positions plus any time the encoder is behind by more than the pool size. 
+//  WriteSeconds() reports the total time spent in Write so the overhead can be measured.
+//
+//  Close must be called to flush the remaining frames. It throws std::runtime_error if the 
+//  file could not be written.
+
+const int kTrajectoryBuffers = 2;
+
+class TrajectoryWriter : public concurrency::agent
+{
+private:
+    struct Frame
+    {
+        unsigned long long step;
+        std::vector<float_3> pos;
+    };
+
+    std::ofstream m_file;
+    const int m_numParticles;
+    const float m_precision;
+    const int m_keyframeInterval;
+    std::vector<std::unique_ptr<Frame>> m_frames;
+    concurrency::unbounded_buffer<Frame*> m_free;
+    concurrency::unbounded_buffer<Frame*> m_pending;    // A nullptr shuts down the agent.
+
+    // Only accessed by the agent.
+    std::vector<int> m_previous;
+    std::vector<unsigned char> m_chunk;
+    int m_frameCount;
+    bool m_failed;
+
+    double m_writeSeconds;
+    unsigned long long m_encodedBytes;
+    bool m_closed;
+
+public:
+    TrajectoryWriter(const std::string& path, int numParticles, float precision, int keyframeInterval = 100);
+    ~TrajectoryWriter();
+
+    void Write(const ParticleCpu* const pParticles, unsigned long long step);
+    void Write(const float_3* const pPos, unsigned long long step);
+    void Close();
+
+    inline int FrameCount() const { return m_frameCount; }
+    inline double WriteSeconds() const { return m_writeSeconds; }
+    inline unsigned long long EncodedBytes() const { return m_encodedBytes; }
+
+protected:
+    void run();
+
+private:
+    Frame* AcquireFrame();
+    void EncodeFrame(const Frame& frame);
+
+    TrajectoryWriter(const TrajectoryWriter&);
+    TrajectoryWriter& operator=(const TrajectoryWriter&);
+};
+
+//--------------------------------------------------------------------------------------
+//  Trajectory reader.
+//--------------------------------------------------------------------------------------
+//
+//  Reads frames sequentially. Positions are accurate to about half the precision the file was 
+//  written with. Throws std::runtime_error if the file is not a valid trajectory.
+
+class TrajectoryReader
+{
+private:
+    std::ifstream m_file;
+    TrajectoryHeader m_header;
+    std::vector<int> m_previous;
+    std::vector<unsigned char> m_chunk;
+
+public:
+    explicit TrajectoryReader(const std::string& path);
+
+    inline int NumParticles() const { return static_cast<int>(m_header.numParticles); }
+    inline float Precision() const { return m_header.precision; }
+
+    //  Returns false at the end of the file.
+    bool ReadFrame(std::vector<float_3>& pos, unsigned long long& step);
+
+private:
+    TrajectoryReader(const TrajectoryReader&);
+    TrajectoryReader& operator=(const TrajectoryReader&);
+};
@@ -0,0 +1,310 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the 
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+
+#if defined(_WIN32)
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+
+#include <stdint.h>
+#include <string.h>
+#include <sstream>
+#include <algorithm>
+#include <stdexcept>
+#include <chrono>
+#include <thread>
+
+#include "Common.h"
+#include "NBodyTransport.h"
+
+#if defined(_WIN32)
+#pragma comment(lib, "ws2_32.lib")
+#endif
+
+using namespace concurrency;
+
+//--------------------------------------------------------------------------------------
+//  Shared memory transport.
+//--------------------------------------------------------------------------------------
+
+class LocalTransport : public ITransport
+{
+private:
+    LocalTransportGroup& m_group;
+    const int m_rank;
+
+public:
+    LocalTransport(LocalTransportGroup& group, int rank) : m_group(group), m_rank(rank) { }
+
+    int Rank() const { return m_rank; }
+    int Size() const { return m_group.Size(); }
+
+    void Send(int dest, const std::vector<char>& message)
+    {
+        asend(m_group.GetChannel(m_rank, dest), std::make_shared<std::vector<char>>(message));
+    }
+
+    void Receive(int source, std::vector<char>& message)
+    {
+        message.swap(*receive(m_group.GetChannel(source, m_rank)));
+    }
+};
+
+LocalTransportGroup::LocalTransportGroup(int size) :
+    m_size(size)
+{
+    for (int i = 0; i < size * size; ++i)
+        m_channels.push_back(std::make_shared<Channel>());
+}
+
+std::shared_ptr<ITransport> LocalTransportGroup::Endpoint(int rank)
+{
+    return std::make_shared<LocalTransport>(*this, rank);
+}
+
+//--------------------------------------------------------------------------------------
+//  Socket transport.
+//--------------------------------------------------------------------------------------
+
+#if defined(_WIN32)
+
+typedef SOCKET SocketHandle;
+typedef int SocketLength;
+
+#if !defined(MSG_NOSIGNAL)
+#define MSG_NOSIGNAL 0                                          // Winsock never raises signals.
+#endif
+
+inline void CloseSocket(SocketHandle s) { closesocket(s); }
+inline int SocketError() { return WSAGetLastError(); }
+inline bool SocketInterrupted() { return WSAGetLastError() == WSAEINTR; }
+
+//  Winsock is initialized once for the lifetime of the process.
+
+void StartSockets()
+{
+    static bool started = false;
+    if (started)
+        return;
+    WSADATA data;
+    if (WSAStartup(MAKEWORD(2, 2), &data) != 0)
+        throw std::runtime_error("Unable to initialize Winsock.");
+    started = true;
+}
+
+#else
+
+typedef int SocketHandle;
+typedef int SocketLength;
+const SocketHandle INVALID_SOCKET = -1;
+
+inline void CloseSocket(SocketHandle s) { close(s); }
+inline int SocketError() { return errno; }
+inline bool SocketInterrupted() { return errno == EINTR; }
+inline void StartSockets() { }
+
+#endif
+
+const int kConnectRetries = 300;
+const int kConnectRetryMilliseconds = 100;
+
+std::string PortString(int port)
+{
+    std::ostringstream stream;
+    stream << port;
+    return stream.str();
+}
+
+//  Resolve host:port as an IPv4 TCP address.
+
+sockaddr_in ResolveAddress(const std::string& host, int port)
+{
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* pResult = nullptr;
+    if ((getaddrinfo(host.c_str(), PortString(port).c_str(), &hints, &pResult) != 0) || (pResult == nullptr))
+        throw std::runtime_error("Unable to resolve host " + host + ".");
+    sockaddr_in address;
+    memcpy(&address, pResult->ai_addr, sizeof(address));
+    freeaddrinfo(pResult);
+    return address;
+}
+
+//  Sends use MSG_NOSIGNAL so a peer that has exited is reported as an error rather than 
+//  raising SIGPIPE, which would end the process. Interrupted calls are retried.
+
+void SendAll(SocketHandle s, const char* pData, size_t size)
+{
+    while (size > 0)
+    {
+        const int chunk = static_cast<int>(std::min<size_t>(size, 1 << 30));
+        const int sent = send(s, pData, chunk, MSG_NOSIGNAL);
+        if ((sent < 0) && SocketInterrupted())
+            continue;
+        if (sent <= 0)
+            throw std::runtime_error("Unable to send to socket, error " + PortString(SocketError()) + ".");
+        pData += sent;
+        size -= sent;
+    }
+}
+
+void ReceiveAll(SocketHandle s, char* pData, size_t size)
+{
+    while (size > 0)
+    {
+        const int chunk = static_cast<int>(std::min<size_t>(size, 1 << 30));
+        const int received = recv(s, pData, chunk, 0);
+        if ((received < 0) && SocketInterrupted())
+            continue;
+        if (received == 0)
+            throw std::runtime_error("Unable to receive from socket, the connection was closed.");
+        if (received < 0)
+            throw std::runtime_error("Unable to receive from socket, error " + PortString(SocketError()) + ".");
+        pData += received;
+        size -= received;
+    }
+}
+
+//  Small messages, such as the block headers, are sent immediately rather than being 
+//  delayed by Nagle's algorithm.
+
+void SetNoDelay(SocketHandle s)
+{
+    int noDelay = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&noDelay), sizeof(noDelay));
+}
+
+SocketTransport::SocketTransport(int rank, int size, const std::vector<std::string>& hosts, int basePort) :
+    m_rank(rank),
+    m_size(size),
+    m_sockets(size, static_cast<long long>(INVALID_SOCKET))
+{
+    if (hosts.empty() || ((hosts.size() != 1) && (static_cast<int>(hosts.size()) != size)))
+        throw std::runtime_error("Either one host or one host per rank is required.");
+    StartSockets();
+
+    // Connected sockets are stored in m_sockets as soon as they are created so that any 
+    // failure, including one from a later rank, closes all of them.
+    SocketHandle listener = INVALID_SOCKET;
+    SocketHandle accepted = INVALID_SOCKET;                     // Connection whose rank is not yet known.
+    try
+    {
+        listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (listener == INVALID_SOCKET)
+            throw std::runtime_error("Unable to create socket.");
+        int reuse = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&reuse), sizeof(reuse));
+        sockaddr_in address = ResolveAddress(hosts[(hosts.size() == 1) ? 0 : rank], basePort + rank);
+        address.sin_addr.s_addr = htonl(INADDR_ANY);
+        if ((bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) || (listen(listener, size) != 0))
+            throw std::runtime_error("Unable to listen on port " + PortString(basePort + rank) + ".");
+
+        // Connect to the lower ranks and identify this rank to them.
+        for (int r = 0; r < rank; ++r)
+        {
+            const sockaddr_in peer = ResolveAddress(hosts[(hosts.size() == 1) ? 0 : r], basePort + r);
+            SocketHandle s = INVALID_SOCKET;
+            for (int attempt = 0; (attempt < kConnectRetries) && (s == INVALID_SOCKET); ++attempt)
+            {
+                s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+                if (connect(s, reinterpret_cast<const sockaddr*>(&peer), sizeof(peer)) != 0)
+                {
+                    CloseSocket(s);
+                    s = INVALID_SOCKET;
+                    std::this_thread::sleep_for(std::chrono::milliseconds(kConnectRetryMilliseconds));
+                }
+            }
+            if (s == INVALID_SOCKET)
+                throw std::runtime_error("Unable to connect to rank " + PortString(r) + ".");
+            m_sockets[r] = static_cast<long long>(s);
+            const int32_t id = rank;
+            SendAll(s, reinterpret_cast<const char*>(&id), sizeof(id));
+            SetNoDelay(s);
+        }
+
+        // Accept connections from the higher ranks, which may arrive in any order.
+        for (int i = rank + 1; i < size; ++i)
+        {
+            do
+                accepted = accept(listener, nullptr, nullptr);
+            while ((accepted == INVALID_SOCKET) && SocketInterrupted());
+            if (accepted == INVALID_SOCKET)
+                throw std::runtime_error("Unable to accept a connection, error " + PortString(SocketError()) + ".");
+            int32_t id = -1;
+            ReceiveAll(accepted, reinterpret_cast<char*>(&id), sizeof(id));
+            if ((id <= rank) || (id >= size) || (m_sockets[id] != static_cast<long long>(INVALID_SOCKET)))
+                throw std::runtime_error("Unexpected connection from another process.");
+            SetNoDelay(accepted);
+            m_sockets[id] = static_cast<long long>(accepted);
+            accepted = INVALID_SOCKET;
+        }
+    }
+    catch (...)
+    {
+        if (accepted != INVALID_SOCKET)
+            CloseSocket(accepted);
+        if (listener != INVALID_SOCKET)
+            CloseSocket(listener);
+        Close();
+        throw;
+    }
+    CloseSocket(listener);
+}
+
+SocketTransport::~SocketTransport()
+{
+    Close();
+}
+
+void SocketTransport::Close()
+{
+    for (int r = 0; r < m_size; ++r)
+    {
+        if (m_sockets[r] != static_cast<long long>(INVALID_SOCKET))
+            CloseSocket(static_cast<SocketHandle>(m_sockets[r]));
+        m_sockets[r] = static_cast<long long>(INVALID_SOCKET);
+    }
+}
+
+void SocketTransport::Send(int dest, const std::vector<char>& message)
+{
+    const SocketHandle s = static_cast<SocketHandle>(m_sockets[dest]);
+    const uint64_t size = message.size();
+    SendAll(s, reinterpret_cast<const char*>(&size), sizeof(size));
+    if (size > 0)
+        SendAll(s, &message[0], message.size());
+}
+
+void SocketTransport::Receive(int source, std::vector<char>& message)
+{
+    const SocketHandle s = static_cast<SocketHandle>(m_sockets[source]);
+    uint64_t size = 0;
+    ReceiveAll(s, reinterpret_cast<char*>(&size), sizeof(size));
+    message.resize(static_cast<size_t>(size));
+    if (size > 0)
+        ReceiveAll(s, &message[0], message.size());
+}
@@ -0,0 +1,113 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the 
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <agents.h>
+
+//--------------------------------------------------------------------------------------
+//  Message transport between the ranks of a distributed simulation.
+//--------------------------------------------------------------------------------------
+//
+//  Each rank has an ITransport that sends messages to, and receives messages from, the other 
+//  ranks. Messages between a pair of ranks arrive in the order they were sent. Send may return
+//  before the message has been received but Receive waits for a message to arrive, so a rank
+//  that sends and receives in the same exchange should do both at once, see NBodyDistributed.
+//
+//  Both operations may be called by different threads at the same time, provided no two 
+//  threads send to the same rank or receive from the same rank. They throw std::runtime_error
+//  if the message cannot be sent or received.
+
+class ITransport
+{
+public:
+    virtual ~ITransport() { }
+
+    virtual int Rank() const = 0;
+    virtual int Size() const = 0;
+    virtual void Send(int dest, const std::vector<char>& message) = 0;
+    virtual void Receive(int source, std::vector<char>& message) = 0;
+};
+
+//--------------------------------------------------------------------------------------
+//  Shared memory transport.
+//--------------------------------------------------------------------------------------
+//
+//  All the ranks run in one process. Each ordered pair of ranks has an unbounded_buffer and a 
+//  message is passed by sending a copy of it to the buffer. The group creates the buffers and 
+//  an endpoint for each rank, the group must outlive the endpoints.
+
+class LocalTransportGroup
+{
+private:
+    typedef concurrency::unbounded_buffer<std::shared_ptr<std::vector<char>>> Channel;
+
+    const int m_size;
+    std::vector<std::shared_ptr<Channel>> m_channels;           // Indexed by source * size + dest.
+
+public:
+    explicit LocalTransportGroup(int size);
+
+    inline int Size() const { return m_size; }
+
+    std::shared_ptr<ITransport> Endpoint(int rank);
+
+private:
+    friend class LocalTransport;
+
+    inline Channel& GetChannel(int source, int dest) { return *m_channels[source * m_size + dest]; }
+};
+
+//--------------------------------------------------------------------------------------
+//  Socket transport.
+//--------------------------------------------------------------------------------------
+//
+//  Each rank is a separate process connected to every other rank by a TCP connection. Rank r 
+//  listens on basePort + r of hosts[r], or of hosts[0] if a single host is given, so all the 
+//  ranks of a test can run on one machine over the loopback interface. On creation each rank
+//  connects to the lower ranks, retrying until they are listening, and accepts connections 
+//  from the higher ranks.
+//
+//  Each message is written as a 64 bit length followed by the message bytes.
+
+class SocketTransport : public ITransport
+{
+private:
+    const int m_rank;
+    const int m_size;
+    std::vector<long long> m_sockets;                           // Indexed by rank, the platform's socket handles.
+
+public:
+    SocketTransport(int rank, int size, const std::vector<std::string>& hosts, int basePort);
+    ~SocketTransport();
+
+    int Rank() const { return m_rank; }
+    int Size() const { return m_size; }
+    void Send(int dest, const std::vector<char>& message);
+    void Receive(int source, std::vector<char>& message);
+
+private:
+    //  Close the connections, the constructor calls this before throwing as the destructor 
+    //  does not run for a partially constructed object.
+    void Close();
+
+    SocketTransport(const SocketTransport&);
+    SocketTransport& operator=(const SocketTransport&);
+};
@@ -0,0 +1,103 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the 
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <ppl.h>
+
+//--------------------------------------------------------------------------------------
+//  Parallel prefix sum and stream compaction on the CPU.
+//--------------------------------------------------------------------------------------
+//
+//  Both functions split the input into blocks and make three passes. The first calculates
+//  the total of each block in parallel, the second scans the block totals, which is cheap 
+//  as there are only a few hundred of them, and the third scans each block in parallel 
+//  starting from its offset.
+
+const int kScanBlockSize = 4096;
+
+//  Exclusive scan, pOut[i] is the sum of pIn[0]...pIn[i-1]. Returns the sum of all the 
+//  elements. pIn and pOut may be the same array.
+
+template <typename T>
+T ParallelExclusiveScan(const T* const pIn, T* const pOut, int size)
+{
+    const int numBlocks = (size + kScanBlockSize - 1) / kScanBlockSize;
+    std::vector<T> offsets(numBlocks + 1, T(0));
+
+    concurrency::parallel_for(0, numBlocks, [=, &offsets](int b)
+    {
+        const int end = std::min(size, (b + 1) * kScanBlockSize);
+        T sum = T(0);
+        for (int i = b * kScanBlockSize; i < end; ++i)
+            sum += pIn[i];
+        offsets[b + 1] = sum;
+    });
+
+    for (int b = 0; b < numBlocks; ++b)
+        offsets[b + 1] += offsets[b];
+
+    concurrency::parallel_for(0, numBlocks, [=, &offsets](int b)
+    {
+        const int end = std::min(size, (b + 1) * kScanBlockSize);
+        T sum = offsets[b];
+        for (int i = b * kScanBlockSize; i < end; ++i)
+        {
+            const T value = pIn[i];
+            pOut[i] = sum;
+            sum += value;
+        }
+    });
+    return offsets[numBlocks];
+}
+
+//  Write the indices in [0, size) for which predicate(i) is true to pOut, in increasing
+//  order. Returns the number of indices written. The predicate is called twice for each 
+//  index so it should be cheap and must not have side effects.
+
+template <typename Predicate>
+int ParallelCompact(int size, const Predicate& predicate, int* const pOut)
+{
+    const int numBlocks = (size + kScanBlockSize - 1) / kScanBlockSize;
+    std::vector<int> offsets(numBlocks + 1, 0);
+
+    concurrency::parallel_for(0, numBlocks, [=, &offsets, &predicate](int b)
+    {
+        const int end = std::min(size, (b + 1) * kScanBlockSize);
+        int count = 0;
+        for (int i = b * kScanBlockSize; i < end; ++i)
+            count += predicate(i) ? 1 : 0;
+        offsets[b + 1] = count;
+    });
+
+    for (int b = 0; b < numBlocks; ++b)
+        offsets[b + 1] += offsets[b];
+
+    concurrency::parallel_for(0, numBlocks, [=, &offsets, &predicate](int b)
+    {
+        const int end = std::min(size, (b + 1) * kScanBlockSize);
+        int* pNext = pOut + offsets[b];
+        for (int i = b * kScanBlockSize; i < end; ++i)
+        {
+            if (predicate(i))
+                *pNext++ = i;
+        }
+    });
+    return offsets[numBlocks];
+}
@@ -16,7 +16,7 @@
 
 #pragma once
 
-#include <amp_short_vectors.h>
+#include "CpuShortVectors.h"
 
 //--------------------------------------------------------------------------------------
 // Data structures for storing particles.
@@ -43,8 +43,15 @@
 
 #define SSE_ALIGNMENTBOUNDARY 16
 
-__declspec(align(SSE_ALIGNMENTBOUNDARY))
-struct ParticleCpu
+// Visual C++ 2012 and 2013 do not support alignas.
+
+#if defined(_MSC_VER)
+#define NBODY_ALIGN(n) __declspec(align(n))
+#else
+#define NBODY_ALIGN(n) alignas(n)
+#endif
+
+struct NBODY_ALIGN(SSE_ALIGNMENTBOUNDARY) ParticleCpu
 {
     float_3 pos;
     float ssePpadding1;
@@ -63,8 +70,7 @@ struct ParticleCpu
 // These two types could have been combined using a union but are kept separate here for 
 // clarity and a cast is used when access to the __m128 values is needed.
 
-__declspec(align(SSE_ALIGNMENTBOUNDARY))
-struct ParticleSSE
+struct NBODY_ALIGN(SSE_ALIGNMENTBOUNDARY) ParticleSSE
 {
     __m128 pos;
     __m128 vel;
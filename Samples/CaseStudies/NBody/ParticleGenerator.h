@@ -0,0 +1,215 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the 
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+
+#pragma once
+
+#include <ppl.h>
+#include <math.h>
+#include <algorithm>
+
+#include "Common.h"
+
+//--------------------------------------------------------------------------------------
+//  Philox4x32-10 counter-based random number generator.
+//--------------------------------------------------------------------------------------
+//
+//  Philox (Salmon et al., "Parallel Random Numbers: As Easy as 1, 2, 3", SC11) maps a 128 bit
+//  counter and a 64 bit key to 128 random bits with ten rounds of multiplication and xor.
+//  There is no state to advance so any number can be generated directly from its counter,
+//  which lets each particle be generated independently by any thread.
+
+struct PhiloxBits
+{
+    unsigned int v[4];
+};
+
+inline void PhiloxMulHiLo(unsigned int a, unsigned int b, unsigned int& hi, unsigned int& lo)
+{
+    const unsigned long long product = static_cast<unsigned long long>(a) * b;
+    hi = static_cast<unsigned int>(product >> 32);
+    lo = static_cast<unsigned int>(product);
+}
+
+inline PhiloxBits Philox4x32(PhiloxBits counter, unsigned long long key)
+{
+    unsigned int k0 = static_cast<unsigned int>(key);
+    unsigned int k1 = static_cast<unsigned int>(key >> 32);
+    for (int round = 0; round < 10; ++round)
+    {
+        unsigned int hi0, lo0, hi1, lo1;
+        PhiloxMulHiLo(0xD2511F53, counter.v[0], hi0, lo0);
+        PhiloxMulHiLo(0xCD9E8D57, counter.v[2], hi1, lo1);
+        const PhiloxBits next = { { hi1 ^ counter.v[1] ^ k0, lo1, hi0 ^ counter.v[3] ^ k1, lo0 } };
+        counter = next;
+        k0 += 0x9E3779B9;
+        k1 += 0xBB67AE85;
+    }
+    return counter;
+}
+
+//  Uniform float in (0, 1], the top 24 bits are used so every value is exactly representable.
+
+inline float PhiloxUniform(unsigned int bits)
+{
+    return ((bits >> 8) + 1) * (1.0f / 16777216.0f);
+}
+
+//--------------------------------------------------------------------------------------
+//  Seeded, parallel particle generation.
+//--------------------------------------------------------------------------------------
+//
+//  Particle i of a cluster uses the counters (i, draw, stream, 0) with the seed as the key. 
+//  A particle depends only on the seed, the cluster's stream and i, so the same particles are 
+//  generated for any number of threads and any range of a cluster can be generated on its own,
+//  for example by the rank that owns it.
+//
+//  kDistributionCluster    - The original demonstration cluster, a sphere of radius scale 
+//                            whose density falls off as 1 / r^2. Particles move with the
+//                            cluster's velocity.
+//  kDistributionPlummer    - A Plummer sphere with the same half mass radius as a uniform 
+//                            sphere of radius scale. Velocities are drawn from the isotropic 
+//                            equilibrium distribution (Aarseth, Henon & Wielen 1974) if the
+//                            cluster's gravitational mass is non-zero. The radius is truncated
+//                            at about 40 scale radii.
+//  kDistributionDisk       - A thin disk of radius scale in the xy plane with a uniform surface
+//                            density. Particles are given the circular velocity of the mass 
+//                            inside their radius, treated as if it were spherical.
+
+enum ParticleDistribution
+{
+    kDistributionCluster = 0,
+    kDistributionPlummer = 1,
+    kDistributionDisk = 2
+};
+
+struct ClusterDesc
+{
+    ParticleDistribution distribution;
+    float_3 center;
+    float_3 velocity;                                           // Velocity of the whole cluster.
+    float scale;
+    float gravitationalMass;                                    // G * total mass, zero for no internal motion.
+    unsigned long long seed;
+    unsigned int stream;                                        // Each cluster with the same seed needs its own stream.
+
+    ClusterDesc(ParticleDistribution distribution, float_3 center, float_3 velocity, float scale, unsigned long long seed, 
+        unsigned int stream) :
+        distribution(distribution), center(center), velocity(velocity), scale(scale), gravitationalMass(0.0f), seed(seed), 
+        stream(stream) { }
+};
+
+const unsigned long long kDefaultSeed = 20121105;
+
+const float kPi = 3.14159265358979f;
+const float kPlummerHalfMassScale = 0.7937f / 1.3048f;          // Uniform sphere and Plummer half mass radii.
+const float kPlummerMaxMassFraction = 0.999f;
+const float kDiskThickness = 0.02f;
+
+inline PhiloxBits ClusterDraw(const ClusterDesc& cluster, int index, unsigned int draw)
+{
+    const PhiloxBits counter = { { static_cast<unsigned int>(index), draw, cluster.stream, 0 } };
+    return Philox4x32(counter, cluster.seed);
+}
+
+inline float_3 RandomDirection(float cosTheta, float phi)
+{
+    const float sinTheta = sqrt(std::max(0.0f, 1.0f - cosTheta * cosTheta));
+    return float_3(sinTheta * cos(phi), sinTheta * sin(phi), cosTheta);
+}
+
+//  Draw q = v / v_escape from g(q) = q^2 (1 - q^2)^3.5 by rejection, using two candidates from
+//  each draw. The maximum of g is below 0.1.
+
+inline float PlummerVelocityFraction(const ClusterDesc& cluster, int index)
+{
+    for (unsigned int draw = 2; ; ++draw)
+    {
+        const PhiloxBits bits = ClusterDraw(cluster, index, draw);
+        for (int c = 0; c < 4; c += 2)
+        {
+            const float q = PhiloxUniform(bits.v[c]);
+            const float g = q * q * pow(std::max(0.0f, 1.0f - q * q), 3.5f);
+            if ((0.1f * PhiloxUniform(bits.v[c + 1])) < g)
+                return q;
+        }
+    }
+}
+
+inline void GenerateParticle(const ClusterDesc& cluster, int index, float_3& pos, float_3& vel)
+{
+    const PhiloxBits bits = ClusterDraw(cluster, index, 0);
+    const float u0 = PhiloxUniform(bits.v[0]);
+    const float cosTheta = 2.0f * PhiloxUniform(bits.v[1]) - 1.0f;
+    const float phi = 2.0f * kPi * PhiloxUniform(bits.v[2]);
+    vel = cluster.velocity;
+
+    switch (cluster.distribution)
+    {
+    case kDistributionPlummer:
+        {
+            const float a = cluster.scale * kPlummerHalfMassScale;
+            const float massFraction = std::min(u0, kPlummerMaxMassFraction);
+            const float r = a / sqrt(pow(massFraction, -2.0f / 3.0f) - 1.0f);
+            pos = cluster.center + RandomDirection(cosTheta, phi) * r;
+            if (cluster.gravitationalMass > 0.0f)
+            {
+                const PhiloxBits velocityBits = ClusterDraw(cluster, index, 1);
+                const float escape = sqrt(2.0f * cluster.gravitationalMass) * pow(r * r + a * a, -0.25f);
+                const float speed = PlummerVelocityFraction(cluster, index) * escape;
+                vel += RandomDirection(2.0f * PhiloxUniform(velocityBits.v[0]) - 1.0f, 2.0f * kPi * PhiloxUniform(velocityBits.v[1])) * speed;
+            }
+        }
+        break;
+    case kDistributionDisk:
+        {
+            const float r = cluster.scale * sqrt(u0);
+            const float z = cluster.scale * kDiskThickness * (PhiloxUniform(bits.v[3]) - 0.5f);
+            pos = cluster.center + float_3(r * cos(phi), r * sin(phi), z);
+            if (cluster.gravitationalMass > 0.0f)
+            {
+                const float enclosedMass = cluster.gravitationalMass * u0;
+                const float speed = sqrt(enclosedMass / r);
+                vel += float_3(-sin(phi), cos(phi), 0.0f) * speed;
+            }
+        }
+        break;
+    default:
+        pos = cluster.center + RandomDirection(cosTheta, phi) * (cluster.scale * (1.0f - u0));
+        break;
+    }
+}
+
+//  Generate count particles of a cluster, starting with particle first, in parallel. Each 
+//  particle is passed to store(i, pos, vel) with i in [0, count).
+
+const int kGenerateChunkSize = 4096;
+
+template <typename StoreFunc>
+void GenerateCluster(const ClusterDesc& cluster, int first, int count, const StoreFunc& store)
+{
+    const int numChunks = (count + kGenerateChunkSize - 1) / kGenerateChunkSize;
+    concurrency::parallel_for(0, numChunks, [=, &cluster, &store](int c)
+    {
+        const int end = std::min(count, (c + 1) * kGenerateChunkSize);
+        for (int i = c * kGenerateChunkSize; i < end; ++i)
+        {
+            float_3 pos, vel;
+            GenerateParticle(cluster, first + i, pos, vel);
+            store(i, pos, vel);
+        }
+    });
+}
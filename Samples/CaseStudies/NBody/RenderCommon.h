@@ -0,0 +1,38 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the 
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+#pragma once
+
+#include <d3dx9math.h>
+
+//--------------------------------------------------------------------------------------
+//  D3D related data structures used by the GUI.
+//--------------------------------------------------------------------------------------
+//
+//  These are kept separate from Common.h so that the integrators, and the headless driver,
+//  do not depend on D3D.
+
+struct ParticleVertex
+{
+    D3DXCOLOR color;
+};
+
+struct ResourceData
+{
+    D3DXMATRIX worldViewProj;
+    D3DXMATRIX inverseView;
+    D3DXCOLOR color;            // color value for changing particles color
+};
@@ -16,8 +16,17 @@
 
 #pragma once
 
+#include "CpuShortVectors.h"
+
+//  CPU only builds that use the portable short vectors do not include C++ AMP, functions that
+//  are shared with C++ AMP kernels are marked NBODY_RESTRICT_AMP_CPU.
+
+#if defined(NBODY_CPU_SHORT_VECTORS)
+#define NBODY_RESTRICT_AMP_CPU
+#else
 #include <amp_graphics.h>
-#include <d3dx9math.h>
+#define NBODY_RESTRICT_AMP_CPU restrict(amp, cpu)
+#endif
 
 using namespace concurrency::graphics;
 
@@ -25,7 +34,7 @@ using namespace concurrency::graphics;
 //  Utility functions for vector calculations.
 //--------------------------------------------------------------------------------------
 
-inline const float SqrLength(const float_3& r) restrict(amp, cpu) 
+inline float SqrLength(const float_3& r) NBODY_RESTRICT_AMP_CPU 
 {
     return r.x * r.x + r.y * r.y + r.z * r.z; 
 }
@@ -37,19 +46,27 @@ inline float_3 PolarToCartesian(T r, T theta, T phi)
 }
 
 //--------------------------------------------------------------------------------------
-//  D3D related data structures used by the GUI.
+//  Time integration schemes.
 //--------------------------------------------------------------------------------------
+//
+//  kDampedEuler        - The original update, vel += acc * dt; vel *= damping; pos += vel * dt.
+//                        First order, the damping hides the energy it gains each step.
+//  kLeapfrog           - Kick-drift-kick leapfrog with the closing half kick of one step fused 
+//                        with the opening half kick of the next. Second order and symplectic. 
+//                        After the first step the stored velocities are half a step behind the 
+//                        positions, add acc * dt / 2 to synchronize them.
+//  kVelocityVerlet     - Velocity Verlet. The same trajectory as kLeapfrog but the velocities 
+//                        are synchronized with the positions after every step. This requires 
+//                        the previous step's accelerations and an additional pass over the 
+//                        particles.
+//
+//  Only kDampedEuler applies the damping factor.
 
-struct ParticleVertex
-{
-    D3DXCOLOR color;
-};       
-
-struct ResourceData
+enum IntegratorType
 {
-    D3DXMATRIX worldViewProj;
-    D3DXMATRIX inverseView;
-    D3DXCOLOR color;            // color value for changing particles color
+    kDampedEuler = 0,
+    kLeapfrog = 1,
+    kVelocityVerlet = 2
 };
 
 //--------------------------------------------------------------------------------------
@@ -72,3 +89,20 @@ struct FreeDeleter
         std::free(ptr);
     }
 };
+
+//--------------------------------------------------------------------------------------
+//  Custom deleter for smart pointers to memory allocated with _aligned_malloc.
+//--------------------------------------------------------------------------------------
+
+template <typename T>
+struct AlignedFreeDeleter
+{
+    AlignedFreeDeleter() throw()
+    {}
+
+    void operator()(T* const ptr) const throw()
+    {
+        static_assert(std::has_trivial_destructor<T>::value, "Cannot free memory for a type with a non-trivial destructor, use delete.");
+        _aligned_free(ptr);
+    }
+};